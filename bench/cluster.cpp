@@ -0,0 +1,143 @@
+#include <chrono>
+#include <iostream>
+#include <iomanip>
+#include <numeric>
+#include <random>
+#include <cmath>
+#include <boost/filesystem/fstream.hpp>
+#include "array.hpp"
+#include "ligand.hpp"
+#include "task_scheduler.hpp"
+
+//! Clusters conformations by sorting all of them, recovering each one in turn and comparing it with every representative over all its atoms, i.e. the reference algorithm prior to the heap, the centroid bound and the early exit.
+vector<size_t> cluster_reference(const ligand& lig, const float* const ex, const size_t num_tasks, const size_t max_conformations)
+{
+	vector<size_t> rank(num_tasks);
+	iota(rank.begin(), rank.end(), 0);
+	sort(rank.begin(), rank.end(), [ex](const size_t v0, const size_t v1)
+	{
+		return ex[v0] < ex[v1] || (ex[v0] == ex[v1] && v0 < v1);
+	});
+	const float square_deviation_threshold = 4.0f * lig.na;
+	vector<size_t> representatives;
+	vector<vector<array<float, 3>>> coordinates;
+	vector<array<float, 4>> q;
+	vector<array<float, 3>> c;
+	for (const size_t r : rank)
+	{
+		lig.recover(ex, num_tasks, r, q, c);
+		bool representative = true;
+		for (const auto& t : coordinates)
+		{
+			float square_deviation = 0.0f;
+			for (size_t i = 0; i < lig.na; ++i)
+			{
+				square_deviation += distance_sqr(c[i], t[i]);
+			}
+			if (square_deviation < square_deviation_threshold)
+			{
+				representative = false;
+				break;
+			}
+		}
+		if (!representative) continue;
+		representatives.push_back(r);
+		coordinates.push_back(c);
+		if (representatives.size() == max_conformations) break;
+	}
+	return representatives;
+}
+
+int main(int argc, char* argv[])
+{
+	if (argc < 2)
+	{
+		cout << "bench_cluster ligand.pdbqt [num_tasks] [num_poses] [threads]" << endl;
+		return 0;
+	}
+	const size_t num_tasks = argc > 2 ? stoul(argv[2]) : 4096;
+	const size_t num_poses = argc > 3 ? stoul(argv[3]) : 8;
+	const size_t num_threads = argc > 4 ? stoul(argv[4]) : thread::hardware_concurrency();
+	const size_t max_conformations = 9;
+	const size_t num_repeats = 20;
+
+	// Parse the ligand.
+	boost::filesystem::ifstream ifs(argv[1]);
+	const string s((istreambuf_iterator<char>(ifs)), istreambuf_iterator<char>());
+	const ligand lig(path(argv[1]).filename(), s.data(), s.data() + s.size());
+
+	// Scatter the conformations of the tasks around a few random poses, so that most of them fall into a few clusters as local optimization tends to make them.
+	mt19937_64 rng(1);
+	uniform_real_distribution<float> u11(-1, 1);
+	normal_distribution<float> n01(0, 1);
+	const size_t cnf_elems = lig.get_cnf_elems();
+	vector<vector<float>> poses(num_poses, vector<float>(cnf_elems));
+	for (auto& p : poses)
+	{
+		p[0] = -10 + 2 * u11(rng);
+		for (size_t o = 1; o < 4; ++o) p[o] = 5 * u11(rng);
+		for (size_t o = 4; o < 8; ++o) p[o] = n01(rng);
+		for (size_t o = 8; o < cnf_elems; ++o) p[o] = 3.1416f * u11(rng);
+	}
+	vector<float> ex(cnf_elems * num_tasks);
+	for (size_t r = 0; r < num_tasks; ++r)
+	{
+		const auto& p = poses[r % num_poses];
+		ex[r] = p[0] + n01(rng);
+		for (size_t o = 1; o < 4; ++o) ex[num_tasks * o + r] = p[o] + 0.3f * n01(rng);
+		float qn = 0;
+		for (size_t o = 4; o < 8; ++o) qn += (ex[num_tasks * o + r] = p[o] + 0.05f * n01(rng)) * ex[num_tasks * o + r];
+		qn = 1 / sqrt(qn);
+		for (size_t o = 4; o < 8; ++o) ex[num_tasks * o + r] *= qn;
+		for (size_t o = 8; o < cnf_elems; ++o) ex[num_tasks * o + r] = p[o] + 0.2f * n01(rng);
+	}
+	cout << "Clustering " << num_tasks << " conformations of " << lig.na << " heavy atoms and " << lig.nv - 6 << " torsions around " << num_poses << " poses into up to " << max_conformations << " clusters" << endl;
+
+	// Time the reference algorithm.
+	vector<size_t> reference;
+	auto start = std::chrono::steady_clock::now();
+	for (size_t i = 0; i < num_repeats; ++i)
+	{
+		reference = cluster_reference(lig, ex.data(), num_tasks, max_conformations);
+	}
+	const double reference_seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count() / num_repeats;
+
+	// Time the staged algorithm, serially and in parallel.
+	vector<size_t> serial, parallel;
+	start = std::chrono::steady_clock::now();
+	for (size_t i = 0; i < num_repeats; ++i)
+	{
+		serial = lig.cluster(ex.data(), num_tasks, num_tasks, max_conformations);
+	}
+	const double serial_seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count() / num_repeats;
+	task_scheduler ts(num_threads);
+	const ligand::parallel_for pf = [&](const size_t n, const function<void(const size_t)>& f)
+	{
+		const size_t num_chunks = min(num_threads, n);
+		task_group tg(ts);
+		for (size_t c = 0; c < num_chunks; ++c)
+		{
+			tg.run([&, c]()
+			{
+				for (size_t i = n * c / num_chunks; i < n * (c + 1) / num_chunks; ++i)
+				{
+					f(i);
+				}
+			});
+		}
+		tg.wait();
+	};
+	start = std::chrono::steady_clock::now();
+	for (size_t i = 0; i < num_repeats; ++i)
+	{
+		parallel = lig.cluster(ex.data(), num_tasks, num_tasks, max_conformations, pf);
+	}
+	const double parallel_seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count() / num_repeats;
+	ts.wait();
+
+	// Compare the representatives.
+	const bool identical = serial == reference && parallel == reference;
+	cout.setf(ios::fixed, ios::floatfield);
+	cout << setprecision(3) << reference.size() << " clusters, reference " << reference_seconds * 1e3 << " ms, staged " << serial_seconds * 1e3 << " ms, staged on " << num_threads << " threads " << parallel_seconds * 1e3 << " ms, speedup " << reference_seconds / serial_seconds << "x and " << reference_seconds / parallel_seconds << "x, " << (identical ? "identical" : "DIFFERENT") << endl;
+	return identical ? 0 : 1;
+}
@@ -0,0 +1,186 @@
+#include <chrono>
+#include <iostream>
+#include <iomanip>
+#include <numeric>
+#include <algorithm>
+#include <random>
+#include <boost/align/aligned_allocator.hpp>
+#include <boost/filesystem/fstream.hpp>
+#include "array.hpp"
+#include "scoring_function.hpp"
+#include "receptor.hpp"
+#include "ligand.hpp"
+#include "random_forest.hpp"
+#include "kernel.hpp"
+#include "profile.hpp"
+
+//! Number of Monte Carlo tasks docked per ligand, a whole number of SIMD lane groups.
+const size_t num_tasks = 32;
+
+//! Number of BFGS iterations per task.
+const size_t num_bfgs_iterations = 100;
+
+//! Number of trees of the random forest, as idock docks with by default.
+const size_t num_trees = 128;
+
+//! Number of random samples predicted by the random forest.
+const size_t num_samples = 4096;
+
+//! Maximum number of conformations written per ligand.
+const size_t max_conformations = 9;
+
+//! Number of repeats of the benchmarks too short to time once.
+const size_t num_repeats = 10;
+
+//! Edge lengths in Angstrom of the cubic boxes whose grid maps are populated.
+const array<float, 4> box_sizes = { 10, 15, 20, 25 };
+
+//! Seed of the random number streams, fixed so that every run does the same work.
+const uint64_t seed = 1;
+
+//! Returns the seconds elapsed since start.
+double seconds_since(const std::chrono::steady_clock::time_point start)
+{
+	return std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+}
+
+//! Writes a CSV record of a benchmark case, whose size is the problem size and whose work is the number of units of work done in the given seconds.
+void record(const string& benchmark, const string& c, const size_t size, const size_t work, const double seconds)
+{
+	cout << benchmark << ',' << c << ',' << size << ',' << work << ',' << seconds << endl;
+}
+
+//! Creates the grid maps of atom types xs serially, one layer of bricks at a time if the maps are sparse.
+void create_maps(receptor& rec, const vector<size_t>& xs, const scoring_function& sf)
+{
+	rec.allocate(xs);
+	rec.precalculate(sf, xs);
+	for (size_t l = 0; l < rec.num_layers(); ++l)
+	{
+		for (size_t z = rec.layer_begin(l); z < rec.layer_end(l); ++z)
+		{
+			rec.populate(xs, z, sf);
+		}
+		rec.store(xs, l);
+	}
+	rec.quantize(xs);
+}
+
+int main(int argc, char* argv[])
+{
+	if (argc < 9)
+	{
+		cout << "bench_micro receptor.pdbqt center_x center_y center_z size_x size_y size_z ligand.pdbqt..." << endl;
+		return 0;
+	}
+	const path receptor_path = argv[1];
+	const array<float, 3> center = { stof(argv[2]), stof(argv[3]), stof(argv[4]) };
+	const array<float, 3> size = { stof(argv[5]), stof(argv[6]), stof(argv[7]) };
+	const float granularity = 0.15625f;
+
+	// Parse the ligands, and collect the atom types they use.
+	vector<ligand> ligands;
+	vector<size_t> xs;
+	for (int i = 8; i < argc; ++i)
+	{
+		boost::filesystem::ifstream ifs(argv[i]);
+		const string s((istreambuf_iterator<char>(ifs)), istreambuf_iterator<char>());
+		ligands.emplace_back(path(argv[i]).filename(), s.data(), s.data() + s.size());
+	}
+	for (size_t t = 0; t < scoring_function::n; ++t)
+	{
+		if (any_of(ligands.cbegin(), ligands.cend(), [t](const ligand& lig) { return lig.xs[t]; })) xs.push_back(t);
+	}
+	cout.setf(ios::fixed, ios::floatfield);
+	cout << setprecision(6) << "Benchmark,Case,Size,Work,Seconds" << endl;
+
+	// Precalculate all the type pairs of the scoring function.
+	scoring_function sf;
+	auto start = std::chrono::steady_clock::now();
+	for (size_t t1 = 0; t1 < sf.n; ++t1)
+	for (size_t t0 = 0; t0 <= t1; ++t0)
+	{
+		sf.precalculate(t0, t1);
+	}
+	record("precalculate", "all type pairs", sf.nr, sf.np, seconds_since(start));
+
+	// Populate the grid maps of the atom types of the ligands in cubic boxes of increasing size around the center, and in the docking box.
+	for (const float s : box_sizes)
+	{
+		receptor rec(receptor_path, center, { s, s, s }, granularity);
+		start = std::chrono::steady_clock::now();
+		create_maps(rec, xs, sf);
+		record("populate", to_string(static_cast<int>(s)) + " A box", rec.num_probes_product, rec.num_probes_product * xs.size(), seconds_since(start));
+	}
+	receptor rec(receptor_path, center, size, granularity);
+	start = std::chrono::steady_clock::now();
+	create_maps(rec, xs, sf);
+	record("populate", "docking box", rec.num_probes_product, rec.num_probes_product * xs.size(), seconds_since(start));
+
+	// Train the random forest serially, and predict random samples both one at a time and in bulk.
+	forest f(num_trees, seed);
+	start = std::chrono::steady_clock::now();
+	for (size_t i = 0; i < num_trees; ++i)
+	{
+		f.train(i);
+	}
+	f.clear();
+	record("train", to_string(num_trees) + " trees", num_trees, num_trees, seconds_since(start));
+	mt19937_64 rng(seed);
+	uniform_real_distribution<float> u(0, 100);
+	vector<float> X(tree::nv * num_samples);
+	for (auto& v : X) v = u(rng);
+	double sum = 0;
+	start = std::chrono::steady_clock::now();
+	for (size_t r = 0; r < num_repeats; ++r)
+	{
+		for (size_t i = 0; i < num_samples; ++i)
+		{
+			array<float, tree::nv> x;
+			copy(X.cbegin() + tree::nv * i, X.cbegin() + tree::nv * (i + 1), x.begin());
+			sum += f(x);
+		}
+	}
+	record("forest", "operator()", num_trees, num_samples * num_repeats, seconds_since(start));
+	start = std::chrono::steady_clock::now();
+	for (size_t r = 0; r < num_repeats; ++r)
+	{
+		const vector<float> y = f.predict(X.data(), num_samples);
+		sum += y.front();
+	}
+	record("forest", "predict", num_trees, num_samples * num_repeats, seconds_since(start));
+
+	// Dock each ligand with the Monte Carlo kernel on a single thread, counting its evaluations, and then cluster, rescore and format its conformations.
+	const array<decltype(&monte_carlo<num_lanes, 0>), max_specialized_nv - 5> kernels =
+	{{
+		monte_carlo<num_lanes,  6>, monte_carlo<num_lanes,  7>, monte_carlo<num_lanes,  8>, monte_carlo<num_lanes,  9>,
+		monte_carlo<num_lanes, 10>, monte_carlo<num_lanes, 11>, monte_carlo<num_lanes, 12>, monte_carlo<num_lanes, 13>,
+		monte_carlo<num_lanes, 14>, monte_carlo<num_lanes, 15>, monte_carlo<num_lanes, 16>,
+	}};
+	for (size_t l = 0; l < ligands.size(); ++l)
+	{
+		ligand& lig = ligands[l];
+		const string stem = lig.filename.stem().string();
+		const auto kernel = lig.nv <= max_specialized_nv ? kernels[lig.nv - 6] : monte_carlo<num_lanes, 0>;
+		vector<int> ligh(lig.get_lig_elems());
+		lig.encode(ligh.data(), sf.nr);
+		vector<float, boost::alignment::aligned_allocator<float, 64>> sln(((lig.get_sln_elems() + 15) & ~static_cast<size_t>(15)) * num_lanes);
+		vector<float> cnf(lig.get_cnf_elems() * num_tasks);
+		profile_counters ctr{};
+		start = std::chrono::steady_clock::now();
+		kernel(sln.data(), ligh.data(), lig.nv, lig.nf, lig.na, lig.np, seed, l, 0, num_tasks, num_bfgs_iterations, sf.e, sf.d, sf.ns, sf.interpolated, rec.corner0, rec.corner1, rec.num_probes, rec.granularity_inverse, rec.mps.data(), rec.bts.data(), rec.mqs.data(), rec.mqa.data(), rec.precision, false, 0, rec.num_probes, rec.granularity_inverse, rec.mps.data(), cnf.data(), num_tasks, ctr.data());
+		record("monte_carlo", stem, lig.na, ctr[counter_evaluations], seconds_since(start));
+		pose_record pose;
+		start = std::chrono::steady_clock::now();
+		for (size_t r = 0; r < num_repeats; ++r)
+		{
+			lig.affinities.clear();
+			lig.pkds.clear();
+			lig.write(cnf.data(), max_conformations, num_tasks, rec, f, sf, pose);
+		}
+		record("write", stem, lig.na, lig.affinities.size() * num_repeats, seconds_since(start));
+	}
+
+	// Keep the predictions alive so that they are not optimized away.
+	return sum != sum;
+}
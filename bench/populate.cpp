@@ -0,0 +1,120 @@
+#include <chrono>
+#include <iostream>
+#include <iomanip>
+#include <numeric>
+#include <cstring>
+#include <cmath>
+#include "array.hpp"
+#include "scoring_function.hpp"
+#include "receptor.hpp"
+
+//! Populates grid maps by visiting every receptor atom for each Z slice and scattering into the maps of the requested atom types, i.e. the reference algorithm prior to spatial binning and tiling.
+void populate_reference(receptor& rec, vector<vector<float>>& maps, const vector<size_t>& xs, const size_t z, const scoring_function& sf)
+{
+	const size_t n = xs.size();
+	const float z_coord = rec.corner0[2] + rec.granularity * z;
+	const size_t z_offset = rec.num_probes[0] * rec.num_probes[1] * z;
+	for (const auto& a : rec.atoms)
+	{
+		const float dz = z_coord - a.coord[2];
+		const float dz_sqr = dz * dz;
+		const float dydx_sqr_ub = scoring_function::cutoff_sqr - dz_sqr;
+		if (dydx_sqr_ub <= 0) continue;
+		const float dydx_ub = sqrt(dydx_sqr_ub);
+		const float y_lb = a.coord[1] - dydx_ub;
+		const float y_ub = a.coord[1] + dydx_ub;
+		const size_t y_beg = y_lb > rec.corner0[1] ? (y_lb < rec.corner1[1] ? static_cast<size_t>((y_lb - rec.corner0[1]) * rec.granularity_inverse)     : rec.num_probes[1]) : 0;
+		const size_t y_end = y_ub > rec.corner0[1] ? (y_ub < rec.corner1[1] ? static_cast<size_t>((y_ub - rec.corner0[1]) * rec.granularity_inverse) + 1 : rec.num_probes[1]) : 0;
+		const vector<size_t>& p = rec.p_offset[a.xs];
+		size_t zy_offset = z_offset + rec.num_probes[0] * y_beg;
+		float dy = rec.corner0[1] + rec.granularity * y_beg - a.coord[1];
+		for (size_t y = y_beg; y < y_end; ++y, zy_offset += rec.num_probes[0], dy += rec.granularity)
+		{
+			const float dy_sqr = dy * dy;
+			const float dx_sqr_ub = dydx_sqr_ub - dy_sqr;
+			if (dx_sqr_ub <= 0) continue;
+			const float dx_ub = sqrt(dx_sqr_ub);
+			const float x_lb = a.coord[0] - dx_ub;
+			const float x_ub = a.coord[0] + dx_ub;
+			const size_t x_beg = x_lb > rec.corner0[0] ? (x_lb < rec.corner1[0] ? static_cast<size_t>((x_lb - rec.corner0[0]) * rec.granularity_inverse)     : rec.num_probes[0]) : 0;
+			const size_t x_end = x_ub > rec.corner0[0] ? (x_ub < rec.corner1[0] ? static_cast<size_t>((x_ub - rec.corner0[0]) * rec.granularity_inverse) + 1 : rec.num_probes[0]) : 0;
+			const float dzdy_sqr = dz_sqr + dy_sqr;
+			size_t zyx_offset = zy_offset + x_beg;
+			float dx = rec.corner0[0] + rec.granularity * x_beg - a.coord[0];
+			for (size_t x = x_beg; x < x_end; ++x, ++zyx_offset, dx += rec.granularity)
+			{
+				const float dx_sqr = dx * dx;
+				const float r2 = dzdy_sqr + dx_sqr;
+				if (r2 >= scoring_function::cutoff_sqr) continue;
+				const size_t r_offset = static_cast<size_t>(sf.ns * r2);
+				for (size_t i = 0; i < n; ++i)
+				{
+					maps[xs[i]][zyx_offset] += sf.e[p[i] + r_offset];
+				}
+			}
+		}
+	}
+}
+
+int main(int argc, char* argv[])
+{
+	if (argc < 8)
+	{
+		cout << "bench_populate receptor.pdbqt center_x center_y center_z size_x size_y size_z [granularity] [xs...]" << endl;
+		return 0;
+	}
+	const array<float, 3> center = { stof(argv[2]), stof(argv[3]), stof(argv[4]) };
+	const array<float, 3> size = { stof(argv[5]), stof(argv[6]), stof(argv[7]) };
+	const float granularity = argc > 8 ? stof(argv[8]) : 0.15625f;
+	vector<size_t> xs;
+	for (int i = 9; i < argc; ++i)
+	{
+		xs.push_back(stoul(argv[i]));
+	}
+	if (xs.empty())
+	{
+		xs.resize(scoring_function::n);
+		iota(xs.begin(), xs.end(), 0);
+	}
+
+	scoring_function sf;
+	for (size_t t1 = 0; t1 < sf.n; ++t1)
+	for (size_t t0 = 0; t0 <=  t1; ++t0)
+	{
+		sf.precalculate(t0, t1);
+	}
+	receptor rec(argv[1], center, size, granularity);
+	const size_t num_planes = rec.num_probes[2]; // Number of planes along Z.
+	cout << "Populating " << xs.size() << " grid maps of " << rec.num_probes[0] << 'x' << rec.num_probes[1] << 'x' << rec.num_probes[2] << " probes from " << rec.atoms.size() << " atoms" << endl;
+
+	// Time the reference algorithm.
+	vector<vector<float>> reference_maps(sf.n);
+	for (const size_t t : xs) reference_maps[t].resize(rec.num_probes_product);
+	auto start = std::chrono::steady_clock::now();
+	rec.precalculate(sf, xs);
+	for (size_t z = 0; z < num_planes; ++z)
+	{
+		populate_reference(rec, reference_maps, xs, z, sf);
+	}
+	const double reference_seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+	// Time the indexed and tiled algorithm.
+	for (const size_t t : xs) rec.maps[t].resize(rec.num_probes_product);
+	start = std::chrono::steady_clock::now();
+	rec.precalculate(sf, xs);
+	for (size_t z = 0; z < num_planes; ++z)
+	{
+		rec.populate(xs, z, sf);
+	}
+	const double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+	// Compare the two sets of grid maps bitwise.
+	bool identical = true;
+	for (const size_t t : xs)
+	{
+		identical &= !memcmp(reference_maps[t].data(), rec.maps[t].data(), rec.map_bytes);
+	}
+	cout.setf(ios::fixed, ios::floatfield);
+	cout << setprecision(3) << "reference " << reference_seconds << " s, tiled " << seconds << " s, speedup " << reference_seconds / seconds << "x, " << (identical ? "identical" : "DIFFERENT") << endl;
+	return identical ? 0 : 1;
+}
@@ -1,6 +1,7 @@
-#include <iomanip>
 #include <cassert>
+#include <algorithm>
 #include "array.hpp"
+#include "format.hpp"
 #include "atom.hpp"
 
 //! AutoDock4 atom type strings, e.g. H, HD, C, A.
@@ -147,11 +148,20 @@ const array<size_t, atom::n> atom::ad_to_rf =
 	n, // 30 = Cs -> dummy
 };
 
-atom::atom(const string& line) :
-	serial(stoul(line.substr(6, 5))),
-	name(line.substr(12, 4)),
-	coord({ stof(line.substr(30, 8)), stof(line.substr(38, 8)), stof(line.substr(46, 8)) }),
-	ad(find(ad_strings.cbegin(), ad_strings.cend(), line.substr(77, isspace(line[78]) ? 1 : 2)) - ad_strings.cbegin()),
+//! Returns the line if it is long enough to hold the fields up to the AutoDock4 atom type, or throws out_of_range as substr does otherwise.
+static const char* check_length(const char* const line, const size_t n)
+{
+	if (n < 77) throw out_of_range("ATOM/HETATM line too short: " + string(line, n));
+	return line;
+}
+
+atom::atom(const char* const line, const size_t n) :
+	coord({ parse_float(check_length(line, n) + 30, 8), parse_float(line + 38, 8), parse_float(line + 46, 8) }),
+	serial(static_cast<uint32_t>(parse_size(line + 6, 5))),
+	hydrogens_begin(0),
+	hydrogens_end(0),
+	name({{ line[12], line[13], line[14], line[15] }}),
+	ad(find(ad_strings.cbegin(), ad_strings.cend(), string(line + 77, n > 78 ? (isspace(line[78]) ? 1 : 2) : n - 77)) - ad_strings.cbegin()),
 	xs(ad_to_xs[ad]),
 	rf(ad_to_rf[ad])
 {
@@ -229,7 +239,18 @@ bool atom::has_covalent_bond(const atom& a) const
 	return distance_sqr(coord, a.coord) < s * s;
 }
 
-void atom::output(boost::filesystem::ofstream& ofs, const array<float, 3>& coord) const
+void atom::output(string& s, const array<float, 3>& coord) const
 {
-	ofs << "ATOM  " << setw(5) << serial << ' ' << name << setw(14) << "" << setw(8) << coord[0] << setw(8) << coord[1] << setw(8) << coord[2] << setw(23) << "" << ad_strings[ad] << (ad_strings[ad].size() == 1 ? " " : "") << '\n';
+	s.append("ATOM  ", 6);
+	append_size(s, serial, 5);
+	s.push_back(' ');
+	s.append(name.data(), name.size());
+	s.append(14, ' ');
+	append_float(s, coord[0], 8);
+	append_float(s, coord[1], 8);
+	append_float(s, coord[2], 8);
+	s.append(23, ' ');
+	s.append(ad_strings[ad]);
+	if (ad_strings[ad].size() == 1) s.push_back(' ');
+	s.push_back('\n');
 }
@@ -3,10 +3,40 @@
 #define IDOCK_ATOM_HPP
 
 #include <array>
-#include <boost/filesystem/fstream.hpp>
+#include <cstdint>
+#include <cstring>
+#include <string>
+#include <vector>
+#include <stdexcept>
 using namespace std;
 
-//! Represents an atom of either receptor or ligand.
+//! Parses an unsigned integer from a fixed-width field of n characters without allocation, throwing invalid_argument as stoul does if the field holds no number.
+inline size_t parse_size(const char* const p, const size_t n)
+{
+	char buf[32];
+	const size_t l = min<size_t>(n, sizeof(buf) - 1);
+	memcpy(buf, p, l);
+	buf[l] = '\0';
+	char* e;
+	const size_t v = strtoul(buf, &e, 10);
+	if (e == buf) throw invalid_argument("parse_size");
+	return v;
+}
+
+//! Parses a floating point number from a fixed-width field of n characters without allocation, throwing invalid_argument as stof does if the field holds no number.
+inline float parse_float(const char* const p, const size_t n)
+{
+	char buf[32];
+	const size_t l = min<size_t>(n, sizeof(buf) - 1);
+	memcpy(buf, p, l);
+	buf[l] = '\0';
+	char* e;
+	const float v = strtof(buf, &e);
+	if (e == buf) throw invalid_argument("parse_float");
+	return v;
+}
+
+//! Represents an atom of either receptor or ligand as a fixed-width record of 32 bytes, which holds no heap storage so that parsing a ligand allocates nothing per atom.
 class atom
 {
 private:
@@ -16,16 +46,20 @@ private:
 	static const array<size_t, n> ad_to_xs; //!< AutoDock4 to XScore atom type conversion.
 	static const array<size_t, n> ad_to_rf; //!< AutoDock4 to RF-Score atom type conversion.
 public:
-	size_t serial; //!< Atom serial.
-	string name; //!< Atom name, 4 characters wide.
 	array<float, 3> coord; //!< Coordinate.
-	size_t ad; //!< AutoDock4 atom type.
-	size_t xs; //!< XScore atom type.
-	size_t rf; //!< RF-Score atom type.
-	vector<atom> hydrogens; //!< Hydrogens connected to the current atom.
+	uint32_t serial; //!< Atom serial.
+	uint32_t hydrogens_begin; //!< Index to ligand::hydrogens of the first hydrogen connected to the current atom, if it is a heavy atom of a ligand.
+	uint32_t hydrogens_end; //!< Index to ligand::hydrogens one past the last hydrogen connected to the current atom.
+	array<char, 4> name; //!< Atom name, 4 characters wide.
+	uint8_t ad; //!< AutoDock4 atom type.
+	uint8_t xs; //!< XScore atom type.
+	uint8_t rf; //!< RF-Score atom type.
+
+	//! Constructs an atom from an ATOM/HETATM line of n characters in PDBQT format, parsing fixed-width fields in place.
+	explicit atom(const char* const line, const size_t n);
 
 	//! Constructs an atom from an ATOM/HETATM line in PDBQT format.
-	explicit atom(const string& line);
+	explicit atom(const string& line) : atom(line.data(), line.size()) {}
 
 	//! Returns true if the AutoDock4 atom type is not supported.
 	bool ad_unsupported() const;
@@ -60,8 +94,8 @@ public:
 	//! Returns true if the current atom is covalently bonded to a given atom, i.e. their distance is within a certain threshold which depends on their covalent radii.
 	bool has_covalent_bond(const atom& a) const;
 
-	//! Outputs an ATOM line in PDBQT format.
-	void output(boost::filesystem::ofstream& ofs, const array<float, 3>& coord) const;
+	//! Appends an ATOM line in PDBQT format.
+	void output(string& s, const array<float, 3>& coord) const;
 };
 
 #endif
@@ -0,0 +1,94 @@
+#include <cstring>
+#include <boost/filesystem/operations.hpp>
+#include "checksum.hpp"
+#include "message.hpp"
+#include "checkpoint.hpp"
+
+//! Signature of checkpoint files.
+static const char checkpoint_magic[8] = { 'i', 'd', 'o', 'c', 'k', 'c', 'k', 0 };
+
+//! Returns the checksum of the payload of a record, which detects torn or corrupted records.
+static uint64_t record_checksum(const char* const p, const size_t n)
+{
+	checksum c;
+	c(p, n);
+	return c.value();
+}
+
+checkpoint::checkpoint(const path& p, const uint64_t key, const bool resume)
+{
+	// Read the records of an existing file up to the first torn or corrupted one.
+	uint64_t valid_size = 0;
+	if (resume && exists(p))
+	{
+		boost::filesystem::ifstream ifs(p, ios::binary);
+		char magic[sizeof(checkpoint_magic)];
+		uint64_t k;
+		if (ifs.read(magic, sizeof(magic)) && ifs.read(reinterpret_cast<char*>(&k), sizeof(k)))
+		{
+			if (memcmp(magic, checkpoint_magic, sizeof(checkpoint_magic)) || k != key) throw runtime_error("Checkpoint file " + p.string() + " was written by a run of different parameters");
+			valid_size = sizeof(magic) + sizeof(k);
+			const uint64_t size = file_size(p);
+			string payload;
+			uint64_t n, sum;
+			while (ifs.read(reinterpret_cast<char*>(&n), sizeof(n)) && n <= size)
+			{
+				payload.resize(n);
+				if (!ifs.read(&payload[0], n) || !ifs.read(reinterpret_cast<char*>(&sum), sizeof(sum)) || sum != record_checksum(payload.data(), n)) break;
+				checkpoint_record r;
+				try
+				{
+					message_reader mr(payload);
+					mr.get(r.index);
+					mr.get(r.num_tasks);
+					mr.get(r.shard);
+					mr.get(r.shard_size);
+					mr.get(r.shard_models);
+					mr.get(r.stem);
+					mr.get(r.affinities);
+				}
+				catch (const exception&)
+				{
+					break;
+				}
+				records.push_back(move(r));
+				valid_size += sizeof(n) + n + sizeof(sum);
+			}
+		}
+	}
+
+	// Append to the valid records, or create the file anew.
+	if (valid_size)
+	{
+		resize_file(p, valid_size);
+		ofs.open(p, ios::binary | ios::app);
+	}
+	else
+	{
+		ofs.open(p, ios::binary);
+		ofs.write(checkpoint_magic, sizeof(checkpoint_magic));
+		ofs.write(reinterpret_cast<const char*>(&key), sizeof(key));
+		ofs.flush();
+	}
+	if (!ofs) throw runtime_error("Failed to create checkpoint file " + p.string());
+}
+
+void checkpoint::append(const checkpoint_record& r)
+{
+	lock_guard<mutex> guard(m);
+	buf.clear();
+	put<uint64_t>(buf, 0);
+	put(buf, r.index);
+	put(buf, r.num_tasks);
+	put(buf, r.shard);
+	put(buf, r.shard_size);
+	put(buf, r.shard_models);
+	put(buf, r.stem);
+	put(buf, r.affinities);
+	const uint64_t n = buf.size() - sizeof(n);
+	memcpy(&buf[0], &n, sizeof(n));
+	put(buf, record_checksum(buf.data() + sizeof(n), n));
+	ofs.write(buf.data(), buf.size());
+	ofs.flush();
+	if (!ofs) throw runtime_error("Failed to write checkpoint file");
+}
@@ -0,0 +1,43 @@
+#pragma once
+#ifndef IDOCK_CHECKPOINT_HPP
+#define IDOCK_CHECKPOINT_HPP
+
+#include <mutex>
+#include <vector>
+#include <cstdint>
+#include <boost/filesystem/fstream.hpp>
+using namespace std;
+using namespace boost::filesystem;
+
+//! Represents a ligand whose log record and conformations are complete, as recorded in a checkpoint file.
+class checkpoint_record
+{
+public:
+	uint64_t index; //!< Index of the ligand in input order.
+	uint64_t num_tasks; //!< Number of Monte Carlo tasks run for the ligand if the tasks are adaptive, or 0 otherwise.
+	uint64_t shard; //!< Shard file the conformations were appended to, or the number of shards if they were written to a file of their own.
+	uint64_t shard_size; //!< Size of the shard file right after the conformations.
+	uint64_t shard_models; //!< Number of models of the shard file right after the conformations.
+	string stem; //!< Stem of the ligand filename.
+	vector<float> affinities; //!< Predicted binding affinities of the ligand.
+};
+
+//! Represents an append-only checkpoint file of the ligands completed by a run, from which a preempted run resumes.
+//! The file starts with a key of the run parameters, followed by records that are each prefixed by their size and suffixed by their checksum, so that a record torn by preemption is detected and dropped together with anything after it.
+class checkpoint
+{
+public:
+	//! Opens a checkpoint file for a run whose parameters have a key. If resume is true and the file exists, reads its valid records, truncates it after them and appends to it, or throws if its key differs. Otherwise creates the file anew.
+	explicit checkpoint(const path& p, const uint64_t key, const bool resume);
+
+	//! Appends a record and flushes it to the file. Thread safe.
+	void append(const checkpoint_record& r);
+
+	vector<checkpoint_record> records; //!< Records read from the file on resume.
+private:
+	boost::filesystem::ofstream ofs; //!< Checkpoint file.
+	string buf; //!< Buffer of the record being appended.
+	mutex m; //!< Mutex guarding ofs and buf.
+};
+
+#endif
@@ -0,0 +1,20 @@
+#include "checksum.hpp"
+
+checksum::checksum() : h(14695981039346656037ULL)
+{
+}
+
+void checksum::operator()(const void* const p, const size_t num_bytes)
+{
+	const unsigned char* const b = static_cast<const unsigned char*>(p);
+	for (size_t i = 0; i < num_bytes; ++i)
+	{
+		h ^= b[i];
+		h *= 1099511628211ULL;
+	}
+}
+
+uint64_t checksum::value() const
+{
+	return h;
+}
@@ -0,0 +1,32 @@
+#pragma once
+#ifndef IDOCK_CHECKSUM_HPP
+#define IDOCK_CHECKSUM_HPP
+
+#include <cstdint>
+#include <cstddef>
+using namespace std;
+
+//! Represents a 64-bit FNV-1a checksum used to validate cache files against the parameters they were created from.
+class checksum
+{
+public:
+	//! Constructs a checksum initialized to the FNV offset basis.
+	explicit checksum();
+
+	//! Aggregates a number of bytes into the checksum.
+	void operator()(const void* const p, const size_t num_bytes);
+
+	//! Aggregates the bytes of a trivially copyable object into the checksum.
+	template <typename T>
+	void operator()(const T& v)
+	{
+		(*this)(&v, sizeof(v));
+	}
+
+	//! Returns the checksum value.
+	uint64_t value() const;
+private:
+	uint64_t h; //!< Hash value.
+};
+
+#endif
@@ -0,0 +1,50 @@
+#include "client.hpp"
+
+client::client(const string& address, string&& setup, const path& input_folder_path, const size_t input_offset, const size_t batch_size, result_handler&& handle) : host(address.substr(0, address.rfind(':'))), port(address.substr(address.rfind(':') + 1)), setup(move(setup)), reader(input_folder_path, input_offset), batch_size(batch_size), handle(move(handle))
+{
+}
+
+void client::run()
+{
+	boost::asio::io_service io;
+	tcp::socket sock(io);
+	boost::asio::connect(sock, tcp::resolver(io).resolve(tcp::resolver::query(host, port)));
+	uint64_t lid = 0;
+	string payload;
+	while (true)
+	{
+		// Read the next batch of ligands, each with its index in input order, after the setup.
+		payload = setup;
+		const size_t n_offset = payload.size();
+		put<uint64_t>(payload, 0);
+		uint64_t n = 0;
+		ligand_block blk;
+		while (n < batch_size && reader.next(blk))
+		{
+			put<uint64_t>(payload, lid++);
+			put(payload, blk.filename.string());
+			put(payload, string(blk.b, blk.e));
+			++n;
+		}
+		if (!n) break;
+		memcpy(&payload[n_offset], &n, sizeof(n));
+		send_message(sock, message_dock, payload);
+
+		// Handle the ligands as they stream back until the batch is done.
+		while (true)
+		{
+			const message_type type = receive_message(sock, payload);
+			if (type == message_done) break;
+			if (type == message_error) throw runtime_error("Server " + host + ':' + port + ": " + payload);
+			if (type != message_pose) throw runtime_error("Unexpected message");
+			message_reader r(payload);
+			uint64_t id;
+			string filename;
+			pose_record pose;
+			r.get(id);
+			r.get(filename);
+			r.get(pose);
+			handle(filename, move(pose));
+		}
+	}
+}
@@ -0,0 +1,32 @@
+#pragma once
+#ifndef IDOCK_CLIENT_HPP
+#define IDOCK_CLIENT_HPP
+
+#include <functional>
+#include <boost/asio/io_service.hpp>
+#include "ligand_reader.hpp"
+#include "message.hpp"
+
+//! Represents a client of a resident server, which sends batches of input ligands one after another to be docked against a receptor with docking parameters, and handles each docked ligand as the server streams it back.
+//! Ligands are keyed by their index in the input, so every ligand is docked exactly as a standalone run would dock it.
+class client
+{
+public:
+	//! Represents a handler of the result of a docked ligand, i.e. its output filename and conformations.
+	typedef function<void(const path& filename, pose_record&& pose)> result_handler;
+
+	//! Constructs a client of a server at an address of the form host:port, which sends batches of up to batch_size ligands read from an input folder or file from a byte offset, each prefixed by the receptor, the box and the docking parameters in setup.
+	explicit client(const string& address, string&& setup, const path& input_folder_path, const size_t input_offset, const size_t batch_size, result_handler&& handle);
+
+	//! Connects to the server and docks all the ligands. Throws on errors of the connection, and on an error reported by the server.
+	void run();
+private:
+	const string host; //!< Host of the server.
+	const string port; //!< Port of the server.
+	const string setup; //!< Receptor, box and docking parameters prefixing every dock message.
+	ligand_reader reader; //!< Reader of the input ligands.
+	const size_t batch_size; //!< Maximum number of ligands per batch.
+	const result_handler handle; //!< Handler of the results.
+};
+
+#endif
@@ -0,0 +1,214 @@
+#include <iostream>
+#include <boost/lexical_cast.hpp>
+#include "coordinator.hpp"
+
+coordinator::coordinator(const unsigned short port, string&& setup, const path& input_folder_path, const size_t input_offset, const size_t batch_size, result_handler&& handle) : port(port), setup(move(setup)), reader(input_folder_path, input_offset), batch_size(batch_size), handle(move(handle)), lid(0), next_id(0), exhausted(false), num_handling(0), finished(false)
+{
+}
+
+void coordinator::run()
+{
+	tcp::acceptor acceptor(io, tcp::endpoint(tcp::v4(), port));
+	vector<shared_ptr<tcp::socket>> sockets;
+	vector<thread> threads;
+	{
+		// Read the first batch, so as to finish at once if there are no ligands.
+		lock_guard<mutex> guard(m);
+		size_t id;
+		if (read(id)) queued.push_back(id);
+		finish_if_done();
+	}
+
+	// Accept workers in the calling thread, and serve each in its own thread. Finishing connects to the acceptor to wake it up.
+	while (true)
+	{
+		const auto sock = make_shared<tcp::socket>(io);
+		{
+			lock_guard<mutex> guard(m);
+			if (finished) break;
+		}
+		boost::system::error_code ec;
+		acceptor.accept(*sock, ec);
+		if (ec) continue;
+		lock_guard<mutex> guard(m);
+		if (finished) break;
+		cout << "Accepted worker " << sock->remote_endpoint(ec) << endl;
+		sockets.push_back(sock);
+		threads.emplace_back([this, sock]()
+		{
+			serve(*sock);
+		});
+	}
+
+	// Shut down the connections of workers still docking copies of batches already done, and wait for their threads.
+	for (const auto& sock : sockets)
+	{
+		boost::system::error_code ec;
+		sock->shutdown(tcp::socket::shutdown_both, ec);
+	}
+	for (auto& t : threads)
+	{
+		t.join();
+	}
+	if (!error.empty()) throw runtime_error(error);
+}
+
+void coordinator::serve(tcp::socket& sock)
+{
+	bool holding = false; // Whether the worker holds a batch whose result has not arrived.
+	size_t id = 0;
+	try
+	{
+		send_message(sock, message_setup, setup);
+		string payload;
+		while (true)
+		{
+			switch (receive_message(sock, payload))
+			{
+			case message_request:
+			{
+				bool more;
+				{
+					lock_guard<mutex> guard(m);
+					more = !finished && next(id, payload);
+
+					// The input may turn out exhausted only now, after the results of all the batches read before.
+					if (!more) finish_if_done();
+				}
+				if (!more)
+				{
+					send_message(sock, message_done, string());
+					return;
+				}
+				holding = true;
+				send_message(sock, message_batch, payload);
+				break;
+			}
+			case message_result:
+			{
+				message_reader r(payload);
+				size_t rid;
+				r.get(rid);
+				holding = false;
+				if (!accept(rid)) break;
+
+				// Decode and handle the results, then finish if they are the last.
+				uint64_t n;
+				r.get(n);
+				{
+					lock_guard<mutex> guard(hm);
+					for (size_t i = 0; i < n; ++i)
+					{
+						string filename;
+						pose_record pose;
+						r.get(filename);
+						r.get(pose);
+						handle(filename, move(pose));
+					}
+				}
+				lock_guard<mutex> guard(m);
+				--num_handling;
+				finish_if_done();
+				break;
+			}
+			case message_error:
+			{
+				lock_guard<mutex> guard(m);
+				boost::system::error_code ec;
+				if (error.empty()) error = "Worker " + boost::lexical_cast<string>(sock.remote_endpoint(ec)) + ": " + payload;
+				finished = true;
+				finish_if_done();
+				return;
+			}
+			default:
+				throw runtime_error("Unexpected message");
+			}
+		}
+	}
+	catch (const exception&)
+	{
+		// Issue the batch held by the failed worker again, unless it is done meanwhile.
+		lock_guard<mutex> guard(m);
+		if (holding && outstanding.count(id))
+		{
+			queued.push_front(id);
+		}
+	}
+}
+
+bool coordinator::read(size_t& id)
+{
+	if (exhausted) return false;
+	batch& b = outstanding[next_id];
+	put<uint64_t>(b.payload, next_id);
+	put<uint64_t>(b.payload, 0);
+	uint64_t n = 0;
+	ligand_block blk;
+	while (n < batch_size && reader.next(blk))
+	{
+		put<uint64_t>(b.payload, lid++);
+		put(b.payload, blk.filename.string());
+		put(b.payload, string(blk.b, blk.e));
+		++n;
+	}
+	if (!n)
+	{
+		outstanding.erase(next_id);
+		exhausted = true;
+		return false;
+	}
+	memcpy(&b.payload[sizeof(uint64_t)], &n, sizeof(n));
+	b.num_issues = 0;
+	id = next_id++;
+	return true;
+}
+
+bool coordinator::next(size_t& id, string& payload)
+{
+	// Issue the queued batches first, then a new batch, then a copy of the outstanding batch issued the fewest times, the oldest first, should its worker straggle or hang.
+	map<size_t, batch>::iterator it;
+	while (!queued.empty() && (it = outstanding.find(queued.front())) == outstanding.end())
+	{
+		queued.pop_front();
+	}
+	if (!queued.empty())
+	{
+		queued.pop_front();
+	}
+	else if (read(id))
+	{
+		it = outstanding.find(id);
+	}
+	else
+	{
+		if (outstanding.empty()) return false;
+		it = outstanding.begin();
+		for (auto i = outstanding.begin(); i != outstanding.end(); ++i)
+		{
+			if (i->second.num_issues < it->second.num_issues) it = i;
+		}
+	}
+	++it->second.num_issues;
+	id = it->first;
+	payload = it->second.payload;
+	return true;
+}
+
+bool coordinator::accept(const size_t id)
+{
+	lock_guard<mutex> guard(m);
+	if (!outstanding.erase(id)) return false;
+	++num_handling;
+	return true;
+}
+
+void coordinator::finish_if_done()
+{
+	if (!finished && !(exhausted && outstanding.empty() && !num_handling)) return;
+	finished = true;
+
+	// Wake up the accepting thread.
+	tcp::socket sock(io);
+	boost::system::error_code ec;
+	sock.connect(tcp::endpoint(boost::asio::ip::address_v4::loopback(), port), ec);
+}
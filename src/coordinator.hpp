@@ -0,0 +1,69 @@
+#pragma once
+#ifndef IDOCK_COORDINATOR_HPP
+#define IDOCK_COORDINATOR_HPP
+
+#include <map>
+#include <deque>
+#include <mutex>
+#include <thread>
+#include <memory>
+#include <functional>
+#include <boost/asio/io_service.hpp>
+#include "ligand_reader.hpp"
+#include "message.hpp"
+
+//! Represents the coordinator of a distributed run, which serves the same setup to every worker that connects, and batches of input ligands to the workers as they request them, so that faster workers dock more batches.
+//! A batch stays outstanding until its result arrives. The batch of a worker whose connection fails is issued again, and once the input is exhausted, idle workers receive copies of the outstanding batches issued the fewest times, so that stragglers do not hold up the run. The first result of a batch wins.
+class coordinator
+{
+public:
+	//! Represents a handler of the result of a docked ligand, i.e. its output filename and conformations. Handlers are called one at a time.
+	typedef function<void(const path& filename, pose_record&& pose)> result_handler;
+
+	//! Constructs a coordinator that listens on a TCP port, and serves batches of up to batch_size ligands read from an input folder or file from a byte offset.
+	explicit coordinator(const unsigned short port, string&& setup, const path& input_folder_path, const size_t input_offset, const size_t batch_size, result_handler&& handle);
+
+	//! Accepts workers until the results of all the ligands have been handled, and rethrows the error reported by a worker, if any.
+	void run();
+private:
+	//! Represents a batch of ligands issued to workers.
+	struct batch
+	{
+		string payload; //!< Payload of the batch message.
+		size_t num_issues; //!< Number of times the batch has been issued.
+	};
+
+	//! Serves a worker connected by a socket until it is done or its connection fails.
+	void serve(tcp::socket& sock);
+
+	//! Reads a new batch of ligands from the input as an outstanding batch not yet issued, and returns false if the input is exhausted. Requires the lock.
+	bool read(size_t& id);
+
+	//! Chooses the next batch to issue, and returns false if all the batches are done. Requires the lock.
+	bool next(size_t& id, string& payload);
+
+	//! Marks the results of a batch as handled if they are the first of the batch, returning false for a duplicate.
+	bool accept(const size_t id);
+
+	//! Finishes the run if the input is exhausted and all the results have been handled, or unconditionally on error, waking up the accepting thread. Requires the lock.
+	void finish_if_done();
+
+	const unsigned short port; //!< TCP port to listen on.
+	const string setup; //!< Payload of the setup message.
+	ligand_reader reader; //!< Reader of the input ligands.
+	const size_t batch_size; //!< Maximum number of ligands per batch.
+	const result_handler handle; //!< Handler of the results.
+	size_t lid; //!< Index of the next ligand in input order, which keys the random number streams of its tasks.
+	size_t next_id; //!< Identifier of the next batch.
+	bool exhausted; //!< Whether all the input ligands have been read.
+	size_t num_handling; //!< Number of results being handled.
+	bool finished; //!< Whether the run is finished.
+	string error; //!< Error reported by a worker.
+	map<size_t, batch> outstanding; //!< Batches not yet done, by identifier.
+	deque<size_t> queued; //!< Batches to issue before reading new ones, i.e. the first batch and those of workers whose connections failed.
+	mutex m; //!< Mutex guarding the above.
+	mutex hm; //!< Mutex serializing the result handler.
+	boost::asio::io_service io; //!< I/O service of the sockets.
+};
+
+#endif
@@ -0,0 +1,61 @@
+#include <atomic>
+#include <boost/align/aligned_allocator.hpp>
+#include "cpu_backend.hpp"
+
+cpu_backend::cpu_backend(task_scheduler& ts, const size_t num_jobs, const size_t num_tasks, const size_t num_bfgs_iterations, const uint64_t seed, const scoring_function& sf, const receptor& rec, const bool trilinear, profile* const prof) : ts(ts), num_jobs(num_jobs), num_tasks(num_tasks), num_bfgs_iterations(num_bfgs_iterations), seed(seed), sf(sf), rec(rec), trilinear(trilinear), prof(prof), kernels
+({{
+	monte_carlo<num_lanes,  6>, monte_carlo<num_lanes,  7>, monte_carlo<num_lanes,  8>, monte_carlo<num_lanes,  9>,
+	monte_carlo<num_lanes, 10>, monte_carlo<num_lanes, 11>, monte_carlo<num_lanes, 12>, monte_carlo<num_lanes, 13>,
+	monte_carlo<num_lanes, 14>, monte_carlo<num_lanes, 15>, monte_carlo<num_lanes, 16>,
+}})
+{
+}
+
+void cpu_backend::dock(const ligand_batch& bat, float* const cnfh, const function<void(const size_t)>& done) const
+{
+	// Encode the batch once, whose descriptors hold the offsets of the encoded ligands. The jobs of all the ligands share the encoding, and are forked to one task group.
+	vector<int> ligh(bat.get_lig_elems());
+	bat.encode(ligh.data(), sf.nr);
+	task_group tg(ts);
+	for (size_t l = 0; l < bat.size(); ++l)
+	{
+		// Split the tasks of the ligand into jobs, each of which runs its tasks num_lanes at a time in lockstep into its own solution buffer padded to whole cache lines.
+		const ligand& lig = bat.ligands[l];
+		const auto kernel = lig.nv <= max_specialized_nv ? kernels[lig.nv - 6] : monte_carlo<num_lanes, 0>;
+		const size_t nj = min<size_t>(num_jobs, (num_tasks + num_lanes - 1) / num_lanes);
+		const size_t sln_elems = ((lig.get_sln_elems() + 15) & ~static_cast<size_t>(15)) * num_lanes;
+		const size_t lig_offset = ligh[ligand_batch::dsc_elems * l + 4];
+		const uint64_t lid = bat.lids[l];
+		float* const cnf = cnfh + bat.cnf_offsets[l];
+		const shared_ptr<atomic<size_t>> jobs = make_shared<atomic<size_t>>(nj);
+		const shared_ptr<ligand_work> wrk = prof ? make_shared<ligand_work>() : nullptr;
+		for (size_t job = 0; job < nj; ++job)
+		{
+			tg.run([this, &lig, &ligh, &done, kernel, nj, sln_elems, lig_offset, lid, cnf, jobs, wrk, job, l]()
+			{
+				const size_t jbeg = num_tasks * job / nj;
+				const size_t jend = num_tasks * (job + 1) / nj;
+				vector<float, boost::alignment::aligned_allocator<float, 64>> sln(sln_elems);
+				profile_counters ctr{};
+				profile_timer t(prof, phase_monte_carlo);
+				kernel(sln.data(), ligh.data() + lig_offset, lig.nv, lig.nf, lig.na, lig.np, seed, lid, jbeg, jend - jbeg, num_bfgs_iterations, sf.e, sf.d, sf.ns, sf.interpolated, rec.corner0, rec.corner1, rec.num_probes, rec.granularity_inverse, rec.mps.data(), rec.bts.data(), rec.mqs.data(), rec.mqa.data(), rec.precision, trilinear, 0, rec.num_probes, rec.granularity_inverse, rec.mps.data(), cnf + jbeg, num_tasks, wrk ? ctr.data() : nullptr);
+				if (wrk)
+				{
+					lock_guard<mutex> guard(wrk->m);
+					for (size_t c = 0; c < num_counters; ++c)
+					{
+						wrk->counters[c] += ctr[c];
+					}
+					wrk->ns += t.elapsed();
+				}
+				t.stop();
+				if (!--*jobs)
+				{
+					if (wrk) prof->add_ligand(lig.filename.stem().string(), num_tasks, wrk->counters, wrk->ns);
+					done(l);
+				}
+			});
+		}
+	}
+	tg.wait();
+}
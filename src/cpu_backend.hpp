@@ -0,0 +1,44 @@
+#pragma once
+#ifndef IDOCK_CPU_BACKEND_HPP
+#define IDOCK_CPU_BACKEND_HPP
+
+#include <functional>
+#include "task_scheduler.hpp"
+#include "scoring_function.hpp"
+#include "receptor.hpp"
+#include "ligand_batch.hpp"
+#include "kernel.hpp"
+#include "profile.hpp"
+
+//! Represents the host backend of idock_cu, idock_cl, the worker and the resident server, which docks batches of ligands as task groups on the worker threads of a task scheduler with the SIMD lane kernels of idock_cp, so that host cores dock alongside the devices rather than wait for them.
+//! The kernels draw from the same Philox streams as the device kernels, and write conformations in the same strided layout, so a batch may go to any backend.
+class cpu_backend
+{
+public:
+	//! Constructs a backend that splits the tasks of each ligand into up to num_jobs jobs, and samples grid maps with trilinear interpolation if trilinear is true or at the nearest probe otherwise. The work of each ligand is streamed to prof if it is not null.
+	explicit cpu_backend(task_scheduler& ts, const size_t num_jobs, const size_t num_tasks, const size_t num_bfgs_iterations, const uint64_t seed, const scoring_function& sf, const receptor& rec, const bool trilinear, profile* const prof = nullptr);
+
+	//! Docks the ligands of a batch in parallel, writing the conformations of ligand l into cnfh + bat.cnf_offsets[l] with stride num_tasks, and calls done(l) in a worker thread once ligand l has been docked. Returns once all the ligands are done, and rethrows the first exception thrown by a job or by done. A worker thread calling it executes jobs meanwhile.
+	void dock(const ligand_batch& bat, float* const cnfh, const function<void(const size_t)>& done) const;
+private:
+	//! Represents the work of the Monte Carlo kernel summed over the jobs of a ligand.
+	struct ligand_work
+	{
+		profile_counters counters{}; //!< Counters of the kernel.
+		uint64_t ns = 0; //!< Nanoseconds of the kernel.
+		mutex m; //!< Mutex guarding counters and ns.
+	};
+
+	task_scheduler& ts; //!< Scheduler whose worker threads run the jobs.
+	const size_t num_jobs; //!< Maximum number of jobs per ligand.
+	const size_t num_tasks; //!< Number of Monte Carlo tasks per ligand.
+	const int num_bfgs_iterations; //!< Number of BFGS iterations per task.
+	const uint64_t seed; //!< Seed of the random number streams.
+	const scoring_function& sf; //!< Precalculated scoring function.
+	const receptor& rec; //!< Receptor and its grid maps.
+	const bool trilinear; //!< Whether to interpolate grid maps trilinearly.
+	profile* const prof; //!< Profile of the run, or null.
+	const array<decltype(&monte_carlo<num_lanes, 0>), max_specialized_nv - 5> kernels; //!< Kernels specialized on the number of variables from 6 to max_specialized_nv.
+};
+
+#endif
@@ -0,0 +1,67 @@
+#pragma once
+#ifndef IDOCK_FORMAT_HPP
+#define IDOCK_FORMAT_HPP
+
+#include <cmath>
+#include <cstdio>
+#include <string>
+using namespace std;
+
+//! Returns a floating point number in thousandths rounded half to even, as printf rounds it to 3 decimal places. The product is exact in double precision for any float.
+inline long long to_thousandths(const float v)
+{
+	return static_cast<long long>(nearbyint(static_cast<double>(v) * 1000));
+}
+
+//! Appends an unsigned integer right-aligned in a field of w characters, as ostream does with setw(w).
+inline void append_size(string& s, size_t v, const size_t w)
+{
+	char buf[24];
+	char* p = buf + sizeof(buf);
+	do
+	{
+		*--p = '0' + v % 10;
+		v /= 10;
+	} while (v);
+	const size_t n = buf + sizeof(buf) - p;
+	if (n < w) s.append(w - n, ' ');
+	s.append(p, n);
+}
+
+//! Appends a number given in thousandths with 3 decimal places right-aligned in a field of w characters, prefixing a minus sign if negative is true even if the number rounds to zero.
+inline void append_thousandths(string& s, const long long t, const bool negative, const size_t w)
+{
+	char buf[32];
+	char* p = buf + sizeof(buf);
+	unsigned long long u = t < 0 ? -static_cast<unsigned long long>(t) : t;
+	for (size_t i = 0; i < 3; ++i)
+	{
+		*--p = '0' + u % 10;
+		u /= 10;
+	}
+	*--p = '.';
+	do
+	{
+		*--p = '0' + u % 10;
+		u /= 10;
+	} while (u);
+	if (negative) *--p = '-';
+	const size_t n = buf + sizeof(buf) - p;
+	if (n < w) s.append(w - n, ' ');
+	s.append(p, n);
+}
+
+//! Appends a floating point number with 3 decimal places right-aligned in a field of w characters, producing the same text as ostream does with fixed, setprecision(3) and setw(w), but without locale or stream state.
+inline void append_float(string& s, const float v, const size_t w)
+{
+	if (!isfinite(v) || fabs(v) >= 1e15f)
+	{
+		char buf[64];
+		const int n = snprintf(buf, sizeof(buf), "%*.3f", static_cast<int>(w), v);
+		s.append(buf, n);
+		return;
+	}
+	append_thousandths(s, to_thousandths(v), signbit(v), w);
+}
+
+#endif
@@ -1,123 +1,245 @@
-/*
-The idock kernel for OpenCL uses the MWC64X random number generator.
-
-MWC64X
-http://cas.ee.ic.ac.uk/people/dt10/research/rngs-gpu-mwc64x.html
-Copyright (c) 2011, David Thomas
-All rights reserved.
-
-Redistribution and use in source and binary forms, with or without modification,
-are permitted provided that the following conditions are met:
-
-	* Redistributions of source code must retain the above copyright notice,
-	this list of conditions and the following disclaimer.
-	* Redistributions in binary form must reproduce the above copyright
-	notice, this list of conditions and the following disclaimer in the
-	documentation and/or other materials provided with the distribution.
-	* Neither the name of Imperial College London nor the names of its
-	contributors may be used to endorse or promote products derived
-	from this software without specific prior written permission.
-
-THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND
-CONTRIBUTORS "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES,
-INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF
-MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
-DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR
-CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
-SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
-LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS
-OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
-CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT,
-STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
-ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF
-ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
-*/
+// Represents the Philox4x32-10 stream of a Monte Carlo task, keyed by the seed and counted by the ligand index, the task id and the draw number, identical to philox_stream of philox.hpp.
+typedef struct { uint4 ctr; uint4 blk; uint2 key; uint d; } philox_state_t;
 
-// Pre: a < M, b < M
-// Post: r = (a + b) mod M
-ulong AddMod64(ulong a, ulong b, ulong M)
+void philox_init(philox_state_t *s, const ulong sed, const ulong lid, const uint tid)
 {
-	ulong v = a + b;
-	if (v >= M || v < a) v -= M;
-	return v;
+	s->ctr = (uint4)(0, tid, (uint)lid, (uint)(lid >> 32));
+	s->key = (uint2)((uint)sed, (uint)(sed >> 32));
+	s->d = 0;
 }
 
-// Pre: a < M, b < M
-// Post: r = (a * b) mod M
-ulong MulMod64(ulong a, ulong b, ulong M)
+float philox_uniform(philox_state_t *s)
 {
-	ulong r = 0;
-	while (a)
+	if (!(s->d & 3))
 	{
-		if (a & 1) r = AddMod64(r, b, M);
-		b = AddMod64(b, b, M);
-		a = a >> 1;
+		uint4 c = s->ctr;
+		uint2 k = s->key;
+		c.x = s->d >> 2;
+		for (int r = 0; r < 10; ++r)
+		{
+			if (r)
+			{
+				k.x += 0x9E3779B9;
+				k.y += 0xBB67AE85;
+			}
+			const uint h0 = mul_hi(0xD2511F53U, c.x), l0 = 0xD2511F53U * c.x;
+			const uint h1 = mul_hi(0xCD9E8D57U, c.z), l1 = 0xCD9E8D57U * c.z;
+			c = (uint4)(h1 ^ c.y ^ k.x, l1, h0 ^ c.w ^ k.y, l0);
+		}
+		s->blk = c;
 	}
-	return r;
+	const uint w = s->d++ & 3;
+	return ((w == 0 ? s->blk.x : w == 1 ? s->blk.y : w == 2 ? s->blk.z : s->blk.w) >> 8) * (1.0f / 16777216);
 }
 
-// Pre: a < M, e >= 0
-// Post: r = (a ^ b) mod M
-// This takes at most ~64^2 modular additions, so probably about 2^15 or so instructions on most architectures
-ulong PowMod64(ulong a, ulong e, ulong M)
-{
-	ulong sqr = a, acc = 1;
-	while (e)
-	{
-		if (e & 1) acc = MulMod64(acc, sqr, M);
-		sqr = MulMod64(sqr, sqr, M);
-		e = e >> 1;
-	}
-	return acc;
-}
+// Avoid using Shared Local Memory on the Intel Xeon Phi coprocessor.
+// Have at least 1000 WGs per NDRange to optimally utilize Phi.
+// Use Array Notation with int32 Indices.
+
+#define assert(arg)
 
-typedef struct { uint x; uint c; } mwc64x_state_t;
+// With TEXTURES defined, the grid maps of all atom types are stacked along z into a single 3D image, because OpenCL C forbids arrays of images, and sampled with hardware trilinear filtering.
+#ifdef TEXTURES
+#define MAPS_PARAM __read_only image3d_t mpi
+#define MAPS_ARG mpi
+__constant sampler_t mps_sampler = CLK_NORMALIZED_COORDS_FALSE | CLK_ADDRESS_CLAMP_TO_EDGE | CLK_FILTER_LINEAR;
+#else
+#define MAPS_PARAM __global const float* const mps[15]
+#define MAPS_ARG mps
+#endif
 
-enum { A = 4294883355U };
-enum { M = 18446383549859758079UL };
-enum { B = 4077358422479273989UL };
+// With BRICKS defined, each grid map is sparse, holding a table of brick offsets followed by bricks of 9x9x9 probes, which include the first probes of the next bricks.
 
-void skip(mwc64x_state_t *s, ulong d)
+// With FLOAT16 or INT16 defined, the values of each grid map are 16-bit codes that follow the scale and offset of the map as two floats, and are decoded by the same bit manipulation as half_to_float of precision.hpp for FLOAT16.
+#if defined(FLOAT16) || defined(INT16)
+float decode(__global const float* map, const int i)
 {
-	ulong m = PowMod64(A, d, M);
-	ulong x = MulMod64(s->x * (ulong)A + s->c, m, M);
-	s->x = x / A;
-	s->c = x % A;
+	const uint h = ((__global const ushort*)(map + 2))[i];
+#ifdef FLOAT16
+	return as_float(((h & 0x8000) << 16) | ((h & 0x7fff) ? ((h & 0x7fff) + 0x1c000) << 13 : 0));
+#else
+	return map[1] + map[0] * (short)h;
+#endif
 }
+#define LOOKUP(k) decode(map, k)
+#else
+#define LOOKUP(k) map[k]
+#endif
 
-void seed(mwc64x_state_t *s, ulong baseOffset, ulong perStreamOffset)
+// Looks up the grid map of XScore type t at the coordinate c0, c1 and c2 of a heavy atom, returning its free energy and storing its derivatives at i0, i0 + gds and i0 + 2 * gds of both d and n, or penalizes the atom with zero derivatives if it is out of the box.
+inline
+float lookup(__global float* d, __global float* n, const int i0, const int gds, const int t, const float c0, const float c1, const float c2, const float3 cr0, const float3 cr1, const int3 npr, const float gri, MAPS_PARAM)
 {
-	ulong d = baseOffset + get_global_id(0) * perStreamOffset;
-	ulong m = PowMod64(A, d, M);
-	ulong x = MulMod64(B, m, M);
-	s->x = x / A;
-	s->c = x % A;
+	const int i1 = i0 + gds;
+	const int i2 = i1 + gds;
+	float p0, p1, p2, e000, e100, e010, e001;
+	int k0, k1, k2;
+#ifndef TEXTURES
+	__global const float* map;
+#endif
+
+	// TODO: move conditional expression out to bypass short circuiting.
+	// Penalize out-of-box case.
+	if (c0 < cr0.x || cr1.x <= c0 || c1 < cr0.y || cr1.y <= c1 || c2 < cr0.z || cr1.z <= c2)
+	{
+		d[i0] = n[i0] = 0.0f;
+		d[i1] = n[i1] = 0.0f;
+		d[i2] = n[i2] = 0.0f;
+		return 10.0f;
+	}
+
+#ifdef TEXTURES
+	// Sample the layers [t * npr.z, (t + 1) * npr.z) of the image, whose texels are centered at half-integer coordinates. Clamp z within the layers of the current map.
+	p0 = (c0 - cr0.x) * gri + 0.5f;
+	p1 = (c1 - cr0.y) * gri + 0.5f;
+	p2 = (c2 - cr0.z) * gri + 0.5f;
+	k2 = t * npr.z;
+	e000 = read_imagef(mpi, mps_sampler, (float4)(p0, p1, k2 + p2, 0.0f)).x;
+	e100 = read_imagef(mpi, mps_sampler, (float4)(p0 + 1.0f, p1, k2 + p2, 0.0f)).x;
+	e010 = read_imagef(mpi, mps_sampler, (float4)(p0, p1 + 1.0f, k2 + p2, 0.0f)).x;
+	e001 = read_imagef(mpi, mps_sampler, (float4)(p0, p1, k2 + min(p2 + 1.0f, npr.z - 0.5f), 0.0f)).x;
+#else
+	// Find the index of the current coordinate
+	k0 = (int)((c0 - cr0.x) * gri);
+	k1 = (int)((c1 - cr0.y) * gri);
+	k2 = (int)((c2 - cr0.z) * gri);
+	assert(k0 + 1 < npr.x);
+	assert(k1 + 1 < npr.y);
+	assert(k2 + 1 < npr.z);
+
+	// Retrieve the grid map, and find the offset of the probe and the strides to the next probes along Y and Z, within the brick of the cell if the map is sparse.
+	map = mps[t];
+#ifdef BRICKS
+	const int3 nbk = ((npr - 2) >> 3) + 1;
+	k0 = ((__global const int*)map)[nbk.x * (nbk.y * (k2 >> 3) + (k1 >> 3)) + (k0 >> 3)] + 81 * (k2 & 7) + 9 * (k1 & 7) + (k0 & 7);
+	map += nbk.x * nbk.y * nbk.z;
+	k1 = 9;
+	k2 = 81;
+#else
+	k0 = npr.x * (npr.y * k2 + k1) + k0;
+	k1 = npr.x;
+	k2 = npr.x * npr.y;
+#endif
+
+	// Lookup the values, decoding them if the map is quantized.
+	e000 = LOOKUP(k0);
+	e100 = LOOKUP(k0 + 1);
+	e010 = LOOKUP(k0 + k1);
+	e001 = LOOKUP(k0 + k2);
+#endif
+	d[i0] = n[i0] = (e100 - e000) * gri;
+	d[i1] = n[i1] = (e010 - e000) * gri;
+	d[i2] = n[i2] = (e001 - e000) * gri;
+	return e000;
 }
 
-uint next(mwc64x_state_t *s)
+// Calculates and aggregates the force and torque of BRANCH frames to their parent frame from the coordinates c and derivatives d of heavy atoms and the axes a of frames, saving the torque projections of active BRANCH frames to g downwards from w, followed by the force and torque of ROOT frame, with f and t as scratch.
+inline
+void aggregate(__global float* g, __global const float* a, __global const float* c, __global const float* d, __global float* f, __global float* t, const int nf, int w, __local const int* shared, const int gid, const int gds)
 {
-	uint X = s->x;
-	uint C = s->c;
-	uint r = X ^ C;
-	uint Xn = A * X + C;
-	uint carry = Xn < C;
-	uint Cn = mad_hi(A, X, carry);
-	s->x = Xn;
-	s->c = Cn;
-	return r;
-}
+	const int gd3 = 3 * gds;
 
-// Avoid using Shared Local Memory on the Intel Xeon Phi coprocessor.
-// Have at least 1000 WGs per NDRange to optimally utilize Phi.
-// Use Array Notation with int32 Indices.
+	__local const int* const act = shared;
+	__local const int* const beg = &act[nf];
+	__local const int* const end = &beg[nf];
+	__local const int* const nbr = &end[nf];
+	__local const int* const prn = &nbr[nf];
 
-#define assert(arg)
+	float y0, y1, y2, v0, v1, v2, f0, f1, f2, t0, t1, t2, d0, d1, d2;
+	int i, k, i0, i1, i2, k0, k1, k2, z;
+
+	// Clear the force and torque of frames.
+	f[k0 = gid] = 0.0f;
+	t[k0] = 0.0f;
+	for (i = 1, z = 3 * nf; i < z; ++i)
+	{
+		f[k0 += gds] = 0.0f;
+		t[k0] = 0.0f;
+	}
+	k = nf;
+	while (k)
+	{
+		--k;
+
+		// Load f, t and rotorY from memory into register
+		k0 = k * gd3 + gid;
+		k1 = k0 + gds;
+		k2 = k1 + gds;
+		f0 = f[k0];
+		f1 = f[k1];
+		f2 = f[k2];
+		t0 = t[k0];
+		t1 = t[k1];
+		t2 = t[k2];
+		y0 = c[i0  = beg[k] * gd3 + gid];
+		y1 = c[i0 += gds];
+		y2 = c[i0 += gds];
+
+		// Aggregate frame atoms.
+		for (i = beg[k], z = end[k]; i < z; ++i)
+		{
+			i0 = i * gd3 + gid;
+			i1 = i0 + gds;
+			i2 = i1 + gds;
+			d0 = d[i0];
+			d1 = d[i1];
+			d2 = d[i2];
+
+			// The derivatives with respect to the position, orientation, and torsions
+			// would be the negative total force acting on the ligand,
+			// the negative total torque, and the negative torque projections, respectively,
+			// where the projections refer to the torque applied to the branch moved by the torsion,
+			// projected on its rotation axi
+			f0 += d0;
+			f1 += d1;
+			f2 += d2;
+			if (i == beg[k]) continue;
+
+			v0 = c[i0] - y0;
+			v1 = c[i1] - y1;
+			v2 = c[i2] - y2;
+			t0 += v1 * d2 - v2 * d1;
+			t1 += v2 * d0 - v0 * d2;
+			t2 += v0 * d1 - v1 * d0;
+		}
+
+		if (k)
+		{
+			// Save the aggregated torque of active BRANCH frames to g.
+			if (act[k])
+			{
+				g[w -= gds] = t0 * a[k0] + t1 * a[k1] + t2 * a[k2]; // dot product
+			}
+
+			// Aggregate the force and torque of current frame to its parent frame.
+			k0 = prn[k] * gd3 + gid;
+			k1 = k0 + gds;
+			k2 = k1 + gds;
+			f[k0] += f0;
+			f[k1] += f1;
+			f[k2] += f2;
+			v0 = y0 - c[i0  = beg[prn[k]] * gd3 + gid];
+			v1 = y1 - c[i0 += gds];
+			v2 = y2 - c[i0 += gds];
+			t[k0] += t0 + v1 * f2 - v2 * f1;
+			t[k1] += t1 + v2 * f0 - v0 * f2;
+			t[k2] += t2 + v0 * f1 - v1 * f0;
+		}
+	}
+	assert(w == 6 * gds + gid);
+
+	// Save the aggregated force and torque of ROOT frame to g.
+	g[i0  = gid] = f0;
+	g[i0 += gds] = f1;
+	g[i0 += gds] = f2;
+	g[i0 += gds] = t0;
+	g[i0 += gds] = t1;
+	g[i0 += gds] = t2;
+}
 
 inline
-bool evaluate(__global float* e, __global float* g, __global float* a, __global float* q, __global float* c, __global float* d, __global float* f, __global float* t, __global const float* x, const int nf, const int na, const int np, const float eub, __local const int* shared, __global const float* sfe, __global const float* sfd, const int sfs, const float3 cr0, const float3 cr1, const int3 npr, const float gri, __global const float* const mps[15])
+bool evaluate(__global float* e, __global float* g, __global float* a, __global float* q, __global float* c, __global float* d, __global float* f, __global float* t, __global float* n, __global const float* x, const int nf, const int na, const int np, const float eub, __local const int* shared, __global const float* sfe, __global const float* sfd, const int sfs, const float3 cr0, const float3 cr1, const int3 npr, const float gri, MAPS_PARAM, const int gid, const int gds)
 {
-	const int gid = get_global_id(0);
-	const int gds = get_global_size(0);
 	const int gd3 = 3 * gds;
 	const int gd4 = 4 * gds;
 
@@ -141,10 +263,9 @@ bool evaluate(__global float* e, __global float* g, __global float* a, __global
 	__local const int* const ip1 = &ip0[np];
 	__local const int* const ipp = &ip1[np];
 
-	float y, y0, y1, y2, v0, v1, v2, c0, c1, c2, e000, e100, e010, e001, a0, a1, a2, ang, sng, r0, r1, r2, r3, vs, dr, f0, f1, f2, t0, t1, t2, d0, d1, d2;
+	float y, h, y0, y1, y2, v0, v1, v2, c0, c1, c2, a0, a1, a2, ang, sng, r0, r1, r2, r3, vs, dr, d0, d1, d2;
 	float q0, q1, q2, q3, q00, q01, q02, q03, q11, q12, q13, q22, q23, q33, m0, m1, m2, m3, m4, m5, m6, m7, m8;
 	int i, j, k, b, w, i0, i1, i2, k0, k1, k2, z;
-	__global const float* map;
 
 	// Apply position, orientation and torsions.
 	c[i  = gid] = x[k  = gid];
@@ -221,36 +342,8 @@ bool evaluate(__global float* e, __global float* g, __global float* a, __global
 				c[i2] = c2;
 			}
 
-			// TODO: move conditional expression out to bypass short circuiting.
-			// Penalize out-of-box case.
-			if (c0 < cr0.x || cr1.x <= c0 || c1 < cr0.y || cr1.y <= c1 || c2 < cr0.z || cr1.z <= c2)
-			{
-				y += 10.0f;
-				d[i0] = 0.0f;
-				d[i1] = 0.0f;
-				d[i2] = 0.0f;
-				continue;
-			}
-
-			// Find the index of the current coordinate
-			k0 = (int)((c0 - cr0.x) * gri);
-			k1 = (int)((c1 - cr0.y) * gri);
-			k2 = (int)((c2 - cr0.z) * gri);
-			assert(k0 + 1 < npr.x);
-			assert(k1 + 1 < npr.y);
-			assert(k2 + 1 < npr.z);
-			k0 = npr.x * (npr.y * k2 + k1) + k0;
-
-			// Retrieve the grid map and lookup the value
-			 map = mps[xst[i]];
-			e000 = map[k0];
-			e100 = map[k0 + 1];
-			e010 = map[k0 + npr.x];
-			e001 = map[k0 + npr.x * npr.y];
-			y += e000;
-			d[i0] = (e100 - e000) * gri;
-			d[i1] = (e010 - e000) * gri;
-			d[i2] = (e001 - e000) * gri;
+			// Look up the grid map, keeping the inter-ligand derivatives in n too.
+			y += lookup(d, n, i0, gds, xst[i], c0, c1, c2, cr0, cr1, npr, gri, MAPS_ARG);
 		}
 		for (j = 0, z = nbr[k]; j < z; ++j)
 		{
@@ -297,7 +390,8 @@ bool evaluate(__global float* e, __global float* g, __global float* a, __global
 //	assert(w == nv * gds + gid);
 	assert(k == nf);
 
-	// Calculate intra-ligand free energy.
+	// Calculate intra-ligand free energy. With INTERPOLATE defined, lookups of the scoring function interpolate linearly between the sample below and the one above.
+	h = y;
 	for (i = 0; i < np; ++i)
 	{
 		i0 = ip0[i] * gd3 + gid;
@@ -312,9 +406,16 @@ bool evaluate(__global float* e, __global float* g, __global float* a, __global
 		vs = v0*v0 + v1*v1 + v2*v2;
 		if (vs < 64.0f)
 		{
-			j = ipp[i] + (int)(sfs * vs);
+			vs *= sfs;
+			j = ipp[i] + (int)vs;
+#ifdef INTERPOLATE
+			vs -= (int)vs;
+			y += sfe[j] + (sfe[j + 1] - sfe[j]) * vs;
+			dr = sfd[j] + (sfd[j + 1] - sfd[j]) * vs;
+#else
 			y += sfe[j];
 			dr = sfd[j];
+#endif
 			d0 = dr * v0;
 			d1 = dr * v1;
 			d2 = dr * v2;
@@ -327,6 +428,9 @@ bool evaluate(__global float* e, __global float* g, __global float* a, __global
 		}
 	}
 
+	// Store the intra-ligand free energy into n, by which translations of this conformation are evaluated.
+	n[na * gd3 + gid] = y - h;
+
 	// If the free energy is no better than the upper bound, refuse this conformation.
 	if (y >= eub) return false;
 
@@ -334,101 +438,83 @@ bool evaluate(__global float* e, __global float* g, __global float* a, __global
 	e[gid] = y;
 
 	// Calculate and aggregate the force and torque of BRANCH frames to their parent frame.
-	f[k0 = gid] = 0.0f;
-	t[k0] = 0.0f;
-	for (i = 1, z = 3 * nf; i < z; ++i)
-	{
-		f[k0 += gds] = 0.0f;
-		t[k0] = 0.0f;
-	}
-//	assert(w == nv * gds + gid);
-	assert(k == nf);
-	while (k)
-	{
-		--k;
+	aggregate(g, a, c, d, f, t, nf, w, shared, gid, gds);
+	return true;
+}
 
-		// Load f, t and rotorY from memory into register
-		k0 = k * gd3 + gid;
-		k1 = k0 + gds;
-		k2 = k1 + gds;
-		f0 = f[k0];
-		f1 = f[k1];
-		f2 = f[k2];
-		t0 = t[k0];
-		t1 = t[k1];
-		t2 = t[k2];
-		y0 = c[i0  = beg[k] * gd3 + gid];
-		y1 = c[i0 += gds];
-		y2 = c[i0 += gds];
+// Evaluates conformation x, a translation of conformation r such as a mutation of s0x, whose frame axes, coordinates, derivatives, n and variables are ra, rc, rd, rn and rx. Only the grid maps are looked up at the shifted coordinates of r, because translations leave the intra-ligand free energy and derivatives of r unchanged.
+inline
+bool translate(__global float* e, __global float* g, __global float* a, __global float* c, __global float* d, __global float* f, __global float* t, __global float* n, __global const float* x, __global const float* ra, __global const float* rc, __global const float* rd, __global const float* rn, __global const float* rx, const int nv, const int nf, const int na, const float eub, __local const int* shared, const float3 cr0, const float3 cr1, const int3 npr, const float gri, MAPS_PARAM, const int gid, const int gds)
+{
+	const int gd3 = 3 * gds;
 
-		// Aggregate frame atoms.
-		for (i = beg[k], z = end[k]; i < z; ++i)
-		{
-			i0 = i * gd3 + gid;
-			i1 = i0 + gds;
-			i2 = i1 + gds;
-			d0 = d[i0];
-			d1 = d[i1];
-			d2 = d[i2];
+	__local const int* const xst = &shared[12 * nf - 1 + 3 * na]; // Skip the frames, branches and frame coordinates laid out before the XScore types as in evaluate.
 
-			// The derivatives with respect to the position, orientation, and torsions
-			// would be the negative total force acting on the ligand,
-			// the negative total torque, and the negative torque projections, respectively,
-			// where the projections refer to the torque applied to the branch moved by the torsion,
-			// projected on its rotation axi
-			f0 += d0;
-			f1 += d1;
-			f2 += d2;
-			if (i == beg[k]) continue;
+	float y, v0, v1, v2, c0, c1, c2;
+	int i, i0, i1, i2, z;
 
-			v0 = c[i0] - y0;
-			v1 = c[i1] - y1;
-			v2 = c[i2] - y2;
-			t0 += v1 * d2 - v2 * d1;
-			t1 += v2 * d0 - v0 * d2;
-			t2 += v0 * d1 - v1 * d0;
-		}
-
-		if (k)
-		{
-			// Save the aggregated torque of active BRANCH frames to g.
-			if (act[k])
-			{
-				g[w -= gds] = t0 * a[k0] + t1 * a[k1] + t2 * a[k2]; // dot product
-			}
+	// Shift the coordinates of r, look up the grid maps at them, and add the intra-ligand derivatives of r, i.e. its derivatives less its inter-ligand ones.
+	i0 = gid;
+	i1 = i0 + gds;
+	i2 = i1 + gds;
+	v0 = x[i0] - rx[i0];
+	v1 = x[i1] - rx[i1];
+	v2 = x[i2] - rx[i2];
+	y = 0.0f;
+	for (i = 0; i < na; ++i)
+	{
+		i0 = i * gd3 + gid;
+		i1 = i0 + gds;
+		i2 = i1 + gds;
+		c[i0] = c0 = rc[i0] + v0;
+		c[i1] = c1 = rc[i1] + v1;
+		c[i2] = c2 = rc[i2] + v2;
+		y += lookup(d, n, i0, gds, xst[i], c0, c1, c2, cr0, cr1, npr, gri, MAPS_ARG);
+		d[i0] += rd[i0] - rn[i0];
+		d[i1] += rd[i1] - rn[i1];
+		d[i2] += rd[i2] - rn[i2];
+	}
 
-			// Aggregate the force and torque of current frame to its parent frame.
-			k0 = prn[k] * gd3 + gid;
-			k1 = k0 + gds;
-			k2 = k1 + gds;
-			f[k0] += f0;
-			f[k1] += f1;
-			f[k2] += f2;
-			v0 = y0 - c[i0  = beg[prn[k]] * gd3 + gid];
-			v1 = y1 - c[i0 += gds];
-			v2 = y2 - c[i0 += gds];
-			t[k0] += t0 + v1 * f2 - v2 * f1;
-			t[k1] += t1 + v2 * f0 - v0 * f2;
-			t[k2] += t2 + v0 * f1 - v1 * f0;
-		}
+	// Add the intra-ligand free energy of r, and copy its frame axes.
+	i0 = na * gd3 + gid;
+	y += n[i0] = rn[i0];
+	for (i0 = gid, z = nf * gd3; i0 < z; i0 += gds)
+	{
+		a[i0] = ra[i0];
 	}
-	assert(w == 6 * gds + gid);
 
-	// Save the aggregated force and torque of ROOT frame to g.
-	g[i0  = gid] = f0;
-	g[i0 += gds] = f1;
-	g[i0 += gds] = f2;
-	g[i0 += gds] = t0;
-	g[i0 += gds] = t1;
-	g[i0 += gds] = t2;
+	// If the free energy is no better than the upper bound, refuse this conformation.
+	if (y >= eub) return false;
+
+	// Store e from register into memory.
+	e[gid] = y;
+
+	// Calculate and aggregate the force and torque of BRANCH frames to their parent frame.
+	aggregate(g, a, c, d, f, t, nf, nv * gds + gid, shared, gid, gds);
 	return true;
 }
 
 __kernel //__attribute__((reqd_work_group_size(X, Y, Z))) // X <= 16 (i.e. half warp or quarter wavefront) informs the compiler to optimize out barrier. Compile-time work group size helps the compiler to optimize register allocation.
-void monte_carlo(__global float* const restrict s0e, __global const int* const restrict lig, const int nv, const int nf, const int na, const int np, __local int* const shared, const int nbi, __global const float* const sfe, __global const float* const sfd, const int sfs, const float3 cr0, const float3 cr1, const int3 npr, const float gri, __global const float* const x00, __global const float* const x01, __global const float* const x02, __global const float* const x03, __global const float* const x04, __global const float* const x05, __global const float* const x06, __global const float* const x07, __global const float* const x08, __global const float* const x09, __global const float* const x10, __global const float* const x11, __global const float* const x12, __global const float* const x13, __global const float* const x14)
+void monte_carlo(__global float* const restrict sln, __global const int* const restrict bat, const int nl, __local int* const shared, const int nbi, __global const float* const sfe, __global const float* const sfd, const int sfs, const float3 cr0, const float3 cr1, const int3 npr, const float gri,
+#ifdef TEXTURES
+__read_only image3d_t mpi,
+#else
+__global const float* const x00, __global const float* const x01, __global const float* const x02, __global const float* const x03, __global const float* const x04, __global const float* const x05, __global const float* const x06, __global const float* const x07, __global const float* const x08, __global const float* const x09, __global const float* const x10, __global const float* const x11, __global const float* const x12, __global const float* const x13, __global const float* const x14,
+#endif
+const ulong sed)
 {
-	const int gid = get_global_id(0);
-	const int gds = get_global_size(0);
+	// Locate the descriptor of the ligand of the current work group, whose tasks span get_num_groups(0) / nl consecutive work groups.
+	const int bpl = get_num_groups(0) / nl;
+	__global const int* const dsc = &bat[8 * (get_group_id(0) / bpl)];
+	const int nv = dsc[0];
+	const int nf = dsc[1];
+	const int na = dsc[2];
+	const int np = dsc[3];
+	__global const int* const lig = &bat[dsc[4]];
+	__global float* const s0e = &sln[(uint)dsc[5]];
+	const ulong lid = (uint)dsc[6] | (ulong)(uint)dsc[7] << 32;
+	const int gid = (get_group_id(0) % bpl) * get_local_size(0) + get_local_id(0);
+	const int gds = bpl * get_local_size(0);
 	const int nls = 5; // Number of line search trials for determining step size in BFGS
 	const float eub = 40.0f * na; // A conformation will be droped if its free energy is not better than e_upper_bound.
 	__global float* const s0x = &s0e[gds];
@@ -439,7 +525,8 @@ void monte_carlo(__global float* const restrict s0e, __global const int* const r
 	__global float* const s0d = &s0c[3 * na * gds];
 	__global float* const s0f = &s0d[3 * na * gds];
 	__global float* const s0t = &s0f[3 * nf * gds];
-	__global float* const s1e = &s0t[3 * nf * gds];
+	__global float* const s0n = &s0t[3 * nf * gds];
+	__global float* const s1e = &s0n[(3 * na + 1) * gds];
 	__global float* const s1x = &s1e[gds];
 	__global float* const s1g = &s1x[(nv + 1) * gds];
 	__global float* const s1a = &s1g[nv * gds];
@@ -448,7 +535,8 @@ void monte_carlo(__global float* const restrict s0e, __global const int* const r
 	__global float* const s1d = &s1c[3 * na * gds];
 	__global float* const s1f = &s1d[3 * na * gds];
 	__global float* const s1t = &s1f[3 * nf * gds];
-	__global float* const s2e = &s1t[3 * nf * gds];
+	__global float* const s1n = &s1t[3 * nf * gds];
+	__global float* const s2e = &s1n[(3 * na + 1) * gds];
 	__global float* const s2x = &s2e[gds];
 	__global float* const s2g = &s2x[(nv + 1) * gds];
 	__global float* const s2a = &s2g[nv * gds];
@@ -457,7 +545,8 @@ void monte_carlo(__global float* const restrict s0e, __global const int* const r
 	__global float* const s2d = &s2c[3 * na * gds];
 	__global float* const s2f = &s2d[3 * na * gds];
 	__global float* const s2t = &s2f[3 * nf * gds];
-	__global float* const bfh = &s2t[3 * nf * gds];
+	__global float* const s2n = &s2t[3 * nf * gds];
+	__global float* const bfh = &s2n[(3 * na + 1) * gds];
 	__global float* const bfp = &bfh[(nv*(nv+1)>>1) * gds];
 	__global float* const bfy = &bfp[nv * gds];
 	__global float* const bfm = &bfy[nv * gds];
@@ -465,8 +554,10 @@ void monte_carlo(__global float* const restrict s0e, __global const int* const r
 	float sum, pg1, pga, pgc, alp, pg2, pr0, pr1, pr2, nrm, ang, sng, pq0, pq1, pq2, pq3, s1xq0, s1xq1, s1xq2, s1xq3, s2xq0, s2xq1, s2xq2, s2xq3, bpi;
 	float yhy, yps, ryp, pco, bpj, bmj, ppj;
 	int g, i, j, o0, o1, o2;
-	mwc64x_state_t rng;
+	philox_state_t rng;
+#ifndef TEXTURES
 	__global const float* const mps[15] = { x00, x01, x02, x03, x04, x05, x06, x07, x08, x09, x10, x11, x12, x13, x14 };
+#endif
 
 #ifndef CL_GLOBAL
 	// Load ligand into local memory.
@@ -486,17 +577,17 @@ void monte_carlo(__global float* const restrict s0e, __global const int* const r
 #endif
 
 	// Randomize s0x.
-	seed(&rng, 0, 9999);
-	rd0 = next(&rng);
+	philox_init(&rng, sed, lid, gid);
+	rd0 = philox_uniform(&rng);
 	s0x[o0  = gid] = rd0 * cr1.x + (1 - rd0) * cr0.x;
-	rd0 = next(&rng);
+	rd0 = philox_uniform(&rng);
 	s0x[o0 += gds] = rd0 * cr1.y + (1 - rd0) * cr0.y;
-	rd0 = next(&rng);
+	rd0 = philox_uniform(&rng);
 	s0x[o0 += gds] = rd0 * cr1.z + (1 - rd0) * cr0.z;
-	rd0 = next(&rng);
-	rd1 = next(&rng);
-	rd2 = next(&rng);
-	rd3 = next(&rng);
+	rd0 = philox_uniform(&rng);
+	rd1 = philox_uniform(&rng);
+	rd2 = philox_uniform(&rng);
+	rd3 = philox_uniform(&rng);
 	rst = rsqrt(rd0*rd0 + rd1*rd1 + rd2*rd2 + rd3*rd3);
 	s0x[o0 += gds] = rd0 * rst;
 	s0x[o0 += gds] = rd1 * rst;
@@ -504,7 +595,7 @@ void monte_carlo(__global float* const restrict s0e, __global const int* const r
 	s0x[o0 += gds] = rd3 * rst;
 	for (i = 6; i < nv; ++i)
 	{
-		s0x[o0 += gds] = next(&rng);
+		s0x[o0 += gds] = philox_uniform(&rng);
 	}
 /*
 	s0x[o0  = gid] =  49.799f;
@@ -519,25 +610,25 @@ void monte_carlo(__global float* const restrict s0e, __global const int* const r
 		s0x[o0 += gds] = 0.0f;
 	}
 */
-	evaluate(s0e, s0g, s0a, s0q, s0c, s0d, s0f, s0t, s0x, nf, na, np, eub, shared, sfe, sfd, sfs, cr0, cr1, npr, gri, mps);
+	evaluate(s0e, s0g, s0a, s0q, s0c, s0d, s0f, s0t, s0n, s0x, nf, na, np, eub, shared, sfe, sfd, sfs, cr0, cr1, npr, gri, MAPS_ARG, gid, gds);
 
 	// Repeat for a number of generations.
 	for (g = 0; g < nbi; ++g)
 	{
 		// Mutate s0x into s1x
 		o0  = gid;
-		s1x[o0] = s0x[o0] + next(&rng);
+		s1x[o0] = s0x[o0] + philox_uniform(&rng);
 		o0 += gds;
-		s1x[o0] = s0x[o0] + next(&rng);
+		s1x[o0] = s0x[o0] + philox_uniform(&rng);
 		o0 += gds;
-		s1x[o0] = s0x[o0] + next(&rng);
+		s1x[o0] = s0x[o0] + philox_uniform(&rng);
 //		for (i = 3; i < nv + 1; ++i)
 		for (i = 2 - nv; i < 0; ++i)
 		{
 			o0 += gds;
 			s1x[o0] = s0x[o0];
 		}
-		evaluate(s1e, s1g, s1a, s1q, s1c, s1d, s1f, s1t, s1x, nf, na, np, eub, shared, sfe, sfd, sfs, cr0, cr1, npr, gri, mps);
+		translate(s1e, s1g, s1a, s1c, s1d, s1f, s1t, s1n, s1x, s0a, s0c, s0d, s0n, s0x, nv, nf, na, eub, shared, cr0, cr1, npr, gri, MAPS_ARG, gid, gds);
 
 		// Initialize the inverse Hessian matrix to identity matrix.
 		// An easier option that works fine in practice is to use a scalar multiple of the identity matrix,
@@ -616,7 +707,8 @@ void monte_carlo(__global float* const restrict s0e, __global const int* const r
 				ang = 0.5f * alp * nrm;
 //				sng = sin(ang) / nrm;
 //				pq0 = cos(ang);
-				sng = sincos(ang, &pq0) / nrm;
+				sng = sincos(ang, &pq0);
+				sng = nrm > 0.0f ? sng / nrm : 0.0f; // Keep the orientation under zero torque, e.g. of a ligand out of the box, whose intra-ligand forces exert none.
 				pq1 = sng * pr0;
 				pq2 = sng * pr1;
 				pq3 = sng * pr2;
@@ -640,7 +732,7 @@ void monte_carlo(__global float* const restrict s0e, __global const int* const r
 				// Evaluate x2, subject to Wolfe conditions http://en.wikipedia.org/wiki/Wolfe_conditions
 				// 1) Armijo rule ensures that the step length alpha decreases f sufficiently.
 				// 2) The curvature condition ensures that the slope has been reduced sufficiently.
-				if (evaluate(s2e, s2g, s2a, s2q, s2c, s2d, s2f, s2t, s2x, nf, na, np, s1e[gid] + alp * pga, shared, sfe, sfd, sfs, cr0, cr1, npr, gri, mps))
+				if (evaluate(s2e, s2g, s2a, s2q, s2c, s2d, s2f, s2t, s2n, s2x, nf, na, np, s1e[gid] + alp * pga, shared, sfe, sfd, sfs, cr0, cr1, npr, gri, MAPS_ARG, gid, gds))
 				{
 					o0 = gid;
 					pg2 = bfp[o0] * s2g[o0];
@@ -721,28 +813,287 @@ void monte_carlo(__global float* const restrict s0e, __global const int* const r
 				o2 += gds;
 			}
 
-			// Move to the next iteration, i.e. e1 = e2, x1 = x2, g1 = g2.
-			o0 = gid;
-			s1e[o0] = s2e[o0];
-//			for (i = 1; i < 2 * (nv + 1); ++i)
-			for (i = -1 - 2 * nv; i < 0; ++i)
+			// Move to the next iteration, i.e. e1 = e2, x1 = x2, g1 = g2, along with the frame axes, coordinates, derivatives and n by which a mutation of x1 is translated once Metropolis accepts it.
+			for (o0 = gid; o0 < s2e - s1e; o0 += gds)
 			{
-				o0 += gds;
 				s1e[o0] = s2e[o0];
 			}
 		}
 
-		// Accept x1 according to Metropolis criteria.
+		// Accept x1 according to Metropolis criteria, along with the frame axes, coordinates, derivatives and n by which the next mutation is translated.
 		if (s1e[gid] < s0e[gid])
 		{
-			o0 = gid;
-			s0e[o0] = s1e[o0];
-//			for (i = 1; i < nv + 2; ++i)
-			for (i = -1 - nv; i < 0; ++i)
+			for (o0 = gid; o0 < s1e - s0e; o0 += gds)
 			{
-				o0 += gds;
 				s0e[o0] = s1e[o0];
 			}
 		}
 	}
 }
+
+// Populates the probes of a dense float32 grid map of XScore type t, one work item per probe along X, one work group row per Y row and one work group layer per plane along Z. Each probe sums the scoring function between it and the atoms near its tile of Y rows, listed in tla from tlo in ascending order as receptor::populate visits them, so that the values match those of the host up to the rounding of the distances. The type pairs of t with the receptor types must have been written to sfe.
+__kernel
+void populate(__global float* const restrict map, const int t, const float gr, const int nr, const int tile, __global const float4* const restrict atm, __global const int* const restrict tlo, __global const int* const restrict tla, __global const float* const sfe, const int sfs, const float3 cr0, const int3 npr)
+{
+	const int x = get_global_id(0);
+	if (x >= npr.x) return;
+	const int y = get_global_id(1);
+	const int z = get_global_id(2);
+	const float px = cr0.x + gr * x;
+	const float py = cr0.y + gr * y;
+	const float pz = cr0.z + gr * z;
+	const int b = z * ((npr.y + tile - 1) / tile) + y / tile;
+	float e = 0.0f;
+	for (int i = tlo[b]; i < tlo[b + 1]; ++i)
+	{
+		const float4 a = atm[tla[i]];
+		const float dx = px - a.x;
+		const float dy = py - a.y;
+		const float dz = pz - a.z;
+		float vs = dx*dx + dy*dy + dz*dz;
+		if (vs >= 64.0f) continue;
+		const int t0 = (int)a.w;
+		const int j = nr * (t0 <= t ? (t*(t+1)>>1) + t0 : (t0*(t0+1)>>1) + t) + (int)(vs *= sfs);
+#ifdef INTERPOLATE
+		vs -= (int)vs;
+		e += sfe[j] + (sfe[j + 1] - sfe[j]) * vs;
+#else
+		e += sfe[j];
+#endif
+	}
+	map[(z * npr.y + y) * npr.x + x] = e;
+}
+
+// Places the heavy atoms of conformation x into c and the orientations of its frames into q by the same arithmetic as evaluate, without scoring it.
+void place(__global float* q, __global float* c, __global const float* x, const int nf, const int na, __local const int* shared, const int gid, const int gds)
+{
+	const int gd3 = 3 * gds;
+	const int gd4 = 4 * gds;
+
+	__local const int* const act = shared;
+	__local const int* const beg = &act[nf];
+	__local const int* const end = &beg[nf];
+	__local const int* const nbr = &end[nf];
+	__local const int* const prn = &nbr[nf];
+	__local const float* const yy0 = (__local const float*)&prn[nf];
+	__local const float* const yy1 = &yy0[nf];
+	__local const float* const yy2 = &yy1[nf];
+	__local const float* const xy0 = &yy2[nf];
+	__local const float* const xy1 = &xy0[nf];
+	__local const float* const xy2 = &xy1[nf];
+	__local const int* const brs = (__local const int*)&xy2[nf];
+	__local const float* const co0 = (__local const float*)&brs[nf - 1];
+	__local const float* const co1 = &co0[na];
+	__local const float* const co2 = &co1[na];
+
+	float y0, y1, y2, v0, v1, v2, a0, a1, a2, ang, sng, r0, r1, r2, r3;
+	float q0, q1, q2, q3, q00, q01, q02, q03, q11, q12, q13, q22, q23, q33, m0, m1, m2, m3, m4, m5, m6, m7, m8;
+	int i, j, k, b, w, i0, k0, z;
+
+	// Apply position, orientation and torsions.
+	c[i  = gid] = x[k  = gid];
+	c[i += gds] = x[k += gds];
+	c[i += gds] = x[k += gds];
+	q[i  = gid] = x[k += gds];
+	q[i += gds] = x[k += gds];
+	q[i += gds] = x[k += gds];
+	q[i += gds] = x[k += gds];
+	for (k = 0, b = 0, w = 6 * gds + gid; k < nf; ++k)
+	{
+		// Load rotorY from memory into registers.
+		y0 = c[i0  = beg[k] * gd3 + gid];
+		y1 = c[i0 += gds];
+		y2 = c[i0 += gds];
+
+		// Translate orientation of active frames from quaternion into 3x3 matrix.
+		if (act[k])
+		{
+			q0 = q[k0  = k * gd4 + gid];
+			q1 = q[k0 += gds];
+			q2 = q[k0 += gds];
+			q3 = q[k0 += gds];
+			q00 = q0 * q0;
+			q01 = q0 * q1;
+			q02 = q0 * q2;
+			q03 = q0 * q3;
+			q11 = q1 * q1;
+			q12 = q1 * q2;
+			q13 = q1 * q3;
+			q22 = q2 * q2;
+			q23 = q2 * q3;
+			q33 = q3 * q3;
+			m0 = q00 + q11 - q22 - q33;
+			m1 = 2 * (q12 - q03);
+			m2 = 2 * (q02 + q13);
+			m3 = 2 * (q03 + q12);
+			m4 = q00 - q11 + q22 - q33;
+			m5 = 2 * (q23 - q01);
+			m6 = 2 * (q13 - q02);
+			m7 = 2 * (q01 + q23);
+			m8 = q00 - q11 - q22 + q33;
+		}
+
+		// Calculate the coordinates of the frame atoms other than its rotor Y.
+		for (i = beg[k] + 1, z = end[k]; i < z; ++i)
+		{
+			i0 = i * gd3 + gid;
+			v0 = co0[i];
+			v1 = co1[i];
+			v2 = co2[i];
+			c[i0] = y0 + m0 * v0 + m1 * v1 + m2 * v2;
+			c[i0 += gds] = y1 + m3 * v0 + m4 * v1 + m5 * v2;
+			c[i0 += gds] = y2 + m6 * v0 + m7 * v1 + m8 * v2;
+		}
+		for (j = 0, z = nbr[k]; j < z; ++j)
+		{
+			i = brs[b++];
+			i0 = beg[i] * gd3 + gid;
+			c[i0] = y0 + m0 * yy0[i] + m1 * yy1[i] + m2 * yy2[i];
+			c[i0 += gds] = y1 + m3 * yy0[i] + m4 * yy1[i] + m5 * yy2[i];
+			c[i0 += gds] = y2 + m6 * yy0[i] + m7 * yy1[i] + m8 * yy2[i];
+
+			// Skip inactive BRANCH frame
+			if (!act[i]) continue;
+
+			// Update q of BRANCH frame
+			a0 = m0 * xy0[i] + m1 * xy1[i] + m2 * xy2[i];
+			a1 = m3 * xy0[i] + m4 * xy1[i] + m5 * xy2[i];
+			a2 = m6 * xy0[i] + m7 * xy1[i] + m8 * xy2[i];
+			ang = x[w += gds] * 0.5f;
+			sng = sincos(ang, &r0);
+			r1 = sng * a0;
+			r2 = sng * a1;
+			r3 = sng * a2;
+			q[k0  = i * gd4 + gid] = r0 * q0 - r1 * q1 - r2 * q2 - r3 * q3;
+			q[k0 += gds] = r0 * q1 + r1 * q0 + r2 * q3 - r3 * q2;
+			q[k0 += gds] = r0 * q2 - r1 * q3 + r2 * q0 + r3 * q1;
+			q[k0 += gds] = r0 * q3 + r1 * q2 - r2 * q1 + r3 * q0;
+		}
+	}
+}
+
+// Ranks the nt tasks of each ligand by free energy and deduplicates their conformations, one work group per ligand, and writes nc candidate conformations of each ligand to cnf, of stride nc and with the ligands consecutive. The candidates are the representatives of clusters of RMSD 2.0 visited in ascending order of free energy, ties broken by task index, as ligand::cluster finds them, followed by the other conformations in the same order should there be fewer than nc representatives. Clustering the candidates on the host therefore finds the clusters of all the tasks up to the rounding of the coordinates. The placements and centroids of the tasks are held in the second solution of monte_carlo, and the local memory holds the largest ligand followed by nt + 2 * nc ints.
+__kernel
+void rank(const int nt, const int nc, __global const int* const restrict bat, __global float* const restrict sln, __global float* const restrict cnf, __local int* const shared)
+{
+	__local int nk, sim;
+	__global const int* const dsc = &bat[8 * get_group_id(0)];
+	const int nv = dsc[0];
+	const int nf = dsc[1];
+	const int na = dsc[2];
+	const int np = dsc[3];
+	__global const int* const lig = &bat[dsc[4]];
+	__global const float* const s0e = &sln[(uint)dsc[5]];
+	const int gds = ((nt - 1) / 32 + 1) * 32;
+	__global const float* const s0x = &s0e[gds];
+	__global float* const s1e = &sln[(uint)dsc[5] + (1 + nv + 1 + nv + 3 * nf + 4 * nf + 3 * na + 3 * na + 3 * nf + 3 * nf + 3 * na + 1) * gds];
+	__global float* const s1o = &s1e[(nv + 2) * gds];
+	__global float* const s1q = &s1o[(nv + 3 * nf) * gds];
+	__global float* const s1c = &s1q[4 * nf * gds];
+	const int g = 11 * nf + nf - 1 + 4 * na + 3 * np;
+	__local int* const srt = &shared[g];
+	__local int* const kpt = &srt[nt];
+	__local int* const col = &kpt[nc];
+	const float sdt = 4.0f * na;
+	const float sct = 4.0f * 1.001f;
+	const float ina = 1.0f / na;
+	float e, o0, o1, o2, d0, d1, d2, sd;
+	int i, j, r, u, v, o;
+
+	// Load ligand into local memory.
+	for (i = get_local_id(0); i < g; i += get_local_size(0))
+	{
+		shared[i] = lig[i];
+	}
+	barrier(CLK_LOCAL_MEM_FENCE | CLK_GLOBAL_MEM_FENCE);
+
+	// Place the conformation of each task, and find its centroid.
+	for (u = get_local_id(0); u < nt; u += get_local_size(0))
+	{
+		place(s1q, s1c, s0x, nf, na, shared, u, gds);
+		o0 = o1 = o2 = 0.0f;
+		for (i = 0, o = u; i < na; ++i)
+		{
+			o0 += s1c[o];
+			o1 += s1c[o += gds];
+			o2 += s1c[o += gds];
+			o += gds;
+		}
+		s1o[u] = ina * o0;
+		s1o[u + gds] = ina * o1;
+		s1o[u + 2 * gds] = ina * o2;
+	}
+
+	// Rank the tasks in ascending order of free energy.
+	for (u = get_local_id(0); u < nt; u += get_local_size(0))
+	{
+		e = s0e[u];
+		for (v = 0, r = 0; v < nt; ++v)
+		{
+			r += s0e[v] < e || (s0e[v] == e && v < u);
+		}
+		srt[r] = u;
+	}
+	if (!get_local_id(0)) nk = 0;
+	barrier(CLK_LOCAL_MEM_FENCE | CLK_GLOBAL_MEM_FENCE);
+
+	// Check in order if each task forms a new cluster, comparing it with the representatives in parallel. Representatives are marked by complementing their entries.
+	for (r = 0; r < nt && nk < nc; ++r)
+	{
+		u = srt[r];
+		if (!get_local_id(0)) sim = 0;
+		barrier(CLK_LOCAL_MEM_FENCE | CLK_GLOBAL_MEM_FENCE);
+		for (j = get_local_id(0); j < nk; j += get_local_size(0))
+		{
+			v = kpt[j];
+			d0 = s1o[u] - s1o[v];
+			d1 = s1o[u + gds] - s1o[v + gds];
+			d2 = s1o[u + 2 * gds] - s1o[v + 2 * gds];
+			if (d0 * d0 + d1 * d1 + d2 * d2 >= sct) continue;
+			for (i = 0, o = 0, sd = 0.0f; i < na && sd < sdt; ++i, o += 3 * gds)
+			{
+				d0 = s1c[o + u] - s1c[o + v];
+				d1 = s1c[o + gds + u] - s1c[o + gds + v];
+				d2 = s1c[o + 2 * gds + u] - s1c[o + 2 * gds + v];
+				sd += d0 * d0 + d1 * d1 + d2 * d2;
+			}
+			if (sd < sdt) sim = 1;
+		}
+		barrier(CLK_LOCAL_MEM_FENCE | CLK_GLOBAL_MEM_FENCE);
+		if (!get_local_id(0) && !sim)
+		{
+			kpt[nk++] = u;
+			srt[r] = ~u;
+		}
+		barrier(CLK_LOCAL_MEM_FENCE | CLK_GLOBAL_MEM_FENCE);
+	}
+
+	// Collect the representatives followed by the other tasks in order.
+	if (!get_local_id(0))
+	{
+		for (r = 0, j = 0; j < nk; ++r)
+		{
+			if (srt[r] < 0) col[j++] = ~srt[r];
+		}
+		for (r = 0; j < nc; ++r)
+		{
+			if (srt[r] >= 0) col[j++] = srt[r];
+		}
+	}
+	barrier(CLK_LOCAL_MEM_FENCE | CLK_GLOBAL_MEM_FENCE);
+
+	// Write the free energies and conformations of the candidates after those of the previous ligands.
+	for (i = 0, o = 0; i < get_group_id(0); ++i)
+	{
+		o += (bat[8 * i] + 2) * nc;
+	}
+	for (j = get_local_id(0); j < nc; j += get_local_size(0))
+	{
+		u = col[j];
+		cnf[o + j] = s0e[u];
+		for (i = 0; i <= nv; ++i)
+		{
+			cnf[o + (1 + i) * nc + j] = s0x[i * gds + u];
+		}
+	}
+}
@@ -1,10 +1,153 @@
 #include <cmath>
 #include <cassert>
-#include <random>
+#include "lanes.hpp"
+#include "philox.hpp"
+#include "precision.hpp"
 #include "kernel.hpp"
 
-bool evaluate(float* e, float* g, float* a, float* q, float* c, float* d, float* f, float* t, const float* x, const int nf, const int na, const int np, const float eub, const int* shared, const float* sfe, const float* sfd, const int sfs, const array<float, 3> cr0, const array<float, 3> cr1, const array<int, 3> npr, const float gri, const vector<vector<float>>& mps, const int gid, const int gds)
+//! Base-2 logarithm of the number of cells along each edge of a brick of sparse grid maps, i.e. of receptor::brick.
+const int bkl = 3;
+
+//! Number of probes along each edge of a brick of sparse grid maps, i.e. receptor::brick_stride.
+const int bks = (1 << bkl) + 1;
+
+//! Returns the offsets of the probes at the lower corners of cells k0, k1 and k2 of a grid map, and stores the strides to the next probes along Y and Z into sy and sz. A sparse map is looked up through its brick table bt, within whose bricks the eight probes of a cell lie, whereas bt is null for a dense map.
+template <int L>
+inline lanes<int, L> probe(const lanes<int, L>& k0, const lanes<int, L>& k1, const lanes<int, L>& k2, const array<int, 3> npr, const int* const bt, int& sy, int& sz)
+{
+	if (bt)
+	{
+		const int nb0 = ((npr[0] - 2) >> bkl) + 1;
+		const int nb1 = ((npr[1] - 2) >> bkl) + 1;
+		const int m = (1 << bkl) - 1;
+		sy = bks;
+		sz = bks * bks;
+		return gather(bt, nb0 * (nb1 * (k2 >> bkl) + (k1 >> bkl)) + (k0 >> bkl)) + bks * (bks * (k2 & m) + (k1 & m)) + (k0 & m);
+	}
+	sy = npr[0];
+	sz = npr[0] * npr[1];
+	return npr[0] * (npr[1] * k2 + k1) + k0;
+}
+
+//! Represents the grid map of an atom type, whose values are either float32 or 16-bit codes decoded at the precision mpf.
+class map_view
+{
+public:
+	//! Views the grid map of atom type t, with the scale and offset of its int16 codes at mqa[2 * t].
+	explicit map_view(const float* const* const mps, const uint16_t* const* const mqs, const float* const mqa, const int mpf, const int t) : map(mps[t]), codes(mqs[t]), scale(mqa[2 * t]), offset(mqa[2 * t + 1]), mpf(mpf) {}
+
+	//! Gathers the values at the offsets of the lanes.
+	template <int L>
+	lanes<float, L> operator()(const lanes<int, L>& o) const
+	{
+		if (!codes) return gather(map, o);
+		lanes<float, L> r;
+		if (mpf == map_float16)
+		{
+			for (int l = 0; l < L; ++l) r.v[l] = half_to_float(codes[o.v[l]]);
+		}
+		else
+		{
+			for (int l = 0; l < L; ++l) r.v[l] = static_cast<int16_t>(codes[o.v[l]]);
+			r = offset + scale * r;
+		}
+		return r;
+	}
+private:
+	const float* const map;
+	const uint16_t* const codes;
+	const float scale;
+	const float offset;
+	const int mpf;
+};
+
+//! Null brick tables and codes of the dense float32 grid maps of the coarse level, one per XScore atom type.
+static const int* const dense_bts[15] = {};
+static const uint16_t* const float_mqs[15] = {};
+
+//! Aggregates the trilinearly interpolated free energies of atoms [ia, iz) from grid maps, and stores their analytic gradients into d, only for the lanes of msk unless it is null. Atoms out of box are penalized with zero gradient. The loop body is free of branches other than telling sparse maps from dense ones and masked stores from whole ones, so as to be vectorizable.
+template <int L>
+lanes<float, L> interpolate(float* d, const float* c, const int ia, const int iz, const int* xst, const array<float, 3> cr0, const array<float, 3> cr1, const array<int, 3> npr, const float gri, const float* const* const mps, const int* const* const bts, const uint16_t* const* const mqs, const float* const mqa, const int mpf, const lanes<bool, L>* const msk = nullptr)
+{
+	typedef lanes<float, L> vf;
+	typedef lanes<int, L> vi;
+	typedef lanes<bool, L> vb;
+	const int gds = L;
+	const int gd3 = 3 * gds;
+	int sy, sz;
+	vf y = 0.0f;
+	for (int i = ia; i < iz; ++i)
+	{
+		const int i0 = i * gd3;
+		const int i1 = i0 + gds;
+		const int i2 = i1 + gds;
+		const vf c0(&c[i0]);
+		const vf c1(&c[i1]);
+		const vf c2(&c[i2]);
+
+		// Fall back to the corner of the box for out-of-box atoms to keep memory accesses valid.
+		const vb inside = (cr0[0] <= c0) & (c0 < cr1[0]) & (cr0[1] <= c1) & (c1 < cr1[1]) & (cr0[2] <= c2) & (c2 < cr1[2]);
+		const vf p0 = select(inside, (c0 - cr0[0]) * gri, vf(0.0f));
+		const vf p1 = select(inside, (c1 - cr0[1]) * gri, vf(0.0f));
+		const vf p2 = select(inside, (c2 - cr0[2]) * gri, vf(0.0f));
+		const vi k0(p0);
+		const vi k1(p1);
+		const vi k2(p2);
+		const vf t0 = p0 - vf(k0);
+		const vf t1 = p1 - vf(k1);
+		const vf t2 = p2 - vf(k2);
+		const vf u0 = 1.0f - t0;
+		const vf u1 = 1.0f - t1;
+		const vf u2 = 1.0f - t2;
+
+		// Retrieve the grid map and lookup the values of the eight surrounding probes.
+		const map_view map(mps, mqs, mqa, mpf, xst[i]);
+		const vi o00 = probe(k0, k1, k2, npr, bts[xst[i]], sy, sz);
+		const vi o10 = o00 + sy;
+		const vi o01 = o00 + sz;
+		const vi o11 = o01 + sy;
+		const vf e000 = map(o00);
+		const vf e100 = map(o00 + 1);
+		const vf e010 = map(o10);
+		const vf e110 = map(o10 + 1);
+		const vf e001 = map(o01);
+		const vf e101 = map(o01 + 1);
+		const vf e011 = map(o11);
+		const vf e111 = map(o11 + 1);
+
+		// Interpolate along x, y and z in turn, and differentiate analytically.
+		const vf e00 = u0 * e000 + t0 * e100;
+		const vf e10 = u0 * e010 + t0 * e110;
+		const vf e01 = u0 * e001 + t0 * e101;
+		const vf e11 = u0 * e011 + t0 * e111;
+		const vf e0 = u1 * e00 + t1 * e10;
+		const vf e1 = u1 * e01 + t1 * e11;
+		const vf g0 = (u2 * (u1 * (e100 - e000) + t1 * (e110 - e010)) + t2 * (u1 * (e101 - e001) + t1 * (e111 - e011))) * gri;
+		const vf g1 = (u2 * (e10 - e00) + t2 * (e11 - e01)) * gri;
+		const vf g2 = (e1 - e0) * gri;
+		y += select(inside, u2 * e0 + t2 * e1, vf(10.0f));
+		if (msk)
+		{
+			select(inside, g0, vf(0.0f)).store(&d[i0], *msk);
+			select(inside, g1, vf(0.0f)).store(&d[i1], *msk);
+			select(inside, g2, vf(0.0f)).store(&d[i2], *msk);
+			continue;
+		}
+		select(inside, g0, vf(0.0f)).store(&d[i0]);
+		select(inside, g1, vf(0.0f)).store(&d[i1]);
+		select(inside, g2, vf(0.0f)).store(&d[i2]);
+	}
+	return y;
+}
+
+//! Evaluates the free energies and gradients of L conformations in lockstep, where the values of lane l lie at offset l with stride L. Returns the mask of conformations better than the upper bounds, whose e and g are stored.
+template <int L>
+lanes<bool, L> evaluate(float* e, float* g, float* a, float* q, float* c, float* d, float* f, float* t, const float* x, const int nf, const int na, const int np, const lanes<float, L>& eub, const int* shared, const float* sfe, const float* sfd, const int sfs, const bool sfi, const array<float, 3> cr0, const array<float, 3> cr1, const array<int, 3> npr, const float gri, const float* const* const mps, const int* const* const bts, const uint16_t* const* const mqs, const float* const mqa, const int mpf, const bool tri, const lanes<bool, L>& crs, const array<int, 3> cnp, const float cgi, const float* const* const cms)
 {
+	typedef lanes<float, L> vf;
+	typedef lanes<int, L> vi;
+	typedef lanes<bool, L> vb;
+	const int gds = L;
 	const int gd3 = 3 * gds;
 	const int gd4 = 4 * gds;
 
@@ -28,35 +171,41 @@ bool evaluate(float* e, float* g, float* a, float* q, float* c, float* d, float*
 	const int* const ip1 = &ip0[np];
 	const int* const ipp = &ip1[np];
 
-	float y, y0, y1, y2, v0, v1, v2, c0, c1, c2, e000, e100, e010, e001, a0, a1, a2, ang, sng, r0, r1, r2, r3, vs, dr, f0, f1, f2, t0, t1, t2, d0, d1, d2;
-	float q0, q1, q2, q3, q00, q01, q02, q03, q11, q12, q13, q22, q23, q33, m0, m1, m2, m3, m4, m5, m6, m7, m8;
+	vf y, yf, y0, y1, y2, c0, c1, c2, e000, e100, e010, e001, a0, a1, a2, ang, sng, r0, r1, r2, r3, vs, s3, e3, dr, f0, f1, f2, t0, t1, t2, d0, d1, d2, v0, v1, v2;
+	vf q0, q1, q2, q3, q00, q01, q02, q03, q11, q12, q13, q22, q23, q33, m0, m1, m2, m3, m4, m5, m6, m7, m8;
+	vi n0, n1, n2, n3, j3;
+	vb in, ok;
+	const bool fin = !all(crs); // Whether any lane looks up the fine grid maps.
+	const bool crx = any(crs); // Whether any lane looks up the coarse grid maps.
+	int sy, sz;
 	int i, j, k, b, w, i0, i1, i2, k0, k1, k2, z;
-	const float* map;
+	float u0, u1, u2;
 
 	// Apply position, orientation and torsions.
-	c[i  = gid] = x[k  = gid];
-	c[i += gds] = x[k += gds];
-	c[i += gds] = x[k += gds];
-	q[i  = gid] = x[k += gds];
-	q[i += gds] = x[k += gds];
-	q[i += gds] = x[k += gds];
-	q[i += gds] = x[k += gds];
+	for (i = 0; i < gd3; ++i)
+	{
+		c[i] = x[i];
+	}
+	for (i = 0; i < gd4; ++i)
+	{
+		q[i] = x[gd3 + i];
+	}
 	y = 0.0f;
-	for (k = 0, b = 0, w = 6 * gds + gid; k < nf; ++k)
+	for (k = 0, b = 0, w = 6 * gds; k < nf; ++k)
 	{
 		// Load rotorY from memory into registers.
-		y0 = c[i0  = beg[k] * gd3 + gid];
-		y1 = c[i0 += gds];
-		y2 = c[i0 += gds];
+		y0 = vf(&c[i0  = beg[k] * gd3]);
+		y1 = vf(&c[i0 += gds]);
+		y2 = vf(&c[i0 += gds]);
 
 		// Translate orientation of active frames from quaternion into 3x3 matrix.
 		if (act[k])
 		{
-			q0 = q[k0  = k * gd4 + gid];
-			q1 = q[k0 += gds];
-			q2 = q[k0 += gds];
-			q3 = q[k0 += gds];
-			assert(fabs(q0*q0 + q1*q1 + q2*q2 + q3*q3 - 1.0f) < 2e-3f);
+			q0 = vf(&q[k0  = k * gd4]);
+			q1 = vf(&q[k0 += gds]);
+			q2 = vf(&q[k0 += gds]);
+			q3 = vf(&q[k0 += gds]);
+			assert(all(fabs(q0*q0 + q1*q1 + q2*q2 + q3*q3 - 1.0f) < 2e-3f));
 			q00 = q0 * q0;
 			q01 = q0 * q1;
 			q02 = q0 * q2;
@@ -79,9 +228,10 @@ bool evaluate(float* e, float* g, float* a, float* q, float* c, float* d, float*
 		}
 
 		// Evaluate c and d of frame atoms. Aggregate e into y.
+		yf = y;
 		for (i = beg[k], z = end[k]; i < z; ++i)
 		{
-			i0 = i * gd3 + gid;
+			i0 = i * gd3;
 			i1 = i0 + gds;
 			i2 = i1 + gds;
 
@@ -95,59 +245,61 @@ bool evaluate(float* e, float* g, float* a, float* q, float* c, float* d, float*
 			else
 			{
 				// Calculate coordinate from transformation matrix and offset.
-				v0 = co0[i];
-				v1 = co1[i];
-				v2 = co2[i];
-				c0 = y0 + m0 * v0 + m1 * v1 + m2 * v2;
-				c1 = y1 + m3 * v0 + m4 * v1 + m5 * v2;
-				c2 = y2 + m6 * v0 + m7 * v1 + m8 * v2;
+				u0 = co0[i];
+				u1 = co1[i];
+				u2 = co2[i];
+				c0 = y0 + m0 * u0 + m1 * u1 + m2 * u2;
+				c1 = y1 + m3 * u0 + m4 * u1 + m5 * u2;
+				c2 = y2 + m6 * u0 + m7 * u1 + m8 * u2;
 
 				// Store coordinate from registers into memory.
-				c[i0] = c0;
-				c[i1] = c1;
-				c[i2] = c2;
+				c0.store(&c[i0]);
+				c1.store(&c[i1]);
+				c2.store(&c[i2]);
 			}
 
-			// TODO: move conditional expression out to bypass short circuiting.
-			// Penalize out-of-box case.
-			if (c0 < cr0[0] || cr1[0] <= c0 || c1 < cr0[1] || cr1[1] <= c1 || c2 < cr0[2] || cr1[2] <= c2)
-			{
-				y += 10.0f;
-				d[i0] = 0.0f;
-				d[i1] = 0.0f;
-				d[i2] = 0.0f;
-				continue;
-			}
+			// Defer grid map lookups to interpolate() over all the atoms of the frame, as well as those of lanes on the coarse grid maps.
+			if (tri || !fin) continue;
+
+			// Penalize out-of-box case. Lanes out of box look up the corner of the box to keep memory accesses valid.
+			in = (cr0[0] <= c0) & (c0 < cr1[0]) & (cr0[1] <= c1) & (c1 < cr1[1]) & (cr0[2] <= c2) & (c2 < cr1[2]);
 
 			// Find the index of the current coordinate
-			k0 = (int)((c0 - cr0[0]) * gri);
-			k1 = (int)((c1 - cr0[1]) * gri);
-			k2 = (int)((c2 - cr0[2]) * gri);
-			assert(k0 + 1 < npr[0]);
-			assert(k1 + 1 < npr[1]);
-			assert(k2 + 1 < npr[2]);
-			k0 = npr[0] * (npr[1] * k2 + k1) + k0;
+			n0 = vi(select(in, (c0 - cr0[0]) * gri, vf(0.0f)));
+			n1 = vi(select(in, (c1 - cr0[1]) * gri, vf(0.0f)));
+			n2 = vi(select(in, (c2 - cr0[2]) * gri, vf(0.0f)));
+			n3 = probe(n0, n1, n2, npr, bts[xst[i]], sy, sz);
 
 			// Retrieve the grid map and lookup the value
-			 map = mps[xst[i]].data();
-			e000 = map[k0];
-			e100 = map[k0 + 1];
-			e010 = map[k0 + npr[0]];
-			e001 = map[k0 + npr[0] * npr[1]];
-			y += e000;
-			d[i0] = (e100 - e000) * gri;
-			d[i1] = (e010 - e000) * gri;
-			d[i2] = (e001 - e000) * gri;
+			const map_view map(mps, mqs, mqa, mpf, xst[i]);
+			e000 = map(n3);
+			e100 = map(n3 + 1);
+			e010 = map(n3 + sy);
+			e001 = map(n3 + sz);
+			y += select(in, e000, vf(10.0f));
+			select(in, (e100 - e000) * gri, vf(0.0f)).store(&d[i0]);
+			select(in, (e010 - e000) * gri, vf(0.0f)).store(&d[i1]);
+			select(in, (e001 - e000) * gri, vf(0.0f)).store(&d[i2]);
+		}
+		if (tri && fin)
+		{
+			y += interpolate<L>(d, c, beg[k], end[k], xst, cr0, cr1, npr, gri, mps, bts, mqs, mqa, mpf);
+		}
+
+		// Replace the free energies and gradients of the lanes on the coarse grid maps, which are always interpolated trilinearly.
+		if (crx)
+		{
+			y = select(crs, yf + interpolate<L>(d, c, beg[k], end[k], xst, cr0, cr1, cnp, cgi, cms, dense_bts, float_mqs, mqa, map_float32, fin ? &crs : nullptr), y);
 		}
 		for (j = 0, z = nbr[k]; j < z; ++j)
 		{
 			i = brs[b++];
-			i0 = beg[i] * gd3 + gid;
+			i0 = beg[i] * gd3;
 			i1 = i0 + gds;
 			i2 = i1 + gds;
-			c[i0] = y0 + m0 * yy0[i] + m1 * yy1[i] + m2 * yy2[i];
-			c[i1] = y1 + m3 * yy0[i] + m4 * yy1[i] + m5 * yy2[i];
-			c[i2] = y2 + m6 * yy0[i] + m7 * yy1[i] + m8 * yy2[i];
+			(y0 + m0 * yy0[i] + m1 * yy1[i] + m2 * yy2[i]).store(&c[i0]);
+			(y1 + m3 * yy0[i] + m4 * yy1[i] + m5 * yy2[i]).store(&c[i1]);
+			(y2 + m6 * yy0[i] + m7 * yy1[i] + m8 * yy2[i]).store(&c[i2]);
 
 			// Skip inactive BRANCH frame
 			if (!act[i]) continue;
@@ -156,13 +308,13 @@ bool evaluate(float* e, float* g, float* a, float* q, float* c, float* d, float*
 			a0 = m0 * xy0[i] + m1 * xy1[i] + m2 * xy2[i];
 			a1 = m3 * xy0[i] + m4 * xy1[i] + m5 * xy2[i];
 			a2 = m6 * xy0[i] + m7 * xy1[i] + m8 * xy2[i];
-			assert(fabs(a0*a0 + a1*a1 + a2*a2 - 1.0f) < 2e-3f);
-			a[k0  = i * gd3 + gid] = a0;
-			a[k0 += gds] = a1;
-			a[k0 += gds] = a2;
+			assert(all(fabs(a0*a0 + a1*a1 + a2*a2 - 1.0f) < 2e-3f));
+			a0.store(&a[k0  = i * gd3]);
+			a1.store(&a[k0 += gds]);
+			a2.store(&a[k0 += gds]);
 
 			// Update q of BRANCH frame
-			ang = x[w += gds] * 0.5f;
+			ang = vf(&x[w += gds]) * 0.5f;
 			sng = sin(ang);
 			r0 = cos(ang);
 			r1 = sng * a0;
@@ -172,90 +324,96 @@ bool evaluate(float* e, float* g, float* a, float* q, float* c, float* d, float*
 			q01 = r0 * q1 + r1 * q0 + r2 * q3 - r3 * q2;
 			q02 = r0 * q2 - r1 * q3 + r2 * q0 + r3 * q1;
 			q03 = r0 * q3 + r1 * q2 - r2 * q1 + r3 * q0;
-			assert(fabs(q00*q00 + q01*q01 + q02*q02 + q03*q03 - 1.0f) < 2e-3f);
-			q[k0  = i * gd4 + gid] = q00;
-			q[k0 += gds] = q01;
-			q[k0 += gds] = q02;
-			q[k0 += gds] = q03;
+			assert(all(fabs(q00*q00 + q01*q01 + q02*q02 + q03*q03 - 1.0f) < 2e-3f));
+			q00.store(&q[k0  = i * gd4]);
+			q01.store(&q[k0 += gds]);
+			q02.store(&q[k0 += gds]);
+			q03.store(&q[k0 += gds]);
 		}
 	}
 	assert(b == nf - 1);
-//	assert(w == nv * gds + gid);
+//	assert(w == nv * gds);
 	assert(k == nf);
 
-	// Calculate intra-ligand free energy.
+	// Calculate intra-ligand free energy. Lanes whose pairs are beyond the cutoff look up the first entry of the precalculated table. If sfi is true, lookups interpolate linearly between the sample below and the one above.
 	for (i = 0; i < np; ++i)
 	{
-		i0 = ip0[i] * gd3 + gid;
+		i0 = ip0[i] * gd3;
 		i1 = i0 + gds;
 		i2 = i1 + gds;
-		k0 = ip1[i] * gd3 + gid;
+		k0 = ip1[i] * gd3;
 		k1 = k0 + gds;
 		k2 = k1 + gds;
-		v0 = c[k0] - c[i0];
-		v1 = c[k1] - c[i1];
-		v2 = c[k2] - c[i2];
+		v0 = vf(&c[k0]) - vf(&c[i0]);
+		v1 = vf(&c[k1]) - vf(&c[i1]);
+		v2 = vf(&c[k2]) - vf(&c[i2]);
 		vs = v0*v0 + v1*v1 + v2*v2;
-		if (vs < 64.0f)
+		in = vs < 64.0f;
+		if (!any(in)) continue;
+		s3 = sfs * select(in, vs, vf(0.0f));
+		j3 = ipp[i] + vi(s3);
+		e3 = gather(sfe, j3);
+		dr = gather(sfd, j3);
+		if (sfi)
 		{
-			j = ipp[i] + (int)(sfs * vs);
-			y += sfe[j];
-			dr = sfd[j];
-			d0 = dr * v0;
-			d1 = dr * v1;
-			d2 = dr * v2;
-			d[i0] -= d0;
-			d[i1] -= d1;
-			d[i2] -= d2;
-			d[k0] += d0;
-			d[k1] += d1;
-			d[k2] += d2;
+			s3 = s3 - vf(vi(s3));
+			e3 = e3 + (gather(sfe, j3 + 1) - e3) * s3;
+			dr = dr + (gather(sfd, j3 + 1) - dr) * s3;
 		}
+		y = select(in, y + e3, y);
+		d0 = dr * v0;
+		d1 = dr * v1;
+		d2 = dr * v2;
+		(vf(&d[i0]) - d0).store(&d[i0], in);
+		(vf(&d[i1]) - d1).store(&d[i1], in);
+		(vf(&d[i2]) - d2).store(&d[i2], in);
+		(vf(&d[k0]) + d0).store(&d[k0], in);
+		(vf(&d[k1]) + d1).store(&d[k1], in);
+		(vf(&d[k2]) + d2).store(&d[k2], in);
 	}
 
 	// If the free energy is no better than the upper bound, refuse this conformation.
-	if (y >= eub) return false;
+	ok = !(y >= eub);
+	if (!any(ok)) return ok;
 
 	// Store e from register into memory.
-	e[gid] = y;
+	y.store(e, ok);
 
 	// Calculate and aggregate the force and torque of BRANCH frames to their parent frame.
-	f[k0 = gid] = 0.0f;
-	t[k0] = 0.0f;
-	for (i = 1, z = 3 * nf; i < z; ++i)
+	for (i = 0, z = 3 * nf * gds; i < z; ++i)
 	{
-		f[k0 += gds] = 0.0f;
-		t[k0] = 0.0f;
+		f[i] = 0.0f;
+		t[i] = 0.0f;
 	}
-//	assert(w == nv * gds + gid);
+//	assert(w == nv * gds);
 	assert(k == nf);
 	while (k)
 	{
 		--k;
 
 		// Load f, t and rotorY from memory into register
-		k0 = k * gd3 + gid;
+		k0 = k * gd3;
 		k1 = k0 + gds;
 		k2 = k1 + gds;
-		f0 = f[k0];
-		f1 = f[k1];
-		f2 = f[k2];
-		t0 = t[k0];
-		t1 = t[k1];
-		t2 = t[k2];
-		y0 = c[i0  = beg[k] * gd3 + gid];
-		y1 = c[i0 += gds];
-		y2 = c[i0 += gds];
+		f0 = vf(&f[k0]);
+		f1 = vf(&f[k1]);
+		f2 = vf(&f[k2]);
+		t0 = vf(&t[k0]);
+		t1 = vf(&t[k1]);
+		t2 = vf(&t[k2]);
+		y0 = vf(&c[i0  = beg[k] * gd3]);
+		y1 = vf(&c[i0 += gds]);
+		y2 = vf(&c[i0 += gds]);
 
 		// Aggregate frame atoms.
 		for (i = beg[k], z = end[k]; i < z; ++i)
 		{
-			i0 = i * gd3 + gid;
+			i0 = i * gd3;
 			i1 = i0 + gds;
 			i2 = i1 + gds;
-			d0 = d[i0];
-			d1 = d[i1];
-			d2 = d[i2];
+			d0 = vf(&d[i0]);
+			d1 = vf(&d[i1]);
+			d2 = vf(&d[i2]);
 
 			// The derivatives with respect to the position, orientation, and torsions
 			// would be the negative total force acting on the ligand,
@@ -267,9 +425,9 @@ bool evaluate(float* e, float* g, float* a, float* q, float* c, float* d, float*
 			f2 += d2;
 			if (i == beg[k]) continue;
 
-			v0 = c[i0] - y0;
-			v1 = c[i1] - y1;
-			v2 = c[i2] - y2;
+			v0 = vf(&c[i0]) - y0;
+			v1 = vf(&c[i1]) - y1;
+			v2 = vf(&c[i2]) - y2;
 			t0 += v1 * d2 - v2 * d1;
 			t1 += v2 * d0 - v0 * d2;
 			t2 += v0 * d1 - v1 * d0;
@@ -280,38 +438,45 @@ bool evaluate(float* e, float* g, float* a, float* q, float* c, float* d, float*
 			// Save the aggregated torque of active BRANCH frames to g.
 			if (act[k])
 			{
-				g[w -= gds] = t0 * a[k0] + t1 * a[k1] + t2 * a[k2]; // dot product
+				(t0 * vf(&a[k0]) + t1 * vf(&a[k1]) + t2 * vf(&a[k2])).store(&g[w -= gds], ok); // dot product
 			}
 
 			// Aggregate the force and torque of current frame to its parent frame.
-			k0 = prn[k] * gd3 + gid;
+			k0 = prn[k] * gd3;
 			k1 = k0 + gds;
 			k2 = k1 + gds;
-			f[k0] += f0;
-			f[k1] += f1;
-			f[k2] += f2;
-			v0 = y0 - c[i0  = beg[prn[k]] * gd3 + gid];
-			v1 = y1 - c[i0 += gds];
-			v2 = y2 - c[i0 += gds];
-			t[k0] += t0 + v1 * f2 - v2 * f1;
-			t[k1] += t1 + v2 * f0 - v0 * f2;
-			t[k2] += t2 + v0 * f1 - v1 * f0;
+			(vf(&f[k0]) + f0).store(&f[k0]);
+			(vf(&f[k1]) + f1).store(&f[k1]);
+			(vf(&f[k2]) + f2).store(&f[k2]);
+			v0 = y0 - vf(&c[i0  = beg[prn[k]] * gd3]);
+			v1 = y1 - vf(&c[i0 += gds]);
+			v2 = y2 - vf(&c[i0 += gds]);
+			(vf(&t[k0]) + (t0 + v1 * f2 - v2 * f1)).store(&t[k0]);
+			(vf(&t[k1]) + (t1 + v2 * f0 - v0 * f2)).store(&t[k1]);
+			(vf(&t[k2]) + (t2 + v0 * f1 - v1 * f0)).store(&t[k2]);
 		}
 	}
-	assert(w == 6 * gds + gid);
+	assert(w == 6 * gds);
 
 	// Save the aggregated force and torque of ROOT frame to g.
-	g[i0  = gid] = f0;
-	g[i0 += gds] = f1;
-	g[i0 += gds] = f2;
-	g[i0 += gds] = t0;
-	g[i0 += gds] = t1;
-	g[i0 += gds] = t2;
-	return true;
+	f0.store(&g[i0  = 0], ok);
+	f1.store(&g[i0 += gds], ok);
+	f2.store(&g[i0 += gds], ok);
+	t0.store(&g[i0 += gds], ok);
+	t1.store(&g[i0 += gds], ok);
+	t2.store(&g[i0 += gds], ok);
+	return ok;
 }
 
-void monte_carlo(float* const s0e, const int* const lig, const int nv, const int nf, const int na, const int np, const int seed, const int nbi, const float* const sfe, const float* const sfd, const int sfs, const array<float, 3> cr0, const array<float, 3> cr1, const array<int, 3> npr, const float gri, const vector<vector<float>>& mps, const int gid, const int gds)
+template <int L, int V>
+void monte_carlo(float* const s0e, const int* const lig, const int nvr, const int nf, const int na, const int np, const uint64_t sed, const uint64_t lid, const int tid, const int nt, const int nbi, const float* const sfe, const float* const sfd, const int sfs, const bool sfi, const array<float, 3> cr0, const array<float, 3> cr1, const array<int, 3> npr, const float gri, const float* const* const mps, const int* const* const bts, const uint16_t* const* const mqs, const float* const mqa, const int mpf, const bool tri, const int ncg, const array<int, 3> cnp, const float cgi, const float* const* const cms, float* const cnf, const int cds, uint64_t* const ctr)
 {
+	typedef lanes<float, L> vf;
+	typedef lanes<int, L> vi;
+	typedef lanes<bool, L> vb;
+	assert(V == 0 || V == nvr);
+	const int nv = V ? V : nvr; // Number of variables, which is a compile-time constant in specializations so that the loops over variables have known trip counts.
+	const int gds = L;
 	const int nls = 5; // Number of line search trials for determining step size in BFGS
 	const float eub = 40.0f * na; // A conformation will be droped if its free energy is not better than e_upper_bound.
 	float* const s0x = &s0e[gds];
@@ -344,256 +509,400 @@ void monte_carlo(float* const s0e, const int* const lig, const int nv, const int
 	float* const bfp = &bfh[(nv*(nv+1)>>1) * gds];
 	float* const bfy = &bfp[nv * gds];
 	float* const bfm = &bfy[nv * gds];
+	float* const bfz = &bfm[nv * gds];
 	float rd0, rd1, rd2, rd3, rst;
-	float sum, pg1, pga, pgc, alp, pg2, pr0, pr1, pr2, nrm, ang, sng, pq0, pq1, pq2, pq3, s1xq0, s1xq1, s1xq2, s1xq3, s2xq0, s2xq1, s2xq2, s2xq3, bpi;
-	float yhy, yps, ryp, pco, bpj, bmj, ppj;
-	int g, i, j, o0, o1, o2;
-	mt19937_64 rng(seed);
-	uniform_real_distribution<double> uniform_01(0, 1);
-
-	// Randomize s0x.
-	rd0 = uniform_01(rng);
-	s0x[o0  = gid] = rd0 * cr1[0] + (1 - rd0) * cr0[0];
-	rd0 = uniform_01(rng);
-	s0x[o0 += gds] = rd0 * cr1[1] + (1 - rd0) * cr0[1];
-	rd0 = uniform_01(rng);
-	s0x[o0 += gds] = rd0 * cr1[2] + (1 - rd0) * cr0[2];
-	rd0 = uniform_01(rng);
-	rd1 = uniform_01(rng);
-	rd2 = uniform_01(rng);
-	rd3 = uniform_01(rng);
-	rst = 1 / sqrt(rd0*rd0 + rd1*rd1 + rd2*rd2 + rd3*rd3);
-	s0x[o0 += gds] = rd0 * rst;
-	s0x[o0 += gds] = rd1 * rst;
-	s0x[o0 += gds] = rd2 * rst;
-	s0x[o0 += gds] = rd3 * rst;
-	for (i = 6; i < nv; ++i)
+	vf sum, pg1, pga, pgc, alp, pg2, pr0, pr1, pr2, nrm, ang, sng, pq0, pq1, pq2, pq3, s1xq0, s1xq1, s1xq2, s1xq3, s2xq0, s2xq1, s2xq2, s2xq3, bpi;
+	vf yhy, yps, ryp, pco, bpj, bmj, ppj;
+	vi gen, trl;
+	vb ini, mut, lns, don, acc, fnd, ext, nwd, crs;
+	array<int, L> tsk;
+	int i, j, k, l, o0, o1, o2, nxt;
+	array<philox_stream, L> rng;
+
+	// Start task t in lane l, whose solution values are cleared before s0x is randomized.
+	const auto start = [&](const int l, const int t)
 	{
-		s0x[o0 += gds] = uniform_01(rng);
-	}
-	evaluate(s0e, s0g, s0a, s0q, s0c, s0d, s0f, s0t, s0x, nf, na, np, eub, lig, sfe, sfd, sfs, cr0, cr1, npr, gri, mps, gid, gds);
-
-	// Repeat for a number of generations.
-	for (g = 0; g < nbi; ++g)
-	{
-		// Mutate s0x into s1x
-		o0  = gid;
-		s1x[o0] = s0x[o0] + uniform_01(rng);
-		o0 += gds;
-		s1x[o0] = s0x[o0] + uniform_01(rng);
-		o0 += gds;
-		s1x[o0] = s0x[o0] + uniform_01(rng);
-//		for (i = 3; i < nv + 1; ++i)
-		for (i = 2 - nv; i < 0; ++i)
+		for (o0 = l; o0 < bfz - s0e; o0 += gds)
 		{
-			o0 += gds;
-			s1x[o0] = s0x[o0];
+			s0e[o0] = 0.0f;
 		}
-		evaluate(s1e, s1g, s1a, s1q, s1c, s1d, s1f, s1t, s1x, nf, na, np, eub, lig, sfe, sfd, sfs, cr0, cr1, npr, gri, mps, gid, gds);
-
-		// Initialize the inverse Hessian matrix to identity matrix.
-		// An easier option that works fine in practice is to use a scalar multiple of the identity matrix,
-		// where the scaling factor is chosen to be in the range of the eigenvalues of the true Hessian.
-		// See N&R for a recipe to find this initializer.
-		bfh[o0 = gid] = 1.0f;
-		for (j = 1; j < nv; ++j)
+		tsk[l] = t;
+		rng[l].reset(sed, lid, tid + t);
+
+		// Randomize s0x.
+		rd0 = rng[l]();
+		s0x[o0  = l] = rd0 * cr1[0] + (1 - rd0) * cr0[0];
+		rd0 = rng[l]();
+		s0x[o0 += gds] = rd0 * cr1[1] + (1 - rd0) * cr0[1];
+		rd0 = rng[l]();
+		s0x[o0 += gds] = rd0 * cr1[2] + (1 - rd0) * cr0[2];
+		rd0 = rng[l]();
+		rd1 = rng[l]();
+		rd2 = rng[l]();
+		rd3 = rng[l]();
+		rst = 1 / sqrt(rd0*rd0 + rd1*rd1 + rd2*rd2 + rd3*rd3);
+		s0x[o0 += gds] = rd0 * rst;
+		s0x[o0 += gds] = rd1 * rst;
+		s0x[o0 += gds] = rd2 * rst;
+		s0x[o0 += gds] = rd3 * rst;
+		for (i = 6; i < nv; ++i)
 		{
-			for (i = 0; i < j; ++i)
-			{
-				bfh[o0 += gds] = 0.0f;
-			}
-			bfh[o0 += gds] = 1.0f;
+			s0x[o0 += gds] = rng[l]();
 		}
+	};
 
-		// Use BFGS to optimize the mutated conformation s1x into local optimum s2x.
-		// http://en.wikipedia.org/wiki/BFGS_method
-		// http://en.wikipedia.org/wiki/Quasi-Newton_method
-		// The loop breaks when no appropriate alpha can be found.
-		while (true)
+	// Each lane proceeds through the generations, BFGS iterations and line search trials of its own task, and starts the next task as soon as its current one ends,
+	// so that every step evaluates, in the place of x2, either an initial s0x, a mutated s1x or a line search trial x2 in all lanes but those that have no more tasks.
+	// The solution values of lanes are only updated as they would be in a scalar run, so the results of every task are as if it ran alone.
+	for (l = 0, nxt = 0; l < L; ++l)
+	{
+		if (nxt < nt) start(l, nxt++);
+	}
+	don = false;
+	for (l = nxt; l < L; ++l)
+	{
+		don.v[l] = -1;
+	}
+	gen = 0;
+	trl = 0;
+	ini = !don;
+	mut = false;
+	lns = false;
+	while (!all(don))
+	{
+		// Evaluate s0x in the place of x2 for lanes that begin a task.
+		if (any(ini))
 		{
-			// Calculate p = -h * g, where p is for descent direction, h for Hessian, and g for gradient.
-			sum = bfh[o1 = gid] * s1g[o0 = gid];
-			for (i = 1; i < nv; ++i)
+			for (o0 = 0, o1 = (nv + 1) * gds; o0 < o1; o0 += gds)
 			{
-				sum += bfh[o1 += i * gds] * s1g[o0 += gds];
+				vf(&s0x[o0]).store(&s2x[o0], ini);
 			}
-			bfp[o2 = gid] = -sum;
-			for (j = 1; j < nv; ++j)
+		}
+
+		// Mutate s0x into s1x for lanes that begin a generation, and evaluate s1x in the place of x2.
+		if (any(mut))
+		{
+			for (l = 0; l < L; ++l)
 			{
-				sum = bfh[o1 = (j*(j+1)>>1) * gds + gid] * s1g[o0 = gid];
-				for (i = 1; i < nv; ++i)
+				if (!mut[l]) continue;
+				o0  = l;
+				s1x[o0] = s0x[o0] + rng[l]();
+				o0 += gds;
+				s1x[o0] = s0x[o0] + rng[l]();
+				o0 += gds;
+				s1x[o0] = s0x[o0] + rng[l]();
+				for (i = 2 - nv; i < 0; ++i)
 				{
-					sum += bfh[o1 += i > j ? i * gds : gds] * s1g[o0 += gds];
+					o0 += gds;
+					s1x[o0] = s0x[o0];
 				}
-				bfp[o2 += gds] = -sum;
 			}
+			for (o0 = 0, o1 = (nv + 1) * gds; o0 < o1; o0 += gds)
+			{
+				vf(&s1x[o0]).store(&s2x[o0], mut);
+			}
+		}
 
-			// Calculate pg = p * g = -h * g^2 < 0
-			o0 = gid;
-			pg1 = bfp[o0] * s1g[o0];
-			for (i = 1; i < nv; ++i)
+		// Calculate x2 = x1 + a * p for lanes in a line search.
+		if (any(lns))
+		{
+			o0  = 0;
+			(vf(&s1x[o0]) + alp * vf(&bfp[o0])).store(&s2x[o0], lns);
+			o0 += gds;
+			(vf(&s1x[o0]) + alp * vf(&bfp[o0])).store(&s2x[o0], lns);
+			o0 += gds;
+			(vf(&s1x[o0]) + alp * vf(&bfp[o0])).store(&s2x[o0], lns);
+			o0 += gds;
+			s1xq0 = vf(&s1x[o0]);
+			pr0 = vf(&bfp[o0]);
+			o0 += gds;
+			s1xq1 = vf(&s1x[o0]);
+			pr1 = vf(&bfp[o0]);
+			o0 += gds;
+			s1xq2 = vf(&s1x[o0]);
+			pr2 = vf(&bfp[o0]);
+			o0 += gds;
+			s1xq3 = vf(&s1x[o0]);
+			assert(all((!lns) | (fabs(s1xq0*s1xq0 + s1xq1*s1xq1 + s1xq2*s1xq2 + s1xq3*s1xq3 - 1.0f) < 2e-3f)));
+			nrm = sqrt(pr0*pr0 + pr1*pr1 + pr2*pr2);
+			ang = 0.5f * alp * nrm;
+			sng = select(vf(0.0f) < nrm, sin(ang) / nrm, vf(0.0f)); // Keep the orientation under zero torque, e.g. of a ligand out of the box, whose intra-ligand forces exert none.
+			pq0 = cos(ang);
+			pq1 = sng * pr0;
+			pq2 = sng * pr1;
+			pq3 = sng * pr2;
+			s2xq0 = pq0 * s1xq0 - pq1 * s1xq1 - pq2 * s1xq2 - pq3 * s1xq3;
+			s2xq1 = pq0 * s1xq1 + pq1 * s1xq0 + pq2 * s1xq3 - pq3 * s1xq2;
+			s2xq2 = pq0 * s1xq2 - pq1 * s1xq3 + pq2 * s1xq0 + pq3 * s1xq1;
+			s2xq3 = pq0 * s1xq3 + pq1 * s1xq2 - pq2 * s1xq1 + pq3 * s1xq0;
+			s2xq0.store(&s2x[o0 -= 3 * gds], lns);
+			s2xq1.store(&s2x[o0 += gds], lns);
+			s2xq2.store(&s2x[o0 += gds], lns);
+			s2xq3.store(&s2x[o0 += gds], lns);
+			for (i = 6; i < nv; ++i)
 			{
+				bpi = vf(&bfp[o0]);
 				o0 += gds;
-				pg1 += bfp[o0] * s1g[o0];
+				(vf(&s1x[o0]) + alp * bpi).store(&s2x[o0], lns);
 			}
-			pga = 0.0001f * pg1;
-			pgc = 0.9f * pg1;
+		}
 
-			// Perform a line search to find an appropriate alpha.
-			// Try different alpha values for nls times.
-			// alpha starts with 1, and shrinks to 0.1 of itself iteration by iteration.
-			alp = 1.0f;
-			for (j = 0; j < nls; ++j)
+		// Let lanes that have no more tasks duplicate the x2 of a busy lane to keep evaluating valid conformations.
+		if (any(don))
+		{
+			for (k = 0; don[k]; ++k);
+			for (l = 0; l < L; ++l)
 			{
-				// Calculate x2 = x1 + a * p.
-				o0  = gid;
-				s2x[o0] = s1x[o0] + alp * bfp[o0];
-				o0 += gds;
-				s2x[o0] = s1x[o0] + alp * bfp[o0];
-				o0 += gds;
-				s2x[o0] = s1x[o0] + alp * bfp[o0];
-				o0 += gds;
-				s1xq0 = s1x[o0];
-				pr0 = bfp[o0];
-				o0 += gds;
-				s1xq1 = s1x[o0];
-				pr1 = bfp[o0];
-				o0 += gds;
-				s1xq2 = s1x[o0];
-				pr2 = bfp[o0];
-				o0 += gds;
-				s1xq3 = s1x[o0];
-				assert(fabs(s1xq0*s1xq0 + s1xq1*s1xq1 + s1xq2*s1xq2 + s1xq3*s1xq3 - 1.0f) < 2e-3f);
-				nrm = sqrt(pr0*pr0 + pr1*pr1 + pr2*pr2);
-				ang = 0.5f * alp * nrm;
-				sng = sin(ang) / nrm;
-				pq0 = cos(ang);
-				pq1 = sng * pr0;
-				pq2 = sng * pr1;
-				pq3 = sng * pr2;
-				assert(fabs(pq0*pq0 + pq1*pq1 + pq2*pq2 + pq3*pq3 - 1.0f) < 2e-3f);
-				s2xq0 = pq0 * s1xq0 - pq1 * s1xq1 - pq2 * s1xq2 - pq3 * s1xq3;
-				s2xq1 = pq0 * s1xq1 + pq1 * s1xq0 + pq2 * s1xq3 - pq3 * s1xq2;
-				s2xq2 = pq0 * s1xq2 - pq1 * s1xq3 + pq2 * s1xq0 + pq3 * s1xq1;
-				s2xq3 = pq0 * s1xq3 + pq1 * s1xq2 - pq2 * s1xq1 + pq3 * s1xq0;
-				assert(fabs(s2xq0*s2xq0 + s2xq1*s2xq1 + s2xq2*s2xq2 + s2xq3*s2xq3 - 1.0f) < 2e-3f);
-				s2x[o0 -= 3 * gds] = s2xq0;
-				s2x[o0 += gds] = s2xq1;
-				s2x[o0 += gds] = s2xq2;
-				s2x[o0 += gds] = s2xq3;
-				for (i = 6; i < nv; ++i)
+				if (!don[l]) continue;
+				for (o0 = 0, o1 = (nv + 1) * gds; o0 < o1; o0 += gds)
 				{
-					bpi = bfp[o0];
-					o0 += gds;
-					s2x[o0] = s1x[o0] + alp * bpi;
+					s2x[o0 + l] = s2x[o0 + k];
 				}
+			}
+		}
 
-				// Evaluate x2, subject to Wolfe conditions http://en.wikipedia.org/wiki/Wolfe_conditions
-				// 1) Armijo rule ensures that the step length alpha decreases f sufficiently.
-				// 2) The curvature condition ensures that the slope has been reduced sufficiently.
-				if (evaluate(s2e, s2g, s2a, s2q, s2c, s2d, s2f, s2t, s2x, nf, na, np, s1e[gid] + alp * pga, lig, sfe, sfd, sfs, cr0, cr1, npr, gri, mps, gid, gds))
-				{
-					o0 = gid;
-					pg2 = bfp[o0] * s2g[o0];
-					for (i = 1; i < nv; ++i)
-					{
-						o0 += gds;
-						pg2 += bfp[o0] * s2g[o0];
-					}
-					if (pg2 >= pgc) break;
-				}
+		// Evaluate x2, subject to Wolfe conditions http://en.wikipedia.org/wiki/Wolfe_conditions for lanes in a line search.
+		// 1) Armijo rule ensures that the step length alpha decreases f sufficiently.
+		// 2) The curvature condition ensures that the slope has been reduced sufficiently.
+		// Lanes in their first ncg generations evaluate on the coarse grid maps.
+		crs = gen < ncg;
+		acc = evaluate<L>(s2e, s2g, s2a, s2q, s2c, s2d, s2f, s2t, s2x, nf, na, np, select(lns, vf(&s1e[0]) + alp * pga, vf(eub)), lig, sfe, sfd, sfs, sfi, cr0, cr1, npr, gri, mps, bts, mqs, mqa, mpf, tri, crs, cnp, cgi, cms);
+		if (ctr) ctr[0] += count(!don);
 
-				alp *= 0.1f;
+		// Lanes that have evaluated their s0x or s1x keep its e and g only if it is better than the upper bound.
+		if (any(ini & acc))
+		{
+			vf(&s2e[0]).store(&s0e[0], ini & acc);
+			for (o0 = (nv + 2) * gds, o1 = 2 * (nv + 1) * gds; o0 < o1; o0 += gds)
+			{
+				vf(&s2e[o0]).store(&s0e[o0], ini & acc);
 			}
+		}
+		if (any(mut & acc))
+		{
+			vf(&s2e[0]).store(&s1e[0], mut & acc);
+			for (o0 = (nv + 2) * gds, o1 = 2 * (nv + 1) * gds; o0 < o1; o0 += gds)
+			{
+				vf(&s2e[o0]).store(&s1e[o0], mut & acc);
+			}
+		}
 
-			// If no appropriate alpha can be found, exit the BFGS loop.
-			if (j == nls) break;
+		// Find lanes whose alpha is appropriate.
+		fnd = lns & acc;
+		if (any(fnd))
+		{
+			o0 = 0;
+			pg2 = vf(&bfp[o0]) * vf(&s2g[o0]);
+			for (i = 1; i < nv; ++i)
+			{
+				o0 += gds;
+				pg2 += vf(&bfp[o0]) * vf(&s2g[o0]);
+			}
+			fnd = fnd & (pg2 >= pgc);
+		}
 
+		// Update the Hessian matrix h for lanes whose alpha is appropriate, and move them to their next BFGS iteration.
+		if (any(fnd))
+		{
 			// Calculate y = g2 - g1.
-			o0 = gid;
-			bfy[o0] = s2g[o0] - s1g[o0];
+			o0 = 0;
+			(vf(&s2g[o0]) - vf(&s1g[o0])).store(&bfy[o0]);
 			for (i = 1; i < nv; ++i)
 			{
 				o0 += gds;
-				bfy[o0] = s2g[o0] - s1g[o0];
+				(vf(&s2g[o0]) - vf(&s1g[o0])).store(&bfy[o0]);
 			}
 
 			// Calculate m = -h * y.
-			sum = bfh[o1 = gid] * bfy[o0 = gid];
+			sum = vf(&bfh[o1 = 0]) * vf(&bfy[o0 = 0]);
 			for (i = 1; i < nv; ++i)
 			{
-				sum += bfh[o1 += i * gds] * bfy[o0 += gds];
+				sum += vf(&bfh[o1 += i * gds]) * vf(&bfy[o0 += gds]);
 			}
-			bfm[o2 = gid] = -sum;
+			(-sum).store(&bfm[o2 = 0]);
 			for (j = 1; j < nv; ++j)
 			{
-				sum = bfh[o1 = (j*(j+1)>>1) * gds + gid] * bfy[o0 = gid];
+				sum = vf(&bfh[o1 = (j*(j+1)>>1) * gds]) * vf(&bfy[o0 = 0]);
 				for (i = 1; i < nv; ++i)
 				{
-					sum += bfh[o1 += i > j ? i * gds : gds] * bfy[o0 += gds];
+					sum += vf(&bfh[o1 += i > j ? i * gds : gds]) * vf(&bfy[o0 += gds]);
 				}
-				bfm[o2 += gds] = -sum;
+				(-sum).store(&bfm[o2 += gds]);
 			}
 
 			// Calculate yhy = -y * m = -y * (-h * y) = y * h * y.
-			o0 = gid;
-			yhy = -bfy[o0] * bfm[o0];
+			o0 = 0;
+			yhy = -vf(&bfy[o0]) * vf(&bfm[o0]);
 			for (i = 1; i < nv; ++i)
 			{
 				o0 += gds;
-				yhy -= bfy[o0] * bfm[o0];
+				yhy -= vf(&bfy[o0]) * vf(&bfm[o0]);
 			}
 
 			// Calculate yps = y * p.
-			o0 = gid;
-			yps = bfy[o0] * bfp[o0];
+			o0 = 0;
+			yps = vf(&bfy[o0]) * vf(&bfp[o0]);
 			for (i = 1; i < nv; ++i)
 			{
 				o0 += gds;
-				yps += bfy[o0] * bfp[o0];
+				yps += vf(&bfy[o0]) * vf(&bfp[o0]);
 			}
 
 			// Update Hessian matrix h.
 			ryp = 1.0f / yps;
 			pco = ryp * (ryp * yhy + alp);
-			o2 = gid;
+			o2 = 0;
 			for (j = 0; j < nv; ++j)
 			{
-				bpj = bfp[o2];
-				bmj = bfm[o2];
+				bpj = vf(&bfp[o2]);
+				bmj = vf(&bfm[o2]);
 				ppj = pco * bpj;
-				bfh[o1 = (j*(j+3)>>1) * gds + gid] += (ryp * 2 * bmj + ppj) * bpj;
+				o1 = (j*(j+3)>>1) * gds;
+				(vf(&bfh[o1]) + (ryp * 2 * bmj + ppj) * bpj).store(&bfh[o1], fnd);
 				for (i = j + 1; i < nv; ++i)
 				{
-					o0 = i * gds + gid;
-					bpi = bfp[o0];
-					bfh[o1 += i * gds] += ryp * (bmj * bpi + bfm[o0] * bpj) + ppj * bpi;
+					o0 = i * gds;
+					bpi = vf(&bfp[o0]);
+					o1 += i * gds;
+					(vf(&bfh[o1]) + (ryp * (bmj * bpi + vf(&bfm[o0]) * bpj) + ppj * bpi)).store(&bfh[o1], fnd);
 				}
 				o2 += gds;
 			}
 
 			// Move to the next iteration, i.e. e1 = e2, x1 = x2, g1 = g2.
-			o0 = gid;
-			s1e[o0] = s2e[o0];
-//			for (i = 1; i < 2 * (nv + 1); ++i)
-			for (i = -1 - 2 * nv; i < 0; ++i)
+			for (o0 = 0, o1 = 2 * (nv + 1) * gds; o0 < o1; o0 += gds)
 			{
-				o0 += gds;
-				s1e[o0] = s2e[o0];
+				vf(&s2e[o0]).store(&s1e[o0], fnd);
 			}
 		}
 
-		// Accept x1 according to Metropolis criteria.
-		if (s1e[gid] < s0e[gid])
+		// Shrink alpha to 0.1 of itself for lanes whose alpha is inappropriate. Lanes that have tried nls times exit BFGS.
+		ext = lns & !fnd;
+		if (ctr)
 		{
-			o0 = gid;
-			s0e[o0] = s1e[o0];
-//			for (i = 1; i < nv + 2; ++i)
-			for (i = -1 - nv; i < 0; ++i)
+			ctr[1] += count(fnd);
+			ctr[2] += count(ext);
+		}
+		alp = select(ext, alp * 0.1f, alp);
+		trl = select(ext, trl + 1, trl);
+		ext = ext & (trl >= nls);
+
+		// Accept x1 according to Metropolis criteria for lanes that exit BFGS, and move them to their next generation.
+		if (any(ext))
+		{
+			acc = ext & (vf(&s1e[0]) < vf(&s0e[0]));
+			for (o0 = 0, o1 = (nv + 2) * gds; o0 < o1; o0 += gds)
+			{
+				vf(&s1e[o0]).store(&s0e[o0], acc);
+			}
+			gen = select(ext, gen + 1, gen);
+		}
+
+		// Begin a BFGS iteration for lanes that have just evaluated their s1x or moved to the next BFGS iteration.
+		nwd = mut | fnd;
+		if (any(nwd))
+		{
+			// Initialize the inverse Hessian matrix to identity matrix for lanes that begin BFGS.
+			// An easier option that works fine in practice is to use a scalar multiple of the identity matrix,
+			// where the scaling factor is chosen to be in the range of the eigenvalues of the true Hessian.
+			// See N&R for a recipe to find this initializer.
+			if (any(mut))
+			{
+				vf(1.0f).store(&bfh[o0 = 0], mut);
+				for (j = 1; j < nv; ++j)
+				{
+					for (i = 0; i < j; ++i)
+					{
+						vf(0.0f).store(&bfh[o0 += gds], mut);
+					}
+					vf(1.0f).store(&bfh[o0 += gds], mut);
+				}
+			}
+
+			// Calculate p = -h * g, where p is for descent direction, h for Hessian, and g for gradient.
+			sum = vf(&bfh[o1 = 0]) * vf(&s1g[o0 = 0]);
+			for (i = 1; i < nv; ++i)
+			{
+				sum += vf(&bfh[o1 += i * gds]) * vf(&s1g[o0 += gds]);
+			}
+			(-sum).store(&bfp[o2 = 0], nwd);
+			for (j = 1; j < nv; ++j)
+			{
+				sum = vf(&bfh[o1 = (j*(j+1)>>1) * gds]) * vf(&s1g[o0 = 0]);
+				for (i = 1; i < nv; ++i)
+				{
+					sum += vf(&bfh[o1 += i > j ? i * gds : gds]) * vf(&s1g[o0 += gds]);
+				}
+				(-sum).store(&bfp[o2 += gds], nwd);
+			}
+
+			// Calculate pg = p * g = -h * g^2 < 0
+			o0 = 0;
+			pg1 = vf(&bfp[o0]) * vf(&s1g[o0]);
+			for (i = 1; i < nv; ++i)
 			{
 				o0 += gds;
-				s0e[o0] = s1e[o0];
+				pg1 += vf(&bfp[o0]) * vf(&s1g[o0]);
+			}
+			pga = select(nwd, 0.0001f * pg1, pga);
+			pgc = select(nwd, 0.9f * pg1, pgc);
+
+			// Perform a line search to find an appropriate alpha.
+			// Try different alpha values for nls times.
+			// alpha starts with 1, and shrinks to 0.1 of itself iteration by iteration.
+			alp = select(nwd, vf(1.0f), alp);
+			trl = select(nwd, vi(0), trl);
+		}
+		lns = (lns & !ext) | mut;
+
+		// Lanes that have evaluated their s0x begin their first generation, and so do lanes that exit BFGS unless their tasks end.
+		mut = ini | ext;
+		ini = false;
+		for (l = 0; l < L; ++l)
+		{
+			if (!mut[l]) continue;
+
+			// Lanes that have just finished their coarse generations evaluate their s0x again on the fine grid maps before mutating it, so that the Metropolis criterion compares energies of the same maps.
+			if (ncg && gen[l] == ncg && ext[l])
+			{
+				s0e[l] = eub;
+				mut.v[l] = 0;
+				ini.v[l] = -1;
+				continue;
+			}
+			if (gen[l] < nbi) continue;
+
+			// Write e and x of s0 of the ended task in the layout of solutions of the GPU kernels, and start the next task.
+			for (i = 0, o0 = l; i < nv + 2; ++i, o0 += gds)
+			{
+				cnf[cds * i + tsk[l]] = s0e[o0];
+			}
+			mut.v[l] = 0;
+			gen.v[l] = 0;
+			if (nxt < nt)
+			{
+				start(l, nxt++);
+				ini.v[l] = -1;
+			}
+			else
+			{
+				don.v[l] = -1;
 			}
 		}
 	}
 }
+
+// Instantiate the generic kernel and its specializations for ligands of up to max_specialized_nv - 6 active torsions.
+#define INSTANTIATE_MONTE_CARLO(V) template void monte_carlo<num_lanes, V>(float* const s0e, const int* const lig, const int nvr, const int nf, const int na, const int np, const uint64_t sed, const uint64_t lid, const int tid, const int nt, const int nbi, const float* const sfe, const float* const sfd, const int sfs, const bool sfi, const array<float, 3> cr0, const array<float, 3> cr1, const array<int, 3> npr, const float gri, const float* const* const mps, const int* const* const bts, const uint16_t* const* const mqs, const float* const mqa, const int mpf, const bool tri, const int ncg, const array<int, 3> cnp, const float cgi, const float* const* const cms, float* const cnf, const int cds, uint64_t* const ctr);
+INSTANTIATE_MONTE_CARLO(0)
+INSTANTIATE_MONTE_CARLO(6)
+INSTANTIATE_MONTE_CARLO(7)
+INSTANTIATE_MONTE_CARLO(8)
+INSTANTIATE_MONTE_CARLO(9)
+INSTANTIATE_MONTE_CARLO(10)
+INSTANTIATE_MONTE_CARLO(11)
+INSTANTIATE_MONTE_CARLO(12)
+INSTANTIATE_MONTE_CARLO(13)
+INSTANTIATE_MONTE_CARLO(14)
+INSTANTIATE_MONTE_CARLO(15)
+INSTANTIATE_MONTE_CARLO(16)
@@ -1,5 +1,4 @@
 #include <assert.h>
-#include <curand_kernel.h>
 
 #if defined(__CUDA_ARCH__) && (__CUDA_ARCH__ < 200)
 #undef  assert
@@ -9,23 +8,258 @@
 __constant__ const float* sfe;
 __constant__ const float* sfd;
 __constant__ int sfs;
+__constant__ int sfi; // Nonzero if lookups of the scoring function interpolate linearly between the sample below and the one above.
 __constant__ float3 cr0;
 __constant__ float3 cr1;
 __constant__ int3 npr;
 __constant__ float gri;
 __constant__ const float* mps[15];
+__constant__ cudaTextureObject_t mts[15]; // Textures of grid maps sampled with hardware trilinear filtering, or 0 to read mps.
+__constant__ int bks; // Nonzero if the grid maps are sparse, each holding a table of brick offsets followed by bricks of 9x9x9 probes.
+__constant__ int mpf; // Precision of the values of grid maps, i.e. 0 for float32, 1 for float16 and 2 for int16, each 16-bit map starting with its scale and offset as two floats.
 __constant__ int nbi;
 __constant__ unsigned long sed;
-__constant__ float* __restrict__ s0e;
-__constant__ const int* __restrict__ lig;
 
 extern __shared__ int shared[];
 
+// Decodes value i of a 16-bit grid map, whose codes follow its scale and offset, by the same bit manipulation as half_to_float of precision.hpp for float16.
+__device__ __forceinline__
+float decode(const float* map, const int i)
+{
+	const unsigned int h = reinterpret_cast<const unsigned short*>(map + 2)[i];
+	if (mpf == 1) return __int_as_float(((h & 0x8000) << 16) | ((h & 0x7fff) ? ((h & 0x7fff) + 0x1c000) << 13 : 0));
+	return map[1] + map[0] * (short)h;
+}
+
+// Represents the Philox4x32-10 stream of a Monte Carlo task, keyed by sed and counted by the ligand index, the task id and the draw number, identical to philox_stream of philox.hpp.
+struct philox_state
+{
+	uint4 ctr;
+	uint4 blk;
+	unsigned int d;
+};
+
+__device__ __forceinline__
+void philox_init(philox_state* s, const unsigned long long lid, const unsigned int tid)
+{
+	s->ctr = make_uint4(0, tid, (unsigned int)lid, (unsigned int)(lid >> 32));
+	s->d = 0;
+}
+
+__device__ __forceinline__
+float philox_uniform(philox_state* s)
+{
+	if (!(s->d & 3))
+	{
+		uint4 c = s->ctr;
+		c.x = s->d >> 2;
+		unsigned int k0 = (unsigned int)sed, k1 = (unsigned int)(sed >> 32);
+		for (int r = 0; r < 10; ++r)
+		{
+			if (r)
+			{
+				k0 += 0x9E3779B9;
+				k1 += 0xBB67AE85;
+			}
+			const unsigned int h0 = __umulhi(0xD2511F53, c.x), l0 = 0xD2511F53 * c.x;
+			const unsigned int h1 = __umulhi(0xCD9E8D57, c.z), l1 = 0xCD9E8D57 * c.z;
+			c = make_uint4(h1 ^ c.y ^ k0, l1, h0 ^ c.w ^ k1, l0);
+		}
+		s->blk = c;
+	}
+	const unsigned int w = s->d & 3;
+	++s->d;
+	return ((w == 0 ? s->blk.x : w == 1 ? s->blk.y : w == 2 ? s->blk.z : s->blk.w) >> 8) * (1.0f / 16777216);
+}
+
+// Looks up the grid map of XScore type t at the coordinate c0, c1 and c2 of a heavy atom, returning its free energy and storing its derivatives at i0, i0 + gds and i0 + 2 * gds of both d and n, or penalizes the atom with zero derivatives if it is out of the box.
+__device__ __forceinline__
+float lookup(float* d, float* n, const int i0, const int gds, const int t, const float c0, const float c1, const float c2)
+{
+	const int i1 = i0 + gds;
+	const int i2 = i1 + gds;
+	float p0, p1, p2, e000, e100, e010, e001;
+	int k0, k1, k2;
+	const float* map;
+
+	// Penalize out-of-box case.
+	if (c0 < cr0.x || cr1.x <= c0 || c1 < cr0.y || cr1.y <= c1 || c2 < cr0.z || cr1.z <= c2)
+	{
+		d[i0] = n[i0] = 0.0f;
+		d[i1] = n[i1] = 0.0f;
+		d[i2] = n[i2] = 0.0f;
+		return 10.0f;
+	}
+
+	// Sample the texture of the grid map if any, whose texels are centered at half-integer coordinates and clamped at the edges.
+	if (mts[t])
+	{
+		p0 = (c0 - cr0.x) * gri + 0.5f;
+		p1 = (c1 - cr0.y) * gri + 0.5f;
+		p2 = (c2 - cr0.z) * gri + 0.5f;
+		e000 = tex3D<float>(mts[t], p0, p1, p2);
+		e100 = tex3D<float>(mts[t], p0 + 1.0f, p1, p2);
+		e010 = tex3D<float>(mts[t], p0, p1 + 1.0f, p2);
+		e001 = tex3D<float>(mts[t], p0, p1, p2 + 1.0f);
+	}
+	else
+	{
+		// Find the index of the current coordinate
+		k0 = static_cast<int>((c0 - cr0.x) * gri);
+		k1 = static_cast<int>((c1 - cr0.y) * gri);
+		k2 = static_cast<int>((c2 - cr0.z) * gri);
+		assert(k0 + 1 < npr.x);
+		assert(k1 + 1 < npr.y);
+		assert(k2 + 1 < npr.z);
+
+		// Retrieve the grid map, and find the offset of the probe and the strides to the next probes along Y and Z, within the brick of the cell if the map is sparse.
+		map = mps[t];
+		if (bks)
+		{
+			const int nb0 = ((npr.x - 2) >> 3) + 1;
+			const int nb1 = ((npr.y - 2) >> 3) + 1;
+			const int nb2 = ((npr.z - 2) >> 3) + 1;
+			k0 = reinterpret_cast<const int*>(map)[nb0 * (nb1 * (k2 >> 3) + (k1 >> 3)) + (k0 >> 3)] + 81 * (k2 & 7) + 9 * (k1 & 7) + (k0 & 7);
+			map += nb0 * nb1 * nb2;
+			k1 = 9;
+			k2 = 81;
+		}
+		else
+		{
+			k0 = npr.x * (npr.y * k2 + k1) + k0;
+			k1 = npr.x;
+			k2 = npr.x * npr.y;
+		}
+
+		// Lookup the values, decoding them if the map is quantized.
+		if (mpf)
+		{
+			e000 = decode(map, k0);
+			e100 = decode(map, k0 + 1);
+			e010 = decode(map, k0 + k1);
+			e001 = decode(map, k0 + k2);
+		}
+		else
+		{
+			e000 = map[k0];
+			e100 = map[k0 + 1];
+			e010 = map[k0 + k1];
+			e001 = map[k0 + k2];
+		}
+	}
+	d[i0] = n[i0] = (e100 - e000) * gri;
+	d[i1] = n[i1] = (e010 - e000) * gri;
+	d[i2] = n[i2] = (e001 - e000) * gri;
+	return e000;
+}
+
+// Calculates and aggregates the force and torque of BRANCH frames to their parent frame from the coordinates c and derivatives d of heavy atoms and the axes a of frames, saving the torque projections of active BRANCH frames to g downwards from w, followed by the force and torque of ROOT frame, with f and t as scratch.
+__device__ __forceinline__
+void aggregate(float* g, const float* a, const float* c, const float* d, float* f, float* t, const int nf, int w, const int gid, const int gds)
+{
+	const int gd3 = 3 * gds;
+
+	const int* act = shared;
+	const int* beg = act + nf;
+	const int* end = beg + nf;
+	const int* nbr = end + nf;
+	const int* prn = nbr + nf;
+
+	float y0, y1, y2, v0, v1, v2, f0, f1, f2, t0, t1, t2, d0, d1, d2;
+	int i, k, i0, i1, i2, k0, k1, k2, z;
+
+	// Clear the force and torque of frames.
+	f[k0 = gid] = 0.0f;
+	t[k0] = 0.0f;
+	for (i = 1, z = 3 * nf; i < z; ++i)
+	{
+		f[k0 += gds] = 0.0f;
+		t[k0] = 0.0f;
+	}
+	k = nf;
+	while (k)
+	{
+		--k;
+
+		// Load f, t and rotorY from memory into register
+		k0 = k * gd3 + gid;
+		k1 = k0 + gds;
+		k2 = k1 + gds;
+		f0 = f[k0];
+		f1 = f[k1];
+		f2 = f[k2];
+		t0 = t[k0];
+		t1 = t[k1];
+		t2 = t[k2];
+		y0 = c[i0  = beg[k] * gd3 + gid];
+		y1 = c[i0 += gds];
+		y2 = c[i0 += gds];
+
+		// Aggregate frame atoms.
+		for (i = beg[k], z = end[k]; i < z; ++i)
+		{
+			i0 = i * gd3 + gid;
+			i1 = i0 + gds;
+			i2 = i1 + gds;
+			d0 = d[i0];
+			d1 = d[i1];
+			d2 = d[i2];
+
+			// The derivatives with respect to the position, orientation, and torsions
+			// would be the negative total force acting on the ligand,
+			// the negative total torque, and the negative torque projections, respectively,
+			// where the projections refer to the torque applied to the branch moved by the torsion,
+			// projected on its rotation axi
+			f0 += d0;
+			f1 += d1;
+			f2 += d2;
+			if (i == beg[k]) continue;
+
+			v0 = c[i0] - y0;
+			v1 = c[i1] - y1;
+			v2 = c[i2] - y2;
+			t0 += v1 * d2 - v2 * d1;
+			t1 += v2 * d0 - v0 * d2;
+			t2 += v0 * d1 - v1 * d0;
+		}
+
+		if (k)
+		{
+			// Save the aggregated torque of active BRANCH frames to g.
+			if (act[k])
+			{
+				g[w -= gds] = t0 * a[k0] + t1 * a[k1] + t2 * a[k2]; // dot product
+			}
+
+			// Aggregate the force and torque of current frame to its parent frame.
+			k0 = prn[k] * gd3 + gid;
+			k1 = k0 + gds;
+			k2 = k1 + gds;
+			f[k0] += f0;
+			f[k1] += f1;
+			f[k2] += f2;
+			v0 = y0 - c[i0  = beg[prn[k]] * gd3 + gid];
+			v1 = y1 - c[i0 += gds];
+			v2 = y2 - c[i0 += gds];
+			t[k0] += t0 + v1 * f2 - v2 * f1;
+			t[k1] += t1 + v2 * f0 - v0 * f2;
+			t[k2] += t2 + v0 * f1 - v1 * f0;
+		}
+	}
+	assert(w == 6 * gds + gid);
+
+	// Save the aggregated force and torque of ROOT frame to g.
+	g[i0  = gid] = f0;
+	g[i0 += gds] = f1;
+	g[i0 += gds] = f2;
+	g[i0 += gds] = t0;
+	g[i0 += gds] = t1;
+	g[i0 += gds] = t2;
+}
+
 __device__  __noinline__// __forceinline__
-bool evaluate(float* e, float* g, float* a, float* q, float* c, float* d, float* f, float* t, const float* x, const int nf, const int na, const int np, const float eub)
+bool evaluate(float* e, float* g, float* a, float* q, float* c, float* d, float* f, float* t, float* n, const float* x, const int nf, const int na, const int np, const float eub, const int gid, const int gds)
 {
-	const int gid = blockIdx.x * blockDim.x + threadIdx.x;
-	const int gds = blockDim.x * gridDim.x;
 	const int gd3 = 3 * gds;
 	const int gd4 = 4 * gds;
 
@@ -49,10 +283,9 @@ bool evaluate(float* e, float* g, float* a, float* q, float* c, float* d, float*
 	const int* ip1 = ip0 + np;
 	const int* ipp = ip1 + np;
 
-	float y, y0, y1, y2, v0, v1, v2, c0, c1, c2, e000, e100, e010, e001, a0, a1, a2, ang, sng, r0, r1, r2, r3, vs, dr, f0, f1, f2, t0, t1, t2, d0, d1, d2;
+	float y, h, y0, y1, y2, v0, v1, v2, c0, c1, c2, a0, a1, a2, ang, sng, r0, r1, r2, r3, vs, dr, d0, d1, d2;
 	float q0, q1, q2, q3, q00, q01, q02, q03, q11, q12, q13, q22, q23, q33, m0, m1, m2, m3, m4, m5, m6, m7, m8;
 	int i, j, k, b, w, i0, i1, i2, k0, k1, k2, z;
-	const float* map;
 
 	// Apply position, orientation and torsions.
 	c[i  = gid] = x[k  = gid];
@@ -129,35 +362,8 @@ bool evaluate(float* e, float* g, float* a, float* q, float* c, float* d, float*
 				c[i2] = c2;
 			}
 
-			// Penalize out-of-box case.
-			if (c0 < cr0.x || cr1.x <= c0 || c1 < cr0.y || cr1.y <= c1 || c2 < cr0.z || cr1.z <= c2)
-			{
-				y += 10.0f;
-				d[i0] = 0.0f;
-				d[i1] = 0.0f;
-				d[i2] = 0.0f;
-				continue;
-			}
-
-			// Find the index of the current coordinate
-			k0 = static_cast<int>((c0 - cr0.x) * gri);
-			k1 = static_cast<int>((c1 - cr0.y) * gri);
-			k2 = static_cast<int>((c2 - cr0.z) * gri);
-			assert(k0 + 1 < npr.x);
-			assert(k1 + 1 < npr.y);
-			assert(k2 + 1 < npr.z);
-			k0 = npr.x * (npr.y * k2 + k1) + k0;
-
-			// Retrieve the grid map and lookup the value
-			 map = mps[xst[i]];
-			e000 = map[k0];
-			e100 = map[k0 + 1];
-			e010 = map[k0 + npr.x];
-			e001 = map[k0 + npr.x * npr.y];
-			y += e000;
-			d[i0] = (e100 - e000) * gri;
-			d[i1] = (e010 - e000) * gri;
-			d[i2] = (e001 - e000) * gri;
+			// Look up the grid map, keeping the inter-ligand derivatives in n too.
+			y += lookup(d, n, i0, gds, xst[i], c0, c1, c2);
 		}
 		for (j = 0, z = nbr[k]; j < z; ++j)
 		{
@@ -205,7 +411,8 @@ bool evaluate(float* e, float* g, float* a, float* q, float* c, float* d, float*
 //	assert(w == nv * gds + gid);
 	assert(k == nf);
 
-	// Calculate intra-ligand free energy.
+	// Calculate intra-ligand free energy, interpolating lookups of the scoring function if sfi is nonzero.
+	h = y;
 	for (i = 0; i < np; ++i)
 	{
 		i0 = ip0[i] * gd3 + gid;
@@ -220,9 +427,19 @@ bool evaluate(float* e, float* g, float* a, float* q, float* c, float* d, float*
 		vs = v0*v0 + v1*v1 + v2*v2;
 		if (vs < 64.0f)
 		{
-			j = ipp[i] + static_cast<int>(sfs * vs);
-			y += sfe[j];
-			dr = sfd[j];
+			vs *= sfs;
+			j = ipp[i] + static_cast<int>(vs);
+			if (sfi)
+			{
+				vs -= static_cast<int>(vs);
+				y += sfe[j] + (sfe[j + 1] - sfe[j]) * vs;
+				dr = sfd[j] + (sfd[j + 1] - sfd[j]) * vs;
+			}
+			else
+			{
+				y += sfe[j];
+				dr = sfd[j];
+			}
 			d0 = dr * v0;
 			d1 = dr * v1;
 			d2 = dr * v2;
@@ -235,6 +452,9 @@ bool evaluate(float* e, float* g, float* a, float* q, float* c, float* d, float*
 		}
 	}
 
+	// Store the intra-ligand free energy into n, by which translations of this conformation are evaluated.
+	n[na * gd3 + gid] = y - h;
+
 	// If the free energy is no better than the upper bound, refuse this conformation.
 	if (y >= eub) return false;
 
@@ -242,102 +462,78 @@ bool evaluate(float* e, float* g, float* a, float* q, float* c, float* d, float*
 	e[gid] = y;
 
 	// Calculate and aggregate the force and torque of BRANCH frames to their parent frame.
-	f[k0 = gid] = 0.0f;
-	t[k0] = 0.0f;
-	for (i = 1, z = 3 * nf; i < z; ++i)
-	{
-		f[k0 += gds] = 0.0f;
-		t[k0] = 0.0f;
-	}
-//	assert(w == nv * gds + gid);
-	assert(k == nf);
-	while (k)
-	{
-		--k;
-
-		// Load f, t and rotorY from memory into register
-		k0 = k * gd3 + gid;
-		k1 = k0 + gds;
-		k2 = k1 + gds;
-		f0 = f[k0];
-		f1 = f[k1];
-		f2 = f[k2];
-		t0 = t[k0];
-		t1 = t[k1];
-		t2 = t[k2];
-		y0 = c[i0  = beg[k] * gd3 + gid];
-		y1 = c[i0 += gds];
-		y2 = c[i0 += gds];
+	aggregate(g, a, c, d, f, t, nf, w, gid, gds);
+	return true;
+}
 
-		// Aggregate frame atoms.
-		for (i = beg[k], z = end[k]; i < z; ++i)
-		{
-			i0 = i * gd3 + gid;
-			i1 = i0 + gds;
-			i2 = i1 + gds;
-			d0 = d[i0];
-			d1 = d[i1];
-			d2 = d[i2];
+// Evaluates conformation x, a translation of conformation r such as a mutation of s0x, whose frame axes, coordinates, derivatives, n and variables are ra, rc, rd, rn and rx. Only the grid maps are looked up at the shifted coordinates of r, because translations leave the intra-ligand free energy and derivatives of r unchanged.
+__device__  __noinline__
+bool translate(float* e, float* g, float* a, float* c, float* d, float* f, float* t, float* n, const float* x, const float* ra, const float* rc, const float* rd, const float* rn, const float* rx, const int nv, const int nf, const int na, const float eub, const int gid, const int gds)
+{
+	const int gd3 = 3 * gds;
 
-			// The derivatives with respect to the position, orientation, and torsions
-			// would be the negative total force acting on the ligand,
-			// the negative total torque, and the negative torque projections, respectively,
-			// where the projections refer to the torque applied to the branch moved by the torsion,
-			// projected on its rotation axi
-			f0 += d0;
-			f1 += d1;
-			f2 += d2;
-			if (i == beg[k]) continue;
+	const int* xst = shared + 12 * nf - 1 + 3 * na; // Skip the frames, branches and frame coordinates laid out before the XScore types as in evaluate.
 
-			v0 = c[i0] - y0;
-			v1 = c[i1] - y1;
-			v2 = c[i2] - y2;
-			t0 += v1 * d2 - v2 * d1;
-			t1 += v2 * d0 - v0 * d2;
-			t2 += v0 * d1 - v1 * d0;
-		}
+	float y, v0, v1, v2, c0, c1, c2;
+	int i, i0, i1, i2, z;
 
-		if (k)
-		{
-			// Save the aggregated torque of active BRANCH frames to g.
-			if (act[k])
-			{
-				g[w -= gds] = t0 * a[k0] + t1 * a[k1] + t2 * a[k2]; // dot product
-			}
+	// Shift the coordinates of r, look up the grid maps at them, and add the intra-ligand derivatives of r, i.e. its derivatives less its inter-ligand ones.
+	i0 = gid;
+	i1 = i0 + gds;
+	i2 = i1 + gds;
+	v0 = x[i0] - rx[i0];
+	v1 = x[i1] - rx[i1];
+	v2 = x[i2] - rx[i2];
+	y = 0.0f;
+	for (i = 0; i < na; ++i)
+	{
+		i0 = i * gd3 + gid;
+		i1 = i0 + gds;
+		i2 = i1 + gds;
+		c[i0] = c0 = rc[i0] + v0;
+		c[i1] = c1 = rc[i1] + v1;
+		c[i2] = c2 = rc[i2] + v2;
+		y += lookup(d, n, i0, gds, xst[i], c0, c1, c2);
+		d[i0] += rd[i0] - rn[i0];
+		d[i1] += rd[i1] - rn[i1];
+		d[i2] += rd[i2] - rn[i2];
+	}
 
-			// Aggregate the force and torque of current frame to its parent frame.
-			k0 = prn[k] * gd3 + gid;
-			k1 = k0 + gds;
-			k2 = k1 + gds;
-			f[k0] += f0;
-			f[k1] += f1;
-			f[k2] += f2;
-			v0 = y0 - c[i0  = beg[prn[k]] * gd3 + gid];
-			v1 = y1 - c[i0 += gds];
-			v2 = y2 - c[i0 += gds];
-			t[k0] += t0 + v1 * f2 - v2 * f1;
-			t[k1] += t1 + v2 * f0 - v0 * f2;
-			t[k2] += t2 + v0 * f1 - v1 * f0;
-		}
+	// Add the intra-ligand free energy of r, and copy its frame axes.
+	i0 = na * gd3 + gid;
+	y += n[i0] = rn[i0];
+	for (i0 = gid, z = nf * gd3; i0 < z; i0 += gds)
+	{
+		a[i0] = ra[i0];
 	}
-	assert(w == 6 * gds + gid);
 
-	// Save the aggregated force and torque of ROOT frame to g.
-	g[i0  = gid] = f0;
-	g[i0 += gds] = f1;
-	g[i0 += gds] = f2;
-	g[i0 += gds] = t0;
-	g[i0 += gds] = t1;
-	g[i0 += gds] = t2;
+	// If the free energy is no better than the upper bound, refuse this conformation.
+	if (y >= eub) return false;
+
+	// Store e from register into memory.
+	e[gid] = y;
+
+	// Calculate and aggregate the force and torque of BRANCH frames to their parent frame.
+	aggregate(g, a, c, d, f, t, nf, nv * gds + gid, gid, gds);
 	return true;
 }
 
 extern "C" __global__
 //__launch_bounds__(maxThreadsPerBlock, minBlocksPerMultiprocessor)
-void monte_carlo(const int nv, const int nf, const int na, const int np)
+void monte_carlo(const int nl, const int* const __restrict__ bat, float* const __restrict__ sln)
 {
-	const int gid = blockIdx.x * blockDim.x + threadIdx.x;
-	const int gds = blockDim.x * gridDim.x;
+	// Locate the descriptor of the ligand of the current block, whose tasks span gridDim.x / nl consecutive blocks.
+	const int bpl = gridDim.x / nl;
+	const int* const dsc = bat + 8 * (blockIdx.x / bpl);
+	const int nv = dsc[0];
+	const int nf = dsc[1];
+	const int na = dsc[2];
+	const int np = dsc[3];
+	const int* const lig = bat + dsc[4];
+	float* const s0e = sln + (unsigned int)dsc[5];
+	const unsigned long long lid = (unsigned int)dsc[6] | (unsigned long long)(unsigned int)dsc[7] << 32;
+	const int gid = (blockIdx.x % bpl) * blockDim.x + threadIdx.x;
+	const int gds = bpl * blockDim.x;
 	const int nls = 5; // Number of line search trials for determining step size in BFGS
 	const float eub = 40.0f * na; // A conformation will be droped if its free energy is not better than e_upper_bound.
 	float* s0x = s0e + gds;
@@ -348,7 +544,8 @@ void monte_carlo(const int nv, const int nf, const int na, const int np)
 	float* s0d = s0c + 3 * na * gds;
 	float* s0f = s0d + 3 * na * gds;
 	float* s0t = s0f + 3 * nf * gds;
-	float* s1e = s0t + 3 * nf * gds;
+	float* s0n = s0t + 3 * nf * gds;
+	float* s1e = s0n + (3 * na + 1) * gds;
 	float* s1x = s1e + gds;
 	float* s1g = s1x + (nv + 1) * gds;
 	float* s1a = s1g + nv * gds;
@@ -357,7 +554,8 @@ void monte_carlo(const int nv, const int nf, const int na, const int np)
 	float* s1d = s1c + 3 * na * gds;
 	float* s1f = s1d + 3 * na * gds;
 	float* s1t = s1f + 3 * nf * gds;
-	float* s2e = s1t + 3 * nf * gds;
+	float* s1n = s1t + 3 * nf * gds;
+	float* s2e = s1n + (3 * na + 1) * gds;
 	float* s2x = s2e + gds;
 	float* s2g = s2x + (nv + 1) * gds;
 	float* s2a = s2g + nv * gds;
@@ -366,7 +564,8 @@ void monte_carlo(const int nv, const int nf, const int na, const int np)
 	float* s2d = s2c + 3 * na * gds;
 	float* s2f = s2d + 3 * na * gds;
 	float* s2t = s2f + 3 * nf * gds;
-	float* bfh = s2t + 3 * nf * gds;
+	float* s2n = s2t + 3 * nf * gds;
+	float* bfh = s2n + (3 * na + 1) * gds;
 	float* bfp = bfh + (nv*(nv+1)>>1) * gds;
 	float* bfy = bfp + nv * gds;
 	float* bfm = bfy + nv * gds;
@@ -374,7 +573,7 @@ void monte_carlo(const int nv, const int nf, const int na, const int np)
 	float sum, pg1, pga, pgc, alp, pg2, pr0, pr1, pr2, nrm, ang, sng, pq0, pq1, pq2, pq3, s1xq0, s1xq1, s1xq2, s1xq3, s2xq0, s2xq1, s2xq2, s2xq3, bpi;
 	float yhy, yps, ryp, pco, bpj, bmj, ppj;
 	int g, i, j, o0, o1, o2;
-	curandState crs;
+	philox_state crs;
 
 	// Load ligand into external shared memory.
 	g = 11 * nf + nf - 1 + 4 * na + 3 * np;
@@ -391,17 +590,17 @@ void monte_carlo(const int nv, const int nf, const int na, const int np)
 	__syncthreads();
 
 	// Randomize s0x.
-	curand_init(sed, gid, 0, &crs);
-	rd0 = curand_uniform(&crs);
+	philox_init(&crs, lid, gid);
+	rd0 = philox_uniform(&crs);
 	s0x[o0  = gid] = rd0 * cr1.x + (1 - rd0) * cr0.x;
-	rd0 = curand_uniform(&crs);
+	rd0 = philox_uniform(&crs);
 	s0x[o0 += gds] = rd0 * cr1.y + (1 - rd0) * cr0.y;
-	rd0 = curand_uniform(&crs);
+	rd0 = philox_uniform(&crs);
 	s0x[o0 += gds] = rd0 * cr1.z + (1 - rd0) * cr0.z;
-	rd0 = curand_uniform(&crs);
-	rd1 = curand_uniform(&crs);
-	rd2 = curand_uniform(&crs);
-	rd3 = curand_uniform(&crs);
+	rd0 = philox_uniform(&crs);
+	rd1 = philox_uniform(&crs);
+	rd2 = philox_uniform(&crs);
+	rd3 = philox_uniform(&crs);
 	rst = rsqrtf(rd0*rd0 + rd1*rd1 + rd2*rd2 + rd3*rd3);
 	s0x[o0 += gds] = rd0 * rst;
 	s0x[o0 += gds] = rd1 * rst;
@@ -409,7 +608,7 @@ void monte_carlo(const int nv, const int nf, const int na, const int np)
 	s0x[o0 += gds] = rd3 * rst;
 	for (i = 6; i < nv; ++i)
 	{
-		s0x[o0 += gds] = curand_uniform(&crs);
+		s0x[o0 += gds] = philox_uniform(&crs);
 	}
 /*
 	s0x[o0  = gid] =  49.799f;
@@ -424,22 +623,22 @@ void monte_carlo(const int nv, const int nf, const int na, const int np)
 		s0x[o0 += gds] = 0.0f;
 	}
 */
-	evaluate(s0e, s0g, s0a, s0q, s0c, s0d, s0f, s0t, s0x, nf, na, np, eub);
+	evaluate(s0e, s0g, s0a, s0q, s0c, s0d, s0f, s0t, s0n, s0x, nf, na, np, eub, gid, gds);
 
 	// Mutate s0x into s1x
 	o0  = gid;
-	s1x[o0] = s0x[o0] + curand_uniform(&crs);
+	s1x[o0] = s0x[o0] + philox_uniform(&crs);
 	o0 += gds;
-	s1x[o0] = s0x[o0] + curand_uniform(&crs);
+	s1x[o0] = s0x[o0] + philox_uniform(&crs);
 	o0 += gds;
-	s1x[o0] = s0x[o0] + curand_uniform(&crs);
+	s1x[o0] = s0x[o0] + philox_uniform(&crs);
 //	for (i = 3; i < nv + 1; ++i)
 	for (i = 2 - nv; i < 0; ++i)
 	{
 		o0 += gds;
 		s1x[o0] = s0x[o0];
 	}
-	evaluate(s1e, s1g, s1a, s1q, s1c, s1d, s1f, s1t, s1x, nf, na, np, eub);
+	translate(s1e, s1g, s1a, s1c, s1d, s1f, s1t, s1n, s1x, s0a, s0c, s0d, s0n, s0x, nv, nf, na, eub, gid, gds);
 
 	// Initialize the inverse Hessian matrix to identity matrix.
 	// An easier option that works fine in practice is to use a scalar multiple of the identity matrix,
@@ -521,7 +720,7 @@ void monte_carlo(const int nv, const int nf, const int na, const int np)
 //			pq0 = cosf(ang);
 			sincosf(ang, &sng, &pq0);
 //			sincospif(ang, &sng, &pq0);
-			sng /= nrm;
+			sng = nrm > 0.0f ? sng / nrm : 0.0f; // Keep the orientation under zero torque, e.g. of a ligand out of the box, whose intra-ligand forces exert none.
 			pq1 = sng * pr0;
 			pq2 = sng * pr1;
 			pq3 = sng * pr2;
@@ -545,7 +744,7 @@ void monte_carlo(const int nv, const int nf, const int na, const int np)
 			// Evaluate x2, subject to Wolfe conditions http://en.wikipedia.org/wiki/Wolfe_conditions
 			// 1) Armijo rule ensures that the step length alpha decreases f sufficiently.
 			// 2) The curvature condition ensures that the slope has been reduced sufficiently.
-			if (evaluate(s2e, s2g, s2a, s2q, s2c, s2d, s2f, s2t, s2x, nf, na, np, s1e[gid] + alp * pga))
+			if (evaluate(s2e, s2g, s2a, s2q, s2c, s2d, s2f, s2t, s2n, s2x, nf, na, np, s1e[gid] + alp * pga, gid, gds))
 			{
 				o0 = gid;
 				pg2 = bfp[o0] * s2g[o0];
@@ -563,33 +762,29 @@ void monte_carlo(const int nv, const int nf, const int na, const int np)
 		// If no appropriate alpha can be found, restart the BFGS loop.
 		if (j == nls)
 		{
-			// Accept x1 according to Metropolis criteria.
+			// Accept x1 according to Metropolis criteria, along with the frame axes, coordinates, derivatives and n by which the next mutation is translated.
 			if (s1e[gid] < s0e[gid])
 			{
-				o0 = gid;
-				s0e[o0] = s1e[o0];
-//				for (i = 1; i < nv + 2; ++i)
-				for (i = -1 - nv; i < 0; ++i)
+				for (o0 = gid; o0 < s1e - s0e; o0 += gds)
 				{
-					o0 += gds;
 					s0e[o0] = s1e[o0];
 				}
 			}
 
 			// Mutate s0x into s1x
 			o0  = gid;
-			s1x[o0] = s0x[o0] + curand_uniform(&crs);
+			s1x[o0] = s0x[o0] + philox_uniform(&crs);
 			o0 += gds;
-			s1x[o0] = s0x[o0] + curand_uniform(&crs);
+			s1x[o0] = s0x[o0] + philox_uniform(&crs);
 			o0 += gds;
-			s1x[o0] = s0x[o0] + curand_uniform(&crs);
+			s1x[o0] = s0x[o0] + philox_uniform(&crs);
 //			for (i = 3; i < nv + 1; ++i)
 			for (i = 2 - nv; i < 0; ++i)
 			{
 				o0 += gds;
 				s1x[o0] = s0x[o0];
 			}
-			evaluate(s1e, s1g, s1a, s1q, s1c, s1d, s1f, s1t, s1x, nf, na, np, eub);
+			translate(s1e, s1g, s1a, s1c, s1d, s1f, s1t, s1n, s1x, s0a, s0c, s0d, s0n, s0x, nv, nf, na, eub, gid, gds);
 
 			// Initialize the inverse Hessian matrix to identity matrix.
 			bfh[o0 = gid] = 1.0f;
@@ -667,13 +862,9 @@ void monte_carlo(const int nv, const int nf, const int na, const int np)
 				o2 += gds;
 			}
 
-			// Move to the next iteration, i.e. e1 = e2, x1 = x2, g1 = g2.
-			o0 = gid;
-			s1e[o0] = s2e[o0];
-//			for (i = 1; i < 2 * (nv + 1); ++i)
-			for (i = -1 - 2 * nv; i < 0; ++i)
+			// Move to the next iteration, i.e. e1 = e2, x1 = x2, g1 = g2, along with the frame axes, coordinates, derivatives and n by which a mutation of x1 is translated once Metropolis accepts it.
+			for (o0 = gid; o0 < s2e - s1e; o0 += gds)
 			{
-				o0 += gds;
 				s1e[o0] = s2e[o0];
 			}
 		}
@@ -692,3 +883,275 @@ void monte_carlo(const int nv, const int nf, const int na, const int np)
 		}
 	}
 }
+
+// Populates the probes of a dense float32 grid map of XScore type t, one thread per probe along X, one block row per Y row and one block layer per plane along Z. Each probe sums the scoring function between it and the atoms near its tile of Y rows, listed in tla from tlo in ascending order as receptor::populate visits them, so that the values match those of the host up to the rounding of the distances. The type pairs of t with the receptor types must have been uploaded to sfe.
+extern "C" __global__
+void populate(float* const __restrict__ map, const int t, const float gr, const int nr, const int tile, const float4* const __restrict__ atm, const int* const __restrict__ tlo, const int* const __restrict__ tla)
+{
+	const int x = blockIdx.x * blockDim.x + threadIdx.x;
+	if (x >= npr.x) return;
+	const int y = blockIdx.y;
+	const int z = blockIdx.z;
+	const float px = cr0.x + gr * x;
+	const float py = cr0.y + gr * y;
+	const float pz = cr0.z + gr * z;
+	const int b = z * ((npr.y + tile - 1) / tile) + y / tile;
+	float e = 0.0f;
+	for (int i = tlo[b]; i < tlo[b + 1]; ++i)
+	{
+		const float4 a = atm[tla[i]];
+		const float dx = px - a.x;
+		const float dy = py - a.y;
+		const float dz = pz - a.z;
+		float vs = dx*dx + dy*dy + dz*dz;
+		if (vs >= 64.0f) continue;
+		const int t0 = (int)a.w;
+		const int j = nr * (t0 <= t ? (t*(t+1)>>1) + t0 : (t0*(t0+1)>>1) + t) + (int)(vs *= sfs);
+		if (sfi)
+		{
+			vs -= (int)vs;
+			e += sfe[j] + (sfe[j + 1] - sfe[j]) * vs;
+		}
+		else
+		{
+			e += sfe[j];
+		}
+	}
+	map[(z * npr.y + y) * npr.x + x] = e;
+}
+
+
+// Places the heavy atoms of conformation x into c and the orientations of its frames into q by the same arithmetic as evaluate, without scoring it.
+__device__  __noinline__
+void place(float* q, float* c, const float* x, const int nf, const int na, const int gid, const int gds)
+{
+	const int gd3 = 3 * gds;
+	const int gd4 = 4 * gds;
+
+	const int* act = shared;
+	const int* beg = act + nf;
+	const int* end = beg + nf;
+	const int* nbr = end + nf;
+	const int* prn = nbr + nf;
+	const float* yy0 = (float*)(prn + nf);
+	const float* yy1 = yy0 + nf;
+	const float* yy2 = yy1 + nf;
+	const float* xy0 = yy2 + nf;
+	const float* xy1 = xy0 + nf;
+	const float* xy2 = xy1 + nf;
+	const int* brs = (int*)(xy2 + nf);
+	const float* co0 = (float*)(brs + nf - 1);
+	const float* co1 = co0 + na;
+	const float* co2 = co1 + na;
+
+	float y0, y1, y2, v0, v1, v2, a0, a1, a2, ang, sng, r0, r1, r2, r3;
+	float q0, q1, q2, q3, q00, q01, q02, q03, q11, q12, q13, q22, q23, q33, m0, m1, m2, m3, m4, m5, m6, m7, m8;
+	int i, j, k, b, w, i0, k0, z;
+
+	// Apply position, orientation and torsions.
+	c[i  = gid] = x[k  = gid];
+	c[i += gds] = x[k += gds];
+	c[i += gds] = x[k += gds];
+	q[i  = gid] = x[k += gds];
+	q[i += gds] = x[k += gds];
+	q[i += gds] = x[k += gds];
+	q[i += gds] = x[k += gds];
+	for (k = 0, b = 0, w = 6 * gds + gid; k < nf; ++k)
+	{
+		// Load rotorY from memory into registers.
+		y0 = c[i0  = beg[k] * gd3 + gid];
+		y1 = c[i0 += gds];
+		y2 = c[i0 += gds];
+
+		// Translate orientation of active frames from quaternion into 3x3 matrix.
+		if (act[k])
+		{
+			q0 = q[k0  = k * gd4 + gid];
+			q1 = q[k0 += gds];
+			q2 = q[k0 += gds];
+			q3 = q[k0 += gds];
+			q00 = q0 * q0;
+			q01 = q0 * q1;
+			q02 = q0 * q2;
+			q03 = q0 * q3;
+			q11 = q1 * q1;
+			q12 = q1 * q2;
+			q13 = q1 * q3;
+			q22 = q2 * q2;
+			q23 = q2 * q3;
+			q33 = q3 * q3;
+			m0 = q00 + q11 - q22 - q33;
+			m1 = 2 * (q12 - q03);
+			m2 = 2 * (q02 + q13);
+			m3 = 2 * (q03 + q12);
+			m4 = q00 - q11 + q22 - q33;
+			m5 = 2 * (q23 - q01);
+			m6 = 2 * (q13 - q02);
+			m7 = 2 * (q01 + q23);
+			m8 = q00 - q11 - q22 + q33;
+		}
+
+		// Calculate the coordinates of the frame atoms other than its rotor Y.
+		for (i = beg[k] + 1, z = end[k]; i < z; ++i)
+		{
+			i0 = i * gd3 + gid;
+			v0 = co0[i];
+			v1 = co1[i];
+			v2 = co2[i];
+			c[i0] = y0 + m0 * v0 + m1 * v1 + m2 * v2;
+			c[i0 += gds] = y1 + m3 * v0 + m4 * v1 + m5 * v2;
+			c[i0 += gds] = y2 + m6 * v0 + m7 * v1 + m8 * v2;
+		}
+		for (j = 0, z = nbr[k]; j < z; ++j)
+		{
+			i = brs[b++];
+			i0 = beg[i] * gd3 + gid;
+			c[i0] = y0 + m0 * yy0[i] + m1 * yy1[i] + m2 * yy2[i];
+			c[i0 += gds] = y1 + m3 * yy0[i] + m4 * yy1[i] + m5 * yy2[i];
+			c[i0 += gds] = y2 + m6 * yy0[i] + m7 * yy1[i] + m8 * yy2[i];
+
+			// Skip inactive BRANCH frame
+			if (!act[i]) continue;
+
+			// Update q of BRANCH frame
+			a0 = m0 * xy0[i] + m1 * xy1[i] + m2 * xy2[i];
+			a1 = m3 * xy0[i] + m4 * xy1[i] + m5 * xy2[i];
+			a2 = m6 * xy0[i] + m7 * xy1[i] + m8 * xy2[i];
+			ang = x[w += gds] * 0.5f;
+			sincosf(ang, &sng, &r0);
+			r1 = sng * a0;
+			r2 = sng * a1;
+			r3 = sng * a2;
+			q[k0  = i * gd4 + gid] = r0 * q0 - r1 * q1 - r2 * q2 - r3 * q3;
+			q[k0 += gds] = r0 * q1 + r1 * q0 + r2 * q3 - r3 * q2;
+			q[k0 += gds] = r0 * q2 - r1 * q3 + r2 * q0 + r3 * q1;
+			q[k0 += gds] = r0 * q3 + r1 * q2 - r2 * q1 + r3 * q0;
+		}
+	}
+}
+
+// Ranks the nt tasks of each ligand by free energy and deduplicates their conformations, one block per ligand, and writes nc candidate conformations of each ligand to cnf, of stride nc and with the ligands consecutive. The candidates are the representatives of clusters of RMSD 2.0 visited in ascending order of free energy, ties broken by task index, as ligand::cluster finds them, followed by the other conformations in the same order should there be fewer than nc representatives. Clustering the candidates on the host therefore finds the clusters of all the tasks up to the rounding of the coordinates. The placements and centroids of the tasks are held in the second solution of monte_carlo, and the external shared memory holds the largest ligand followed by nt + 2 * nc ints.
+extern "C" __global__
+void rank(const int nt, const int nc, const int* const __restrict__ bat, float* const __restrict__ sln, float* const __restrict__ cnf)
+{
+	__shared__ int nk, sim;
+	const int* const dsc = bat + 8 * blockIdx.x;
+	const int nv = dsc[0];
+	const int nf = dsc[1];
+	const int na = dsc[2];
+	const int np = dsc[3];
+	const int* const lig = bat + dsc[4];
+	const float* const s0e = sln + (unsigned int)dsc[5];
+	const int gds = ((nt - 1) / 32 + 1) * 32;
+	const float* const s0x = s0e + gds;
+	float* const s1e = sln + (unsigned int)dsc[5] + (1 + nv + 1 + nv + 3 * nf + 4 * nf + 3 * na + 3 * na + 3 * nf + 3 * nf + 3 * na + 1) * gds;
+	float* const s1o = s1e + (nv + 2) * gds;
+	float* const s1q = s1o + (nv + 3 * nf) * gds;
+	float* const s1c = s1q + 4 * nf * gds;
+	const int g = 11 * nf + nf - 1 + 4 * na + 3 * np;
+	int* const srt = shared + g;
+	int* const kpt = srt + nt;
+	int* const col = kpt + nc;
+	const float sdt = 4.0f * na;
+	const float sct = 4.0f * 1.001f;
+	const float ina = 1.0f / na;
+	float e, o0, o1, o2, d0, d1, d2, sd;
+	int i, j, r, u, v, o;
+
+	// Load ligand into external shared memory.
+	for (i = threadIdx.x; i < g; i += blockDim.x)
+	{
+		shared[i] = lig[i];
+	}
+	__syncthreads();
+
+	// Place the conformation of each task, and find its centroid.
+	for (u = threadIdx.x; u < nt; u += blockDim.x)
+	{
+		place(s1q, s1c, s0x, nf, na, u, gds);
+		o0 = o1 = o2 = 0.0f;
+		for (i = 0, o = u; i < na; ++i)
+		{
+			o0 += s1c[o];
+			o1 += s1c[o += gds];
+			o2 += s1c[o += gds];
+			o += gds;
+		}
+		s1o[u] = ina * o0;
+		s1o[u + gds] = ina * o1;
+		s1o[u + 2 * gds] = ina * o2;
+	}
+
+	// Rank the tasks in ascending order of free energy.
+	for (u = threadIdx.x; u < nt; u += blockDim.x)
+	{
+		e = s0e[u];
+		for (v = 0, r = 0; v < nt; ++v)
+		{
+			r += s0e[v] < e || (s0e[v] == e && v < u);
+		}
+		srt[r] = u;
+	}
+	if (!threadIdx.x) nk = 0;
+	__syncthreads();
+
+	// Check in order if each task forms a new cluster, comparing it with the representatives in parallel. Representatives are marked by complementing their entries.
+	for (r = 0; r < nt && nk < nc; ++r)
+	{
+		u = srt[r];
+		if (!threadIdx.x) sim = 0;
+		__syncthreads();
+		for (j = threadIdx.x; j < nk; j += blockDim.x)
+		{
+			v = kpt[j];
+			d0 = s1o[u] - s1o[v];
+			d1 = s1o[u + gds] - s1o[v + gds];
+			d2 = s1o[u + 2 * gds] - s1o[v + 2 * gds];
+			if (d0 * d0 + d1 * d1 + d2 * d2 >= sct) continue;
+			for (i = 0, o = 0, sd = 0.0f; i < na && sd < sdt; ++i, o += 3 * gds)
+			{
+				d0 = s1c[o + u] - s1c[o + v];
+				d1 = s1c[o + gds + u] - s1c[o + gds + v];
+				d2 = s1c[o + 2 * gds + u] - s1c[o + 2 * gds + v];
+				sd += d0 * d0 + d1 * d1 + d2 * d2;
+			}
+			if (sd < sdt) sim = 1;
+		}
+		__syncthreads();
+		if (!threadIdx.x && !sim)
+		{
+			kpt[nk++] = u;
+			srt[r] = ~u;
+		}
+		__syncthreads();
+	}
+
+	// Collect the representatives followed by the other tasks in order.
+	if (!threadIdx.x)
+	{
+		for (r = 0, j = 0; j < nk; ++r)
+		{
+			if (srt[r] < 0) col[j++] = ~srt[r];
+		}
+		for (r = 0; j < nc; ++r)
+		{
+			if (srt[r] >= 0) col[j++] = srt[r];
+		}
+	}
+	__syncthreads();
+
+	// Write the free energies and conformations of the candidates after those of the previous ligands.
+	for (i = 0, o = 0; i < blockIdx.x; ++i)
+	{
+		o += (bat[8 * i] + 2) * nc;
+	}
+	for (j = threadIdx.x; j < nc; j += blockDim.x)
+	{
+		u = col[j];
+		cnf[o + j] = s0e[u];
+		for (i = 0; i <= nv; ++i)
+		{
+			cnf[o + (1 + i) * nc + j] = s0x[i * gds + u];
+		}
+	}
+}
@@ -3,8 +3,17 @@
 #define IDOCK_KERNEL_HPP
 
 #include <array>
+#include <cstdint>
 using namespace std;
 
-void monte_carlo(float* const s0e, const int* const lig, const int nv, const int nf, const int na, const int np, const int seed, const int nbi, const float* const sfe, const float* const sfd, const int sfs, const array<float, 3> cr0, const array<float, 3> cr1, const array<int, 3> npr, const float gri, const vector<vector<float>>& mps, const int gid, const int gds);
+//! Number of Monte Carlo tasks that run in lockstep on the CPU, one per SIMD lane.
+const int num_lanes = 8;
+
+//! Largest number of variables for which the CPU kernel is specialized at compile time.
+const int max_specialized_nv = 16;
+
+//! Runs nt Monte Carlo tasks, L at a time in lockstep, where the local task t draws from the Philox stream of task tid + t of ligand lid under seed sed. The solution values of lane l lie at offset l with stride L in s0e, and the e and x of task t are written to cnf at offset t with stride cds. A positive V specializes the kernel for nvr == V, whereas V == 0 is the generic kernel for any nvr. The brick tables bts are null for dense grid maps, and the codes mqs of grid maps quantized at precision mpf are null for float32 maps, whose int16 scales and offsets lie in mqa. The first ncg generations of each task evaluate on the coarse grid maps cms of cnp probes at a granularity inverse of cgi instead, which share the corners of the box, are dense float32 and are interpolated trilinearly, and its s0x is evaluated again on the fine maps before the next generation. The coarse maps are never looked up if ncg is 0. If ctr is not null, the evaluations, BFGS iterations and rejected line search trials of the tasks are added to ctr[0], ctr[1] and ctr[2], in the order of profile_counter.
+template <int L, int V>
+void monte_carlo(float* const s0e, const int* const lig, const int nvr, const int nf, const int na, const int np, const uint64_t sed, const uint64_t lid, const int tid, const int nt, const int nbi, const float* const sfe, const float* const sfd, const int sfs, const bool sfi, const array<float, 3> cr0, const array<float, 3> cr1, const array<int, 3> npr, const float gri, const float* const* const mps, const int* const* const bts, const uint16_t* const* const mqs, const float* const mqa, const int mpf, const bool tri, const int ncg, const array<int, 3> cnp, const float cgi, const float* const* const cms, float* const cnf, const int cds, uint64_t* const ctr = nullptr);
 
 #endif
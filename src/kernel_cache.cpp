@@ -0,0 +1,91 @@
+#include <cstdio>
+#include <cstring>
+#include <boost/filesystem/operations.hpp>
+#include <boost/filesystem/fstream.hpp>
+#include "checksum.hpp"
+#include "kernel_cache.hpp"
+
+//! Signature of kernel binary files.
+static const char binary_magic[8] = { 'i', 'd', 'o', 'c', 'k', 'k', 'b', 0 };
+
+//! Returns the checksum of a binary, which detects truncated or corrupted files.
+static uint64_t binary_checksum(const vector<char>& bin)
+{
+	checksum c;
+	c(bin.data(), bin.size());
+	return c.value();
+}
+
+//! Represents the header of a kernel binary file, which is followed by the binary.
+class binary_header
+{
+public:
+	char magic[8]; //!< File signature.
+	uint64_t key; //!< Key of the binary.
+	uint64_t size; //!< Number of bytes of the binary.
+	uint64_t checksum; //!< Checksum of the binary.
+};
+
+kernel_cache::kernel_cache(const path& folder_path) : folder_path(folder_path)
+{
+	if (folder_path.empty()) return;
+	boost::system::error_code ec;
+	create_directories(folder_path, ec);
+}
+
+path kernel_cache::binary_path(const uint64_t key) const
+{
+	char filename[21];
+	snprintf(filename, sizeof(filename), "%016llx.bin", static_cast<unsigned long long>(key));
+	return folder_path / filename;
+}
+
+bool kernel_cache::load(const uint64_t key, vector<char>& bin) const
+{
+	if (folder_path.empty()) return false;
+	const path p = binary_path(key);
+	boost::system::error_code ec;
+	const uintmax_t file_size = boost::filesystem::file_size(p, ec);
+	if (ec || file_size < sizeof(binary_header)) return false;
+	boost::filesystem::ifstream ifs(p, ios::binary);
+	binary_header h;
+	if (!ifs.read(reinterpret_cast<char*>(&h), sizeof(h)) || memcmp(h.magic, binary_magic, sizeof(binary_magic)) || h.key != key || h.size != file_size - sizeof(h)) return false; // A size other than that of the rest of the file is a truncated or corrupted file, which is rebuilt.
+	bin.resize(h.size);
+	if (!ifs.read(bin.data(), bin.size()) || binary_checksum(bin) != h.checksum)
+	{
+		bin.clear();
+		return false;
+	}
+	return true;
+}
+
+bool kernel_cache::save(const uint64_t key, const vector<char>& bin) const
+{
+	if (folder_path.empty()) return false;
+	binary_header h;
+	memcpy(h.magic, binary_magic, sizeof(binary_magic));
+	h.key = key;
+	h.size = bin.size();
+	h.checksum = binary_checksum(bin);
+	const path p = binary_path(key);
+	const path tmp_path = p.parent_path() / unique_path(p.filename().string() + ".%%%%-%%%%-%%%%-%%%%");
+	boost::system::error_code ec;
+	{
+		boost::filesystem::ofstream ofs(tmp_path, ios::binary);
+		ofs.write(reinterpret_cast<const char*>(&h), sizeof(h));
+		ofs.write(bin.data(), bin.size());
+		if (!ofs)
+		{
+			ofs.close();
+			remove(tmp_path, ec);
+			return false;
+		}
+	}
+	rename(tmp_path, p, ec);
+	if (ec)
+	{
+		remove(tmp_path, ec);
+		return false;
+	}
+	return true;
+}
@@ -0,0 +1,29 @@
+#pragma once
+#ifndef IDOCK_KERNEL_CACHE_HPP
+#define IDOCK_KERNEL_CACHE_HPP
+
+#include <vector>
+#include <boost/filesystem/path.hpp>
+using namespace std;
+using namespace boost::filesystem;
+
+//! Represents a folder of compiled kernel binaries, i.e. cubins of idock_cu and program binaries of idock_cl, each keyed by a checksum of the device, the driver, the kernel source and the build options that produced it.
+class kernel_cache
+{
+public:
+	//! Constructs a cache of binaries in a folder, which is created if it does not exist. An empty path disables the cache.
+	explicit kernel_cache(const path& folder_path);
+
+	//! Loads the binary of a key, returning true if the cache has an intact binary of the key.
+	bool load(const uint64_t key, vector<char>& bin) const;
+
+	//! Saves the binary of a key atomically, so that concurrent jobs sharing the folder never read a partial binary, returning true on success.
+	bool save(const uint64_t key, const vector<char>& bin) const;
+private:
+	const path folder_path; //!< Folder of binaries.
+
+	//! Returns the path of the binary file of a key.
+	path binary_path(const uint64_t key) const;
+};
+
+#endif
@@ -0,0 +1,250 @@
+#pragma once
+#ifndef IDOCK_LANES_HPP
+#define IDOCK_LANES_HPP
+
+#include <cmath>
+#include <cstring>
+#include <cstdint>
+using namespace std;
+
+#if defined(__GNUC__)
+
+//! Represents a SIMD vector of L values of type T by the vector extension of GCC and Clang.
+template <typename T, int L>
+struct simd
+{
+	typedef T type __attribute__((vector_size(sizeof(T) * L)));
+};
+
+#else
+
+//! Represents a SIMD vector of L values of type T by a plain array, whose operations are loops for compilers to vectorize.
+template <typename T, int L>
+struct simd
+{
+	struct type
+	{
+		T e[L];
+		T  operator[](const int l) const { return e[l]; }
+		T& operator[](const int l)       { return e[l]; }
+	};
+};
+#endif
+
+//! Represents L values of type T, one per Monte Carlo task, which are operated on in lockstep as a SIMD vector.
+template <typename T, int L>
+class lanes
+{
+public:
+	typedef T value_type;
+	typedef typename simd<T, L>::type vector_type;
+	vector_type v;
+
+	//! Constructs lanes of indeterminate values.
+	lanes() {}
+
+	//! Broadcasts a scalar to all the lanes.
+	lanes(const T s)
+	{
+		for (int l = 0; l < L; ++l) v[l] = s;
+	}
+
+	//! Loads the lanes from L consecutive values.
+	explicit lanes(const T* const p)
+	{
+		memcpy(&v, p, sizeof(v));
+	}
+
+	//! Converts the lanes of another type by truncation for integers.
+	template <typename U>
+	explicit lanes(const lanes<U, L>& a)
+	{
+#if defined(__GNUC__)
+		v = __builtin_convertvector(a.v, vector_type);
+#else
+		for (int l = 0; l < L; ++l) v[l] = static_cast<T>(a.v[l]);
+#endif
+	}
+
+	//! Returns the value of a lane.
+	T operator[](const int l) const
+	{
+		return v[l];
+	}
+
+	//! Stores the lanes into L consecutive values.
+	void store(T* const p) const
+	{
+		memcpy(p, &v, sizeof(v));
+	}
+
+	//! Stores the lanes selected by a mask into L consecutive values, leaving the others untouched.
+	void store(T* const p, const lanes<bool, L>& m) const
+	{
+		select(m, *this, lanes(p)).store(p);
+	}
+};
+
+//! Represents L boolean masks, one per Monte Carlo task, as a SIMD vector of 32-bit integers that are either all ones or all zeros.
+template <int L>
+class lanes<bool, L>
+{
+public:
+	typedef typename simd<int32_t, L>::type vector_type;
+	vector_type v;
+
+	//! Constructs lanes of indeterminate values.
+	lanes() {}
+
+	//! Broadcasts a boolean to all the lanes.
+	lanes(const bool s)
+	{
+		for (int l = 0; l < L; ++l) v[l] = s ? -1 : 0;
+	}
+
+	//! Wraps a vector of masks.
+	explicit lanes(const vector_type m) : v(m) {}
+
+	//! Returns the value of a lane.
+	bool operator[](const int l) const
+	{
+		return v[l] != 0;
+	}
+};
+
+#if defined(__GNUC__)
+
+template <typename T, int L> inline lanes<T, L> operator-(const lanes<T, L>& a) { lanes<T, L> r; r.v = -a.v; return r; }
+template <typename T, int L> inline lanes<T, L> operator+(const lanes<T, L>& a, const lanes<T, L>& b) { lanes<T, L> r; r.v = a.v + b.v; return r; }
+template <typename T, int L> inline lanes<T, L> operator-(const lanes<T, L>& a, const lanes<T, L>& b) { lanes<T, L> r; r.v = a.v - b.v; return r; }
+template <typename T, int L> inline lanes<T, L> operator*(const lanes<T, L>& a, const lanes<T, L>& b) { lanes<T, L> r; r.v = a.v * b.v; return r; }
+template <typename T, int L> inline lanes<T, L> operator/(const lanes<T, L>& a, const lanes<T, L>& b) { lanes<T, L> r; r.v = a.v / b.v; return r; }
+template <typename T, int L> inline lanes<bool, L> operator< (const lanes<T, L>& a, const lanes<T, L>& b) { return lanes<bool, L>(a.v <  b.v); }
+template <typename T, int L> inline lanes<bool, L> operator<=(const lanes<T, L>& a, const lanes<T, L>& b) { return lanes<bool, L>(a.v <= b.v); }
+template <typename T, int L> inline lanes<bool, L> operator>=(const lanes<T, L>& a, const lanes<T, L>& b) { return lanes<bool, L>(a.v >= b.v); }
+template <int L> inline lanes<bool, L> operator&(const lanes<bool, L>& a, const lanes<bool, L>& b) { return lanes<bool, L>(a.v & b.v); }
+template <int L> inline lanes<bool, L> operator|(const lanes<bool, L>& a, const lanes<bool, L>& b) { return lanes<bool, L>(a.v | b.v); }
+template <int L> inline lanes<bool, L> operator!(const lanes<bool, L>& a) { return lanes<bool, L>(~a.v); }
+template <int L> inline lanes<int, L> operator>>(const lanes<int, L>& a, const int s) { lanes<int, L> r; r.v = a.v >> s; return r; }
+template <int L> inline lanes<int, L> operator&(const lanes<int, L>& a, const int b) { lanes<int, L> r; r.v = a.v & b; return r; }
+
+//! Returns the lanes of a where m is true and those of b otherwise.
+template <typename T, int L>
+inline lanes<T, L> select(const lanes<bool, L>& m, const lanes<T, L>& a, const lanes<T, L>& b)
+{
+	lanes<T, L> r;
+	r.v = m.v ? a.v : b.v;
+	return r;
+}
+
+#else
+
+template <typename T, int L> inline lanes<T, L> operator-(const lanes<T, L>& a) { lanes<T, L> r; for (int l = 0; l < L; ++l) r.v[l] = -a.v[l]; return r; }
+template <typename T, int L> inline lanes<T, L> operator+(const lanes<T, L>& a, const lanes<T, L>& b) { lanes<T, L> r; for (int l = 0; l < L; ++l) r.v[l] = a.v[l] + b.v[l]; return r; }
+template <typename T, int L> inline lanes<T, L> operator-(const lanes<T, L>& a, const lanes<T, L>& b) { lanes<T, L> r; for (int l = 0; l < L; ++l) r.v[l] = a.v[l] - b.v[l]; return r; }
+template <typename T, int L> inline lanes<T, L> operator*(const lanes<T, L>& a, const lanes<T, L>& b) { lanes<T, L> r; for (int l = 0; l < L; ++l) r.v[l] = a.v[l] * b.v[l]; return r; }
+template <typename T, int L> inline lanes<T, L> operator/(const lanes<T, L>& a, const lanes<T, L>& b) { lanes<T, L> r; for (int l = 0; l < L; ++l) r.v[l] = a.v[l] / b.v[l]; return r; }
+template <typename T, int L> inline lanes<bool, L> operator< (const lanes<T, L>& a, const lanes<T, L>& b) { lanes<bool, L> r; for (int l = 0; l < L; ++l) r.v[l] = a.v[l] <  b.v[l] ? -1 : 0; return r; }
+template <typename T, int L> inline lanes<bool, L> operator<=(const lanes<T, L>& a, const lanes<T, L>& b) { lanes<bool, L> r; for (int l = 0; l < L; ++l) r.v[l] = a.v[l] <= b.v[l] ? -1 : 0; return r; }
+template <typename T, int L> inline lanes<bool, L> operator>=(const lanes<T, L>& a, const lanes<T, L>& b) { lanes<bool, L> r; for (int l = 0; l < L; ++l) r.v[l] = a.v[l] >= b.v[l] ? -1 : 0; return r; }
+template <int L> inline lanes<bool, L> operator&(const lanes<bool, L>& a, const lanes<bool, L>& b) { lanes<bool, L> r; for (int l = 0; l < L; ++l) r.v[l] = a.v[l] & b.v[l]; return r; }
+template <int L> inline lanes<bool, L> operator|(const lanes<bool, L>& a, const lanes<bool, L>& b) { lanes<bool, L> r; for (int l = 0; l < L; ++l) r.v[l] = a.v[l] | b.v[l]; return r; }
+template <int L> inline lanes<bool, L> operator!(const lanes<bool, L>& a) { lanes<bool, L> r; for (int l = 0; l < L; ++l) r.v[l] = ~a.v[l]; return r; }
+template <int L> inline lanes<int, L> operator>>(const lanes<int, L>& a, const int s) { lanes<int, L> r; for (int l = 0; l < L; ++l) r.v[l] = a.v[l] >> s; return r; }
+template <int L> inline lanes<int, L> operator&(const lanes<int, L>& a, const int b) { lanes<int, L> r; for (int l = 0; l < L; ++l) r.v[l] = a.v[l] & b; return r; }
+
+//! Returns the lanes of a where m is true and those of b otherwise.
+template <typename T, int L>
+inline lanes<T, L> select(const lanes<bool, L>& m, const lanes<T, L>& a, const lanes<T, L>& b)
+{
+	lanes<T, L> r;
+	for (int l = 0; l < L; ++l) r.v[l] = m.v[l] ? a.v[l] : b.v[l];
+	return r;
+}
+
+#endif
+
+// Mixed operations between lanes and scalars broadcast the scalars, which are converted to the type of the lanes.
+template <typename T, int L> inline lanes<T, L> operator+(const lanes<T, L>& a, const typename lanes<T, L>::value_type b) { return a + lanes<T, L>(b); }
+template <typename T, int L> inline lanes<T, L> operator+(const typename lanes<T, L>::value_type a, const lanes<T, L>& b) { return lanes<T, L>(a) + b; }
+template <typename T, int L> inline lanes<T, L> operator-(const lanes<T, L>& a, const typename lanes<T, L>::value_type b) { return a - lanes<T, L>(b); }
+template <typename T, int L> inline lanes<T, L> operator-(const typename lanes<T, L>::value_type a, const lanes<T, L>& b) { return lanes<T, L>(a) - b; }
+template <typename T, int L> inline lanes<T, L> operator*(const lanes<T, L>& a, const typename lanes<T, L>::value_type b) { return a * lanes<T, L>(b); }
+template <typename T, int L> inline lanes<T, L> operator*(const typename lanes<T, L>::value_type a, const lanes<T, L>& b) { return lanes<T, L>(a) * b; }
+template <typename T, int L> inline lanes<T, L> operator/(const typename lanes<T, L>::value_type a, const lanes<T, L>& b) { return lanes<T, L>(a) / b; }
+template <typename T, int L> inline lanes<bool, L> operator< (const lanes<T, L>& a, const typename lanes<T, L>::value_type b) { return a <  lanes<T, L>(b); }
+template <typename T, int L> inline lanes<bool, L> operator< (const typename lanes<T, L>::value_type a, const lanes<T, L>& b) { return lanes<T, L>(a) <  b; }
+template <typename T, int L> inline lanes<bool, L> operator<=(const typename lanes<T, L>::value_type a, const lanes<T, L>& b) { return lanes<T, L>(a) <= b; }
+template <typename T, int L> inline lanes<bool, L> operator>=(const lanes<T, L>& a, const typename lanes<T, L>::value_type b) { return a >= lanes<T, L>(b); }
+template <typename T, int L> inline lanes<T, L>& operator+=(lanes<T, L>& a, const lanes<T, L>& b) { return a = a + b; }
+template <typename T, int L> inline lanes<T, L>& operator-=(lanes<T, L>& a, const lanes<T, L>& b) { return a = a - b; }
+
+//! Returns true if any lane of a mask is true.
+template <int L>
+inline bool any(const lanes<bool, L>& m)
+{
+	int32_t r = 0;
+	for (int l = 0; l < L; ++l) r |= m.v[l];
+	return r != 0;
+}
+
+//! Returns true if all the lanes of a mask are true.
+template <int L>
+inline bool all(const lanes<bool, L>& m)
+{
+	int32_t r = -1;
+	for (int l = 0; l < L; ++l) r &= m.v[l];
+	return r != 0;
+}
+
+//! Returns the number of true lanes of a mask.
+template <int L>
+inline int count(const lanes<bool, L>& m)
+{
+	int32_t r = 0;
+	for (int l = 0; l < L; ++l) r -= m.v[l];
+	return r;
+}
+
+//! Gathers the values at the indexes of the lanes.
+template <typename T, int L>
+inline lanes<T, L> gather(const T* const p, const lanes<int, L>& i)
+{
+	lanes<T, L> r;
+	for (int l = 0; l < L; ++l) r.v[l] = p[i.v[l]];
+	return r;
+}
+
+template <int L>
+inline lanes<float, L> fabs(const lanes<float, L>& a)
+{
+	lanes<float, L> r;
+	for (int l = 0; l < L; ++l) r.v[l] = fabs(a.v[l]);
+	return r;
+}
+
+template <int L>
+inline lanes<float, L> sqrt(const lanes<float, L>& a)
+{
+	lanes<float, L> r;
+	for (int l = 0; l < L; ++l) r.v[l] = sqrt(a.v[l]);
+	return r;
+}
+
+template <int L>
+inline lanes<float, L> sin(const lanes<float, L>& a)
+{
+	lanes<float, L> r;
+	for (int l = 0; l < L; ++l) r.v[l] = sin(a.v[l]);
+	return r;
+}
+
+template <int L>
+inline lanes<float, L> cos(const lanes<float, L>& a)
+{
+	lanes<float, L> r;
+	for (int l = 0; l < L; ++l) r.v[l] = cos(a.v[l]);
+	return r;
+}
+
+#endif
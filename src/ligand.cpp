@@ -1,40 +1,78 @@
-#include <iomanip>
 #include <numeric>
 #include "array.hpp"
 #include "ligand.hpp"
+#include "profile.hpp"
 
-void frame::output(boost::filesystem::ofstream& ofs) const
+void frame::output(string& s) const
 {
-	ofs << "BRANCH"    << setw(4) << rotorXsrn << setw(4) << rotorYsrn << '\n';
+	s.append("BRANCH", 6);
+	append_size(s, rotorXsrn, 4);
+	append_size(s, rotorYsrn, 4);
+	s.push_back('\n');
 }
 
-ligand::ligand(const path& p) : filename(p.filename()), xs{}, nv(6)
+//! Represents the scratch of parsing a ligand, which is kept per thread and reused by every ligand the thread parses.
+class parse_scratch
 {
-	// Initialize necessary variables for constructing a ligand.
+public:
+	vector<atom> root_hydrogens; //!< Unsaved hydrogens of ROOT frame.
+	vector<atom> hydrogens; //!< Saved hydrogens in input order.
+	vector<size_t> hydrogen_parents; //!< Indexes to the heavy atoms the saved hydrogens are connected to.
+	vector<array<size_t, 2>> bonds; //!< Covalent bonds between heavy atoms.
+	vector<size_t> bond_offsets; //!< Offsets to bonded of the atoms bonded to each heavy atom.
+	vector<size_t> bonded; //!< Atoms bonded to each heavy atom in turn.
+	vector<size_t> neighbors; //!< Atoms within 3 consecutive covalent bonds of the current heavy atom.
+};
+
+ligand::ligand(const path& filename, const char* const b, const char* const e)
+{
+	parse(filename, b, e);
+}
+
+void ligand::parse(const path& filename, const char* const b, const char* const e)
+{
+	// Initialize necessary variables for constructing a ligand, keeping the storage of the previous one.
+	this->filename = filename;
+	frames.clear();
+	branches.clear();
+	atoms.clear();
+	hydrogens.clear();
+	interacting_pairs.clear();
+	affinities.clear();
+	pkds.clear();
+	xs.fill(false);
+	nv = 6;
 	frames.reserve(30); // A ligand typically consists of <= 30 frames.
 	frames.emplace_back(0, 0, 0, 0, 0); // ROOT is also treated as a frame. The parent, rotorXsrn, rotorYsrn, rotorXidx of ROOT frame are dummy.
 	atoms.reserve(100); // A ligand typically consists of <= 100 heavy atoms.
 
 	// Initialize helper variables for parsing.
-	vector<atom> hydrogens; // Unsaved hydrogens of ROOT frame.
-	vector<vector<size_t>> bonds; // Covalent bonds.
-	bonds.reserve(100); // A ligand typically consists of <= 100 heavy atoms.
+	static thread_local parse_scratch scratch;
+	scratch.root_hydrogens.clear();
+	scratch.hydrogens.clear();
+	scratch.hydrogen_parents.clear();
+	scratch.bonds.clear();
 	size_t current = 0; // Index of current frame, initialized to ROOT frame.
 	frame* f = &frames.front(); // Pointer to the current frame.
-	string line;
 
-	// Parse the ligand line by line.
-	for (boost::filesystem::ifstream ifs(p); getline(ifs, line);)
+	// Parse the ligand line by line in place.
+	for (const char* line = b, *next; line < e; line = next)
 	{
-		const string record = line.substr(0, 6);
-		if (record == "ATOM  " || record == "HETATM")
+		const char* const eol = find(line, e, '\n');
+		next = eol + (eol < e);
+		const size_t n = eol - line - (eol > line && eol[-1] == '\r');
+		const auto record = [line, n](const char* const r)
+		{
+			return n >= 6 && !memcmp(line, r, 6);
+		};
+		if (record("ATOM  ") || record("HETATM"))
 		{
 			// Whenever an ATOM/HETATM line shows up, the current frame must be the last one.
 			assert(current == frames.size() - 1);
 			assert(f == &frames.back());
 
 			// Parse the line.
-			atom a(line);
+			atom a(line, n);
 
 			// Skip unsupported atom types.
 			if (a.ad_unsupported()) continue;
@@ -59,29 +97,26 @@ ligand::ligand(const path& p) : filename(p.filename()), xs{}, nv(6)
 							assert(!b.is_hetero());
 						}
 						// Save the hydrogen.
-						b.hydrogens.push_back(move(a));
+						scratch.hydrogens.push_back(a);
+						scratch.hydrogen_parents.push_back(i);
 						unsaved = false;
 						break;
 					}
 				}
 				if (unsaved)
 				{
-					hydrogens.push_back(move(a));
+					scratch.root_hydrogens.push_back(a);
 				}
 			}
 			else // Current atom is a heavy atom.
 			{
 				// Find bonds between the current atom and the other atoms of the same frame.
-				assert(bonds.size() == atoms.size());
-				bonds.emplace_back();
-				bonds.back().reserve(4); // An atom typically consists of <= 4 bonds.
 				for (size_t i = atoms.size(); i > f->rotorYidx;)
 				{
 					atom& b = atoms[--i];
 					if (a.has_covalent_bond(b))
 					{
-						bonds[atoms.size()].push_back(i);
-						bonds[i].push_back(atoms.size());
+						scratch.bonds.push_back({{ i, atoms.size() }});
 
 						// If carbon atom b is bonded to hetero atom a, b is no longer a hydrophobic atom.
 						if (a.is_hetero() && !b.is_hetero())
@@ -97,14 +132,15 @@ ligand::ligand(const path& p) : filename(p.filename()), xs{}, nv(6)
 				}
 
 				// Save the heavy atom.
-				atoms.push_back(move(a));
+				atoms.push_back(a);
 			}
 		}
-		else if (record == "BRANCH")
+		else if (record("BRANCH"))
 		{
 			// Parse "BRANCH   X   Y". X and Y are right-justified and 4 characters wide.
-			const size_t rotorXsrn = stoul(line.substr( 6, 4));
-			const size_t rotorYsrn = stoul(line.substr(10, 4));
+			if (n < 14) throw domain_error("Error parsing " + filename.string() + ": a BRANCH record is too short.");
+			const size_t rotorXsrn = parse_size(line +  6, 4);
+			const size_t rotorYsrn = parse_size(line + 10, 4);
 
 			// Find the corresponding heavy atom with x as its atom serial number in the current frame.
 			for (size_t i = f->rotorYidx; true; ++i)
@@ -117,10 +153,6 @@ ligand::ligand(const path& p) : filename(p.filename()), xs{}, nv(6)
 				}
 			}
 
-			// The current frame has the newly inserted BRANCH frame as one of its branches.
-			// It is unsafe to use f in place of frames[current] because frames could reserve a new memory block after calling emplace_back().
-			frames[current].branches.push_back(frames.size() - 1);
-
 			// Now the current frame is the newly inserted BRANCH frame.
 			current = frames.size() - 1;
 
@@ -130,11 +162,11 @@ ligand::ligand(const path& p) : filename(p.filename()), xs{}, nv(6)
 			// The ending index of atoms of previous frame is the starting index of atoms of current frame.
 			frames[current - 1].childYidx = f->rotorYidx;
 		}
-		else if (record == "ENDBRA")
+		else if (record("ENDBRA"))
 		{
 			// A frame may be empty, e.g. "BRANCH   4   9" is immediately followed by "ENDBRANCH   4   9".
 			// This emptiness is likely to be caused by invalid input structure, especially when all the atoms are located in the same plane.
-			if (f->rotorYidx == atoms.size()) throw domain_error("Error parsing " + p.filename().string() + ": an empty BRANCH has been detected, indicating the input ligand structure is probably invalid.");
+			if (f->rotorYidx == atoms.size()) throw domain_error("Error parsing " + filename.string() + ": an empty BRANCH has been detected, indicating the input ligand structure is probably invalid.");
 
 			// If the current frame consists of rotor Y and a few hydrogens only, e.g. -OH, -NH2 or -CH3,
 			// the torsion of this frame will have no effect on scoring and is thus redundant.
@@ -148,8 +180,7 @@ ligand::ligand(const path& p) : filename(p.filename()), xs{}, nv(6)
 			}
 
 			// Set up bonds between rotorX and rotorY.
-			bonds[f->rotorYidx].push_back(f->rotorXidx);
-			bonds[f->rotorXidx].push_back(f->rotorYidx);
+			scratch.bonds.push_back({{ f->rotorXidx, f->rotorYidx }});
 
 			// Dehydrophobicize rotorX and rotorY if necessary.
 			atom& rotorY = atoms[f->rotorYidx];
@@ -168,9 +199,9 @@ ligand::ligand(const path& p) : filename(p.filename()), xs{}, nv(6)
 			// Update the pointer to the current frame.
 			f = &frames[current];
 		}
-		else if (record == "ENDROO")
+		else if (record("ENDROO"))
 		{
-			for (atom& a : hydrogens)
+			for (const atom& a : scratch.root_hydrogens)
 			{
 				for (size_t i = atoms.size(); i > f->rotorYidx;)
 				{
@@ -189,7 +220,8 @@ ligand::ligand(const path& p) : filename(p.filename()), xs{}, nv(6)
 							assert(!b.is_hetero());
 						}
 						// Save the hydrogen.
-						b.hydrogens.push_back(move(a));
+						scratch.hydrogens.push_back(a);
+						scratch.hydrogen_parents.push_back(i);
 						break;
 					}
 				}
@@ -208,6 +240,66 @@ ligand::ligand(const path& p) : filename(p.filename()), xs{}, nv(6)
 		xs[a.xs] = true;
 	}
 
+	// Index the child branches of each frame, i.e. the frames whose parent it is, in ascending order.
+	for (size_t k = 1; k < nf; ++k)
+	{
+		++frames[frames[k].parent].branches_end;
+	}
+	for (size_t k = 0, o = 0; k < nf; ++k)
+	{
+		frame& f = frames[k];
+		const size_t n = f.branches_end;
+		f.branches_begin = f.branches_end = o;
+		o += n;
+	}
+	branches.resize(nf - 1);
+	for (size_t k = 1; k < nf; ++k)
+	{
+		branches[frames[frames[k].parent].branches_end++] = k;
+	}
+
+	// Group the saved hydrogens by their heavy atoms in input order likewise.
+	for (const size_t i : scratch.hydrogen_parents)
+	{
+		++atoms[i].hydrogens_end;
+	}
+	for (size_t i = 0, o = 0; i < na; ++i)
+	{
+		atom& a = atoms[i];
+		const size_t n = a.hydrogens_end;
+		a.hydrogens_begin = a.hydrogens_end = static_cast<uint32_t>(o);
+		o += n;
+	}
+	hydrogens.assign(scratch.hydrogens.cbegin(), scratch.hydrogens.cend());
+	for (size_t h = 0; h < scratch.hydrogens.size(); ++h)
+	{
+		hydrogens[atoms[scratch.hydrogen_parents[h]].hydrogens_end++] = scratch.hydrogens[h];
+	}
+
+	// Index the atoms bonded to each heavy atom.
+	vector<size_t>& bond_offsets = scratch.bond_offsets;
+	vector<size_t>& bonded = scratch.bonded;
+	bond_offsets.assign(na + 1, 0);
+	for (const auto& bond : scratch.bonds)
+	{
+		++bond_offsets[bond[0] + 1];
+		++bond_offsets[bond[1] + 1];
+	}
+	partial_sum(bond_offsets.cbegin(), bond_offsets.cend(), bond_offsets.begin());
+	bonded.resize(bond_offsets.back());
+	for (const auto& bond : scratch.bonds)
+	{
+		bonded[bond_offsets[bond[0]]++] = bond[1];
+		bonded[bond_offsets[bond[1]]++] = bond[0];
+	}
+
+	// Filling has advanced each offset to the start of the next atom, so shift the offsets back.
+	for (size_t i = na; i > 0; --i)
+	{
+		bond_offsets[i] = bond_offsets[i - 1];
+	}
+	bond_offsets[0] = 0;
+
 	// Update atoms[].coord relative to frame origin.
 	for (const frame& f : frames)
 	{
@@ -216,37 +308,40 @@ ligand::ligand(const path& p) : filename(p.filename()), xs{}, nv(6)
 		{
 			atom& a = atoms[i];
 			a.coord -= origin;
-			for (atom& h : a.hydrogens)
+			for (size_t j = a.hydrogens_begin; j < a.hydrogens_end; ++j)
 			{
-				h.coord -= origin;
+				hydrogens[j].coord -= origin;
 			}
 		}
 	}
 
 	// Find intra-ligand interacting pairs that are not 1-4.
 	interacting_pairs.reserve(na * na);
-	vector<size_t> neighbors;
-	neighbors.reserve(10); // An atom typically consists of <= 10 neighbors.
+	vector<size_t>& neighbors = scratch.neighbors;
+	neighbors.clear();
 	for (size_t k1 = 0; k1 < nf; ++k1)
 	{
 		const frame& f1 = frames[k1];
 		for (size_t i = f1.rotorYidx; i < f1.childYidx; ++i)
 		{
 			// Find neighbor atoms within 3 consecutive covalent bonds.
-			for (const size_t b1 : bonds[i])
+			for (size_t j1 = bond_offsets[i]; j1 < bond_offsets[i + 1]; ++j1)
 			{
+				const size_t b1 = bonded[j1];
 				if (find(neighbors.cbegin(), neighbors.cend(), b1) == neighbors.cend())
 				{
 					neighbors.push_back(b1);
 				}
-				for (const size_t b2 : bonds[b1])
+				for (size_t j2 = bond_offsets[b1]; j2 < bond_offsets[b1 + 1]; ++j2)
 				{
+					const size_t b2 = bonded[j2];
 					if (find(neighbors.cbegin(), neighbors.cend(), b2) == neighbors.cend())
 					{
 						neighbors.push_back(b2);
 					}
-					for (const size_t b3 : bonds[b2])
+					for (size_t j3 = bond_offsets[b2]; j3 < bond_offsets[b2 + 1]; ++j3)
 					{
+						const size_t b3 = bonded[j3];
 						if (find(neighbors.cbegin(), neighbors.cend(), b3) == neighbors.cend())
 						{
 							neighbors.push_back(b3);
@@ -267,7 +362,7 @@ ligand::ligand(const path& p) : filename(p.filename()), xs{}, nv(6)
 					if (k1 > 0 && f1.parent == f2.parent && i == f1.rotorYidx && j == f2.rotorYidx) continue;
 					if (f2.parent > 0 && k1 == f3.parent && i == f3.rotorXidx && j == f2.rotorYidx) continue;
 					if (find(neighbors.cbegin(), neighbors.cend(), j) != neighbors.cend()) continue;
-					interacting_pairs.emplace_back(i, j, scoring_function::nr * mp(t1, atoms[j].xs));
+					interacting_pairs.emplace_back(i, j, mp(t1, atoms[j].xs));
 				}
 			}
 
@@ -286,7 +381,8 @@ size_t ligand::get_lig_elems() const
 size_t ligand::get_sln_elems() const
 {
 	// 3 * (nt + 1) is sufficient for t because the torques of inactive frames are always zero.
-	return (1 + nv + 1 + nv + 3 * nf + 4 * nf + 3 * na + 3 * na + 3 * nf + 3 * nf) * 3 + (nv * (nv + 1) >> 1) + nv * 3;
+	// 3 * na + 1 holds n, i.e. the inter-ligand derivatives and the intra-ligand free energy by which the CUDA and OpenCL kernels evaluate mutations as translations.
+	return (1 + nv + 1 + nv + 3 * nf + 4 * nf + 3 * na + 3 * na + 3 * nf + 3 * nf + 3 * na + 1) * 3 + (nv * (nv + 1) >> 1) + nv * 3;
 }
 
 size_t ligand::get_cnf_elems() const
@@ -294,13 +390,13 @@ size_t ligand::get_cnf_elems() const
 	return 1 + nv + 1;
 }
 
-void ligand::encode(int* const p) const
+void ligand::encode(int* const p, const size_t nr) const
 {
 	int* c = p;
 	for (const frame& f : frames) *c++ = f.active;
 	for (const frame& f : frames) *c++ = f.rotorYidx;
 	for (const frame& f : frames) *c++ = f.childYidx;
-	for (const frame& f : frames) *c++ = f.branches.size();
+	for (const frame& f : frames) *c++ = f.branches_end - f.branches_begin;
 	for (const frame& f : frames) *c++ = f.parent;
 	for (const frame& f : frames) *(float*)c++ = f.yy[0];
 	for (const frame& f : frames) *(float*)c++ = f.yy[1];
@@ -309,13 +405,7 @@ void ligand::encode(int* const p) const
 	for (const frame& f : frames) *(float*)c++ = f.xy[1];
 	for (const frame& f : frames) *(float*)c++ = f.xy[2];
 	assert(c == p + 11 * nf);
-	for (const frame& f : frames)
-	{
-		for (const size_t b : f.branches)
-		{
-			*c++ = b;
-		}
-	}
+	for (const size_t b : branches) *c++ = b;
 	assert(c == p + 11 * nf + nf - 1);
 	for (const atom& a : atoms) *(float*)c++ = a.coord[0];
 	for (const atom& a : atoms) *(float*)c++ = a.coord[1];
@@ -324,7 +414,7 @@ void ligand::encode(int* const p) const
 	assert(c == p + 11 * nf + nf - 1 + 4 * na);
 	for (const interacting_pair& p : interacting_pairs) *c++ = p.i0;
 	for (const interacting_pair& p : interacting_pairs) *c++ = p.i1;
-	for (const interacting_pair& p : interacting_pairs) *c++ = p.p_offset;
+	for (const interacting_pair& p : interacting_pairs) *c++ = nr * p.pair_index;
 	assert(c == p + 11 * nf + nf - 1 + 4 * na + 3 * np);
 	assert(c == p + get_lig_elems());
 }
@@ -337,85 +427,170 @@ public:
 //	vector<float> x; //!< Conformation vector.
 	vector<array<float, 4>> q; //!< Frame quaternions.
 	vector<array<float, 3>> c; //!< Heavy atom coordinates.
+	array<float, 3> o; //!< Centroid of heavy atoms.
 };
 
-void ligand::write(const float* const ex, const path& output_folder_path, const size_t max_conformations, const size_t num_tasks, const receptor& rec, const forest& f, const scoring_function& sf)
+//! Calls f(i) for each i in [0, n) by pf, or serially if pf is empty.
+static void for_each_index(const ligand::parallel_for& pf, const size_t n, const function<void(const size_t)>& f)
 {
-	// Sort solutions in ascending order of e.
-	vector<size_t> rank(num_tasks);
-	iota(rank.begin(), rank.end(), 0);
-	sort(rank.begin(), rank.end(), [&ex](const size_t v0, const size_t v1)
+	if (pf)
 	{
-		return ex[v0] < ex[v1];
-	});
+		pf(n, f);
+		return;
+	}
+	for (size_t i = 0; i < n; ++i)
+	{
+		f(i);
+	}
+}
 
-	// Cluster solutions with RMSD of 2.0 and save them on the fly.
+void ligand::recover(const float* const ex, const size_t cds, const size_t r, vector<array<float, 4>>& q, vector<array<float, 3>>& c) const
+{
+	size_t o;
+	q.resize(nf);
+	c.resize(na);
+	c[0][0] = ex[o  = cds + r];
+	c[0][1] = ex[o += cds];
+	c[0][2] = ex[o += cds];
+	q[0][0] = ex[o += cds];
+	q[0][1] = ex[o += cds];
+	q[0][2] = ex[o += cds];
+	q[0][3] = ex[o += cds];
+	for (size_t k = 0; k < nf; ++k)
+	{
+		const frame& f = frames[k];
+		if (!f.active) continue;
+		const array<float, 9> m = qtn4_to_mat3(q[k]);
+		for (size_t i = f.rotorYidx + 1; i < f.childYidx; ++i)
+		{
+			c[i] = c[f.rotorYidx] + m * atoms[i].coord;
+		}
+		for (size_t j = f.branches_begin; j < f.branches_end; ++j)
+		{
+			const size_t i = branches[j];
+			const frame& b = frames[i];
+			c[b.rotorYidx] = c[f.rotorYidx] + m * b.yy;
+			if (!b.active) continue;
+			const array<float, 3> a = m * b.xy;
+			assert(normalized(a));
+			q[i] = vec4_to_qtn4(a, ex[o += cds]) * q[k];
+			assert(normalized(q[i]));
+		}
+	}
+}
+
+vector<size_t> ligand::cluster(const float* const ex, const size_t cds, const size_t num_tasks, const size_t max_conformations, const parallel_for& pf) const
+{
+	// Heapify solutions in ascending order of e rather than sorting them all, as typically only the lowest ones are visited before the clusters fill up. Ties are broken by task index.
+	vector<size_t> heap(num_tasks);
+	iota(heap.begin(), heap.end(), 0);
+	const auto worse = [ex](const size_t v0, const size_t v1)
+	{
+		return ex[v0] > ex[v1] || (ex[v0] == ex[v1] && v0 > v1);
+	};
+	make_heap(heap.begin(), heap.end(), worse);
+
+	// Cluster solutions with RMSD of 2.0. The mean squared deviation of two solutions is at least the squared distance between their centroids, slightly relaxed against rounding.
 	const float square_deviation_threshold = 4.0f * na;
+	const float square_centroid_threshold = 4.0f * 1.001f;
+	const float inverse_na = 1.0f / na;
+	vector<size_t> representatives;
 	vector<solution> solutions;
+	representatives.reserve(max_conformations);
 	solutions.reserve(max_conformations);
-	affinities.reserve(max_conformations);
-	boost::filesystem::ofstream ofs(output_folder_path / filename);
-	ofs.setf(ios::fixed, ios::floatfield);
-	ofs << setprecision(3);
-	for (const size_t r : rank)
+	vector<size_t> candidates;
+	vector<solution> block;
+	for (size_t block_size = max_conformations; representatives.size() < max_conformations && !heap.empty(); block_size = min<size_t>(block_size << 1, 256))
 	{
-		// Recover q and c from x.
-		solution s;
-		size_t o;
-		s.q.resize(nf);
-		s.c.resize(na);
-		s.c[0][0] = ex[o  = num_tasks + r];
-		s.c[0][1] = ex[o += num_tasks];
-		s.c[0][2] = ex[o += num_tasks];
-		s.q[0][0] = ex[o += num_tasks];
-		s.q[0][1] = ex[o += num_tasks];
-		s.q[0][2] = ex[o += num_tasks];
-		s.q[0][3] = ex[o += num_tasks];
-		for (size_t k = 0; k < nf; ++k)
+		// Pop the next block of solutions in ascending order of e.
+		candidates.clear();
+		while (candidates.size() < block_size && !heap.empty())
 		{
-			const frame& f = frames[k];
-			if (!f.active) continue;
-			const array<float, 9> m = qtn4_to_mat3(s.q[k]);
-			for (size_t i = f.rotorYidx + 1; i < f.childYidx; ++i)
-			{
-				s.c[i] = s.c[f.rotorYidx] + m * atoms[i].coord;
-			}
-			for (const size_t i : f.branches)
-			{
-				const frame& b = frames[i];
-				s.c[b.rotorYidx] = s.c[f.rotorYidx] + m * b.yy;
-				if (!b.active) continue;
-				const array<float, 3> a = m * b.xy;
-				assert(normalized(a));
-				s.q[i] = vec4_to_qtn4(a, ex[o += num_tasks]) * s.q[k];
-				assert(normalized(s.q[i]));
-			}
+			pop_heap(heap.begin(), heap.end(), worse);
+			candidates.push_back(heap.back());
+			heap.pop_back();
 		}
 
-		// Check if c forms a new cluster.
-		bool representative = true;
-		for (const solution& t : solutions)
+		// Recover q, c and the centroid from x of the block in parallel.
+		block.resize(candidates.size());
+		for_each_index(pf, candidates.size(), [&](const size_t k)
 		{
-			float square_deviation = 0.0f;
-			for (size_t i = 0; i < na; ++i)
+			solution& s = block[k];
+			recover(ex, cds, candidates[k], s.q, s.c);
+			s.o = {};
+			for (const auto& c : s.c)
 			{
-				square_deviation += distance_sqr(s.c[i], t.c[i]);
+				s.o += c;
 			}
-			if (square_deviation < square_deviation_threshold)
+			s.o = inverse_na * s.o;
+		});
+
+		// Check in order if c forms a new cluster.
+		for (size_t k = 0; k < candidates.size(); ++k)
+		{
+			solution& s = block[k];
+			bool representative = true;
+			for (const solution& t : solutions)
 			{
-				representative = false;
-				break;
+				if (distance_sqr(s.o, t.o) >= square_centroid_threshold) continue;
+				float square_deviation = 0.0f;
+				for (size_t i = 0; i < na && square_deviation < square_deviation_threshold; ++i)
+				{
+					square_deviation += distance_sqr(s.c[i], t.c[i]);
+				}
+				if (square_deviation < square_deviation_threshold)
+				{
+					representative = false;
+					break;
+				}
 			}
+			if (!representative) continue;
+
+			// Check if the number of clusters has reached the upper bound.
+			representatives.push_back(candidates[k]);
+			solutions.push_back(move(s));
+			if (representatives.size() == max_conformations) break;
 		}
-		if (!representative) continue;
+	}
+	return representatives;
+}
+
+void ligand::write(const float* const ex, const path& output_folder_path, const size_t max_conformations, const size_t num_tasks, const receptor& rec, const forest& f, const scoring_function& sf, const parallel_for& pf, profile* const prof)
+{
+	pose_record pose;
+	write(ex, max_conformations, num_tasks, rec, f, sf, pose, pf, prof);
+	const profile_timer t(prof, phase_output);
+	boost::filesystem::ofstream ofs(output_folder_path / filename);
+	ofs.write(pose.pdbqt.data(), pose.pdbqt.size());
+}
 
-		// Rescore conformations with random forest.
-		array<float, tree::nv> x{};
+void ligand::write(const float* const ex, const size_t max_conformations, const size_t num_tasks, const receptor& rec, const forest& f, const scoring_function& sf, pose_record& pose, const parallel_for& pf, profile* const prof)
+{
+	// Cluster solutions.
+	pose.clear();
+	pose.name = filename.stem().string();
+	profile_timer t(prof, phase_clustering);
+	const vector<size_t> representatives = cluster(ex, num_tasks, num_tasks, max_conformations, pf);
+	const size_t num_representatives = representatives.size();
+	t.next(phase_rescoring);
+
+	// Recover q and c from x of the representatives, and extract the features to rescore them with random forest, in parallel. Only the receptor atoms that the cell index finds within the RF-Score cutoff are visited.
+	vector<solution> solutions(num_representatives);
+	vector<float> X(tree::nv * num_representatives); // Features of the conformations, which are rescored in one batch.
+	for_each_index(pf, num_representatives, [&](const size_t k)
+	{
+		solution& s = solutions[k];
+		recover(ex, num_tasks, representatives[k], s.q, s.c);
+		float* const x = X.data() + tree::nv * k;
+		vector<size_t> nbrs;
 		for (size_t i = 0; i < na; ++i)
 		{
 			const atom& la = atoms[i];
-			for (const atom& ra : rec.atoms)
+			nbrs.clear();
+			rec.neighbors({ s.c[i][0] - 12, s.c[i][1] - 12, s.c[i][2] - 12 }, { s.c[i][0] + 12, s.c[i][1] + 12, s.c[i][2] + 12 }, nbrs);
+			for (const size_t j : nbrs)
 			{
+				const atom& ra = rec.atoms[j];
 				const float ds = distance_sqr(s.c[i], ra.coord);
 				if (ds >= 144) continue; // RF-Score cutoff 12A
 				if (!la.rf_unsupported() && !ra.rf_unsupported())
@@ -425,30 +600,50 @@ void ligand::write(const float* const ex, const path& output_folder_path, const
 				if (ds >= 64) continue; // Vina score cutoff 8A
 				if (!la.xs_unsupported() && !ra.xs_unsupported())
 				{
-					sf.score(x.data() + 36, la.xs, ra.xs, ds);
+					sf.score(x + 36, la.xs, ra.xs, ds);
 				}
 			}
 		}
-		x.back() = 1 / (1 + 0.05846f * (nv - 6 + 0.5f * (nf - 1 - (nv - 6))));
-		affinities.push_back(ex[r]);
-//		affinities.push_back(f(x));
+		x[tree::nv - 1] = 1 / (1 + 0.05846f * (nv - 6 + 0.5f * (nf - 1 - (nv - 6))));
+	});
+
+	// Rescore all the conformations with random forest at once.
+	pkds = f.predict(X.data(), num_representatives);
+
+	// Save the representatives.
+	t.next(phase_output);
+	affinities.reserve(max_conformations);
+	string& pdbqt = pose.pdbqt;
+	for (size_t k = 0; k < num_representatives; ++k)
+	{
+		const solution& s = solutions[k];
+		affinities.push_back(ex[representatives[k]]);
+
+		// Dump the binding affinity rescored by random forest.
+		pdbqt.append("REMARK  RF-Score pKd = ");
+		append_float(pdbqt, pkds[k], 0);
+		pdbqt.push_back('\n');
 
 		// Dump the ROOT frame.
-		ofs << "ROOT\n";
+		pdbqt.append("ROOT\n");
 		{
 			const frame& f = frames.front();
 			const array<float, 9> m = qtn4_to_mat3(s.q[0]);
 			for (size_t i = f.rotorYidx; i < f.childYidx; ++i)
 			{
 				const atom& a = atoms[i];
-				a.output(ofs, s.c[i]);
-				for (const atom& h : a.hydrogens)
+				a.output(pdbqt, s.c[i]);
+				pose.coords.push_back(s.c[i]);
+				for (size_t j = a.hydrogens_begin; j < a.hydrogens_end; ++j)
 				{
-					h.output(ofs, s.c[f.rotorYidx] + m * h.coord);
+					const atom& h = hydrogens[j];
+					const array<float, 3> hc = s.c[f.rotorYidx] + m * h.coord;
+					h.output(pdbqt, hc);
+					pose.coords.push_back(hc);
 				}
 			}
 		}
-		ofs << "ENDROOT\n";
+		pdbqt.append("ENDROOT\n");
 
 		// Dump the BRANCH frames.
 		vector<bool> dumped(nf); // dump_branches[0] is dummy. The ROOT frame has been dumped.
@@ -456,9 +651,9 @@ void ligand::write(const float* const ex, const path& output_folder_path, const
 		stack.reserve(nf - 1); // The ROOT frame is excluded.
 		{
 			const frame& f = frames.front();
-			for (auto i = f.branches.rbegin(); i < f.branches.rend(); ++i)
+			for (size_t j = f.branches_end; j > f.branches_begin;)
 			{
-				stack.push_back(*i);
+				stack.push_back(branches[--j]);
 			}
 		}
 		while (!stack.empty())
@@ -467,34 +662,38 @@ void ligand::write(const float* const ex, const path& output_folder_path, const
 			const frame& f = frames[fn];
 			if (dumped[fn]) // This BRANCH frame has been dumped.
 			{
-				ofs << "END";
-				f.output(ofs);
+				pdbqt.append("END");
+				f.output(pdbqt);
 				stack.pop_back();
 			}
 			else // This BRANCH frame has not been dumped.
 			{
-				f.output(ofs);
+				f.output(pdbqt);
 				const array<float, 9> m = qtn4_to_mat3(s.q[f.active ? fn : f.parent]);
 				for (size_t i = f.rotorYidx; i < f.childYidx; ++i)
 				{
 					const atom& a = atoms[i];
-					a.output(ofs, s.c[i]);
-					for (const atom& h : a.hydrogens)
+					a.output(pdbqt, s.c[i]);
+					pose.coords.push_back(s.c[i]);
+					for (size_t j = a.hydrogens_begin; j < a.hydrogens_end; ++j)
 					{
-						h.output(ofs, s.c[f.rotorYidx] + m * h.coord);
+						const atom& h = hydrogens[j];
+						const array<float, 3> hc = s.c[f.rotorYidx] + m * h.coord;
+						h.output(pdbqt, hc);
+						pose.coords.push_back(hc);
 					}
 				}
 				dumped[fn] = true;
-				for (auto i = f.branches.rbegin(); i < f.branches.rend(); ++i)
+				for (size_t j = f.branches_end; j > f.branches_begin;)
 				{
-					stack.push_back(*i);
+					stack.push_back(branches[--j]);
 				}
 			}
 		}
-		ofs << "TORSDOF " << nf - 1 << '\n';
-
-		// Check if the number of conformations to write has been reached the upper bound.
-		solutions.push_back(move(s));
-		if (solutions.size() == solutions.capacity()) break;
+		pdbqt.append("TORSDOF ");
+		append_size(pdbqt, nf - 1, 0);
+		pdbqt.push_back('\n');
+		pose.ends.push_back(pdbqt.size());
 	}
+	pose.affinities = affinities;
 }
\ No newline at end of file
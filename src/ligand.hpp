@@ -2,13 +2,17 @@
 #ifndef IDOCK_LIGAND_HPP
 #define IDOCK_LIGAND_HPP
 
+#include <functional>
 #include <boost/filesystem/fstream.hpp>
 #include "scoring_function.hpp"
 #include "random_forest.hpp"
 #include "atom.hpp"
 #include "receptor.hpp"
+#include "pose_file.hpp"
 using namespace boost::filesystem;
 
+class profile;
+
 //! Represents a ROOT or a BRANCH in PDBQT structure.
 class frame
 {
@@ -22,37 +26,54 @@ public:
 	bool active; //!< Indicates if the current frame is active.
 	array<float, 3> yy; //!< Vector pointing from the origin of parent frame to the origin of current frame.
 	array<float, 3> xy; //!< Normalized vector pointing from rotor X of parent frame to rotor Y of current frame.
-	vector<size_t> branches; //!< Indexes to child branches.
+	size_t branches_begin; //!< Index to ligand::branches of the first child branch.
+	size_t branches_end; //!< Index to ligand::branches one past the last child branch.
 
 	//! Constructs an active frame, and relates it to its parent frame.
-	explicit frame(const size_t parent, const size_t rotorXsrn, const size_t rotorYsrn, const size_t rotorXidx, const size_t rotorYidx) : parent(parent), rotorXsrn(rotorXsrn), rotorYsrn(rotorYsrn), rotorXidx(rotorXidx), rotorYidx(rotorYidx), active(true) {}
+	explicit frame(const size_t parent, const size_t rotorXsrn, const size_t rotorYsrn, const size_t rotorXidx, const size_t rotorYidx) : parent(parent), rotorXsrn(rotorXsrn), rotorYsrn(rotorYsrn), rotorXidx(rotorXidx), rotorYidx(rotorYidx), active(true), branches_begin(0), branches_end(0) {}
 
-	//! Outputs a BRANCH line in PDBQT format.
-	void output(boost::filesystem::ofstream& ofs) const;
+	//! Appends a BRANCH line in PDBQT format.
+	void output(string& s) const;
 };
 
 //! Represents a ligand.
 class ligand
 {
 public:
-	path filename; //!< Filename of the input ligand.
+	path filename; //!< Filename of the output ligand, which is that of the input file for a single ligand per file.
 	vector<frame> frames; //!< ROOT and BRANCH frames.
-	vector<atom> atoms; //!< Heavy atoms. Coordinates are relative to frame origin, which is the first atom by default. Hydrogens are saved under heavy atoms.
+	vector<size_t> branches; //!< Indexes to child branches, those of each frame being contiguous and in ascending order, and the frames in turn.
+	vector<atom> atoms; //!< Heavy atoms. Coordinates are relative to frame origin, which is the first atom by default.
+	vector<atom> hydrogens; //!< Hydrogens, those connected to each heavy atom being contiguous and in input order, and the heavy atoms in turn. Coordinates are relative to the origin of the frame of their heavy atom.
 	array<bool, scoring_function::n> xs; //!< Presence of XScore atom types.
 	size_t nv; //!< Number of variables to optimize, which equals 6 plus the number of active frames.
 	size_t nf; //!< Number of frames, both active and inactive.
 	size_t na; //!< Number of heavy atoms.
 	size_t np; //!< Number of non 1-4 interacting pairs.
 	vector<float> affinities; //!< Binding affinities of predicted conformations.
+	vector<float> pkds; //!< Binding affinities of predicted conformations in pKd, rescored by random forest.
+
+	//! Constructs a ligand by parsing its PDBQT text in [b, e) in place, naming the output file filename.
+	explicit ligand(const path& filename, const char* const b, const char* const e);
+
+	//! Replaces the current ligand by parsing the PDBQT text in [b, e) in place, naming the output file filename. The vectors of the current ligand are reused, and so is the scratch of parsing kept per thread, so that a ligand recycled for each ligand read parses without allocation once they have grown to fit.
+	void parse(const path& filename, const char* const b, const char* const e);
+
+	//! Encodes the current ligand into an array of integers for a scoring function of nr samples per type pair.
+	void encode(int* const p, const size_t nr) const;
 
-	//! Constructs a ligand by parsing a ligand file in PDBQT format.
-	explicit ligand(const path& p);
+	//! Represents a parallel loop that calls f(i) for each i in [0, n) and returns once all the calls have completed, e.g. by forking tasks to a scheduler. An empty loop runs the calls serially in the calling thread.
+	typedef function<void(const size_t n, const function<void(const size_t)>& f)> parallel_for;
 
-	//! Encodes the current ligand into an array of integers.
-	void encode(int* const p) const;
+	//! Clusters the first num_tasks conformations in ex of stride cds with RMSD of 2.0, and returns the tasks that represent up to max_conformations clusters in ascending order of free energy.
+	//! Conformations are visited in ascending order of free energy from a heap, and recovered in blocks in parallel by pf only until the clusters fill up. A conformation is compared with a representative over all its atoms only if their centroids, whose squared distance bounds the mean squared deviation from below, are within 2.0 A, and the comparison exits as soon as the deviation reaches the threshold.
+	vector<size_t> cluster(const float* const ex, const size_t cds, const size_t num_tasks, const size_t max_conformations, const parallel_for& pf = parallel_for()) const;
 
-	//! Writes conformations in PDBQT format to file.
-	void write(const float* const ex, const path& output_folder_path, const size_t max_conformations, const size_t num_tasks, const receptor& rec, const forest& f, const scoring_function& sf);
+	//! Writes conformations in PDBQT format to file. The phases are timed by prof if it is not null.
+	void write(const float* const ex, const path& output_folder_path, const size_t max_conformations, const size_t num_tasks, const receptor& rec, const forest& f, const scoring_function& sf, const parallel_for& pf = parallel_for(), profile* const prof = nullptr);
+
+	//! Formats conformations in PDBQT format into a pose record, which is cleared first. The representatives are clustered, recovered and featurized for random forest in parallel by pf. Clustering, rescoring and formatting are timed by prof if it is not null.
+	void write(const float* const ex, const size_t max_conformations, const size_t num_tasks, const receptor& rec, const forest& f, const scoring_function& sf, pose_record& pose, const parallel_for& pf = parallel_for(), profile* const prof = nullptr);
 
 	//! Gets the number of elements of the current ligand.
 	size_t get_lig_elems() const;
@@ -62,17 +83,21 @@ public:
 
 	//! Gets the number of elements of a conformation.
 	size_t get_cnf_elems() const;
+
+	//! Recovers the frame quaternions and heavy atom coordinates of task r from its conformation in ex of stride cds.
+	void recover(const float* const ex, const size_t cds, const size_t r, vector<array<float, 4>>& q, vector<array<float, 3>>& c) const;
 private:
+
 	//! Represents a pair of interacting atoms that are separated by 3 consecutive covalent bonds.
 	class interacting_pair
 	{
 	public:
 		size_t i0; //!< Index of atom 0.
 		size_t i1; //!< Index of atom 1.
-		size_t p_offset; //!< Type pair index to the scoring function. It can be precalculated to save the creating time of grid maps.
+		size_t pair_index; //!< Type pair index to the scoring function, which encode scales by the number of samples per type pair.
 
 		//! Constructs a pair of non 1-4 interacting atoms.
-		interacting_pair(const size_t i0, const size_t i1, const size_t p_offset) : i0(i0), i1(i1), p_offset(p_offset) {}
+		interacting_pair(const size_t i0, const size_t i1, const size_t pair_index) : i0(i0), i1(i1), pair_index(pair_index) {}
 	};
 
 	vector<interacting_pair> interacting_pairs; //!< Non 1-4 interacting pairs.
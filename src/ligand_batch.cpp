@@ -0,0 +1,74 @@
+#include <cassert>
+#include "ligand_batch.hpp"
+
+ligand_batch::ligand_batch(const size_t num_tasks) : num_tasks(num_tasks), lig_elems(0), max_lig_elems(0), sln_elems(0), cnf_elems(0)
+{
+}
+
+void ligand_batch::push_back(ligand&& lig, const size_t lid)
+{
+	const size_t this_lig_elems = lig.get_lig_elems();
+	lig_elems += this_lig_elems;
+	max_lig_elems = max(max_lig_elems, this_lig_elems);
+	sln_offsets.push_back(sln_elems);
+	sln_elems += lig.get_sln_elems() * num_tasks;
+	cnf_offsets.push_back(cnf_elems);
+	cnf_elems += lig.get_cnf_elems() * num_tasks;
+	lids.push_back(lid);
+	ligands.push_back(move(lig));
+}
+
+size_t ligand_batch::size() const
+{
+	return ligands.size();
+}
+
+bool ligand_batch::uses(const size_t t) const
+{
+	for (const ligand& lig : ligands)
+	{
+		if (lig.xs[t]) return true;
+	}
+	return false;
+}
+
+size_t ligand_batch::get_lig_elems() const
+{
+	return dsc_elems * ligands.size() + lig_elems;
+}
+
+size_t ligand_batch::get_max_lig_elems() const
+{
+	return max_lig_elems;
+}
+
+size_t ligand_batch::get_sln_elems() const
+{
+	return sln_elems;
+}
+
+size_t ligand_batch::get_cnf_elems() const
+{
+	return cnf_elems;
+}
+
+void ligand_batch::encode(int* const p, const size_t nr) const
+{
+	int* d = p;
+	int* c = p + dsc_elems * ligands.size();
+	for (size_t l = 0; l < ligands.size(); ++l)
+	{
+		const ligand& lig = ligands[l];
+		*d++ = lig.nv;
+		*d++ = lig.nf;
+		*d++ = lig.na;
+		*d++ = lig.np;
+		*d++ = c - p;
+		*d++ = sln_offsets[l];
+		*d++ = static_cast<uint32_t>(lids[l]);
+		*d++ = static_cast<uint32_t>(static_cast<uint64_t>(lids[l]) >> 32);
+		lig.encode(c, nr);
+		c += lig.get_lig_elems();
+	}
+	assert(c == p + get_lig_elems());
+}
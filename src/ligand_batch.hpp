@@ -0,0 +1,53 @@
+#pragma once
+#ifndef IDOCK_LIGAND_BATCH_HPP
+#define IDOCK_LIGAND_BATCH_HPP
+
+#include "ligand.hpp"
+
+//! Represents a batch of ligands docked by a single kernel launch of idock_cu and idock_cl, so that several small ligands fill a GPU regardless of the number of tasks per ligand.
+//! The batch is encoded as a table of one descriptor per ligand followed by the encoded ligands. The tasks of ligand l run in the l-th group of blocks or work groups of the launch, and its solutions start at element sln_offsets[l] of the solution buffer.
+class ligand_batch
+{
+public:
+	static const size_t dsc_elems = 8; //!< Number of elements of a descriptor, i.e. nv, nf, na, np, the offsets of the encoded ligand and of its solutions, and the low and high words of the ligand index.
+
+	vector<ligand> ligands; //!< Ligands of the batch.
+	vector<size_t> lids; //!< Indexes of the ligands in input order, which key the random number streams of their tasks.
+	vector<size_t> sln_offsets; //!< Offsets of the solutions of the ligands in the solution buffer.
+	vector<size_t> cnf_offsets; //!< Offsets of the conformations of the ligands in a host buffer that holds those of all the ligands consecutively.
+
+	//! Constructs an empty batch of ligands docked by num_tasks tasks each.
+	explicit ligand_batch(const size_t num_tasks);
+
+	//! Appends a ligand of index lid in input order.
+	void push_back(ligand&& lig, const size_t lid);
+
+	//! Returns the number of ligands in the batch.
+	size_t size() const;
+
+	//! Returns true if a ligand of the batch has atoms of XScore type t.
+	bool uses(const size_t t) const;
+
+	//! Returns the number of elements of the encoded batch.
+	size_t get_lig_elems() const;
+
+	//! Returns the number of elements of the largest encoded ligand, which is the number of elements of shared or local memory per block or work group.
+	size_t get_max_lig_elems() const;
+
+	//! Returns the number of elements of the solutions of all the tasks of all the ligands.
+	size_t get_sln_elems() const;
+
+	//! Returns the number of elements of the conformations of all the tasks of all the ligands.
+	size_t get_cnf_elems() const;
+
+	//! Encodes the descriptors and the ligands into an array of get_lig_elems() integers for a scoring function of nr samples per type pair.
+	void encode(int* const p, const size_t nr) const;
+private:
+	const size_t num_tasks; //!< Number of tasks per ligand.
+	size_t lig_elems; //!< Number of elements of the encoded ligands, excluding the descriptors.
+	size_t max_lig_elems; //!< Number of elements of the largest encoded ligand.
+	size_t sln_elems; //!< Number of solution elements of the ligands.
+	size_t cnf_elems; //!< Number of conformation elements of the ligands.
+};
+
+#endif
@@ -0,0 +1,203 @@
+#include <cctype>
+#include <cstring>
+#include <algorithm>
+#include <boost/interprocess/file_mapping.hpp>
+#include <boost/interprocess/mapped_region.hpp>
+#include <boost/iostreams/filter/gzip.hpp>
+#include <boost/iostreams/device/file.hpp>
+#include "ligand_reader.hpp"
+
+//! Number of bytes to decompress per read.
+static const size_t chunk_size = 1 << 24;
+
+//! Returns true if a line of n characters starts with record r of l characters.
+static bool has_record(const char* const line, const size_t n, const char* const r, const size_t l)
+{
+	return n >= l && !memcmp(line, r, l);
+}
+
+//! Returns the end of the ligand beginning at b, i.e. the end of its TORSDOF line, or nullptr if there is no TORSDOF line before e. Sets atoms to true if an ATOM/HETATM record precedes the end.
+static const char* find_end(const char* const b, const char* const e, bool& atoms)
+{
+	atoms = false;
+	for (const char* line = b; line < e;)
+	{
+		const char* const eol = find(line, e, '\n');
+		const char* const next = eol + (eol < e);
+		const size_t n = eol - line;
+		if (has_record(line, n, "ATOM  ", 6) || has_record(line, n, "HETATM", 6))
+		{
+			atoms = true;
+		}
+		else if (has_record(line, n, "TORSDOF", 7))
+		{
+			return next;
+		}
+		line = next;
+	}
+	return nullptr;
+}
+
+//! Returns the name of the ligand in [b, e) given by its REMARK Name record, or the serial of its MODEL record prefixed by the stem of the input file, or an empty string if it has neither.
+static string find_name(const char* const b, const char* const e, const string& stem)
+{
+	string model;
+	for (const char* line = b; line < e;)
+	{
+		const char* const eol = find(line, e, '\n');
+		const char* const next = eol + (eol < e);
+		const char* last = eol;
+		while (last > line && isspace(last[-1])) --last;
+		if (has_record(line, last - line, "REMARK", 6))
+		{
+			static const char key[] = "Name = ";
+			const char* const k = search(line + 6, last, key, key + sizeof(key) - 1);
+			if (k != last) return string(k + sizeof(key) - 1, last);
+		}
+		else if (model.empty() && has_record(line, last - line, "MODEL", 5))
+		{
+			const char* first = line + 5;
+			while (first < last && isspace(*first)) ++first;
+			if (first < last) model = stem + '_' + string(first, last);
+		}
+		line = next;
+	}
+	return model;
+}
+
+//! Returns the name reduced to a single path component, i.e. with path separators, drive colons and control characters replaced by underscores, or an empty string if nothing but dots is left.
+static string safe_name(string name)
+{
+	for (char& c : name)
+	{
+		if (c == '/' || c == '\\' || c == ':' || iscntrl(static_cast<unsigned char>(c))) c = '_';
+	}
+	return name.find_first_not_of('.') == string::npos ? string() : name;
+}
+
+ligand_reader::ligand_reader(const path& p, const size_t offset) : folder(is_directory(p)), p(nullptr), e(nullptr), offset(0), ordinal(0)
+{
+	if (folder)
+	{
+		dir_iter = directory_iterator(p);
+	}
+	else
+	{
+		open(p, offset);
+	}
+}
+
+bool ligand_reader::open(const path& q, const size_t off)
+{
+	using namespace boost::interprocess;
+	using namespace boost::iostreams;
+	const bool compressed = q.extension() == ".gz";
+	stem = (compressed ? q.stem().stem() : q.stem()).string();
+	gz.reset();
+	storage.reset();
+	p = e = nullptr;
+	offset = off;
+	ordinal = 0;
+	if (compressed)
+	{
+		// Skip to the offset in the decompressed text, whose first chunk is read by next.
+		gz.reset(new filtering_istream);
+		gz->push(gzip_decompressor());
+		gz->push(file_source(q.string(), ios_base::in | ios_base::binary));
+		gz->ignore(off);
+		return true;
+	}
+	boost::system::error_code ec;
+	const uintmax_t size = file_size(q, ec);
+	if (ec || size <= off) return false;
+	const auto region = make_shared<mapped_region>(file_mapping(q.string().c_str(), read_only), read_only);
+	storage = region;
+	e = static_cast<const char*>(region->get_address()) + region->get_size();
+	p = static_cast<const char*>(region->get_address()) + off;
+	return true;
+}
+
+bool ligand_reader::refill()
+{
+	// Copy the unconsumed text into a new buffer, so that ligands read before keep pointing into the old one.
+	const auto buf = make_shared<string>(p, e);
+	const size_t n = buf->size();
+	buf->resize(n + chunk_size);
+	gz->read(&(*buf)[n], chunk_size);
+	const size_t r = gz->gcount();
+	buf->resize(n + r);
+
+	// Close the stream once a short read indicates the end of the file.
+	if (r < chunk_size) gz.reset();
+	if (!r) return false;
+	storage = buf;
+	p = buf->data();
+	e = p + buf->size();
+	return true;
+}
+
+bool ligand_reader::next(ligand_block& blk)
+{
+	while (true)
+	{
+		// Find the end of the next ligand, decompressing more text until a TORSDOF line or the end of the file is reached.
+		bool atoms;
+		const char* end = find_end(p, e, atoms);
+		if (!end)
+		{
+			if (gz && refill()) continue;
+			end = e;
+		}
+
+		// Skip text without atoms, e.g. trailing blank lines or a lone ENDMDL record.
+		if (atoms)
+		{
+			// Name the ligand after the input file if it is the only one in the file, or after its REMARK Name or MODEL record, or after the file and its ordinal counted from the starting offset.
+			// Whether the file holds more ligands is looked ahead for in compressed files too, decompressing up to the end of the second ligand, so that names do not depend on compression.
+			bool more = true;
+			if (!ordinal && !offset)
+			{
+				const size_t n = end - p;
+				while (!find_end(p + n, e, more) && gz && refill());
+				end = p + n;
+			}
+			string name = more ? safe_name(find_name(p, end, stem)) : stem;
+			if (name.empty()) name = stem + '_' + to_string(ordinal + 1);
+
+			// Make a name given to an earlier ligand unique by appending the ordinal, so that no output file overwrites another.
+			if (!names.insert(name).second)
+			{
+				const string base = name + '_' + to_string(ordinal + 1);
+				name = base;
+				for (size_t i = 2; !names.insert(name).second; ++i) name = base + '_' + to_string(i);
+			}
+			blk.filename = name + ".pdbqt";
+			blk.b = p;
+			blk.e = end;
+			blk.offset = offset;
+			blk.storage = storage;
+			++ordinal;
+			offset += end - p;
+			p = end;
+			return true;
+		}
+		offset += end - p;
+		p = end;
+		if (p < e || gz) continue;
+
+		// Open the next PDBQT file of the folder once the current one is exhausted.
+		storage.reset();
+		if (!folder) return false;
+		bool opened = false;
+		while (!opened && dir_iter != directory_iterator())
+		{
+			const path q = dir_iter->path();
+			++dir_iter;
+			if ((q.extension() == ".pdbqt" || (q.extension() == ".gz" && q.stem().extension() == ".pdbqt")) && is_regular_file(q))
+			{
+				opened = open(q, 0);
+			}
+		}
+		if (!opened) return false;
+	}
+}
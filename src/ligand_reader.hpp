@@ -0,0 +1,53 @@
+#pragma once
+#ifndef IDOCK_LIGAND_READER_HPP
+#define IDOCK_LIGAND_READER_HPP
+
+#include <memory>
+#include <unordered_set>
+#include <boost/filesystem/operations.hpp>
+#include <boost/iostreams/filtering_stream.hpp>
+using namespace std;
+using namespace boost::filesystem;
+
+//! Represents the PDBQT text of an input ligand, which points into storage shared with the reader and with other ligands of the same input file.
+class ligand_block
+{
+public:
+	path filename; //!< Filename of the output ligand.
+	const char* b; //!< Beginning of the PDBQT text.
+	const char* e; //!< End of the PDBQT text.
+	size_t offset; //!< Byte offset of the PDBQT text in the uncompressed input file, from which a later run can resume.
+	shared_ptr<const void> storage; //!< Mapped region or decompressed buffer that the text points into.
+};
+
+//! Represents a reader of input ligands from either a folder of PDBQT files or a single PDBQT file. A file may concatenate many ligands, each ending with a TORSDOF record and optionally wrapped in MODEL and ENDMDL records.
+//! Files are memory-mapped, or decompressed in large sequential reads if their names end with .gz, and are split into ligands without copying.
+//! Each ligand is named by a single path component, unique among the ligands read, so that its output file stays within the output folder and overwrites no other.
+class ligand_reader
+{
+public:
+	//! Opens a folder or a file of input ligands. For a file, reading starts at a byte offset, which should be the ligand_block::offset of a ligand read by a previous run.
+	explicit ligand_reader(const path& p, const size_t offset = 0);
+
+	//! Reads the next ligand, and returns false if there are no more.
+	bool next(ligand_block& blk);
+private:
+	//! Opens an input file to split from a byte offset, and returns false if it is empty.
+	bool open(const path& p, const size_t offset);
+
+	//! Appends the next chunk of the decompressed input file to the unconsumed text, and returns false at the end of the file.
+	bool refill();
+
+	bool folder; //!< True if reading from a folder.
+	directory_iterator dir_iter; //!< Iterator over the files of the input folder.
+	string stem; //!< Stem of the current input file, without the .pdbqt and .gz extensions.
+	unique_ptr<boost::iostreams::filtering_istream> gz; //!< Decompressing stream of the current input file if compressed.
+	shared_ptr<const void> storage; //!< Mapped region or decompressed buffer of the current input file.
+	const char* p; //!< Beginning of the unconsumed text of the current input file.
+	const char* e; //!< End of the mapped or decompressed text of the current input file.
+	size_t offset; //!< Byte offset of p in the uncompressed current input file.
+	size_t ordinal; //!< Number of ligands read from the current input file.
+	unordered_set<string> names; //!< Names given to the ligands read so far, which names of later ligands are made unique against. Ligands before the starting offset of a resumed run are not counted.
+};
+
+#endif
@@ -1,29 +1,104 @@
 #include <iomanip>
-#include <boost/filesystem/fstream.hpp>
+#include <algorithm>
 #include "log.hpp"
 
-void log_engine::write(const path& log_path) const
+log_engine::log_engine(const path& log_path, const size_t max_conformations, const bool adaptive, const size_t top_k, const vector<string>& columns) : summary_path(top_k ? log_path.parent_path() / (log_path.stem().string() + "_top" + log_path.extension().string()) : path()), log_path(log_path), columns(columns), max_conformations(columns.empty() ? max_conformations : columns.size()), adaptive(adaptive), top_k(top_k), num_records(0)
 {
-	const size_t max_conformations = front().affinities.capacity();
-	boost::filesystem::ofstream log(log_path);
-	log.setf(ios::fixed, ios::floatfield);
-	log << "Ligand";
-	for (size_t i = 1; i <= max_conformations; ++i)
-	{
-		log << ",pKd" << i;
-	}
-	log << '\n' << setprecision(2);
-	for (const auto& r : *this)
-	{
-		log << r.stem;
-		for (const float a : r.affinities)
-		{
-			log << ',' << a;
-		}
-		for (size_t i = r.affinities.size(); i < max_conformations; ++i)
-		{
-			log << ',';
-		}
-		log << '\n';
+	if (!top_k) return;
+	ofs.open(log_path);
+	if (!ofs) throw runtime_error("Failed to create log file " + log_path.string());
+	write_header(ofs);
+}
+
+void log_engine::push_back(string&& stem, vector<float>&& affinities, const size_t num_tasks)
+{
+	++num_records;
+	if (!top_k)
+	{
+		records.emplace_back(move(stem), move(affinities), num_tasks);
+		return;
+	}
+
+	// Stream the record, and keep it in place of the worst kept record if it is better.
+	log_record r(move(stem), move(affinities), num_tasks);
+	write_record(ofs, r);
+	if (records.size() < top_k)
+	{
+		records.push_back(move(r));
+		push_heap(records.begin(), records.end());
+	}
+	else if (r < records.front())
+	{
+		pop_heap(records.begin(), records.end());
+		records.back() = move(r);
+		push_heap(records.begin(), records.end());
+	}
+}
+
+size_t log_engine::size() const
+{
+	return num_records;
+}
+
+bool log_engine::empty() const
+{
+	return !num_records;
+}
+
+void log_engine::write()
+{
+	boost::filesystem::ofstream log;
+	if (top_k)
+	{
+		ofs.close();
+		sort_heap(records.begin(), records.end());
+		log.open(summary_path);
+	}
+	else
+	{
+		sort(records.begin(), records.end());
+		log.open(log_path);
+	}
+	write_header(log);
+	for (const auto& r : records)
+	{
+		write_record(log, r);
+	}
+}
+
+void log_engine::write_header(ostream& os) const
+{
+	os.setf(ios::fixed, ios::floatfield);
+	os << "Ligand";
+	for (const string& c : columns)
+	{
+		os << ',' << c;
+	}
+	for (size_t i = columns.size() + 1; i <= max_conformations; ++i)
+	{
+		os << ",pKd" << i;
+	}
+	if (adaptive)
+	{
+		os << ",Tasks";
+	}
+	os << '\n' << setprecision(2);
+}
+
+void log_engine::write_record(ostream& os, const log_record& r) const
+{
+	os << r.stem;
+	for (const float a : r.affinities)
+	{
+		os << ',' << a;
+	}
+	for (size_t i = r.affinities.size(); i < max_conformations; ++i)
+	{
+		os << ',';
+	}
+	if (adaptive)
+	{
+		os << ',' << r.num_tasks;
 	}
+	os << '\n';
 }
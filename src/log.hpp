@@ -2,8 +2,10 @@
 #ifndef IDOCK_LOG_HPP
 #define IDOCK_LOG_HPP
 
-#include <boost/ptr_container/ptr_vector.hpp>
-#include <boost/filesystem/path.hpp>
+#include <deque>
+#include <vector>
+#include <string>
+#include <boost/filesystem/fstream.hpp>
 using namespace std;
 using namespace boost::filesystem;
 
@@ -11,11 +13,12 @@ using namespace boost::filesystem;
 class log_record
 {
 public:
-	const string stem; //!< Stem of the ligand filename.
-	const vector<float> affinities; //!< Predicted binding affinities of the ligand.
+	string stem; //!< Stem of the ligand filename.
+	vector<float> affinities; //!< Predicted binding affinities of the ligand.
+	size_t num_tasks; //!< Number of Monte Carlo tasks run for the ligand if the tasks are adaptive, or 0 otherwise.
 
 	//! Constructs a log record by moving the file stem and predicted binding affinities of a ligand.
-	explicit log_record(string&& stem_, vector<float>&& affinities_) : stem(move(stem_)), affinities(move(affinities_)) {}
+	explicit log_record(string&& stem_, vector<float>&& affinities_, const size_t num_tasks = 0) : stem(move(stem_)), affinities(move(affinities_)), num_tasks(num_tasks) {}
 };
 
 //! Compares two log records by their first predicted binding affinity.
@@ -24,12 +27,42 @@ inline bool operator<(const log_record& r0, const log_record& r1)
 	return r0.affinities.front() < r1.affinities.front();
 }
 
-//! Represents a vector of log records.
-class log_engine : public boost::ptr_vector<log_record>
+//! Represents the log of docked ligands, whose records are allocated in the blocks of a deque rather than one by one.
+//! By default all the records are kept, and written to the log file sorted at the end. If top_k is nonzero, records are instead streamed to the log file in the order they are pushed, and only the top_k of the lowest first affinities are kept for a ranked summary file, so that memory stays bounded however many ligands are docked.
+class log_engine
 {
 public:
-	//! Write ligand log records to the log file.
-	void write(const path& log_path) const;
+	const path summary_path; //!< Ranked summary file, named after the log file with a _top suffix, if top_k is nonzero.
+
+	//! Constructs a log of up to max_conformations affinities per ligand, with a column of the number of Monte Carlo tasks run if the tasks are adaptive. Creates the log file at once if top_k is nonzero. If columns is not empty, the affinities are headed by columns instead of pKd1 to pKd<max_conformations>, and there are as many of them as columns.
+	explicit log_engine(const path& log_path, const size_t max_conformations, const bool adaptive, const size_t top_k = 0, const vector<string>& columns = vector<string>());
+
+	//! Pushes the log record of a ligand, and streams it to the log file if top_k is nonzero. Not thread safe.
+	void push_back(string&& stem, vector<float>&& affinities, const size_t num_tasks = 0);
+
+	//! Returns the number of records pushed.
+	size_t size() const;
+
+	//! Returns true if no records have been pushed.
+	bool empty() const;
+
+	//! Writes the records sorted by their first affinity to the log file, or the kept top_k records to the summary file after closing the log file if top_k is nonzero.
+	void write();
+private:
+	//! Writes the header line of a log file.
+	void write_header(ostream& os) const;
+
+	//! Writes the line of a record.
+	void write_record(ostream& os, const log_record& r) const;
+
+	const path log_path; //!< Log file.
+	const vector<string> columns; //!< Headers of the affinity columns, or empty for pKd1 to pKd<max_conformations>.
+	const size_t max_conformations; //!< Maximum number of affinities per ligand.
+	const bool adaptive; //!< Whether to write a column of the number of tasks run.
+	const size_t top_k; //!< Number of best records to keep, or 0 to keep all.
+	deque<log_record> records; //!< Records kept, as a max-heap by first affinity if top_k is nonzero.
+	size_t num_records; //!< Number of records pushed.
+	boost::filesystem::ofstream ofs; //!< Log file streamed to if top_k is nonzero.
 };
 
 #endif
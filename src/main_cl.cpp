@@ -1,48 +1,64 @@
 #include <chrono>
+#include <cstring>
+#include <algorithm>
 #include <iostream>
 #include <iomanip>
 #include <numeric>
+#include <atomic>
 #include <boost/program_options.hpp>
 #include <boost/filesystem/operations.hpp>
 #include <CL/cl.h>
 #include "cl_helper.h"
-#include "io_service_pool.hpp"
+#include "task_scheduler.hpp"
 #include "safe_class.hpp"
+#include "checksum.hpp"
 #include "random_forest.hpp"
 #include "receptor.hpp"
-#include "ligand.hpp"
+#include "ligand_batch.hpp"
+#include "cpu_backend.hpp"
+#include "ligand_reader.hpp"
+#include "kernel_cache.hpp"
 #include "log.hpp"
 #include "source.hpp"
+#include "profile.hpp"
 
-//! Represents a data wrapper for kernel callback.
+//! Represents a data wrapper for kernel callback, which writes the ligands of a batch.
 template <typename T>
 class callback_data
 {
 public:
-	callback_data(io_service_pool& io, cl_event cbex, const path& output_folder_path, const size_t max_conformations, const size_t num_tasks, const receptor& rec, const forest& f, const scoring_function& sf, const T dev, float* const cnfh, ligand&& lig_, cl_mem slnd, safe_function& safe_print, log_engine& log, safe_vector<T>& idle) : io(io), cbex(cbex), output_folder_path(output_folder_path), max_conformations(max_conformations), num_tasks(num_tasks), rec(rec), f(f), sf(sf), dev(dev), cnfh(cnfh), lig(move(lig_)), slnd(slnd), safe_print(safe_print), log(log), idle(idle) {}
-	io_service_pool& io;
+	callback_data(task_scheduler& ts, cl_event cbex, const path& output_folder_path, const size_t max_conformations, const size_t num_candidates, const receptor& rec, const forest& f, const scoring_function& sf, const T dev, vector<float*>&& cnfh_, ligand_batch&& bat_, cl_mem cnfd, safe_function& safe_print, log_engine& log, safe_vector<T>& idle, profile* const prof, const cl_event kernel_event, const cl_event rank_event, vector<cl_event>&& transfer_events_) : ts(ts), cbex(cbex), output_folder_path(output_folder_path), max_conformations(max_conformations), num_candidates(num_candidates), rec(rec), f(f), sf(sf), dev(dev), cnfh(move(cnfh_)), bat(move(bat_)), remaining(bat.size()), cnfd(cnfd), safe_print(safe_print), log(log), idle(idle), prof(prof), kernel_event(kernel_event), rank_event(rank_event), transfer_events(move(transfer_events_)) {}
+	task_scheduler& ts;
 	cl_event cbex;
 	const path& output_folder_path;
 	const size_t max_conformations;
-	const size_t num_tasks;
+	const size_t num_candidates; //!< Number of conformations of each ligand mapped, which are those of all the tasks unless ranked on the device.
 	const receptor& rec;
 	const forest& f;
 	const scoring_function& sf;
 	const T dev;
-	float* const cnfh;
-	ligand lig;
-	cl_mem slnd;
+	const vector<float*> cnfh; //!< Mapped conformations of each ligand of the batch, of stride num_candidates.
+	ligand_batch bat;
+	atomic<size_t> remaining; //!< Number of ligands of the batch yet to be written.
+	cl_mem cnfd; //!< Buffer the conformations are mapped from, i.e. the solutions, or the candidates if ranked on the device.
 	safe_function& safe_print;
 	log_engine& log;
 	safe_vector<T>& idle;
+	profile* const prof; //!< Profile to add the kernel and transfer time of the batch to, or null.
+	const cl_event kernel_event; //!< Event of the kernel of the batch.
+	const cl_event rank_event; //!< Event of the rank kernel of the batch, or null if not ranked on the device.
+	const vector<cl_event> transfer_events; //!< Events of writing the ligands, clearing the solutions and mapping the conformations of the batch.
 };
 
 int main(int argc, char* argv[])
 {
-	path receptor_path, input_folder_path, output_folder_path, log_path;
+	path receptor_path, input_folder_path, output_folder_path, log_path, sf_cache_path, maps_path, forest_path, kernel_cache_path, profile_path;
 	array<float, 3> center, size;
-	size_t seed, num_threads, num_trees, num_tasks, num_bfgs_iterations, max_conformations;
-	float granularity;
+	size_t input_offset, seed, num_threads, num_cpu_slots, batch_size, num_trees, num_tasks, num_bfgs_iterations, max_conformations, candidate_multiple, top_k, sf_samples;
+	float granularity, brick_cap;
+	string precision_name;
+	map_precision precision;
+	bool textures, device_maps;
 
 	// Parse program options in a try/catch block.
 	try
@@ -50,8 +66,9 @@ int main(int argc, char* argv[])
 		// Initialize the default values of optional arguments.
 		const path default_output_folder_path = "output";
 		const path default_log_path = "log.csv";
-		const size_t default_seed = chrono::system_clock::now().time_since_epoch().count();
+		const size_t default_seed = std::chrono::system_clock::now().time_since_epoch().count();
 		const size_t default_num_threads = thread::hardware_concurrency();
+		const size_t default_batch_size = 8;
 		const size_t default_num_trees = 128;
 		const size_t default_num_tasks = 256;
 		const size_t default_num_bfgs_iterations = 300;
@@ -63,7 +80,7 @@ int main(int argc, char* argv[])
 		options_description input_options("input (required)");
 		input_options.add_options()
 			("receptor", value<path>(&receptor_path)->required(), "receptor in PDBQT format")
-			("input_folder", value<path>(&input_folder_path)->required(), "folder of input ligands in PDBQT format")
+			("input_folder", value<path>(&input_folder_path), "folder of input ligands in PDBQT format, or a file of concatenated ligands optionally compressed by gzip, which can be omitted to create a map file only")
 			("center_x", value<float>(&center[0])->required(), "x coordinate of the search space center")
 			("center_y", value<float>(&center[1])->required(), "y coordinate of the search space center")
 			("center_z", value<float>(&center[2])->required(), "z coordinate of the search space center")
@@ -75,16 +92,31 @@ int main(int argc, char* argv[])
 		output_options.add_options()
 			("output_folder", value<path>(&output_folder_path)->default_value(default_output_folder_path), "folder of output ligands in PDBQT format")
 			("log", value<path>(&log_path)->default_value(default_log_path), "log file in csv format")
+			("top_k", value<size_t>(&top_k)->default_value(0), "log records of the best ligands to keep for a ranked summary file while streaming all the records to the log file, or 0 to write all the records sorted at the end")
+			("profile", value<path>(&profile_path), "profile file in JSON to write the time spent in each phase and the kernel and transfer time of each device to, next to a CSV file of the work of each ligand docked on the worker threads")
 			;
 		options_description miscellaneous_options("options (optional)");
 		miscellaneous_options.add_options()
 			("seed", value<size_t>(&seed)->default_value(default_seed), "explicit non-negative random seed")
 			("threads", value<size_t>(&num_threads)->default_value(default_num_threads), "worker threads to use")
+			("cpu_batches", value<size_t>(&num_cpu_slots)->default_value(0), "batches to dock on the worker threads alongside the devices at a time, or 0 to dock on the devices only")
+			("batch", value<size_t>(&batch_size)->default_value(default_batch_size), "ligands to dock in one kernel launch")
 			("trees", value<size_t>(&num_trees)->default_value(default_num_trees), "trees in random forest")
 			("tasks", value<size_t>(&num_tasks)->default_value(default_num_tasks), "Monte Carlo tasks for global search")
 			("generations", value<size_t>(&num_bfgs_iterations)->default_value(default_num_bfgs_iterations), "generations in BFGS")
 			("max_conformations", value<size_t>(&max_conformations)->default_value(default_max_conformations), "maximum binding conformations to write")
+			("candidates", value<size_t>(&candidate_multiple)->default_value(0), "multiple of max_conformations of the conformations of each ligand to rank by free energy and deduplicate on the device and map for clustering, or 0 to map the conformations of all the tasks")
 			("granularity", value<float>(&granularity)->default_value(default_granularity), "density of probe atoms of grid maps")
+			("textures", bool_switch(&textures), "create grid maps of all atom types before docking and sample them as a 3D image with hardware trilinear filtering")
+			("device_maps", bool_switch(&device_maps), "create the grid maps missing for a batch on each device that docks it rather than on the host and write them, reading them back to the host only for CPU batches, which requires dense float32 grid maps")
+			("brick_cap", value<float>(&brick_cap)->default_value(0), "energy cap of sparse grid maps, which store only the bricks of 8x8x8 cells with any energy below the cap and read the others as the cap, or 0 for dense grid maps")
+			("map_precision", value<string>(&precision_name)->default_value("float32"), "precision of grid maps to dock with, either float32, float16, or int16 with a scale and an offset per map, while map files hold float32")
+			("sf_cache", value<path>(&sf_cache_path), "cache file of precalculated scoring function to map or create")
+			("sf_samples", value<size_t>(&sf_samples)->default_value(scoring_function::default_ns), "samples of the scoring function per unit squared distance, which are interpolated linearly unless the default")
+			("maps", value<path>(&maps_path), "file of grid maps of all atom types to map or create")
+			("forest", value<path>(&forest_path), "model file of random forest trained with the current seed and number of trees to load or create")
+			("kernel_cache", value<path>(&kernel_cache_path), "folder of program binaries compiled for each device, driver and kernel source to load or save")
+			("input_offset", value<size_t>(&input_offset)->default_value(0), "byte offset of the input file to resume reading ligands from")
 			("help", "help information")
 			("version", "version information")
 			("config", value<path>(), "configuration file to load options from")
@@ -120,35 +152,82 @@ int main(int argc, char* argv[])
 		// Notify the user of parsing errors, if any.
 		vm.notify();
 
-		// Validate receptor.
-		if (!is_regular_file(receptor_path))
+		// Parse map_precision.
+		precision = parse_map_precision(precision_name);
+
+		// Validate batch.
+		if (!batch_size)
 		{
-			cerr << "Receptor " << receptor_path << " does not exist or is not a regular file" << endl;
+			cerr << "Option batch must be 1 or greater" << endl;
 			return 1;
 		}
 
-		// Validate input_folder.
-		if (!is_directory(input_folder_path))
+		// Validate sf_samples.
+		if (!sf_samples)
 		{
-			cerr << "Input folder " << input_folder_path << " does not exist or is not a directory" << endl;
+			cerr << "Option sf_samples must be 1 or greater" << endl;
 			return 1;
 		}
 
-		// Validate output_folder.
-		if (exists(output_folder_path))
+		// Validate brick_cap, as the image is dense.
+		if (brick_cap && textures)
 		{
-			if (!is_directory(output_folder_path))
+			cerr << "Options brick_cap and textures are mutually exclusive" << endl;
+			return 1;
+		}
+		if (precision != map_float32 && textures)
+		{
+			cerr << "Options map_precision and textures are mutually exclusive" << endl;
+			return 1;
+		}
+
+		// Validate device_maps, whose kernel populates dense float32 grid maps in device memory on the fly.
+		if (device_maps && (textures || brick_cap || precision != map_float32 || !maps_path.empty()))
+		{
+			cerr << "Option device_maps supports none of options textures, brick_cap, map_precision other than float32 and maps" << endl;
+			return 1;
+		}
+
+		// Validate receptor.
+		if (!is_regular_file(receptor_path))
+		{
+			cerr << "Receptor " << receptor_path << " does not exist or is not a regular file" << endl;
+			return 1;
+		}
+
+		// Validate input_folder, which is required unless a map file is to be created.
+		if (input_folder_path.empty())
+		{
+			if (maps_path.empty())
 			{
-				cerr << "Output folder " << output_folder_path << " is not a directory" << endl;
+				cerr << "the option '--input_folder' is required but missing" << endl;
 				return 1;
 			}
 		}
-		else
+		else if (!is_directory(input_folder_path) && !is_regular_file(input_folder_path))
 		{
-			if (!create_directories(output_folder_path))
+			cerr << "Input folder " << input_folder_path << " does not exist or is neither a directory nor a regular file" << endl;
+			return 1;
+		}
+
+		// Validate output_folder if ligands are to be docked.
+		if (!input_folder_path.empty())
+		{
+			if (exists(output_folder_path))
 			{
-				cerr << "Failed to create output folder " << output_folder_path << endl;
-				return 1;
+				if (!is_directory(output_folder_path))
+				{
+					cerr << "Output folder " << output_folder_path << " is not a directory" << endl;
+					return 1;
+				}
+			}
+			else
+			{
+				if (!create_directories(output_folder_path))
+				{
+					cerr << "Failed to create output folder " << output_folder_path << endl;
+					return 1;
+				}
 			}
 		}
 	}
@@ -161,28 +240,121 @@ int main(int argc, char* argv[])
 	// Initialize a Mersenne Twister random number generator.
 	cout << "Using random seed " << seed << endl;
 
-	cout << "Creating an io service pool of " << num_threads << " worker threads" << endl;
-	io_service_pool io(num_threads);
-	safe_counter<size_t> cnt;
+	// Map the conformations of all the tasks of each ligand, unless candidates are ranked and deduplicated on the devices, in which case fewer of them are.
+	const size_t num_candidates = candidate_multiple ? min(num_tasks, candidate_multiple * max_conformations) : num_tasks;
+
+	// Profile the run if requested.
+	unique_ptr<profile> prof;
+	if (!profile_path.empty())
+	{
+		cout << "Profiling to " << profile_path << endl;
+		prof.reset(new profile(profile_path));
+	}
+
+	cout << "Creating a task scheduler of " << num_threads << " worker threads" << endl;
+	task_scheduler ts(num_threads);
 	safe_function safe_print;
 
-	cout << "Precalculating a scoring function of " << scoring_function::n << " atom types in parallel" << endl;
-	scoring_function sf;
-	cnt.init((sf.n + 1) * sf.n >> 1);
-	for (size_t t1 = 0; t1 < sf.n; ++t1)
-	for (size_t t0 = 0; t0 <=  t1; ++t0)
+	// Precalculate the type pairs of the scoring function claimed in parallel.
+	// The main thread times the phases of setting up in turn.
+	profile_timer pt(prof.get(), phase_scoring_function);
+	scoring_function sf(sf_cache_path, sf_samples);
+	const auto precalculate_pairs = [&](const vector<array<size_t, 2>>& pairs)
 	{
-		io.post([&, t0, t1]()
+		task_group tg(ts);
+		for (const auto& p : pairs)
 		{
-			sf.precalculate(t0, t1);
-			cnt.increment();
-		});
+			tg.run([&, p]()
+			{
+				sf.precalculate(p[0], p[1]);
+			});
+		}
+		tg.wait();
+	};
+	array<bool, scoring_function::n> all_types;
+	all_types.fill(true);
+	if (sf.mapped)
+	{
+		cout << "Mapping a precalculated scoring function from " << sf_cache_path << endl;
+	}
+	else if (!sf_cache_path.empty())
+	{
+		cout << "Precalculating a scoring function of " << scoring_function::n << " atom types in parallel" << endl;
+		precalculate_pairs(sf.claim(all_types, all_types));
+
+		// Save the scoring function to the cache file for subsequent runs.
+		cout << "Saving the precalculated scoring function to " << sf_cache_path << endl;
+		if (!sf.save(sf_cache_path))
+		{
+			cerr << "Failed to save scoring function cache " << sf_cache_path << endl;
+		}
+	}
+	else
+	{
+		// Precalculate only the type pairs that the grid maps and the ligands look up, as they are first needed.
+		cout << "Precalculating a scoring function of " << sf.ns << " samples per unit squared distance for the atom type pairs looked up" << endl;
 	}
-	cnt.wait();
 	const int sfs = sf.ns;
 
+	pt.next(phase_receptor);
 	cout << "Parsing receptor " << receptor_path << endl;
-	receptor rec(receptor_path, center, size, granularity);
+	receptor rec(receptor_path, center, size, granularity, brick_cap, precision);
+	pt.next(phase_maps);
+
+	// Map grid maps of all atom types from the map file if it is valid, or create them and save them to the map file if any. The image is created of all atom types before docking.
+	if (!maps_path.empty() || textures)
+	{
+		vector<size_t> xs(sf.n);
+		iota(xs.begin(), xs.end(), 0);
+		if (!maps_path.empty() && rec.map(maps_path, sf))
+		{
+			cout << "Mapping grid maps from " << maps_path << endl;
+		}
+		else
+		{
+			cout << "Creating grid maps of " << scoring_function::n << " atom types in parallel" << endl;
+			pt.next(phase_scoring_function);
+			precalculate_pairs(sf.claim(all_types, rec.types));
+			pt.next(phase_maps);
+			const auto start = std::chrono::steady_clock::now();
+			rec.allocate(xs);
+			rec.precalculate(sf, xs);
+			for (size_t l = 0; l < rec.num_layers(); ++l)
+			{
+				task_group tg(ts);
+				for (size_t z = rec.layer_begin(l); z < rec.layer_end(l); ++z)
+				{
+					tg.run([&,z]()
+					{
+						rec.populate(xs, z, sf);
+					});
+				}
+				tg.wait();
+				rec.store(xs, l);
+			}
+			if (prof) prof->add_maps(xs, std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - start).count());
+
+			if (!maps_path.empty())
+			{
+				cout << "Saving grid maps to " << maps_path << endl;
+				if (!rec.save(maps_path, sf))
+				{
+					cerr << "Failed to save grid maps to " << maps_path << endl;
+				}
+			}
+		}
+		rec.quantize(xs);
+	}
+
+	// Exit if only the map file is to be created.
+	if (input_folder_path.empty())
+	{
+		ts.wait();
+		pt.stop();
+		if (prof) prof->write();
+		return 0;
+	}
+	pt.stop();
 
 	cout << "Detecting OpenCL platforms" << endl;
 	char name[256];
@@ -192,7 +364,7 @@ int main(int argc, char* argv[])
 	vector<cl_platform_id> platforms(num_platforms);
 	checkOclErrors(clGetPlatformIDs(num_platforms, platforms.data(), NULL));
 	vector<cl_uint> num_platform_devices(num_platforms);
-	cl_uint num_devices = 0;
+	int num_devices = 0; // Devices are indexed by int, as are the CPU slots that follow them.
 	for (cl_uint i = 0; i < num_platforms; ++i)
 	{
 		const auto platform = platforms[i];
@@ -209,6 +381,7 @@ int main(int argc, char* argv[])
 		cerr << "No OpenCL devices detected" << endl;
 		return 2;
 	}
+	if (prof) prof->set_num_devices(num_devices);
 	vector<cl_device_id> devices(num_devices);
 	vector<bool> cl12(num_devices);
 	vector<cl_bool> host_unified_memory(num_devices);
@@ -219,7 +392,7 @@ int main(int argc, char* argv[])
 		const auto platform = platforms[i];
 		const auto npd = num_platform_devices[i];
 		checkOclErrors(clGetDeviceIDs(platform, CL_DEVICE_TYPE_ALL, npd, &devices[dev], NULL));
-		for (int d = 0; d < npd; ++d, ++dev)
+		for (cl_uint d = 0; d < npd; ++d, ++dev)
 		{
 			const auto device = devices[dev];
 			cl_uint max_compute_units;
@@ -248,18 +421,36 @@ int main(int argc, char* argv[])
 	source src;
 	const char* sources[] = { src.data() };
 	const size_t source_length = src.size();
+	string build_options_string = "-cl-fast-relaxed-math"/*-cl-std=CL1.2 -cl-nv-maxrregcount 32*/;
+	if (textures) build_options_string += " -D TEXTURES";
+	if (brick_cap) build_options_string += " -D BRICKS";
+	if (precision == map_float16) build_options_string += " -D FLOAT16";
+	if (precision == map_int16) build_options_string += " -D INT16";
+	if (sf.interpolated) build_options_string += " -D INTERPOLATE";
+	const char* const build_options = build_options_string.c_str();
+	const kernel_cache kc(kernel_cache_path);
 	vector<cl_context> contexts(num_devices);
 	vector<cl_command_queue> queues(num_devices);
 	vector<cl_program> programs(num_devices);
+	vector<uint64_t> keys(num_devices);
+	vector<vector<char>> binaries(num_devices);
 	vector<cl_kernel> kernels(num_devices);
+	vector<cl_kernel> populates(num_devices);
+	vector<cl_kernel> ranks(num_devices);
+	vector<cl_mem> atmd(num_devices);
+	vector<cl_mem> tlod(num_devices);
+	vector<cl_mem> tlad(num_devices);
 	vector<cl_mem> sfed(num_devices);
 	vector<cl_mem> sfdd(num_devices);
+	vector<array<bool, scoring_function::np>> sfu(num_devices); // True for the type pairs of the scoring function written to each device.
 	vector<cl_mem> ligd(num_devices);
 	vector<cl_mem> slnd(num_devices);
-	vector<size_t> lig_elems(num_devices, 2601);
-	vector<size_t> sln_elems(num_devices, 3438);
-	vector<size_t> cnf_elems(num_devices,   43);
+	vector<size_t> lig_elems(num_devices, (2601 + ligand_batch::dsc_elems) * batch_size);
+	vector<size_t> sln_elems(num_devices, 3438 * num_tasks * batch_size);
+	vector<cl_mem> cnfd(num_devices);
+	vector<size_t> cnf_elems(num_devices, 43 * num_candidates * batch_size);
 	vector<array<cl_mem, sf.n>> mpsd(num_devices);
+	vector<cl_mem> mpid(num_devices);
 	cl_int error;
 	for (int dev = 0; dev < num_devices; ++dev)
 	{
@@ -274,136 +465,452 @@ int main(int argc, char* argv[])
 		// Create command queue.
 		cl_command_queue_properties queue_properties;
 		checkOclErrors(clGetDeviceInfo(device, CL_DEVICE_QUEUE_PROPERTIES, sizeof(queue_properties), &queue_properties, NULL));
-		cl_command_queue queue = clCreateCommandQueue(context, device, queue_properties & CL_QUEUE_OUT_OF_ORDER_EXEC_MODE_ENABLE ? CL_QUEUE_OUT_OF_ORDER_EXEC_MODE_ENABLE : 0/* | CL_QUEUE_PROFILING_ENABLE*/, &error);
+		cl_command_queue queue = clCreateCommandQueue(context, device, (queue_properties & CL_QUEUE_OUT_OF_ORDER_EXEC_MODE_ENABLE ? CL_QUEUE_OUT_OF_ORDER_EXEC_MODE_ENABLE : 0) | (prof ? CL_QUEUE_PROFILING_ENABLE : 0), &error);
 		checkOclErrors(error);
 		queues[dev] = queue;
 
-		// Create program.
-		cl_program program = clCreateProgramWithSource(context, 1, sources, &source_length, &error);
-		checkOclErrors(error);
-		programs[dev] = program;
+		// Key the program binary by the device, the driver, the kernel source and the build options.
+		checksum c;
+		for (const cl_device_info param : array<cl_device_info, 4>{{ CL_DEVICE_VENDOR, CL_DEVICE_NAME, CL_DEVICE_VERSION, CL_DRIVER_VERSION }})
+		{
+			checkOclErrors(clGetDeviceInfo(device, param, sizeof(name), name, NULL));
+			c(name, strlen(name));
+		}
+		c(src.data(), src.size());
+		c(build_options, strlen(build_options));
+		keys[dev] = c.value();
+
+		// Create and build program from the cached binary if any.
+		if (!kc.load(keys[dev], binaries[dev])) continue;
+		const size_t binary_length = binaries[dev].size();
+		const unsigned char* binary = reinterpret_cast<const unsigned char*>(binaries[dev].data());
+		cl_int binary_status;
+		cl_program program = clCreateProgramWithBinary(context, 1, &device, &binary_length, &binary, &binary_status, &error);
+		if (error == CL_SUCCESS && binary_status == CL_SUCCESS && clBuildProgram(program, 0, NULL, build_options, NULL, NULL) == CL_SUCCESS)
+		{
+			programs[dev] = program;
+		}
+		else
+		{
+			if (error == CL_SUCCESS) checkOclErrors(clReleaseProgram(program));
+			binaries[dev].clear();
+		}
+	}
+
+	// Build program from source in parallel for one device of each key missing from the cache, and save its binary.
+	vector<int> builders;
+	for (int dev = 0; dev < num_devices; ++dev)
+	{
+		if (programs[dev] || find_if(builders.cbegin(), builders.cend(), [&](const int b) { return keys[b] == keys[dev]; }) != builders.cend()) continue;
+		builders.push_back(dev);
+	}
+	if (!builders.empty())
+	{
+		cout << "Building kernel source for " << builders.size() << " devices in parallel" << endl;
+		task_group tg(ts);
+		for (const int dev : builders)
+		{
+			tg.run([&, dev]()
+			{
+				cl_int error;
+				cl_program program = clCreateProgramWithSource(contexts[dev], 1, sources, &source_length, &error);
+				checkOclErrors(error);
+				checkOclErrors(clBuildProgram(program, 0, NULL, build_options, NULL, NULL));
+				programs[dev] = program;
+				size_t binary_length;
+				checkOclErrors(clGetProgramInfo(program, CL_PROGRAM_BINARY_SIZES, sizeof(binary_length), &binary_length, NULL));
+				binaries[dev].resize(binary_length);
+				unsigned char* binary = reinterpret_cast<unsigned char*>(binaries[dev].data());
+				checkOclErrors(clGetProgramInfo(program, CL_PROGRAM_BINARIES, sizeof(binary), &binary, NULL));
+				if (!kernel_cache_path.empty() && !kc.save(keys[dev], binaries[dev]))
+				{
+					safe_print([&]()
+					{
+						cerr << "Failed to save program binary of device " << dev << " to " << kernel_cache_path << endl;
+					});
+				}
+			});
+		}
+		tg.wait();
+	}
+
+	// Encode the receptor atoms and the atoms near each tile for the grid map kernel, which every device shares.
+	vector<float> atmh;
+	vector<int> tloh, tlah;
+	if (device_maps)
+	{
+		cout << "Creating grid maps on the devices from the atoms near " << rec.num_probes[2] * rec.num_tiles << " tiles" << endl;
+		rec.encode_tiles(atmh, tloh, tlah);
+		if (tlah.empty()) tlah.push_back(0);
+	}
 
-		// Build program.
-		checkOclErrors(clBuildProgram(program, 0, NULL, "-cl-fast-relaxed-math"/*-cl-std=CL1.2 -cl-nv-maxrregcount 32*/, NULL, NULL));
+	for (int dev = 0; dev < num_devices; ++dev)
+	{
+		// Get device, context and command queue.
+		cl_device_id device = devices[dev];
+		cl_context context = contexts[dev];
+		cl_command_queue queue = queues[dev];
+
+		// Create and build program from the binary built for another device of the same key if necessary.
+		if (!programs[dev])
+		{
+			const vector<char>& bin = binaries[*find_if(builders.cbegin(), builders.cend(), [&](const int b) { return keys[b] == keys[dev]; })];
+			const size_t binary_length = bin.size();
+			const unsigned char* binary = reinterpret_cast<const unsigned char*>(bin.data());
+			programs[dev] = clCreateProgramWithBinary(context, 1, &device, &binary_length, &binary, NULL, &error);
+			checkOclErrors(error);
+			checkOclErrors(clBuildProgram(programs[dev], 0, NULL, build_options, NULL, NULL));
+		}
+		cl_program program = programs[dev];
 
 		// Create kernel from program.
 		cl_kernel kernel = clCreateKernel(program, "monte_carlo", &error);
 		checkOclErrors(error);
 		kernels[dev] = kernel;
+		if (device_maps)
+		{
+			populates[dev] = clCreateKernel(program, "populate", &error);
+			checkOclErrors(error);
+		}
+		if (num_candidates < num_tasks)
+		{
+			ranks[dev] = clCreateKernel(program, "rank", &error);
+			checkOclErrors(error);
+		}
 
-		// Create buffers for sfe and sfd.
-		const size_t sfe_bytes = sizeof(float) * sf.e.size();
-		const size_t sfd_bytes = sizeof(float) * sf.d.size();
-		sfed[dev] = clCreateBuffer(context, CL_MEM_READ_ONLY | CL_MEM_COPY_HOST_PTR, sfe_bytes, sf.e.data(), &error);
+		// Create buffers for sfe and sfd, whose type pairs are written before the first launch that looks them up.
+		const size_t sfe_bytes = sizeof(float) * sf.ne;
+		const size_t sfd_bytes = sizeof(float) * sf.ne;
+		sfed[dev] = clCreateBuffer(context, CL_MEM_READ_ONLY, sfe_bytes, NULL, &error);
 		checkOclErrors(error);
-		sfdd[dev] = clCreateBuffer(context, CL_MEM_READ_ONLY | CL_MEM_COPY_HOST_PTR, sfd_bytes, sf.d.data(), &error);
+		sfdd[dev] = clCreateBuffer(context, CL_MEM_READ_ONLY, sfd_bytes, NULL, &error);
 		checkOclErrors(error);
+		sfu[dev].fill(false);
+
+		// Create buffers of the receptor atoms and the atoms near each tile once for the grid map kernel.
+		if (device_maps)
+		{
+			atmd[dev] = clCreateBuffer(context, CL_MEM_READ_ONLY | CL_MEM_COPY_HOST_PTR, sizeof(float) * atmh.size(), atmh.data(), &error);
+			checkOclErrors(error);
+			tlod[dev] = clCreateBuffer(context, CL_MEM_READ_ONLY | CL_MEM_COPY_HOST_PTR, sizeof(int) * tloh.size(), tloh.data(), &error);
+			checkOclErrors(error);
+			tlad[dev] = clCreateBuffer(context, CL_MEM_READ_ONLY | CL_MEM_COPY_HOST_PTR, sizeof(int) * tlah.size(), tlah.data(), &error);
+			checkOclErrors(error);
+		}
 
 		// Create buffers for ligh, ligd, slnd and cnfh.
 		ligd[dev] = clCreateBuffer(context, CL_MEM_READ_ONLY, sizeof(int) * lig_elems[dev], NULL, &error);
 		checkOclErrors(error);
-		slnd[dev] = clCreateBuffer(context, CL_MEM_READ_WRITE, sizeof(float) * sln_elems[dev] * num_tasks, NULL, &error);
+		slnd[dev] = clCreateBuffer(context, CL_MEM_READ_WRITE, sizeof(float) * sln_elems[dev], NULL, &error);
 		checkOclErrors(error);
+		if (num_candidates < num_tasks)
+		{
+			cnfd[dev] = clCreateBuffer(context, CL_MEM_READ_WRITE, sizeof(float) * cnf_elems[dev], NULL, &error);
+			checkOclErrors(error);
+		}
 
 		// Set kernel arguments.
 		checkOclErrors(clSetKernelArg(kernel,  0, sizeof(cl_mem), &slnd[dev]));
 		checkOclErrors(clSetKernelArg(kernel,  1, sizeof(cl_mem), &ligd[dev]));
-		checkOclErrors(clSetKernelArg(kernel,  7, sizeof(int), &num_bfgs_iterations));
-		checkOclErrors(clSetKernelArg(kernel,  8, sizeof(cl_mem), &sfed[dev]));
-		checkOclErrors(clSetKernelArg(kernel,  9, sizeof(cl_mem), &sfdd[dev]));
-		checkOclErrors(clSetKernelArg(kernel, 10, sizeof(int), &sfs));
-		checkOclErrors(clSetKernelArg(kernel, 11, sizeof(cl_float3), rec.corner0.data()));
-		checkOclErrors(clSetKernelArg(kernel, 12, sizeof(cl_float3), rec.corner1.data()));
-		checkOclErrors(clSetKernelArg(kernel, 13, sizeof(cl_float3), rec.num_probes.data()));
-		checkOclErrors(clSetKernelArg(kernel, 14, sizeof(rec.granularity_inverse), &rec.granularity_inverse));
-		for (size_t t = 0; t < sf.n; ++t)
+		checkOclErrors(clSetKernelArg(kernel,  4, sizeof(int), &num_bfgs_iterations));
+		checkOclErrors(clSetKernelArg(kernel,  5, sizeof(cl_mem), &sfed[dev]));
+		checkOclErrors(clSetKernelArg(kernel,  6, sizeof(cl_mem), &sfdd[dev]));
+		checkOclErrors(clSetKernelArg(kernel,  7, sizeof(int), &sfs));
+		checkOclErrors(clSetKernelArg(kernel,  8, sizeof(cl_float3), rec.corner0.data()));
+		checkOclErrors(clSetKernelArg(kernel,  9, sizeof(cl_float3), rec.corner1.data()));
+		checkOclErrors(clSetKernelArg(kernel, 10, sizeof(cl_float3), rec.num_probes.data()));
+		checkOclErrors(clSetKernelArg(kernel, 11, sizeof(rec.granularity_inverse), &rec.granularity_inverse));
+		const cl_ulong sed = seed;
+		if (textures)
 		{
-			checkOclErrors(clSetKernelArg(kernel, 15 + t, sizeof(cl_mem), &mpsd[dev][t]));
+			// Upload the grid maps of all atom types once into a single 3D image of one float channel, in which map t occupies the layers [t * num_probes[2], (t + 1) * num_probes[2]).
+			cl_bool image_support;
+			size_t image3d_max_width, image3d_max_height, image3d_max_depth;
+			checkOclErrors(clGetDeviceInfo(device, CL_DEVICE_IMAGE_SUPPORT, sizeof(image_support), &image_support, NULL));
+			checkOclErrors(clGetDeviceInfo(device, CL_DEVICE_IMAGE3D_MAX_WIDTH, sizeof(image3d_max_width), &image3d_max_width, NULL));
+			checkOclErrors(clGetDeviceInfo(device, CL_DEVICE_IMAGE3D_MAX_HEIGHT, sizeof(image3d_max_height), &image3d_max_height, NULL));
+			checkOclErrors(clGetDeviceInfo(device, CL_DEVICE_IMAGE3D_MAX_DEPTH, sizeof(image3d_max_depth), &image3d_max_depth, NULL));
+			if (!image_support || image3d_max_width < static_cast<size_t>(rec.num_probes[0]) || image3d_max_height < static_cast<size_t>(rec.num_probes[1]) || image3d_max_depth < static_cast<size_t>(rec.num_probes[2]) * sf.n)
+			{
+				cerr << "Device " << dev << " does not support 3D images of " << rec.num_probes[0] << " x " << rec.num_probes[1] << " x " << rec.num_probes[2] * sf.n << " probes" << endl;
+				return 2;
+			}
+			cout << "Uploading grid maps of " << sf.n << " atom types as an image to device " << dev << endl;
+			const cl_image_format image_format = { CL_R, CL_FLOAT };
+			if (cl12[dev])
+			{
+				cl_image_desc image_desc = {};
+				image_desc.image_type = CL_MEM_OBJECT_IMAGE3D;
+				image_desc.image_width = rec.num_probes[0];
+				image_desc.image_height = rec.num_probes[1];
+				image_desc.image_depth = rec.num_probes[2] * sf.n;
+				mpid[dev] = clCreateImage(context, CL_MEM_READ_ONLY, &image_format, &image_desc, NULL, &error);
+			}
+			else
+			{
+				mpid[dev] = clCreateImage3D(context, CL_MEM_READ_ONLY, &image_format, rec.num_probes[0], rec.num_probes[1], rec.num_probes[2] * sf.n, 0, 0, NULL, &error);
+			}
+			checkOclErrors(error);
+			for (size_t t = 0; t < sf.n; ++t)
+			{
+				const size_t origin[3] = { 0, 0, rec.num_probes[2] * t };
+				const size_t region[3] = { static_cast<size_t>(rec.num_probes[0]), static_cast<size_t>(rec.num_probes[1]), static_cast<size_t>(rec.num_probes[2]) };
+				checkOclErrors(clEnqueueWriteImage(queue, mpid[dev], CL_TRUE, origin, region, 0, 0, rec.mps[t], 0, NULL, NULL));
+			}
+			checkOclErrors(clSetKernelArg(kernel, 12, sizeof(cl_mem), &mpid[dev]));
+			checkOclErrors(clSetKernelArg(kernel, 13, sizeof(cl_ulong), &sed));
+		}
+		else
+		{
+			for (size_t t = 0; t < sf.n; ++t)
+			{
+				checkOclErrors(clSetKernelArg(kernel, 12 + t, sizeof(cl_mem), &mpsd[dev][t]));
+			}
+			checkOclErrors(clSetKernelArg(kernel, 27, sizeof(cl_ulong), &sed));
 		}
 	}
 	src.clear();
-	sf.clear();
+	atmh.clear();
+	tloh.clear();
+	tlah.clear();
+
+	// Write the type pairs of the scoring function claimed since the last write to device dev.
+	const auto write_pairs = [&](const int dev)
+	{
+		for (size_t p = 0; p < sf.np; ++p)
+		{
+			if (sf.claimed[p] && !sfu[dev][p])
+			{
+				const size_t offset = sf.nr * p;
+				checkOclErrors(clEnqueueWriteBuffer(queues[dev], sfed[dev], CL_TRUE, sizeof(float) * offset, sizeof(float) * sf.nr, sf.e + offset, 0, NULL, NULL));
+				checkOclErrors(clEnqueueWriteBuffer(queues[dev], sfdd[dev], CL_TRUE, sizeof(float) * offset, sizeof(float) * sf.nr, sf.d + offset, 0, NULL, NULL));
+				sfu[dev][p] = true;
+			}
+		}
+	};
+
+	// Create the dense float32 grid map of atom type t on device dev, populate it with the grid map kernel, wait for the kernel, and point the docking kernel to it. The type pairs of t with the receptor types must have been written.
+	const auto populate_on_device = [&](const int dev, const size_t t)
+	{
+		const cl_kernel kernel = populates[dev];
+		const int th = t;
+		const int nrh = sf.nr;
+		const int tileh = receptor::tile;
+		const cl_int3 nph = {{ rec.num_probes[0], rec.num_probes[1], rec.num_probes[2] }};
+		mpsd[dev][t] = clCreateBuffer(contexts[dev], CL_MEM_READ_WRITE, rec.map_bytes, NULL, &error);
+		checkOclErrors(error);
+		checkOclErrors(clSetKernelArg(kernel,  0, sizeof(cl_mem), &mpsd[dev][t]));
+		checkOclErrors(clSetKernelArg(kernel,  1, sizeof(int), &th));
+		checkOclErrors(clSetKernelArg(kernel,  2, sizeof(rec.granularity), &rec.granularity));
+		checkOclErrors(clSetKernelArg(kernel,  3, sizeof(int), &nrh));
+		checkOclErrors(clSetKernelArg(kernel,  4, sizeof(int), &tileh));
+		checkOclErrors(clSetKernelArg(kernel,  5, sizeof(cl_mem), &atmd[dev]));
+		checkOclErrors(clSetKernelArg(kernel,  6, sizeof(cl_mem), &tlod[dev]));
+		checkOclErrors(clSetKernelArg(kernel,  7, sizeof(cl_mem), &tlad[dev]));
+		checkOclErrors(clSetKernelArg(kernel,  8, sizeof(cl_mem), &sfed[dev]));
+		checkOclErrors(clSetKernelArg(kernel,  9, sizeof(int), &sfs));
+		checkOclErrors(clSetKernelArg(kernel, 10, sizeof(cl_float3), rec.corner0.data()));
+		checkOclErrors(clSetKernelArg(kernel, 11, sizeof(cl_int3), &nph));
+		const size_t gws[3] = { (rec.num_probes[0] + 63) & ~static_cast<size_t>(63), static_cast<size_t>(rec.num_probes[1]), static_cast<size_t>(rec.num_probes[2]) };
+		const size_t lws[3] = { 64, 1, 1 };
+		cl_event populate_event;
+		checkOclErrors(clEnqueueNDRangeKernel(queues[dev], kernel, 3, NULL, gws, lws, 0, NULL, &populate_event));
+		checkOclErrors(clWaitForEvents(1, &populate_event));
+		checkOclErrors(clReleaseEvent(populate_event));
+		checkOclErrors(clSetKernelArg(kernels[dev], 12 + t, sizeof(cl_mem), &mpsd[dev][t]));
+	};
 
 	// Initialize a vector of idle devices.
-	safe_vector<int> idle(num_devices);
+	// Slots [num_devices, num_devices + num_cpu_slots) dock on the worker threads instead. Batches go to whichever slot frees first, so each backend receives batches in proportion to its throughput. CPU slots are placed at the front to be taken after the devices.
+	safe_vector<int> idle(num_devices + num_cpu_slots);
 	iota(idle.begin(), idle.end(), 0);
+	rotate(idle.begin(), idle.begin() + num_devices, idle.end());
+	const cpu_backend cpu(ts, num_threads, num_tasks, num_bfgs_iterations, seed, sf, rec, textures, prof.get());
+	vector<vector<float>> cpu_cnfh(num_cpu_slots);
 
-	cout << "Training a random forest of " << num_trees << " trees in parallel" << endl;
+	// Load the random forest from the model file if it is valid, or train and save it otherwise.
+	pt.next(phase_forest);
 	forest f(num_trees, seed);
-	cnt.init(num_trees);
-	for (size_t i = 0; i < num_trees; ++i)
+	if (!forest_path.empty() && f.load(forest_path))
+	{
+		cout << "Loading a random forest of " << num_trees << " trees from " << forest_path << endl;
+	}
+	else
 	{
-		io.post([&, i]()
+		cout << "Training a random forest of " << num_trees << " trees in parallel" << endl;
+		task_group tg(ts);
+		for (size_t i = 0; i < num_trees; ++i)
 		{
-			f[i].train(4, f.u01_s);
-			cnt.increment();
-		});
+			tg.run([&, i]()
+			{
+				f.train(i);
+			});
+		}
+		tg.wait();
+		f.clear();
+		if (!forest_path.empty())
+		{
+			cout << "Saving the random forest to " << forest_path << endl;
+			if (!f.save(forest_path))
+			{
+				cerr << "Failed to save random forest " << forest_path << endl;
+			}
+		}
 	}
-	cnt.wait();
-	f.clear();
+	pt.stop();
 
-	// Perform docking for each ligand in the input folder.
-	log_engine log;
+	// Perform docking for each batch of ligands in the input folder.
+	log_engine log(log_path, max_conformations, false, top_k);
 	vector<cl_event> cbex(num_devices);
 	cout.setf(ios::fixed, ios::floatfield);
-	cout << "Executing " << num_tasks << " optimization runs of " << num_bfgs_iterations << " BFGS iterations in parallel" << endl
-	     << "   Index        Ligand D  pKd 1     2     3     4     5     6     7     8     9" << endl << setprecision(2);
-	for (directory_iterator dir_iter(input_folder_path), const_dir_iter; dir_iter != const_dir_iter; ++dir_iter)
+	cout << "Executing " << num_tasks << " optimization runs of " << num_bfgs_iterations << " BFGS iterations in parallel for each of up to " << batch_size << " ligands per kernel launch" << endl;
+	if (num_candidates < num_tasks)
 	{
-		// Filter files with .pdbqt extension name.
-		const path& input_ligand_path = dir_iter->path();
-		if (input_ligand_path.extension() != ".pdbqt") continue;
-
-		// Parse the ligand. Don't declare it const as it will be moved to the callback data wrapper.
-		ligand lig(input_ligand_path);
+		cout << "Ranking and deduplicating the conformations on the devices, and mapping " << num_candidates << " candidates per ligand for clustering" << endl;
+	}
+	cout << "   Index        Ligand D  pKd 1     2     3     4     5     6     7     8     9" << endl << setprecision(2);
+	ligand_block blk;
+	size_t lid = 0; // Index of the next ligand in input order, which keys the random number streams of its tasks together with the seed.
+	for (ligand_reader reader(input_folder_path, input_offset); true;)
+	{
+		// Parse up to batch_size ligands into a batch. Don't declare it const as it will be moved to the callback data wrapper.
+		ligand_batch bat(num_tasks);
+		profile_timer bt(prof.get(), phase_ligands);
+		while (bat.size() < batch_size && reader.next(blk))
+		{
+			bat.push_back(ligand(blk.filename, blk.b, blk.e), lid++);
+		}
+		if (!bat.size()) break;
 
-		// Find atom types that are presented in the current ligand but not presented in the grid maps.
+		// Find atom types that are presented in the current batch but not presented in the grid maps.
 		vector<size_t> xs;
+		array<bool, scoring_function::n> batch_types, missing_types{};
 		for (size_t t = 0; t < sf.n; ++t)
 		{
-			if (lig.xs[t] && rec.maps[t].empty())
+			batch_types[t] = bat.uses(t);
+			if (bat.uses(t) && !rec.map_sizes[t])
 			{
-				rec.maps[t].resize(rec.num_probes_product);
 				xs.push_back(t);
+				missing_types[t] = true;
 			}
 		}
 
-		// Create grid maps on the fly if necessary.
-		if (xs.size())
+		// Precalculate the type pairs of the scoring function within the batch and between its missing grid maps and the receptor that no earlier batch has claimed. Batches already in flight look up other pairs only.
+		bt.next(phase_scoring_function);
+		precalculate_pairs(sf.claim(batch_types, batch_types));
+		precalculate_pairs(sf.claim(missing_types, rec.types));
+
+		// Create grid maps on the fly if necessary. Grid maps created on the devices are read back from device 0 only if a CPU slot may dock the batch.
+		bt.next(phase_maps);
+		if (xs.size() && device_maps)
+		{
+			if (num_cpu_slots)
+			{
+				const auto start = std::chrono::steady_clock::now();
+				write_pairs(0);
+				rec.allocate(xs);
+				for (const size_t t : xs)
+				{
+					if (!mpsd[0][t]) populate_on_device(0, t);
+					checkOclErrors(clEnqueueReadBuffer(queues[0], mpsd[0][t], CL_TRUE, 0, rec.map_bytes, rec.maps[t].data(), 0, NULL, NULL));
+				}
+				if (prof) prof->add_maps(xs, std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - start).count());
+			}
+		}
+		else if (xs.size())
 		{
 			// Precalculate p_offset.
+			const auto start = std::chrono::steady_clock::now();
+			rec.allocate(xs);
 			rec.precalculate(sf, xs);
 
-			// Create grid maps in parallel.
-			cnt.init(rec.num_probes[2]);
-			for (size_t z = 0; z < rec.num_probes[2]; ++z)
+			// Create grid maps in parallel, one layer of bricks at a time if the maps are sparse.
+			for (size_t l = 0; l < rec.num_layers(); ++l)
 			{
-				io.post([&,z]()
+				task_group tg(ts);
+				for (size_t z = rec.layer_begin(l); z < rec.layer_end(l); ++z)
 				{
-					rec.populate(xs, z, sf);
-					cnt.increment();
-				});
+					tg.run([&,z]()
+					{
+						rec.populate(xs, z, sf);
+					});
+				}
+				tg.wait();
+				rec.store(xs, l);
 			}
-			cnt.wait();
+			if (prof) prof->add_maps(xs, std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - start).count());
+			rec.quantize(xs);
 		}
+		bt.stop();
 
-		// Wait until a device is ready for execution.
+		// Wait until a device or a CPU slot is ready for execution.
 		const int dev = idle.safe_pop_back();
 
-		// Copy grid maps from host memory to device memory if necessary.
+		// Dock the batch on the worker threads if a CPU slot is chosen, and write each ligand once its jobs have finished.
+		if (dev >= num_devices)
+		{
+			vector<float>& cnfv = cpu_cnfh[dev - num_devices];
+			if (bat.get_cnf_elems() > cnfv.size())
+			{
+				cnfv.resize(bat.get_cnf_elems());
+			}
+			float* const cnfh = cnfv.data();
+			const shared_ptr<ligand_batch> cbat = make_shared<ligand_batch>(move(bat));
+			ts.post([&, dev, cnfh, cbat]()
+			{
+				cpu.dock(*cbat, cnfh, [&](const size_t l)
+				{
+					// Write conformations.
+					auto& lig = cbat->ligands[l];
+					lig.write(cnfh + cbat->cnf_offsets[l], output_folder_path, max_conformations, num_tasks, rec, f, sf, ligand::parallel_for(), prof.get());
+
+					// Output and save ligand stem and predicted affinities.
+					safe_print([&]()
+					{
+						string stem = lig.filename.stem().string();
+						cout << setw(8) << log.size() + 1 << setw(14) << stem << setw(2) << 'C' << ' ';
+						for_each(lig.affinities.cbegin(), lig.affinities.cbegin() + min<size_t>(lig.affinities.size(), 9), [](const float a)
+						{
+							cout << setw(6) << a;
+						});
+						cout << endl;
+						log.push_back(move(stem), move(lig.affinities));
+					});
+				});
+
+				// Signal the main thread to post another batch once all the ligands of the current batch have been written.
+				idle.safe_push_back(dev);
+			});
+			continue;
+		}
+
+		// Write the type pairs of the scoring function claimed since the last launch on the device.
+		write_pairs(dev);
+
+		// Copy grid maps from host memory to device memory if necessary, unless all of them have been uploaded as an image or they are created on the device.
 		for (size_t t = 0; t < sf.n; ++t)
 		{
-			if (lig.xs[t] && !mpsd[dev][t])
+			if (device_maps && bat.uses(t) && !mpsd[dev][t])
 			{
-				mpsd[dev][t] = clCreateBuffer(contexts[dev], CL_MEM_READ_ONLY, rec.map_bytes, NULL, &error);
+				populate_on_device(dev, t);
+			}
+			else if (!textures && bat.uses(t) && !mpsd[dev][t])
+			{
+				// Upload the brick table of a sparse map, followed by the scale and offset of a quantized map, followed by the values or codes.
+				const size_t table_bytes = rec.bts[t] ? sizeof(int) * rec.num_bricks_product : 0;
+				const size_t header_bytes = rec.mqs[t] ? sizeof(float) * 2 : 0;
+				const size_t values_bytes = (rec.mqs[t] ? sizeof(uint16_t) : sizeof(float)) * rec.map_sizes[t];
+				mpsd[dev][t] = clCreateBuffer(contexts[dev], CL_MEM_READ_ONLY, table_bytes + header_bytes + values_bytes, NULL, &error);
 				checkOclErrors(error);
-				checkOclErrors(clEnqueueWriteBuffer(queues[dev], mpsd[dev][t], CL_TRUE, 0, rec.map_bytes, rec.maps[t].data(), 0, NULL, NULL));
-				checkOclErrors(clSetKernelArg(kernels[dev], 15 + t, sizeof(cl_mem), &mpsd[dev][t]));
+				if (table_bytes) checkOclErrors(clEnqueueWriteBuffer(queues[dev], mpsd[dev][t], CL_TRUE, 0, table_bytes, rec.bts[t], 0, NULL, NULL));
+				if (header_bytes) checkOclErrors(clEnqueueWriteBuffer(queues[dev], mpsd[dev][t], CL_TRUE, table_bytes, header_bytes, &rec.mqa[2 * t], 0, NULL, NULL));
+				checkOclErrors(clEnqueueWriteBuffer(queues[dev], mpsd[dev][t], CL_TRUE, table_bytes + header_bytes, values_bytes, rec.mqs[t] ? static_cast<const void*>(rec.mqs[t]) : rec.mps[t], 0, NULL, NULL));
+				checkOclErrors(clSetKernelArg(kernels[dev], 12 + t, sizeof(cl_mem), &mpsd[dev][t]));
 			}
 		}
 
-		// Reallocate ligd should the current ligand elements exceed the default size.
-		const size_t this_lig_elems = lig.get_lig_elems();
+		// Reallocate ligd should the current batch elements exceed the default size.
+		const size_t this_lig_elems = bat.get_lig_elems();
 		if (this_lig_elems > lig_elems[dev])
 		{
 			checkOclErrors(clReleaseMemObject(ligd[dev]));
@@ -413,23 +920,23 @@ int main(int argc, char* argv[])
 			checkOclErrors(clSetKernelArg(kernels[dev], 1, sizeof(cl_mem), &ligd[dev]));
 		}
 
-		// Compute the number of local memory bytes.
-		const size_t lig_bytes = sizeof(int) * lig_elems[dev];
+		// Compute the number of local memory bytes, which hold the largest ligand of the batch.
+		const size_t lig_bytes = sizeof(int) * bat.get_max_lig_elems();
 
-		// Encode the current ligand.
+		// Encode the current batch.
 		cl_event input_events[2];
-		int* ligh = (int*)clEnqueueMapBuffer(queues[dev], ligd[dev], CL_TRUE, cl12[dev] ? CL_MAP_WRITE_INVALIDATE_REGION : CL_MAP_WRITE, 0, lig_bytes, 0, NULL, NULL, &error);
+		int* ligh = (int*)clEnqueueMapBuffer(queues[dev], ligd[dev], CL_TRUE, cl12[dev] ? CL_MAP_WRITE_INVALIDATE_REGION : CL_MAP_WRITE, 0, sizeof(int) * this_lig_elems, 0, NULL, NULL, &error);
 		checkOclErrors(error);
-		lig.encode(ligh);
+		bat.encode(ligh, sf.nr);
 		checkOclErrors(clEnqueueUnmapMemObject(queues[dev], ligd[dev], ligh, 0, NULL, &input_events[0]));
 
 		// Reallocate slnd should the current solution elements exceed the default size.
-		const size_t this_sln_elems = lig.get_sln_elems();
+		const size_t this_sln_elems = bat.get_sln_elems();
 		if (this_sln_elems > sln_elems[dev])
 		{
 			checkOclErrors(clReleaseMemObject(slnd[dev]));
 			sln_elems[dev] = this_sln_elems;
-			slnd[dev] = clCreateBuffer(contexts[dev], CL_MEM_READ_WRITE, sizeof(float) * sln_elems[dev] * num_tasks, NULL, &error);
+			slnd[dev] = clCreateBuffer(contexts[dev], CL_MEM_READ_WRITE, sizeof(float) * sln_elems[dev], NULL, &error);
 			checkOclErrors(error);
 			checkOclErrors(clSetKernelArg(kernels[dev], 0, sizeof(cl_mem), &slnd[dev]));
 		}
@@ -438,94 +945,157 @@ int main(int argc, char* argv[])
 		if (cl12[dev])
 		{
 			const float pattern = 0.0f;
-			checkOclErrors(clEnqueueFillBuffer(queues[dev], slnd[dev], &pattern, sizeof(pattern), 0, sizeof(float) * sln_elems[dev] * num_tasks, 0, NULL, &input_events[1]));
+			checkOclErrors(clEnqueueFillBuffer(queues[dev], slnd[dev], &pattern, sizeof(pattern), 0, sizeof(float) * this_sln_elems, 0, NULL, &input_events[1]));
 		}
 		else
 		{
-			float* slnh = (float*)clEnqueueMapBuffer(queues[dev], slnd[dev], CL_TRUE, CL_MAP_WRITE, 0, sizeof(float) * sln_elems[dev] * num_tasks, 0, NULL, NULL, &error);
+			float* slnh = (float*)clEnqueueMapBuffer(queues[dev], slnd[dev], CL_TRUE, CL_MAP_WRITE, 0, sizeof(float) * this_sln_elems, 0, NULL, NULL, &error);
 			checkOclErrors(error);
-			memset(slnh, 0, sizeof(float) * sln_elems[dev] * num_tasks);
+			memset(slnh, 0, sizeof(float) * this_sln_elems);
 			checkOclErrors(clEnqueueUnmapMemObject(queues[dev], slnd[dev], slnh, 0, NULL, &input_events[1]));
 		}
 
-		// Launch kernel.
-		checkOclErrors(clSetKernelArg(kernels[dev],  2, sizeof(int), &lig.nv));
-		checkOclErrors(clSetKernelArg(kernels[dev],  3, sizeof(int), &lig.nf));
-		checkOclErrors(clSetKernelArg(kernels[dev],  4, sizeof(int), &lig.na));
-		checkOclErrors(clSetKernelArg(kernels[dev],  5, sizeof(int), &lig.np));
-		checkOclErrors(clSetKernelArg(kernels[dev],  6, lig_bytes, NULL));
-		const size_t gws = num_tasks;
+		// Launch kernel, with (num_tasks - 1) / 32 + 1 work groups per ligand.
+		const int nl = bat.size();
+		checkOclErrors(clSetKernelArg(kernels[dev],  2, sizeof(int), &nl));
+		checkOclErrors(clSetKernelArg(kernels[dev],  3, lig_bytes, NULL));
 		const size_t lws = 32;
+		const size_t gws = ((num_tasks - 1) / lws + 1) * lws * nl;
 		cl_event kernel_event;
 		checkOclErrors(clEnqueueNDRangeKernel(queues[dev], kernels[dev], 1, NULL, &gws, &lws, 2, input_events, &kernel_event));
 
-		// Reallocate cnfh should the current conformation elements exceed the default size.
-		const size_t this_cnf_elems = lig.get_cnf_elems();
-		if (this_cnf_elems > cnf_elems[dev])
+		// Rank and deduplicate the conformations of each ligand on the device with one work group per ligand, reallocating cnfd should the candidates exceed the default size, and map the candidates of each ligand from device memory to host memory. Otherwise map the conformations of all the tasks of each ligand.
+		vector<float*> cnfh(nl);
+		vector<cl_event> map_events(nl);
+		cl_event rank_event = NULL;
+		if (num_candidates < num_tasks)
 		{
-//			checkOclErrors(clReleaseMemObject(cnfh[dev]));
-			cnf_elems[dev] = this_cnf_elems;
-//			cnfh[dev] = clCreateBuffer(contexts[dev], CL_MEM_ALLOC_HOST_PTR, sizeof(float) * cnf_elems[dev] * num_tasks, NULL, &error);
-//			checkOclErrors(error);
+			const size_t this_cnf_elems = bat.get_cnf_elems() / num_tasks * num_candidates;
+			if (this_cnf_elems > cnf_elems[dev])
+			{
+				checkOclErrors(clReleaseMemObject(cnfd[dev]));
+				cnf_elems[dev] = this_cnf_elems;
+				cnfd[dev] = clCreateBuffer(contexts[dev], CL_MEM_READ_WRITE, sizeof(float) * cnf_elems[dev], NULL, &error);
+				checkOclErrors(error);
+			}
+			const int nt = num_tasks;
+			const int nc = num_candidates;
+			checkOclErrors(clSetKernelArg(ranks[dev], 0, sizeof(int), &nt));
+			checkOclErrors(clSetKernelArg(ranks[dev], 1, sizeof(int), &nc));
+			checkOclErrors(clSetKernelArg(ranks[dev], 2, sizeof(cl_mem), &ligd[dev]));
+			checkOclErrors(clSetKernelArg(ranks[dev], 3, sizeof(cl_mem), &slnd[dev]));
+			checkOclErrors(clSetKernelArg(ranks[dev], 4, sizeof(cl_mem), &cnfd[dev]));
+			checkOclErrors(clSetKernelArg(ranks[dev], 5, lig_bytes + sizeof(int) * (num_tasks + 2 * num_candidates), NULL));
+			const size_t rank_lws = 128;
+			const size_t rank_gws = rank_lws * nl;
+			checkOclErrors(clEnqueueNDRangeKernel(queues[dev], ranks[dev], 1, NULL, &rank_gws, &rank_lws, 1, &kernel_event, &rank_event));
+			for (size_t l = 0; l < bat.size(); ++l)
+			{
+				cnfh[l] = (float*)clEnqueueMapBuffer(queues[dev], cnfd[dev], CL_FALSE, CL_MAP_READ, sizeof(float) * (bat.cnf_offsets[l] / num_tasks * num_candidates), sizeof(float) * bat.ligands[l].get_cnf_elems() * num_candidates, 1, &rank_event, &map_events[l], &error);
+				checkOclErrors(error);
+			}
+		}
+		else
+		{
+			for (size_t l = 0; l < bat.size(); ++l)
+			{
+				cnfh[l] = (float*)clEnqueueMapBuffer(queues[dev], slnd[dev], CL_FALSE, CL_MAP_READ, sizeof(float) * bat.sln_offsets[l], sizeof(float) * bat.ligands[l].get_cnf_elems() * num_tasks, 1, &kernel_event, &map_events[l], &error);
+				checkOclErrors(error);
+			}
 		}
 
-		// Copy conformations from device memory to host memory.
+		// Mark the completion of all the maps. A marker without a wait list waits for all the previous commands of the queue.
 		cl_event output_event;
-		float* cnfh = (float*)clEnqueueMapBuffer(queues[dev], slnd[dev], CL_FALSE, CL_MAP_READ, 0, sizeof(float) * cnf_elems[dev] * num_tasks, 1, &kernel_event, &output_event, &error);
-		checkOclErrors(error);
+		if (cl12[dev])
+		{
+			checkOclErrors(clEnqueueMarkerWithWaitList(queues[dev], nl, map_events.data(), &output_event));
+		}
+		else
+		{
+			checkOclErrors(clEnqueueMarker(queues[dev], &output_event));
+		}
+
+		// Collect the events of the transfers of the batch to time them if profiled.
+		vector<cl_event> transfer_events;
+		if (prof)
+		{
+			transfer_events.assign(input_events, input_events + 2);
+			transfer_events.insert(transfer_events.end(), map_events.cbegin(), map_events.cend());
+		}
 
 		// Create callback events.
 		if (cbex[dev]) checkOclErrors(clReleaseEvent(cbex[dev]));
 		cbex[dev] = clCreateUserEvent(contexts[dev], &error);
 		checkOclErrors(error);
 
-		// Add a callback to the output event.
+		// Add a callback to the output event, which writes the ligands of the batch in parallel.
 		checkOclErrors(clSetEventCallback(output_event, CL_COMPLETE, [](cl_event event, cl_int command_exec_status, void* data)
 		{
 			assert(command_exec_status == CL_COMPLETE);
 			cl_command_queue queue;
 			checkOclErrors(clGetEventInfo(event, CL_EVENT_COMMAND_QUEUE, sizeof(queue), &queue, 0));
 			const shared_ptr<callback_data<int>> cbd(reinterpret_cast<callback_data<int>*>(data));
-			cbd->io.post([=]()
+
+			// Add the kernel and transfer time of the batch to the profile. The events have all completed, as the output event waits for them.
+			if (cbd->prof)
+			{
+				const auto duration = [](const cl_event e)
+				{
+					cl_ulong start, end;
+					checkOclErrors(clGetEventProfilingInfo(e, CL_PROFILING_COMMAND_START, sizeof(start), &start, NULL));
+					checkOclErrors(clGetEventProfilingInfo(e, CL_PROFILING_COMMAND_END, sizeof(end), &end, NULL));
+					return end - start;
+				};
+				uint64_t transfer_ns = 0;
+				for (const auto e : cbd->transfer_events)
+				{
+					transfer_ns += duration(e);
+				}
+				cbd->prof->add_device(cbd->dev, cbd->bat.size(), duration(cbd->kernel_event) + (cbd->rank_event ? duration(cbd->rank_event) : 0), transfer_ns);
+			}
+			for (size_t l = 0; l < cbd->bat.size(); ++l)
 			{
-				const auto& output_folder_path = cbd->output_folder_path;
-				const auto  max_conformations = cbd->max_conformations;
-				const auto  num_tasks = cbd->num_tasks;
-				const auto& rec = cbd->rec;
-				const auto& f = cbd->f;
-				const auto& sf = cbd->sf;
-				const auto  dev = cbd->dev;
-				const auto cnfh = cbd->cnfh;
-				auto& lig = cbd->lig;
-				auto slnd = cbd->slnd;
-				auto& safe_print = cbd->safe_print;
-				auto& log = cbd->log;
-				auto& idle = cbd->idle;
-
-				// Write conformations.
-				lig.write(cnfh, output_folder_path, max_conformations, num_tasks, rec, f, sf);
-
-				// Unmap cnfh.
-				checkOclErrors(clEnqueueUnmapMemObject(queue, slnd, cnfh, 0, NULL, NULL));
-
-				// Output and save ligand stem and predicted affinities.
-				safe_print([&]()
+				cbd->ts.post([=]()
 				{
-					string stem = lig.filename.stem().string();
-					cout << setw(8) << log.size() + 1 << setw(14) << stem << setw(2) << dev << ' ';
-					for_each(lig.affinities.cbegin(), lig.affinities.cbegin() + min<size_t>(lig.affinities.size(), 9), [](const float a)
+					const auto& output_folder_path = cbd->output_folder_path;
+					const auto  max_conformations = cbd->max_conformations;
+					const auto  num_candidates = cbd->num_candidates;
+					const auto& rec = cbd->rec;
+					const auto& f = cbd->f;
+					const auto& sf = cbd->sf;
+					const auto  dev = cbd->dev;
+					const auto cnfh = cbd->cnfh[l];
+					auto& lig = cbd->bat.ligands[l];
+					auto cnfd = cbd->cnfd;
+					auto& safe_print = cbd->safe_print;
+					auto& log = cbd->log;
+					auto& idle = cbd->idle;
+
+					// Write conformations.
+					lig.write(cnfh, output_folder_path, max_conformations, num_candidates, rec, f, sf, ligand::parallel_for(), cbd->prof);
+
+					// Unmap cnfh.
+					checkOclErrors(clEnqueueUnmapMemObject(queue, cnfd, cnfh, 0, NULL, NULL));
+
+					// Output and save ligand stem and predicted affinities.
+					safe_print([&]()
 					{
-						cout << setw(6) << a;
+						string stem = lig.filename.stem().string();
+						cout << setw(8) << log.size() + 1 << setw(14) << stem << setw(2) << dev << ' ';
+						for_each(lig.affinities.cbegin(), lig.affinities.cbegin() + min<size_t>(lig.affinities.size(), 9), [](const float a)
+						{
+							cout << setw(6) << a;
+						});
+						cout << endl;
+						log.push_back(move(stem), move(lig.affinities));
 					});
-					cout << endl;
-					log.push_back(new log_record(move(stem), move(lig.affinities)));
-				});
 
-				// Signal the main thread to post another task.
-				idle.safe_push_back(dev);
-			});
+					// Signal the main thread to post another batch once all the ligands of the current batch have been written.
+					if (!--cbd->remaining) idle.safe_push_back(dev);
+				});
+			}
 			checkOclErrors(clSetUserEventStatus(cbd->cbex, CL_COMPLETE));
-		}, new callback_data<int>(io, cbex[dev], output_folder_path, max_conformations, num_tasks, rec, f, sf, dev, cnfh, move(lig), slnd[dev], safe_print, log, idle)));
+		}, new callback_data<int>(ts, cbex[dev], output_folder_path, max_conformations, num_candidates, rec, f, sf, dev, move(cnfh), move(bat), num_candidates < num_tasks ? cnfd[dev] : slnd[dev], safe_print, log, idle, prof.get(), kernel_event, rank_event, move(transfer_events))));
 	}
 
 	// Synchronize queues and callback events.
@@ -535,9 +1105,9 @@ int main(int argc, char* argv[])
 		if (cbex[dev]) checkOclErrors(clWaitForEvents(1, &cbex[dev]));
 	}
 
-	// Wait until the io service pool has finished all its tasks.
-	io.wait();
-	assert(idle.size() == num_devices);
+	// Wait until the task scheduler has finished all its tasks.
+	ts.wait();
+	assert(idle.size() == num_devices + num_cpu_slots);
 
 	// Release resources.
 	for (int dev = 0; dev < num_devices; ++dev)
@@ -546,6 +1116,7 @@ int main(int argc, char* argv[])
 		{
 			if (mapd) checkOclErrors(clReleaseMemObject(mapd));
 		}
+		if (mpid[dev]) checkOclErrors(clReleaseMemObject(mpid[dev]));
 		if (cbex[dev]) checkOclErrors(clReleaseEvent(cbex[dev]));
 		checkOclErrors(clReleaseMemObject(sfdd[dev]));
 		checkOclErrors(clReleaseMemObject(sfed[dev]));
@@ -557,9 +1128,31 @@ int main(int argc, char* argv[])
 		checkOclErrors(clReleaseContext(contexts[dev]));
 	}
 
+	// Report the accuracy of quantized grid maps against float32.
+	if (rec.num_quantized_values)
+	{
+		cout << "Quantized " << rec.num_quantized_values << " grid map values to " << map_precision_name(precision) << " with a maximum error of " << setprecision(6) << rec.max_quantization_error << " and an RMS error of " << sqrt(rec.sum_squared_quantization_errors / rec.num_quantized_values) << " against float32" << endl;
+	}
+
 	// Sort and write ligand log records to the log file.
-	if (log.empty()) return 0;
-	cout << "Writing log records of " << log.size() << " ligands to " << log_path << endl;
-	log.sort();
-	log.write(log_path);
+	if (!log.empty())
+	{
+		if (top_k)
+		{
+			cout << "Writing the top " << min(top_k, log.size()) << " log records of " << log.size() << " ligands to " << log.summary_path << endl;
+		}
+		else
+		{
+			cout << "Writing log records of " << log.size() << " ligands to " << log_path << endl;
+		}
+		const profile_timer t(prof.get(), phase_output);
+		log.write();
+	}
+
+	// Write the profile.
+	if (prof)
+	{
+		cout << "Writing the profile to " << profile_path << " and the work of each ligand docked on the worker threads to " << prof->csv_path << endl;
+		prof->write();
+	}
 }
@@ -1,23 +1,81 @@
 #include <chrono>
 #include <iostream>
 #include <iomanip>
+#include <sstream>
 #include <numeric>
+#include <deque>
+#include <atomic>
 #include <boost/program_options.hpp>
 #include <boost/filesystem/operations.hpp>
-#include "io_service_pool.hpp"
+#include <boost/align/aligned_allocator.hpp>
+#include "task_scheduler.hpp"
 #include "safe_class.hpp"
 #include "random_forest.hpp"
 #include "receptor.hpp"
 #include "ligand.hpp"
+#include "ligand_reader.hpp"
+#include "output_writer.hpp"
+#include "checksum.hpp"
+#include "checkpoint.hpp"
+#include "coordinator.hpp"
+#include "worker.hpp"
+#include "server.hpp"
+#include "client.hpp"
 #include "log.hpp"
 #include "kernel.hpp"
+#include "profile.hpp"
+
+//! Represents a ligand in flight through the docking pipeline, together with its own buffers.
+struct ligand_slot
+{
+	//! Constructs an empty slot whose tasks run on a scheduler.
+	explicit ligand_slot(task_scheduler& ts) : tasks(ts) {}
+
+	ligand_block blk; //!< PDBQT text of the ligand.
+	unique_ptr<ligand> lig; //!< Parsed ligand, which is recycled to parse the next ligand into the slot once this one is written.
+	vector<int> ligh; //!< Encoded ligand.
+	vector<float, boost::alignment::aligned_allocator<float, 64>> slnd; //!< Solutions of all the jobs.
+	vector<float> cnfh; //!< Conformations of all the tasks.
+	size_t index; //!< Index of the ligand in input order, which keys the random number streams of its tasks together with the seed.
+	size_t num_jobs; //!< Number of docking jobs.
+	size_t sln_elems; //!< Number of solution elements per job.
+	decltype(&monte_carlo<num_lanes, 0>) kernel; //!< Kernel specialized for the ligand.
+	vector<size_t> representatives; //!< Tasks representing the clusters of the tasks run so far, if the tasks are adaptive.
+	atomic<size_t> jobs; //!< Number of docking jobs yet to finish, the last of which writes the conformations.
+	array<atomic<uint64_t>, num_counters> counters; //!< Counters of the Monte Carlo kernel summed over the jobs, if profiled.
+	atomic<uint64_t> monte_carlo_ns; //!< Nanoseconds of the Monte Carlo kernel summed over the jobs, if profiled.
+	task_group tasks; //!< Tasks of parsing the ligand, or of docking it and writing its conformations.
+};
+
+//! Represents an input ligand read ahead of docking by the planning pass.
+struct planned_ligand
+{
+	ligand_block blk; //!< PDBQT text of the ligand, copied out of the input file.
+	size_t index; //!< Index of the ligand in input order.
+	size_t cost; //!< Estimated cost of docking the ligand, its number of variables times its number of heavy atoms, or 0 if it fails to parse.
+	array<bool, scoring_function::n> xs; //!< XScore atom types present in the ligand.
+};
+
+//! Represents a further receptor of an ensemble together with its box.
+struct receptor_box
+{
+	path receptor_path; //!< Receptor in PDBQT format.
+	array<float, 3> center; //!< Box center.
+	array<float, 3> size; //!< Box size.
+};
 
 int main(int argc, char* argv[])
 {
-	path receptor_path, input_folder_path, output_folder_path, log_path;
+	path receptor_path, input_folder_path, output_folder_path, log_path, checkpoint_path, sf_cache_path, maps_path, forest_path, profile_path, ensemble_path;
 	array<float, 3> center, size;
-	size_t seed, num_threads, num_trees, num_tasks, num_bfgs_iterations, max_conformations;
-	float granularity;
+	vector<receptor_box> ensemble_boxes;
+	vector<string> receptor_stems;
+	size_t input_offset, output_shards, seed, num_threads, num_trees, num_tasks, batch_tasks, num_bfgs_iterations, max_conformations, batch_size, top_k, sf_samples, coarse_generations;
+	float granularity, brick_cap, coarse_granularity;
+	string precision_name, server_address;
+	map_precision precision;
+	bool output_poses, resume, trilinear, pin, plan;
+	unsigned short coordinator_port;
 
 	// Parse program options in a try/catch block.
 	try
@@ -25,12 +83,13 @@ int main(int argc, char* argv[])
 		// Initialize the default values of optional arguments.
 		const path default_output_folder_path = "output";
 		const path default_log_path = "log.csv";
-		const size_t default_seed = chrono::system_clock::now().time_since_epoch().count();
+		const size_t default_seed = std::chrono::system_clock::now().time_since_epoch().count();
 		const size_t default_num_threads = thread::hardware_concurrency();
 		const size_t default_num_trees = 128;
 		const size_t default_num_tasks = 256;
 		const size_t default_num_bfgs_iterations = 300;
 		const size_t default_max_conformations = 9;
+		const size_t default_batch_size = 8;
 		const  float default_granularity = 0.15625f;
 
 		// Set up options description.
@@ -38,18 +97,25 @@ int main(int argc, char* argv[])
 		options_description input_options("input (required)");
 		input_options.add_options()
 			("receptor", value<path>(&receptor_path)->required(), "receptor in PDBQT format")
-			("input_folder", value<path>(&input_folder_path)->required(), "folder of input ligands in PDBQT format")
+			("input_folder", value<path>(&input_folder_path), "folder of input ligands in PDBQT format, or a file of concatenated ligands optionally compressed by gzip, which can be omitted to create a map file only")
 			("center_x", value<float>(&center[0])->required(), "x coordinate of the search space center")
 			("center_y", value<float>(&center[1])->required(), "y coordinate of the search space center")
 			("center_z", value<float>(&center[2])->required(), "z coordinate of the search space center")
 			("size_x", value<float>(&size[0])->required(), "size in the x dimension in Angstrom")
 			("size_y", value<float>(&size[1])->required(), "size in the y dimension in Angstrom")
 			("size_z", value<float>(&size[2])->required(), "size in the z dimension in Angstrom")
+			("ensemble", value<path>(&ensemble_path), "file of further receptors to dock every ligand against in the same run, each line of which holds a receptor in PDBQT format followed by center_x, center_y, center_z, size_x, size_y and size_z of its box, so that the conformations against each receptor are written to a folder of output_folder named after it and the log holds the best affinity against each")
 			;
 		options_description output_options("output (optional)");
 		output_options.add_options()
 			("output_folder", value<path>(&output_folder_path)->default_value(default_output_folder_path), "folder of output ligands in PDBQT format")
 			("log", value<path>(&log_path)->default_value(default_log_path), "log file in csv format")
+			("top_k", value<size_t>(&top_k)->default_value(0), "log records of the best ligands to keep for a ranked summary file while streaming all the records to the log file, or 0 to write all the records sorted at the end")
+			("output_shards", value<size_t>(&output_shards)->default_value(0), "shard files in output_folder to append the conformations of all the ligands to, or 0 to write a file per ligand")
+			("output_poses", bool_switch(&output_poses), "write shard files in binary pose format, from which extractmodel and pdbqt2csv regenerate PDBQT, rather than in PDBQT format")
+			("checkpoint", value<path>(&checkpoint_path), "checkpoint file to append the log records of completed ligands to")
+			("resume", bool_switch(&resume), "resume from the checkpoint file, skipping the ligands completed by a preempted run")
+			("profile", value<path>(&profile_path), "profile file in JSON to write the time spent in each phase and the work of the Monte Carlo kernel to, next to a CSV file of the work of each ligand")
 			;
 		options_description miscellaneous_options("options (optional)");
 		miscellaneous_options.add_options()
@@ -57,9 +123,28 @@ int main(int argc, char* argv[])
 			("threads", value<size_t>(&num_threads)->default_value(default_num_threads), "worker threads to use")
 			("trees", value<size_t>(&num_trees)->default_value(default_num_trees), "trees in random forest")
 			("tasks", value<size_t>(&num_tasks)->default_value(default_num_tasks), "Monte Carlo tasks for global search")
+			("batch_tasks", value<size_t>(&batch_tasks)->default_value(0), "Monte Carlo tasks per batch to stop early once the clusters of a batch equal those of the previous one, or 0 to run all the tasks")
 			("generations", value<size_t>(&num_bfgs_iterations)->default_value(default_num_bfgs_iterations), "generations in BFGS")
 			("max_conformations", value<size_t>(&max_conformations)->default_value(default_max_conformations), "maximum binding conformations to write")
 			("granularity", value<float>(&granularity)->default_value(default_granularity), "density of probe atoms of grid maps")
+			("sf_cache", value<path>(&sf_cache_path), "cache file of precalculated scoring function to map or create")
+			("sf_samples", value<size_t>(&sf_samples)->default_value(scoring_function::default_ns), "samples of the scoring function per unit squared distance, which are interpolated linearly unless the default")
+			("maps", value<path>(&maps_path), "file of grid maps of all atom types to map or create")
+			("forest", value<path>(&forest_path), "model file of random forest trained with the current seed and number of trees to load or create")
+			("trilinear", bool_switch(&trilinear), "interpolate grid maps trilinearly to permit coarser granularity")
+			("coarse_generations", value<size_t>(&coarse_generations)->default_value(0), "generations of each task to evaluate on coarse grid maps, interpolated trilinearly, before refining on the fine grid maps, or 0 to evaluate all the generations on the fine grid maps")
+			("coarse_granularity", value<float>(&coarse_granularity)->default_value(4 * default_granularity), "density of probe atoms of coarse grid maps")
+			("brick_cap", value<float>(&brick_cap)->default_value(0), "energy cap of sparse grid maps, which store only the bricks of 8x8x8 cells with any energy below the cap and read the others as the cap, or 0 for dense grid maps")
+			("map_precision", value<string>(&precision_name)->default_value("float32"), "precision of grid maps to dock with, either float32, float16, or int16 with a scale and an offset per map, while map files hold float32")
+			("pin", bool_switch(&pin), "pin worker threads to consecutive cores")
+			("input_offset", value<size_t>(&input_offset)->default_value(0), "byte offset of the input file to resume reading ligands from")
+			("plan", bool_switch(&plan), "read and parse all the input ligands before docking, so as to dock them in descending order of their estimated cost, the number of variables times the number of heavy atoms, and to create the grid maps of all their atom types in one pass up front, at the expense of holding the text of all the ligands in memory")
+			("coordinator", value<unsigned short>(&coordinator_port)->default_value(0), "TCP port to listen on for workers, which dock batches of ligands for this process and stream their results back, or 0 to dock the ligands in this process")
+			("worker", value<string>(), "host:port of a coordinator to dock ligands for, which supplies all the options but threads and sf_cache")
+			("batch", value<size_t>(&batch_size)->default_value(default_batch_size), "ligands per batch issued to a worker or sent to a server")
+			("serve", value<unsigned short>(), "TCP port to listen on as a resident server, which keeps the scoring function, and the receptors with their grid maps and the random forests of recent requests, in memory and docks the ligands that clients send, so that only the options threads, sf_cache, sf_samples and resident_receptors apply")
+			("resident_receptors", value<size_t>()->default_value(4), "receptors with their grid maps, and random forests, that a resident server keeps in memory")
+			("server", value<string>(&server_address), "host:port of a resident server to dock the ligands on, which streams their conformations back")
 			("help", "help information")
 			("version", "version information")
 			("config", value<path>(), "configuration file to load options from")
@@ -92,9 +177,28 @@ int main(int argc, char* argv[])
 			store(parse_config_file(config_file, all_options), vm);
 		}
 
+		// Run as a worker of a coordinator, which supplies the receptor, the box and the docking parameters, so that the options required of a standalone run are not.
+		if (vm.count("worker"))
+		{
+			worker w(vm["worker"].as<string>(), vm["threads"].as<size_t>(), vm.count("sf_cache") ? vm["sf_cache"].as<path>() : path());
+			w.run();
+			return 0;
+		}
+
+		// Run as a resident server until terminated, which receives the receptor, the box and the docking parameters with each request.
+		if (vm.count("serve"))
+		{
+			server s(vm["serve"].as<unsigned short>(), vm["threads"].as<size_t>(), vm.count("sf_cache") ? vm["sf_cache"].as<path>() : path(), vm["sf_samples"].as<size_t>(), vm["resident_receptors"].as<size_t>());
+			s.run();
+			return 0;
+		}
+
 		// Notify the user of parsing errors, if any.
 		vm.notify();
 
+		// Parse map_precision.
+		precision = parse_map_precision(precision_name);
+
 		// Validate receptor.
 		if (!is_regular_file(receptor_path))
 		{
@@ -102,30 +206,153 @@ int main(int argc, char* argv[])
 			return 1;
 		}
 
-		// Validate input_folder.
-		if (!is_directory(input_folder_path))
+		// Parse the ensemble, each line of which holds a further receptor and its box. The stems of all the receptors name the folders of their output ligands, so they must be distinct.
+		if (!ensemble_path.empty())
+		{
+			if (coordinator_port || !maps_path.empty() || batch_tasks || !checkpoint_path.empty() || coarse_generations || output_shards || output_poses)
+			{
+				cerr << "Option ensemble supports none of options coordinator, maps, batch_tasks, checkpoint, coarse_generations, output_shards and output_poses" << endl;
+				return 1;
+			}
+			boost::filesystem::ifstream ifs(ensemble_path);
+			if (!ifs)
+			{
+				cerr << "Ensemble " << ensemble_path << " does not exist or is not readable" << endl;
+				return 1;
+			}
+			receptor_stems.push_back(receptor_path.stem().string());
+			for (string line; getline(ifs, line);)
+			{
+				istringstream iss(line);
+				string p;
+				if (!(iss >> p)) continue;
+				receptor_box b;
+				b.receptor_path = p;
+				if (!(iss >> b.center[0] >> b.center[1] >> b.center[2] >> b.size[0] >> b.size[1] >> b.size[2]))
+				{
+					cerr << "Ensemble " << ensemble_path << " has a line other than a receptor followed by center_x, center_y, center_z, size_x, size_y and size_z" << endl;
+					return 1;
+				}
+				if (!is_regular_file(b.receptor_path))
+				{
+					cerr << "Receptor " << b.receptor_path << " does not exist or is not a regular file" << endl;
+					return 1;
+				}
+				const string stem = b.receptor_path.stem().string();
+				if (find(receptor_stems.cbegin(), receptor_stems.cend(), stem) != receptor_stems.cend())
+				{
+					cerr << "Receptors of an ensemble must have distinct file stems, which name the folders of their output ligands, but " << stem << " repeats" << endl;
+					return 1;
+				}
+				receptor_stems.push_back(stem);
+				ensemble_boxes.push_back(b);
+			}
+		}
+
+		// Validate input_folder, which is required unless a map file is to be created.
+		if (input_folder_path.empty())
 		{
-			cerr << "Input folder " << input_folder_path << " does not exist or is not a directory" << endl;
+			if (maps_path.empty())
+			{
+				cerr << "the option '--input_folder' is required but missing" << endl;
+				return 1;
+			}
+		}
+		else if (!is_directory(input_folder_path) && !is_regular_file(input_folder_path))
+		{
+			cerr << "Input folder " << input_folder_path << " does not exist or is neither a directory nor a regular file" << endl;
 			return 1;
 		}
 
-		// Validate output_folder.
-		if (exists(output_folder_path))
+		// Validate output_folder if ligands are to be docked.
+		if (!input_folder_path.empty())
 		{
-			if (!is_directory(output_folder_path))
+			if (exists(output_folder_path))
 			{
-				cerr << "Output folder " << output_folder_path << " is not a directory" << endl;
+				if (!is_directory(output_folder_path))
+				{
+					cerr << "Output folder " << output_folder_path << " is not a directory" << endl;
+					return 1;
+				}
+			}
+			else
+			{
+				if (!create_directories(output_folder_path))
+				{
+					cerr << "Failed to create output folder " << output_folder_path << endl;
+					return 1;
+				}
+			}
+			for (const string& stem : receptor_stems)
+			{
+				if (!is_directory(output_folder_path / stem) && !create_directories(output_folder_path / stem))
+				{
+					cerr << "Failed to create output folder " << output_folder_path / stem << endl;
+					return 1;
+				}
+			}
+		}
+
+		// Validate sf_samples.
+		if (!sf_samples)
+		{
+			cerr << "Option sf_samples must be 1 or greater" << endl;
+			return 1;
+		}
+
+		// Validate coarse_generations and coarse_granularity.
+		if (coarse_generations > num_bfgs_iterations)
+		{
+			cerr << "Option coarse_generations must not exceed option generations" << endl;
+			return 1;
+		}
+		if (coarse_generations && coarse_granularity <= 0)
+		{
+			cerr << "Option coarse_granularity must be positive" << endl;
+			return 1;
+		}
+
+		// Validate resume, which requires a checkpoint file to resume from.
+		if (resume && checkpoint_path.empty())
+		{
+			cerr << "Option resume requires option checkpoint" << endl;
+			return 1;
+		}
+
+		// Validate the options of a coordinator, which broadcasts the map file of all atom types and the model file of the random forest to its workers.
+		if (coordinator_port)
+		{
+			if (input_folder_path.empty() || maps_path.empty() || forest_path.empty())
+			{
+				cerr << "Option coordinator requires options input_folder, maps and forest" << endl;
+				return 1;
+			}
+			if (batch_tasks || !checkpoint_path.empty() || coarse_generations || plan)
+			{
+				cerr << "Option coordinator supports none of options batch_tasks, checkpoint, coarse_generations and plan" << endl;
 				return 1;
 			}
 		}
-		else
+
+		// Validate the options of a client, which leaves the grid maps and the random forest to the server.
+		if (!server_address.empty())
 		{
-			if (!create_directories(output_folder_path))
+			if (input_folder_path.empty() || coordinator_port || !ensemble_path.empty() || !maps_path.empty() || !forest_path.empty())
 			{
-				cerr << "Failed to create output folder " << output_folder_path << endl;
+				cerr << "Option server requires option input_folder, and supports none of options coordinator, ensemble, maps and forest" << endl;
+				return 1;
+			}
+			if (batch_tasks || !checkpoint_path.empty() || coarse_generations || plan)
+			{
+				cerr << "Option server supports none of options batch_tasks, checkpoint, coarse_generations and plan" << endl;
 				return 1;
 			}
 		}
+		if ((coordinator_port || !server_address.empty()) && !batch_size)
+		{
+			cerr << "Option batch must be 1 or greater" << endl;
+			return 1;
+		}
 	}
 	catch (const exception& e)
 	{
@@ -133,156 +360,778 @@ int main(int argc, char* argv[])
 		return 1;
 	}
 
-	// Initialize a Mersenne Twister random number generator.
+	// Key the counter-based random number streams of all the Monte Carlo tasks by the seed.
 	cout << "Using random seed " << seed << endl;
-	mt19937_64 rng(seed);
 
-	cout << "Creating an io service pool of " << num_threads << " worker threads" << endl;
-	io_service_pool io(num_threads);
-	safe_counter<size_t> cnt;
+	// Profile the run if requested.
+	unique_ptr<profile> prof;
+	if (!profile_path.empty())
+	{
+		cout << "Profiling to " << profile_path << endl;
+		prof.reset(new profile(profile_path));
+	}
+
+	cout << "Creating a task scheduler of " << num_threads << " worker threads" << endl;
+	task_scheduler ts(num_threads, pin);
 	safe_function safe_print;
 
-	cout << "Precalculating a scoring function of " << scoring_function::n << " atom types in parallel" << endl;
-	scoring_function sf;
-	cnt.init((sf.n + 1) * sf.n >> 1);
-	for (size_t t1 = 0; t1 < sf.n; ++t1)
-	for (size_t t0 = 0; t0 <=  t1; ++t0)
+	// Precalculate the type pairs of the scoring function claimed in parallel.
+	// The main thread times the phases of setting up in turn.
+	profile_timer pt(prof.get(), phase_scoring_function);
+	scoring_function sf(sf_cache_path, sf_samples);
+	const auto precalculate_pairs = [&](const vector<array<size_t, 2>>& pairs)
 	{
-		io.post([&, t0, t1]()
+		task_group tg(ts);
+		for (const auto& p : pairs)
 		{
-			sf.precalculate(t0, t1);
-			cnt.increment();
-		});
+			tg.run([&, p]()
+			{
+				sf.precalculate(p[0], p[1]);
+			});
+		}
+		tg.wait();
+	};
+	array<bool, scoring_function::n> all_types;
+	all_types.fill(true);
+	if (sf.mapped)
+	{
+		cout << "Mapping a precalculated scoring function from " << sf_cache_path << endl;
 	}
-	cnt.wait();
-	sf.clear();
+	else if (!sf_cache_path.empty())
+	{
+		cout << "Precalculating a scoring function of " << scoring_function::n << " atom types in parallel" << endl;
+		precalculate_pairs(sf.claim(all_types, all_types));
 
+		// Save the scoring function to the cache file for subsequent runs.
+		cout << "Saving the precalculated scoring function to " << sf_cache_path << endl;
+		if (!sf.save(sf_cache_path))
+		{
+			cerr << "Failed to save scoring function cache " << sf_cache_path << endl;
+		}
+	}
+	else
+	{
+		// Precalculate only the type pairs that the grid maps and the ligands look up, as they are first needed.
+		cout << "Precalculating a scoring function of " << sf.ns << " samples per unit squared distance for the atom type pairs looked up" << endl;
+	}
+
+	pt.next(phase_receptor);
 	cout << "Parsing receptor " << receptor_path << endl;
-	receptor rec(receptor_path, center, size, granularity);
+	receptor rec(receptor_path, center, size, granularity, brick_cap, precision);
+
+	// Parse the further receptors of the ensemble, whose grid maps are created on the fly like those of the receptor. Each ligand is docked against them all.
+	deque<receptor> ensemble;
+	vector<receptor*> recs = { &rec };
+	for (const auto& b : ensemble_boxes)
+	{
+		cout << "Parsing receptor " << b.receptor_path << endl;
+		ensemble.emplace_back(b.receptor_path, b.center, b.size, granularity, brick_cap, precision);
+		recs.push_back(&ensemble.back());
+	}
+
+	// Parse the receptor again for the coarse level of grid maps, which is dense float32 so as to fit in cache.
+	unique_ptr<receptor> coarse;
+	if (coarse_generations)
+	{
+		coarse.reset(new receptor(receptor_path, center, size, coarse_granularity));
+		cout << "Evaluating the first " << coarse_generations << " generations of each task on coarse grid maps of " << coarse->num_probes[0] << 'x' << coarse->num_probes[1] << 'x' << coarse->num_probes[2] << " probes" << endl;
+	}
+	pt.next(phase_maps);
+
+	// Create the grid maps of certain atom types of a receptor in parallel, one layer of bricks at a time if the maps are sparse. The type pairs of the atom types with the receptor types must have been precalculated.
+	const auto create_maps = [&](receptor& r, const vector<size_t>& xs)
+	{
+		const auto start = std::chrono::steady_clock::now();
+		r.allocate(xs);
+		r.precalculate(sf, xs);
+		for (size_t l = 0; l < r.num_layers(); ++l)
+		{
+			task_group tg(ts);
+			for (size_t z = r.layer_begin(l); z < r.layer_end(l); ++z)
+			{
+				tg.run([&,z]()
+				{
+					r.populate(xs, z, sf);
+				});
+			}
+			tg.wait();
+			r.store(xs, l);
+		}
+		if (prof) prof->add_maps(xs, std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - start).count());
+	};
+
+	// Map grid maps of all atom types from the map file if it is valid, or create and save them otherwise, and then quantize them. Coarse grid maps of all atom types are created too.
+	if (!maps_path.empty())
+	{
+		vector<size_t> xs(sf.n);
+		iota(xs.begin(), xs.end(), 0);
+		if (rec.map(maps_path, sf))
+		{
+			cout << "Mapping grid maps from " << maps_path << endl;
+		}
+		else
+		{
+			cout << "Creating grid maps of " << scoring_function::n << " atom types in parallel" << endl;
+			pt.next(phase_scoring_function);
+			precalculate_pairs(sf.claim(all_types, rec.types));
+			pt.next(phase_maps);
+			create_maps(rec, xs);
+
+			cout << "Saving grid maps to " << maps_path << endl;
+			if (!rec.save(maps_path, sf))
+			{
+				cerr << "Failed to save grid maps to " << maps_path << endl;
+			}
+		}
+		rec.quantize(xs);
+		if (coarse)
+		{
+			pt.next(phase_scoring_function);
+			precalculate_pairs(sf.claim(all_types, rec.types));
+			pt.next(phase_maps);
+			create_maps(*coarse, xs);
+		}
+	}
 
-	vector<int>   ligh(2601);
-	vector<float> slnd(3438 * num_tasks);
+	// Exit if only the map file is to be created.
+	if (input_folder_path.empty())
+	{
+		ts.wait();
+		pt.stop();
+		if (prof) prof->write();
+		return 0;
+	}
+
+	// Kernels specialized on the number of variables from 6 to max_specialized_nv, and the generic kernel for ligands with more variables.
+	const array<decltype(&monte_carlo<num_lanes, 0>), max_specialized_nv - 5> kernels =
+	{{
+		monte_carlo<num_lanes,  6>, monte_carlo<num_lanes,  7>, monte_carlo<num_lanes,  8>, monte_carlo<num_lanes,  9>,
+		monte_carlo<num_lanes, 10>, monte_carlo<num_lanes, 11>, monte_carlo<num_lanes, 12>, monte_carlo<num_lanes, 13>,
+		monte_carlo<num_lanes, 14>, monte_carlo<num_lanes, 15>, monte_carlo<num_lanes, 16>,
+	}};
 
-	cout << "Training a random forest of " << num_trees << " trees in parallel" << endl;
+	// Load the random forest from the model file if it is valid, or train and save it otherwise.
+	pt.next(phase_forest);
 	forest f(num_trees, seed);
-	cnt.init(num_trees);
-	for (size_t i = 0; i < num_trees; ++i)
+	if (!server_address.empty())
+	{
+		cout << "Leaving the random forest to server " << server_address << endl;
+	}
+	else if (!forest_path.empty() && f.load(forest_path))
 	{
-		io.post([&, i]()
+		cout << "Loading a random forest of " << num_trees << " trees from " << forest_path << endl;
+	}
+	else
+	{
+		cout << "Training a random forest of " << num_trees << " trees in parallel" << endl;
+		task_group tg(ts);
+		for (size_t i = 0; i < num_trees; ++i)
 		{
-			f[i].train(4, f.u01_s);
-			cnt.increment();
-		});
+			tg.run([&, i]()
+			{
+				f.train(i);
+			});
+		}
+		tg.wait();
+		f.clear();
+		if (!forest_path.empty())
+		{
+			cout << "Saving the random forest to " << forest_path << endl;
+			if (!f.save(forest_path))
+			{
+				cerr << "Failed to save random forest " << forest_path << endl;
+			}
+		}
+	}
+	pt.stop();
+
+	if (output_poses) output_shards = max<size_t>(output_shards, 1);
+
+	// Open the checkpoint file, keyed by the parameters that determine the docking results and where they are written. On resume, recover the log records of the completed ligands, and the position of each shard file right after the last of them.
+	// The log of an ensemble holds the best affinity of each ligand against any receptor, followed by that against each receptor.
+	vector<string> columns;
+	if (ensemble.size())
+	{
+		columns.push_back("Best");
+		columns.insert(columns.end(), receptor_stems.cbegin(), receptor_stems.cend());
+	}
+	log_engine log(log_path, max_conformations, batch_tasks > 0, top_k, columns);
+	unique_ptr<checkpoint> ckpt;
+	vector<bool> completed;
+	vector<output_writer::position> positions(output_shards);
+	if (!checkpoint_path.empty())
+	{
+		checksum c;
+		for (const path& p : { receptor_path, input_folder_path, output_folder_path })
+		{
+			const string s = p.string();
+			c(s.data(), s.size());
+		}
+		c(center);
+		c(size);
+		c(granularity);
+		c(input_offset);
+		c(output_shards);
+		c(output_poses);
+		c(seed);
+		c(num_trees);
+		c(num_tasks);
+		c(batch_tasks);
+		c(num_bfgs_iterations);
+		c(max_conformations);
+		c(trilinear);
+		c(brick_cap);
+		c(precision);
+		c(sf_samples);
+		c(coarse_generations);
+		if (coarse_generations) c(coarse_granularity);
+		try
+		{
+			ckpt.reset(new checkpoint(checkpoint_path, c.value(), resume));
+		}
+		catch (const exception& e)
+		{
+			cerr << e.what() << endl;
+			return 1;
+		}
+		for (auto& r : ckpt->records)
+		{
+			if (r.index >= completed.size()) completed.resize(r.index + 1);
+			completed[r.index] = true;
+			log.push_back(move(r.stem), move(r.affinities), r.num_tasks);
+			if (r.shard < output_shards && r.shard_size > positions[r.shard].size)
+			{
+				positions[r.shard] = { r.shard_size, r.shard_models };
+			}
+		}
+		if (ckpt->records.size())
+		{
+			cout << "Resuming from " << ckpt->records.size() << " ligands completed in " << checkpoint_path << endl;
+		}
+		ckpt->records.clear();
+	}
+
+	// Create the shard files of the output folder if the conformations of all the ligands are to be appended to them.
+	unique_ptr<output_writer> writer;
+	if (output_shards)
+	{
+		cout << "Writing conformations to " << output_shards << " shard files in " << output_folder_path << " through a writer thread" << endl;
+		writer.reset(new output_writer(output_folder_path, output_shards, output_poses, positions));
 	}
-	cnt.wait();
-	f.clear();
 
 	// Perform docking for each ligand in the input folder.
-	log_engine log;
 	cout.setf(ios::fixed, ios::floatfield);
-	cout << "Executing " << num_tasks << " optimization runs of " << num_bfgs_iterations << " BFGS iterations in parallel" << endl
-	     << "   Index        Ligand    pKd 1     2     3     4     5     6     7     8     9" << endl << setprecision(2);
-	for (directory_iterator dir_iter(input_folder_path), const_dir_iter; dir_iter != const_dir_iter; ++dir_iter)
+
+	// Coordinate workers or request a resident server to dock the ligands if requested, and write their results as they stream back.
+	if (coordinator_port || !server_address.empty())
 	{
-		// Filter files with .pdbqt extension name.
-		const path& input_ligand_path = dir_iter->path();
-		if (input_ligand_path.extension() != ".pdbqt") continue;
+		const auto read_file = [](const path& p)
+		{
+			boost::filesystem::ifstream ifs(p, ios::binary);
+			return string(istreambuf_iterator<char>(ifs), istreambuf_iterator<char>());
+		};
+		string setup;
+		put(setup, read_file(receptor_path));
+		put(setup, center);
+		put(setup, size);
+		put(setup, granularity);
+		put<uint64_t>(setup, seed);
+		put<uint64_t>(setup, num_trees);
+		put<uint64_t>(setup, num_tasks);
+		put<uint64_t>(setup, num_bfgs_iterations);
+		put<uint64_t>(setup, max_conformations);
+		put<uint8_t>(setup, trilinear);
+		put(setup, brick_cap);
+		put<uint8_t>(setup, precision);
+		put<uint64_t>(setup, sf_samples);
+		const auto handle = [&](const path& filename, pose_record&& pose)
+		{
+			// Output and save ligand stem and predicted affinities.
+			string stem = pose.name;
+			vector<float> affinities = pose.affinities;
+			cout << setw(8) << log.size() + 1 << setw(14) << stem << setw(2) << "   ";
+			for_each(affinities.cbegin(), affinities.cbegin() + min<size_t>(affinities.size(), 9), [](const float a)
+			{
+				cout << setw(6) << a;
+			});
+			cout << endl;
+			log.push_back(move(stem), move(affinities));
 
-		// Parse the ligand. Don't declare it const as it will be moved to the callback data wrapper.
-		ligand lig(input_ligand_path);
+			// Write conformations, either to the file of the ligand or to the writer thread.
+			if (writer)
+			{
+				writer->push(move(pose));
+			}
+			else
+			{
+				boost::filesystem::ofstream ofs(output_folder_path / filename);
+				ofs.write(pose.pdbqt.data(), pose.pdbqt.size());
+			}
+		};
+		try
+		{
+			if (coordinator_port)
+			{
+				put(setup, read_file(maps_path));
+				put(setup, read_file(forest_path));
+				cout << "Coordinating workers on port " << coordinator_port << " to execute " << num_tasks << " optimization runs of " << num_bfgs_iterations << " BFGS iterations for each of up to " << batch_size << " ligands per batch" << endl
+				     << "   Index        Ligand    pKd 1     2     3     4     5     6     7     8     9" << endl << setprecision(2);
+				coordinator c(coordinator_port, move(setup), input_folder_path, input_offset, batch_size, handle);
+				c.run();
+			}
+			else
+			{
+				cout << "Requesting server " << server_address << " to execute " << num_tasks << " optimization runs of " << num_bfgs_iterations << " BFGS iterations for each of up to " << batch_size << " ligands per batch" << endl
+				     << "   Index        Ligand    pKd 1     2     3     4     5     6     7     8     9" << endl << setprecision(2);
+				client c(server_address, move(setup), input_folder_path, input_offset, batch_size, handle);
+				c.run();
+			}
+		}
+		catch (const exception& e)
+		{
+			cerr << e.what() << endl;
+			return 1;
+		}
+		ts.wait();
+		if (writer) writer->close();
 
-		// Find atom types that are presented in the current ligand but not presented in the grid maps.
-		vector<size_t> xs;
-		for (size_t t = 0; t < sf.n; ++t)
+		// Sort and write ligand log records to the log file.
+		if (!log.empty())
 		{
-			if (lig.xs[t] && rec.maps[t].empty())
+			if (top_k)
 			{
-				rec.maps[t].resize(rec.num_probes_product);
-				xs.push_back(t);
+				cout << "Writing the top " << min(top_k, log.size()) << " log records of " << log.size() << " ligands to " << log.summary_path << endl;
 			}
+			else
+			{
+				cout << "Writing log records of " << log.size() << " ligands to " << log_path << endl;
+			}
+			const profile_timer t(prof.get(), phase_output);
+			log.write();
 		}
+		if (prof) prof->write();
+		return 0;
+	}
 
-		// Create grid maps on the fly if necessary.
-		if (xs.size())
+	// Ligands flow through a pipeline of three stages: parsing and encoding in the pool, creating missing grid maps and launching docking jobs in the main thread, and writing conformations by whichever job of a ligand finishes last.
+	// Up to num_slots ligands are in flight at once, of which the main thread launches ligand k - lookahead after posting the parsing of ligand k, so that parsing stays ahead of docking and no ligand waits for the previous one to finish.
+	const size_t lookahead = num_threads;
+	const size_t num_slots = lookahead << 1;
+	deque<ligand_slot> slots;
+	for (size_t i = 0; i < num_slots; ++i)
+	{
+		slots.emplace_back(ts);
+	}
+
+	// Make the checkpoint record of a ligand docked with its first end tasks.
+	const auto record = [&](const size_t index, const ligand& lig, const size_t end)
+	{
+		checkpoint_record r;
+		r.index = index;
+		r.num_tasks = batch_tasks ? end : 0;
+		r.shard = output_shards;
+		r.shard_size = 0;
+		r.shard_models = 0;
+		r.stem = lig.filename.stem().string();
+		r.affinities = lig.affinities;
+		return r;
+	};
+
+	// Cluster, recover and featurize conformations for ligand::write in parallel, forking contiguous chunks of the loop to the scheduler. The calling worker executes pending tasks while it waits.
+	const ligand::parallel_for pf = [&](const size_t n, const function<void(const size_t)>& f)
+	{
+		const size_t num_chunks = min(num_threads, n);
+		task_group tg(ts);
+		for (size_t c = 0; c < num_chunks; ++c)
 		{
-			// Precalculate p_offset.
-			rec.precalculate(sf, xs);
+			tg.run([&, c]()
+			{
+				for (size_t i = n * c / num_chunks; i < n * (c + 1) / num_chunks; ++i)
+				{
+					f(i);
+				}
+			});
+		}
+		tg.wait();
+	};
 
-			// Create grid maps in parallel.
-			cnt.init(rec.num_probes[2]);
-			for (size_t z = 0; z < rec.num_probes[2]; ++z)
+	// Launch the docking jobs of tasks [beg, end) of slot i. The job that finishes last launches the next batch of tasks, unless all the tasks have run or the clusters that ligand::write would produce have not changed with this batch, in which case it writes the conformations.
+	function<void(const size_t, const size_t, const size_t)> launch;
+	launch = [&](const size_t i, const size_t beg, const size_t end)
+	{
+		ligand_slot& slt = slots[i];
+		const size_t num_jobs = min<size_t>(slt.num_jobs, (end - beg + num_lanes - 1) / num_lanes);
+		slt.jobs = num_jobs * recs.size();
+		for (size_t job = 0; job < num_jobs * recs.size(); ++job)
+		{
+			slt.tasks.run([&, i, beg, end, num_jobs, job]()
 			{
-				io.post([&,z]()
+				// Clear the solution buffer of this job, and run the kernel on it against receptor r, jr. The kernel writes conformations into the strided layout expected by ligand::write, those against each receptor following those against the previous one.
+				// The tasks against every receptor draw from the same random number streams, so the conformations against the first receptor are those of a run without an ensemble.
+				ligand_slot& slt = slots[i];
+				ligand& lig = *slt.lig;
+				const size_t r = job / num_jobs;
+				const receptor& jr = *recs[r];
+				const size_t jbeg = beg + (end - beg) * (job % num_jobs) / num_jobs;
+				const size_t jend = beg + (end - beg) * (job % num_jobs + 1) / num_jobs;
+				float* const sln = slt.slnd.data() + slt.sln_elems * job;
+				fill(sln, sln + slt.sln_elems, 0.0f);
+				const receptor& cr = coarse ? *coarse : jr;
+				profile_counters ctr{};
+				profile_timer t(prof.get(), phase_monte_carlo);
+				slt.kernel(sln, slt.ligh.data(), lig.nv, lig.nf, lig.na, lig.np, seed, slt.index, jbeg, jend - jbeg, num_bfgs_iterations, sf.e, sf.d, sf.ns, sf.interpolated, jr.corner0, jr.corner1, jr.num_probes, jr.granularity_inverse, jr.mps.data(), jr.bts.data(), jr.mqs.data(), jr.mqa.data(), jr.precision, trilinear, coarse_generations, cr.num_probes, cr.granularity_inverse, cr.mps.data(), slt.cnfh.data() + lig.get_cnf_elems() * num_tasks * r + jbeg, num_tasks, prof ? ctr.data() : nullptr);
+				if (prof)
+				{
+					for (size_t c = 0; c < num_counters; ++c)
+					{
+						slt.counters[c] += ctr[c];
+					}
+					slt.monte_carlo_ns += t.elapsed();
+				}
+				t.stop();
+				if (--slt.jobs) return;
+
+				// Launch the next batch if the representatives of clusters have changed.
+				if (end < num_tasks)
+				{
+					const profile_timer ct(prof.get(), phase_clustering);
+					vector<size_t> representatives = lig.cluster(slt.cnfh.data(), num_tasks, end, max_conformations, pf);
+					if (representatives != slt.representatives)
+					{
+						slt.representatives = move(representatives);
+						launch(i, end, min(end + batch_tasks, num_tasks));
+						return;
+					}
+
+					// Compact the conformations of the tasks run from stride num_tasks to stride end, as expected by ligand::write.
+					for (size_t o = 1; o < lig.get_cnf_elems(); ++o)
+					{
+						copy(slt.cnfh.cbegin() + num_tasks * o, slt.cnfh.cbegin() + num_tasks * o + end, slt.cnfh.begin() + end * o);
+					}
+				}
+
+				// Stream the work of the Monte Carlo kernel for the ligand.
+				if (prof)
+				{
+					profile_counters counters;
+					for (size_t c = 0; c < num_counters; ++c)
+					{
+						counters[c] = slt.counters[c];
+					}
+					prof->add_ligand(lig.filename.stem().string(), end * recs.size(), counters, slt.monte_carlo_ns);
+				}
+
+				// Write conformations, either to the file of the ligand or to the writer thread, and append the ligand to the checkpoint file once they have been written.
+				if (writer)
+				{
+					pose_record pose;
+					lig.write(slt.cnfh.data(), max_conformations, end, rec, f, sf, pose, pf, prof.get());
+					output_writer::written_handler handle;
+					if (ckpt)
+					{
+						checkpoint_record r = record(slt.index, lig, end);
+						handle = [&, r](const size_t shard, const output_writer::position& pos) mutable
+						{
+							r.shard = shard;
+							r.shard_size = pos.size;
+							r.shard_models = pos.num_models;
+							ckpt->append(r);
+						};
+					}
+					writer->push(move(pose), move(handle));
+				}
+				else if (ensemble.empty())
 				{
-					rec.populate(xs, z, sf);
-					cnt.increment();
+					lig.write(slt.cnfh.data(), output_folder_path, max_conformations, end, rec, f, sf, pf, prof.get());
+					if (ckpt) ckpt->append(record(slt.index, lig, end));
+				}
+				else
+				{
+					// Write the conformations against each receptor to its folder, and keep the best affinity against each for the log.
+					vector<float> affinities(1 + recs.size());
+					for (size_t r = 0; r < recs.size(); ++r)
+					{
+						lig.affinities.clear();
+						lig.write(slt.cnfh.data() + lig.get_cnf_elems() * num_tasks * r, output_folder_path / receptor_stems[r], max_conformations, end, *recs[r], f, sf, pf, prof.get());
+						affinities[1 + r] = lig.affinities.front();
+					}
+					affinities[0] = *min_element(affinities.cbegin() + 1, affinities.cend());
+					lig.affinities = move(affinities);
+				}
+
+				// Output and save ligand stem and predicted affinities, together with the number of tasks run if they are adaptive.
+				safe_print([&]()
+				{
+					string stem = lig.filename.stem().string();
+					cout << setw(8) << log.size() + 1 << setw(14) << stem << setw(2) << "   ";
+					for_each(lig.affinities.cbegin(), lig.affinities.cbegin() + min<size_t>(lig.affinities.size(), 9), [](const float a)
+					{
+						cout << setw(6) << a;
+					});
+					cout << endl;
+					log.push_back(move(stem), move(lig.affinities), batch_tasks ? end : 0);
 				});
+			});
+		}
+	};
+
+	// Create the grid maps of the given atom types that are missing for each receptor and for the coarse level.
+	const auto create_missing_maps = [&](const array<bool, scoring_function::n>& types)
+	{
+		// Find atom types that are presented in types but not presented in the grid maps of each receptor, and likewise in the coarse grid maps.
+		vector<vector<size_t>> xs(recs.size());
+		vector<size_t> cxs;
+		vector<array<bool, scoring_function::n>> missing_types(recs.size());
+		for (size_t r = 0; r < recs.size(); ++r)
+		{
+			missing_types[r].fill(false);
+			for (size_t t = 0; t < sf.n; ++t)
+			{
+				if (types[t] && !recs[r]->map_sizes[t])
+				{
+					xs[r].push_back(t);
+					missing_types[r][t] = true;
+				}
+			}
+		}
+		for (size_t t = 0; t < sf.n; ++t)
+		{
+			if (coarse && types[t] && !coarse->map_sizes[t])
+			{
+				cxs.push_back(t);
+				missing_types[0][t] = true;
 			}
-			cnt.wait();
 		}
 
-		// Reallocate ligh and ligd should the current ligand elements exceed the default size.
-		const size_t this_lig_elems = lig.get_lig_elems();
-		if (this_lig_elems > ligh.size())
+		// Precalculate the type pairs of the scoring function within the atom types and between their missing grid maps and each receptor that no earlier ligand has claimed. Ligands already in flight look up other pairs only.
+		profile_timer t(prof.get(), phase_scoring_function);
+		precalculate_pairs(sf.claim(types, types));
+		for (size_t r = 0; r < recs.size(); ++r)
 		{
-			ligh.resize(this_lig_elems);
+			precalculate_pairs(sf.claim(missing_types[r], recs[r]->types));
 		}
 
-		// Encode the current ligand.
-		lig.encode(ligh.data());
+		// Create grid maps on the fly if necessary. Ligands already in flight use other maps and keep docking meanwhile.
+		t.next(phase_maps);
+		for (size_t r = 0; r < recs.size(); ++r)
+		{
+			if (xs[r].empty()) continue;
+			create_maps(*recs[r], xs[r]);
+			recs[r]->quantize(xs[r]);
+		}
+		if (cxs.size())
+		{
+			create_maps(*coarse, cxs);
+		}
+	};
 
-		// Reallocate slnd should the current solution elements exceed the default size.
-		const size_t this_sln_elems = lig.get_sln_elems() * num_tasks;
-		if (this_sln_elems > slnd.size())
+	// Wait for slot i to be parsed, create grid maps missing for its ligand, and launch its docking jobs.
+	const auto dock = [&](const size_t i)
+	{
+		ligand_slot& slt = slots[i];
+		slt.tasks.wait();
+		const ligand& lig = *slt.lig;
+		create_missing_maps(lig.xs);
+		for (auto& c : slt.counters)
 		{
-			slnd.resize(this_sln_elems);
+			c = 0;
 		}
+		slt.monte_carlo_ns = 0;
 
-		// Clear the solution buffer.
-		slnd.assign(slnd.size(), 0);
+		// Launch kernel on the first batch of tasks, or on all the tasks if they are not adaptive.
+		slt.kernel = lig.nv <= max_specialized_nv ? kernels[lig.nv - 6] : monte_carlo<num_lanes, 0>;
+		slt.representatives.clear();
+		launch(i, 0, batch_tasks ? min(batch_tasks, num_tasks) : num_tasks);
+	};
 
-		// Launch kernel.
-		cnt.init(num_tasks);
-		for (int gid = 0; gid < num_tasks; ++gid)
+	// Plan the run if requested. Read all the ligands, skipping those completed before resuming, and parse them in parallel to estimate the cost of docking each and to collect the atom types they use.
+	// The ligands are then docked longest first, so that no long ligand is left to finish alone at the end of the run, and the grid maps of all their atom types are created up front in one pass rather than one ligand at a time. Their tasks are still keyed by the index in input order, so the results do not change.
+	ligand_reader reader(input_folder_path, input_offset);
+	vector<planned_ligand> planned;
+	if (plan)
+	{
+		for (size_t index = 0; true; ++index)
 		{
-			const size_t s = rng();
-			io.post([&, s, gid]()
+			ligand_block blk;
+			if (!reader.next(blk)) break;
+			if (index < completed.size() && completed[index]) continue;
+
+			// Copy the text out of the input file, so that no input file of a folder stays mapped and no decompressed chunk stays in memory beyond the ligands it holds.
+			const auto text = make_shared<string>(blk.b, blk.e);
+			blk.b = text->data();
+			blk.e = blk.b + text->size();
+			blk.storage = text;
+			planned.push_back({ move(blk), index, 0, {} });
+		}
+
+		// Parse the ligands in parallel. A ligand that fails to parse is costed 0, and its exception is rethrown when it is parsed again to be docked.
+		task_group tg(ts);
+		for (size_t j = 0; j < planned.size(); ++j)
+		{
+			tg.run([&, j]()
 			{
-				monte_carlo(slnd.data(), ligh.data(), lig.nv, lig.nf, lig.na, lig.np, s, num_bfgs_iterations, sf.e.data(), sf.d.data(), sf.ns, rec.corner0, rec.corner1, rec.num_probes, rec.granularity_inverse, rec.maps, gid, num_tasks);
-				cnt.increment();
+				const profile_timer t(prof.get(), phase_ligands);
+				planned_ligand& pl = planned[j];
+				try
+				{
+					const ligand lig(pl.blk.filename, pl.blk.b, pl.blk.e);
+					pl.cost = lig.nv * lig.na;
+					pl.xs = lig.xs;
+				}
+				catch (const exception&)
+				{
+				}
 			});
 		}
-		cnt.wait();
+		tg.wait();
+		stable_sort(planned.begin(), planned.end(), [](const planned_ligand& a, const planned_ligand& b)
+		{
+			return a.cost > b.cost;
+		});
 
-		// Reallocate cnfh should the current conformation elements exceed the default size.
-		const size_t this_cnf_elems = lig.get_cnf_elems() * num_tasks;
+		// Create the grid maps of the union of the atom types of all the ligands.
+		array<bool, scoring_function::n> types;
+		types.fill(false);
+		for (const auto& pl : planned)
+		{
+			for (size_t t = 0; t < sf.n; ++t)
+			{
+				types[t] = types[t] || pl.xs[t];
+			}
+		}
+		cout << "Planned " << planned.size() << " ligands to dock longest first, and creating grid maps of their " << count(types.cbegin(), types.cend(), true) << " atom types in parallel" << endl;
+		create_missing_maps(types);
+	}
 
-		io.post(bind([&](ligand lig, vector<float> cnfh)
+	cout << "Executing " << num_tasks << " optimization runs of " << num_bfgs_iterations << " BFGS iterations in parallel" << (ensemble.size() ? " against each of " + to_string(recs.size()) + " receptors" : string()) << endl;
+	if (ensemble.size())
+	{
+		cout << "   Index        Ligand     Best";
+		for (size_t r = 1; r <= min<size_t>(recs.size(), 8); ++r)
 		{
-			// Write conformations.
-			lig.write(cnfh.data(), output_folder_path, max_conformations, num_tasks, rec, f, sf);
+			cout << setw(6) << r;
+		}
+		cout << endl << setprecision(2);
+	}
+	else
+	{
+		cout << "   Index        Ligand    pKd 1     2     3     4     5     6     7     8     9" << endl << setprecision(2);
+	}
 
-			// Output and save ligand stem and predicted affinities.
-			safe_print([&]()
+	size_t k = 0;
+	for (size_t p = 0; true; ++p)
+	{
+		// Wait for the ligand previously in the slot to be written, and read the next ligand into the slot, either in planned order or skipping those completed before resuming.
+		const size_t i = k % num_slots;
+		ligand_slot& slt = slots[i];
+		slt.tasks.wait();
+		size_t index = p;
+		if (plan)
+		{
+			if (p == planned.size()) break;
+			slt.blk = move(planned[p].blk);
+			index = planned[p].index;
+		}
+		else
+		{
+			if (!reader.next(slt.blk)) break;
+			if (index < completed.size() && completed[index]) continue;
+		}
+
+		// Key the random number streams of the tasks by the index of the ligand, so that they depend on neither the number of threads nor the batches of tasks.
+		slt.index = index;
+
+		// Parse and encode the ligand in the pool. Exceptions are rethrown in the main thread when the ligand is to be docked.
+		slt.tasks.run([&, i]()
+		{
+			const profile_timer t(prof.get(), phase_ligands);
+			ligand_slot& slt = slots[i];
+			if (slt.lig)
 			{
-				string stem = lig.filename.stem().string();
-				cout << setw(8) << log.size() + 1 << setw(14) << stem << setw(2) << "   ";
-				for_each(lig.affinities.cbegin(), lig.affinities.cbegin() + min<size_t>(lig.affinities.size(), 9), [](const float a)
-				{
-					cout << setw(6) << a;
-				});
-				cout << endl;
-				log.push_back(new log_record(move(stem), move(lig.affinities)));
-			});
-		}, move(lig), vector<float>(slnd.cbegin(), slnd.cbegin() + this_cnf_elems)));
+				slt.lig->parse(slt.blk.filename, slt.blk.b, slt.blk.e);
+			}
+			else
+			{
+				slt.lig.reset(new ligand(slt.blk.filename, slt.blk.b, slt.blk.e));
+			}
+			slt.blk.storage.reset();
+			const ligand& lig = *slt.lig;
+
+			// Reallocate ligh should the current ligand elements exceed its size.
+			const size_t this_lig_elems = lig.get_lig_elems();
+			if (this_lig_elems > slt.ligh.size())
+			{
+				slt.ligh.resize(this_lig_elems);
+			}
+
+			// Encode the current ligand.
+			lig.encode(slt.ligh.data(), sf.nr);
+
+			// Reallocate slnd should the current solution elements exceed its size.
+			// Tasks are split into one job per worker thread, which runs its tasks num_lanes at a time in lockstep.
+			// Unlike the strided layout of the GPU kernels, the solutions of each job are contiguous and padded to whole cache lines, so that no two jobs share a cache line.
+			slt.num_jobs = min<size_t>(num_threads, (num_tasks + num_lanes - 1) / num_lanes);
+			slt.sln_elems = ((lig.get_sln_elems() + 15) & ~static_cast<size_t>(15)) * num_lanes;
+			const size_t this_sln_elems = slt.sln_elems * slt.num_jobs * recs.size();
+			if (this_sln_elems > slt.slnd.size())
+			{
+				slt.slnd.resize(this_sln_elems);
+			}
+
+			// Reallocate cnfh should the current conformation elements against all the receptors exceed its size.
+			const size_t this_cnf_elems = lig.get_cnf_elems() * num_tasks * recs.size();
+			if (this_cnf_elems > slt.cnfh.size())
+			{
+				slt.cnfh.resize(this_cnf_elems);
+			}
+		});
+
+		// Launch the ligand parsed lookahead ligands ago.
+		if (++k > lookahead)
+		{
+			dock((k - 1 - lookahead) % num_slots);
+		}
 	}
 
-	// Wait until the io service pool has finished all its tasks.
-	io.wait();
+	// Launch the remaining ligands.
+	for (size_t j = k > lookahead ? k - lookahead : 0; j < k; ++j)
+	{
+		dock(j % num_slots);
+	}
+
+	// Wait until the task scheduler has finished all its tasks, and the writer thread has written all the conformations.
+	ts.wait();
+	if (writer)
+	{
+		const profile_timer t(prof.get(), phase_output);
+		writer->close();
+	}
+
+	// Report the accuracy of quantized grid maps against float32.
+	if (rec.num_quantized_values)
+	{
+		cout << "Quantized " << rec.num_quantized_values << " grid map values to " << map_precision_name(precision) << " with a maximum error of " << setprecision(6) << rec.max_quantization_error << " and an RMS error of " << sqrt(rec.sum_squared_quantization_errors / rec.num_quantized_values) << " against float32" << endl;
+	}
 
 	// Sort and write ligand log records to the log file.
-	if (log.empty()) return 0;
-	cout << "Writing log records of " << log.size() << " ligands to " << log_path << endl;
-	log.sort();
-	log.write(log_path);
+	if (!log.empty())
+	{
+		if (top_k)
+		{
+			cout << "Writing the top " << min(top_k, log.size()) << " log records of " << log.size() << " ligands to " << log.summary_path << endl;
+		}
+		else
+		{
+			cout << "Writing log records of " << log.size() << " ligands to " << log_path << endl;
+		}
+		const profile_timer t(prof.get(), phase_output);
+		log.write();
+	}
+
+	// Write the profile.
+	if (prof)
+	{
+		cout << "Writing the profile to " << profile_path << " and the work of each ligand to " << prof->csv_path << endl;
+		prof->write();
+	}
 }
@@ -1,45 +1,62 @@
 #include <chrono>
+#include <cstring>
+#include <algorithm>
 #include <iostream>
 #include <iomanip>
 #include <numeric>
+#include <atomic>
 #include <boost/program_options.hpp>
 #include <boost/filesystem/operations.hpp>
 #include "cu_helper.h"
-#include "io_service_pool.hpp"
+#include "task_scheduler.hpp"
 #include "safe_class.hpp"
+#include "checksum.hpp"
 #include "random_forest.hpp"
 #include "receptor.hpp"
-#include "ligand.hpp"
+#include "ligand_batch.hpp"
+#include "cpu_backend.hpp"
+#include "ligand_reader.hpp"
+#include "kernel_cache.hpp"
 #include "log.hpp"
 #include "source.hpp"
+#include "profile.hpp"
 
-//! Represents a data wrapper for kernel callback.
+//! Represents a data wrapper for kernel callback, which writes the ligands of a batch.
 template <typename T>
 class callback_data
 {
 public:
-	callback_data(io_service_pool& io, const path& output_folder_path, const size_t max_conformations, const size_t num_tasks, const receptor& rec, const forest& f, const scoring_function& sf, const T dev, const float* const cnfh, ligand&& lig_, safe_function& safe_print, log_engine& log, safe_vector<T>& idle) : io(io), output_folder_path(output_folder_path), max_conformations(max_conformations), num_tasks(num_tasks), rec(rec), f(f), sf(sf), dev(dev), cnfh(cnfh), lig(move(lig_)), safe_print(safe_print), log(log), idle(idle) {}
-	io_service_pool& io;
+	callback_data(task_scheduler& ts, const path& output_folder_path, const size_t max_conformations, const size_t num_tasks, const size_t num_candidates, const receptor& rec, const forest& f, const scoring_function& sf, const T dev, const T slt, const float* const cnfh, ligand_batch&& bat_, safe_function& safe_print, log_engine& log, safe_vector<T>& idle, profile* const prof, const CUcontext context, const CUevent* const events) : ts(ts), output_folder_path(output_folder_path), max_conformations(max_conformations), num_tasks(num_tasks), num_candidates(num_candidates), rec(rec), f(f), sf(sf), dev(dev), slt(slt), cnfh(cnfh), bat(move(bat_)), remaining(bat.size() + (prof ? 1 : 0)), safe_print(safe_print), log(log), idle(idle), prof(prof), context(context), events(events) {}
+	task_scheduler& ts;
 	const path& output_folder_path;
 	const size_t max_conformations;
 	const size_t num_tasks;
+	const size_t num_candidates; //!< Number of conformations of each ligand copied back, which are those of all the tasks unless ranked on the device.
 	const receptor& rec;
 	const forest& f;
 	const scoring_function& sf;
 	const T dev;
-	const float* const cnfh;
-	ligand lig;
+	const T slt;
+	const float* const cnfh; //!< Conformations of the ligands of the batch, those of ligand l starting at bat.cnf_offsets[l] / num_tasks * num_candidates with stride num_candidates.
+	ligand_batch bat;
+	atomic<size_t> remaining; //!< Number of ligands of the batch yet to be written, plus one for reading the timing events if profiled.
 	safe_function& safe_print;
 	log_engine& log;
 	safe_vector<T>& idle;
+	profile* const prof; //!< Profile to add the kernel and transfer time of the batch to, or null.
+	const CUcontext context; //!< Context of the device, in which the timing events are read.
+	const CUevent* const events; //!< Timing events recorded before the uploads, before and after the kernel, and after the downloads of the batch, if profiled.
 };
 
 int main(int argc, char* argv[])
 {
-	path receptor_path, input_folder_path, output_folder_path, log_path;
+	path receptor_path, input_folder_path, output_folder_path, log_path, sf_cache_path, maps_path, forest_path, kernel_cache_path, profile_path;
 	array<float, 3> center, size;
-	size_t seed, num_threads, num_trees, num_tasks, num_bfgs_iterations, max_conformations;
-	float granularity;
+	size_t input_offset, seed, num_threads, num_streams, num_cpu_slots, batch_size, num_trees, num_tasks, num_bfgs_iterations, max_conformations, candidate_multiple, top_k, sf_samples;
+	float granularity, brick_cap;
+	string precision_name;
+	map_precision precision;
+	bool textures, device_maps;
 
 	// Parse program options in a try/catch block.
 	try
@@ -47,8 +64,10 @@ int main(int argc, char* argv[])
 		// Initialize the default values of optional arguments.
 		const path default_output_folder_path = "output";
 		const path default_log_path = "log.csv";
-		const size_t default_seed = chrono::system_clock::now().time_since_epoch().count();
+		const size_t default_seed = std::chrono::system_clock::now().time_since_epoch().count();
 		const size_t default_num_threads = thread::hardware_concurrency();
+		const size_t default_num_streams = 2;
+		const size_t default_batch_size = 8;
 		const size_t default_num_trees = 128;
 		const size_t default_num_tasks = 256;
 		const size_t default_num_bfgs_iterations = 300;
@@ -60,7 +79,7 @@ int main(int argc, char* argv[])
 		options_description input_options("input (required)");
 		input_options.add_options()
 			("receptor", value<path>(&receptor_path)->required(), "receptor in PDBQT format")
-			("input_folder", value<path>(&input_folder_path)->required(), "folder of input ligands in PDBQT format")
+			("input_folder", value<path>(&input_folder_path), "folder of input ligands in PDBQT format, or a file of concatenated ligands optionally compressed by gzip, which can be omitted to create a map file only")
 			("center_x", value<float>(&center[0])->required(), "x coordinate of the search space center")
 			("center_y", value<float>(&center[1])->required(), "y coordinate of the search space center")
 			("center_z", value<float>(&center[2])->required(), "z coordinate of the search space center")
@@ -72,16 +91,32 @@ int main(int argc, char* argv[])
 		output_options.add_options()
 			("output_folder", value<path>(&output_folder_path)->default_value(default_output_folder_path), "folder of output ligands in PDBQT format")
 			("log", value<path>(&log_path)->default_value(default_log_path), "log file in csv format")
+			("top_k", value<size_t>(&top_k)->default_value(0), "log records of the best ligands to keep for a ranked summary file while streaming all the records to the log file, or 0 to write all the records sorted at the end")
+			("profile", value<path>(&profile_path), "profile file in JSON to write the time spent in each phase and the kernel and transfer time of each device to, next to a CSV file of the work of each ligand docked on the worker threads")
 			;
 		options_description miscellaneous_options("options (optional)");
 		miscellaneous_options.add_options()
 			("seed", value<size_t>(&seed)->default_value(default_seed), "explicit non-negative random seed")
 			("threads", value<size_t>(&num_threads)->default_value(default_num_threads), "worker threads to use")
+			("streams", value<size_t>(&num_streams)->default_value(default_num_streams), "CUDA streams per device to overlap the transfers of one batch with the kernel of another")
+			("cpu_batches", value<size_t>(&num_cpu_slots)->default_value(0), "batches to dock on the worker threads alongside the devices at a time, or 0 to dock on the devices only")
+			("batch", value<size_t>(&batch_size)->default_value(default_batch_size), "ligands to dock in one kernel launch")
 			("trees", value<size_t>(&num_trees)->default_value(default_num_trees), "trees in random forest")
 			("tasks", value<size_t>(&num_tasks)->default_value(default_num_tasks), "Monte Carlo tasks for global search")
 			("generations", value<size_t>(&num_bfgs_iterations)->default_value(default_num_bfgs_iterations), "generations in BFGS")
 			("max_conformations", value<size_t>(&max_conformations)->default_value(default_max_conformations), "maximum binding conformations to write")
+			("candidates", value<size_t>(&candidate_multiple)->default_value(0), "multiple of max_conformations of the conformations of each ligand to rank by free energy and deduplicate on the device and copy back for clustering, or 0 to copy back the conformations of all the tasks")
 			("granularity", value<float>(&granularity)->default_value(default_granularity), "density of probe atoms of grid maps")
+			("textures", bool_switch(&textures), "create grid maps of all atom types before docking and sample them as 3D textures with hardware trilinear filtering, which requires compute capability 3.0 or greater")
+			("device_maps", bool_switch(&device_maps), "create the grid maps missing for a batch on each device that docks it rather than on the host and upload them, copying them back to the host only for CPU batches, which requires dense float32 grid maps and compute capability 2.0 or greater")
+			("brick_cap", value<float>(&brick_cap)->default_value(0), "energy cap of sparse grid maps, which store only the bricks of 8x8x8 cells with any energy below the cap and read the others as the cap, or 0 for dense grid maps")
+			("map_precision", value<string>(&precision_name)->default_value("float32"), "precision of grid maps to dock with, either float32, float16, or int16 with a scale and an offset per map, while map files hold float32")
+			("sf_cache", value<path>(&sf_cache_path), "cache file of precalculated scoring function to map or create")
+			("sf_samples", value<size_t>(&sf_samples)->default_value(scoring_function::default_ns), "samples of the scoring function per unit squared distance, which are interpolated linearly unless the default")
+			("maps", value<path>(&maps_path), "file of grid maps of all atom types to map or create")
+			("forest", value<path>(&forest_path), "model file of random forest trained with the current seed and number of trees to load or create")
+			("kernel_cache", value<path>(&kernel_cache_path), "folder of cubins compiled for each device, driver and kernel source to load or save")
+			("input_offset", value<size_t>(&input_offset)->default_value(0), "byte offset of the input file to resume reading ligands from")
 			("help", "help information")
 			("version", "version information")
 			("config", value<path>(), "configuration file to load options from")
@@ -117,35 +152,87 @@ int main(int argc, char* argv[])
 		// Notify the user of parsing errors, if any.
 		vm.notify();
 
-		// Validate receptor.
-		if (!is_regular_file(receptor_path))
+		// Parse map_precision.
+		precision = parse_map_precision(precision_name);
+
+		// Validate streams and batch.
+		if (!num_streams)
 		{
-			cerr << "Receptor " << receptor_path << " does not exist or is not a regular file" << endl;
+			cerr << "Option streams must be 1 or greater" << endl;
+			return 1;
+		}
+		if (!batch_size)
+		{
+			cerr << "Option batch must be 1 or greater" << endl;
+			return 1;
+		}
+
+		// Validate sf_samples.
+		if (!sf_samples)
+		{
+			cerr << "Option sf_samples must be 1 or greater" << endl;
+			return 1;
+		}
+
+		// Validate brick_cap, as textures are dense 3D arrays.
+		if (brick_cap && textures)
+		{
+			cerr << "Options brick_cap and textures are mutually exclusive" << endl;
+			return 1;
+		}
+		if (precision != map_float32 && textures)
+		{
+			cerr << "Options map_precision and textures are mutually exclusive" << endl;
 			return 1;
 		}
 
-		// Validate input_folder.
-		if (!is_directory(input_folder_path))
+		// Validate device_maps, whose kernel populates dense float32 grid maps in device memory on the fly.
+		if (device_maps && (textures || brick_cap || precision != map_float32 || !maps_path.empty()))
 		{
-			cerr << "Input folder " << input_folder_path << " does not exist or is not a directory" << endl;
+			cerr << "Option device_maps supports none of options textures, brick_cap, map_precision other than float32 and maps" << endl;
 			return 1;
 		}
 
-		// Validate output_folder.
-		if (exists(output_folder_path))
+		// Validate receptor.
+		if (!is_regular_file(receptor_path))
 		{
-			if (!is_directory(output_folder_path))
+			cerr << "Receptor " << receptor_path << " does not exist or is not a regular file" << endl;
+			return 1;
+		}
+
+		// Validate input_folder, which is required unless a map file is to be created.
+		if (input_folder_path.empty())
+		{
+			if (maps_path.empty())
 			{
-				cerr << "Output folder " << output_folder_path << " is not a directory" << endl;
+				cerr << "the option '--input_folder' is required but missing" << endl;
 				return 1;
 			}
 		}
-		else
+		else if (!is_directory(input_folder_path) && !is_regular_file(input_folder_path))
 		{
-			if (!create_directories(output_folder_path))
+			cerr << "Input folder " << input_folder_path << " does not exist or is neither a directory nor a regular file" << endl;
+			return 1;
+		}
+
+		// Validate output_folder if ligands are to be docked.
+		if (!input_folder_path.empty())
+		{
+			if (exists(output_folder_path))
 			{
-				cerr << "Failed to create output folder " << output_folder_path << endl;
-				return 1;
+				if (!is_directory(output_folder_path))
+				{
+					cerr << "Output folder " << output_folder_path << " is not a directory" << endl;
+					return 1;
+				}
+			}
+			else
+			{
+				if (!create_directories(output_folder_path))
+				{
+					cerr << "Failed to create output folder " << output_folder_path << endl;
+					return 1;
+				}
 			}
 		}
 	}
@@ -155,32 +242,125 @@ int main(int argc, char* argv[])
 		return 1;
 	}
 
-	// Initialize a Mersenne Twister random number generator.
+	// Key the counter-based random number streams of all the Monte Carlo tasks by the seed.
 	cout << "Using random seed " << seed << endl;
 
-	cout << "Creating an io service pool of " << num_threads << " worker threads" << endl;
-	io_service_pool io(num_threads);
-	safe_counter<size_t> cnt;
+	// Copy back the conformations of all the tasks of each ligand, unless candidates are ranked and deduplicated on the devices, in which case fewer of them are.
+	const size_t num_candidates = candidate_multiple ? min(num_tasks, candidate_multiple * max_conformations) : num_tasks;
+
+	// Profile the run if requested.
+	unique_ptr<profile> prof;
+	if (!profile_path.empty())
+	{
+		cout << "Profiling to " << profile_path << endl;
+		prof.reset(new profile(profile_path));
+	}
+
+	cout << "Creating a task scheduler of " << num_threads << " worker threads" << endl;
+	task_scheduler ts(num_threads);
 	safe_function safe_print;
 
-	cout << "Precalculating a scoring function of " << scoring_function::n << " atom types in parallel" << endl;
-	scoring_function sf;
-	cnt.init((sf.n + 1) * sf.n >> 1);
-	for (size_t t1 = 0; t1 < sf.n; ++t1)
-	for (size_t t0 = 0; t0 <=  t1; ++t0)
+	// Precalculate the type pairs of the scoring function claimed in parallel.
+	// The main thread times the phases of setting up in turn.
+	profile_timer pt(prof.get(), phase_scoring_function);
+	scoring_function sf(sf_cache_path, sf_samples);
+	const auto precalculate_pairs = [&](const vector<array<size_t, 2>>& pairs)
 	{
-		io.post([&, t0, t1]()
+		task_group tg(ts);
+		for (const auto& p : pairs)
 		{
-			sf.precalculate(t0, t1);
-			cnt.increment();
-		});
+			tg.run([&, p]()
+			{
+				sf.precalculate(p[0], p[1]);
+			});
+		}
+		tg.wait();
+	};
+	array<bool, scoring_function::n> all_types;
+	all_types.fill(true);
+	if (sf.mapped)
+	{
+		cout << "Mapping a precalculated scoring function from " << sf_cache_path << endl;
 	}
-	cnt.wait();
+	else if (!sf_cache_path.empty())
+	{
+		cout << "Precalculating a scoring function of " << scoring_function::n << " atom types in parallel" << endl;
+		precalculate_pairs(sf.claim(all_types, all_types));
 
+		// Save the scoring function to the cache file for subsequent runs.
+		cout << "Saving the precalculated scoring function to " << sf_cache_path << endl;
+		if (!sf.save(sf_cache_path))
+		{
+			cerr << "Failed to save scoring function cache " << sf_cache_path << endl;
+		}
+	}
+	else
+	{
+		// Precalculate only the type pairs that the grid maps and the ligands look up, as they are first needed.
+		cout << "Precalculating a scoring function of " << sf.ns << " samples per unit squared distance for the atom type pairs looked up" << endl;
+	}
+
+	pt.next(phase_receptor);
 	cout << "Parsing receptor " << receptor_path << endl;
-	receptor rec(receptor_path, center, size, granularity);
+	receptor rec(receptor_path, center, size, granularity, brick_cap, precision);
+	pt.next(phase_maps);
+
+	// Map grid maps of all atom types from the map file if it is valid, or create them and save them to the map file if any. Textures are created of all atom types before docking.
+	if (!maps_path.empty() || textures)
+	{
+		vector<size_t> xs(sf.n);
+		iota(xs.begin(), xs.end(), 0);
+		if (!maps_path.empty() && rec.map(maps_path, sf))
+		{
+			cout << "Mapping grid maps from " << maps_path << endl;
+		}
+		else
+		{
+			cout << "Creating grid maps of " << scoring_function::n << " atom types in parallel" << endl;
+			pt.next(phase_scoring_function);
+			precalculate_pairs(sf.claim(all_types, rec.types));
+			pt.next(phase_maps);
+			const auto start = std::chrono::steady_clock::now();
+			rec.allocate(xs);
+			rec.precalculate(sf, xs);
+			for (size_t l = 0; l < rec.num_layers(); ++l)
+			{
+				task_group tg(ts);
+				for (size_t z = rec.layer_begin(l); z < rec.layer_end(l); ++z)
+				{
+					tg.run([&,z]()
+					{
+						rec.populate(xs, z, sf);
+					});
+				}
+				tg.wait();
+				rec.store(xs, l);
+			}
+			if (prof) prof->add_maps(xs, std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - start).count());
+
+			if (!maps_path.empty())
+			{
+				cout << "Saving grid maps to " << maps_path << endl;
+				if (!rec.save(maps_path, sf))
+				{
+					cerr << "Failed to save grid maps to " << maps_path << endl;
+				}
+			}
+		}
+		rec.quantize(xs);
+	}
 
-	cout << "Detecting CUDA devices with compute capability 1.1 or greater" << endl;
+	// Exit if only the map file is to be created.
+	if (input_folder_path.empty())
+	{
+		ts.wait();
+		pt.stop();
+		if (prof) prof->write();
+		return 0;
+	}
+	pt.stop();
+
+	cout << "Detecting CUDA devices with compute capability " << (textures ? "3.0" : device_maps ? "2.0" : "1.1") << " or greater" << endl;
 	checkCudaErrors(cuInit(0));
 	int num_devices;
 	checkCudaErrors(cuDeviceGetCount(&num_devices));
@@ -193,13 +373,19 @@ int main(int argc, char* argv[])
 		CUdevice device;
 		checkCudaErrors(cuDeviceGet(&device, dev));
 
-		// Filter devices with compute capability 1.1 or greater, which is required by cuMemHostGetDevicePointer and cuStreamAddCallback.
+		// Filter devices with compute capability 1.1 or greater, which is required by cuStreamAddCallback.
 		int major;
 		int minor;
 		checkCudaErrors(cuDeviceGetAttribute(&major, CU_DEVICE_ATTRIBUTE_COMPUTE_CAPABILITY_MAJOR, device));
 		checkCudaErrors(cuDeviceGetAttribute(&minor, CU_DEVICE_ATTRIBUTE_COMPUTE_CAPABILITY_MINOR, device));
 		if (major == 1 && minor == 0) continue;
 
+		// Filter devices with compute capability 3.0 or greater, which is required by texture objects.
+		if (textures && major < 3) continue;
+
+		// Filter devices with compute capability 2.0 or greater, which is required by the three-dimensional grids of the grid map kernel.
+		if (device_maps && major < 2) continue;
+
 		// Save the device handle.
 		devices.push_back(device);
 
@@ -227,106 +413,206 @@ int main(int argc, char* argv[])
 	num_devices = devices.size();
 	if (!num_devices)
 	{
-		cerr << "No CUDA devices with compute capability 1.1 or greater detected" << endl;
+		cerr << "No CUDA devices with compute capability " << (textures ? "3.0" : device_maps ? "2.0" : "1.1") << " or greater detected" << endl;
 		return 2;
 	}
+	if (prof) prof->set_num_devices(num_devices);
 
 	cout << "Creating contexts and compiling kernel source for " << num_devices << " devices" << endl;
 	source src;
+	const kernel_cache kc(kernel_cache_path);
+	int driver_version;
+	checkCudaErrors(cuDriverGetVersion(&driver_version));
 	vector<CUcontext> contexts(num_devices);
+	vector<uint64_t> keys(num_devices);
+	vector<vector<char>> cubins(num_devices);
 	vector<CUfunction> functions(num_devices);
+	vector<CUfunction> populates(num_devices);
+	vector<CUfunction> ranks(num_devices);
+	vector<CUdeviceptr> atmd(num_devices);
+	vector<CUdeviceptr> tlod(num_devices);
+	vector<CUdeviceptr> tlad(num_devices);
 	vector<array<CUdeviceptr, sf.n>> mpsd(num_devices);
+	vector<CUdeviceptr> sfed(num_devices);
+	vector<CUdeviceptr> sfdd(num_devices);
+	vector<array<bool, scoring_function::np>> sfu(num_devices); // True for the type pairs of the scoring function uploaded to each device.
 	vector<CUdeviceptr> mpsv(num_devices);
-	vector<CUdeviceptr> slnv(num_devices);
-	vector<CUdeviceptr> ligv(num_devices);
-	vector<int*> ligh(num_devices);
-	vector<CUdeviceptr> ligd(num_devices);
-	vector<CUdeviceptr> slnd(num_devices);
-	vector<float*> cnfh(num_devices);
-	vector<size_t> lig_elems(num_devices, 2601);
-	vector<size_t> sln_elems(num_devices, 3438);
-	vector<size_t> cnf_elems(num_devices,   43);
+	vector<CUevent> mpse(num_devices);
+	const int num_slots = num_devices * static_cast<int>(num_streams); // Streams are indexed by int, as are the CPU slots that follow them.
+	vector<CUstream> streams(num_slots);
+	vector<int*> ligh(num_slots);
+	vector<CUdeviceptr> ligd(num_slots);
+	vector<CUdeviceptr> slnd(num_slots);
+	vector<CUdeviceptr> cnfd(num_slots);
+	vector<float*> cnfh(num_slots);
+	vector<array<CUevent, 4>> timers(num_slots); // Timing events of each stream, if profiled.
+	vector<size_t> lig_elems(num_slots, (2601 + ligand_batch::dsc_elems) * batch_size);
+	vector<size_t> sln_elems(num_slots, 3438 * num_tasks * batch_size);
+	vector<size_t> cnf_elems(num_slots,   43 * num_tasks * batch_size);
+
+	// Initialize just-in-time compilation options.
+	const unsigned int num_jit_options = 2;
+	array<CUjit_option, num_jit_options> jit_keys =
+	{
+		CU_JIT_MAX_REGISTERS,
+		CU_JIT_CACHE_MODE
+	};
+	array<void*, num_jit_options> jit_vals =
+	{
+		(void*)32,
+		(void*)CU_JIT_CACHE_OPTION_NONE // CU_JIT_CACHE_OPTION_CG, CU_JIT_CACHE_OPTION_CA
+	};
+
 	for (int dev = 0; dev < num_devices; ++dev)
 	{
-		// Create a context for the current device.
+		// Create a context for the current device, and pop it until the module is loaded.
 		checkCudaErrors(cuCtxCreate(&contexts[dev], CU_CTX_SCHED_AUTO/*CU_CTX_SCHED_YIELD*/ | CU_CTX_MAP_HOST, devices[dev]));
-//		checkCudaErrors(cuCtxSetCacheConfig(CU_FUNC_CACHE_PREFER_L1));
-//		checkCudaErrors(cuCtxSetSharedMemConfig(CU_SHARED_MEM_CONFIG_EIGHT_BYTE_BANK_SIZE));
+		checkCudaErrors(cuCtxPopCurrent(NULL));
 
-		// Initialize just-in-time compilation options.
-		const unsigned int num_jit_options = 2;
-		array<CUjit_option, num_jit_options> jit_keys =
-		{
-			CU_JIT_MAX_REGISTERS,
-			CU_JIT_CACHE_MODE
-		};
-		array<void*, num_jit_options> jit_vals =
+		// Key the cubin by the device, the driver, the kernel source and the just-in-time compilation options.
+		char name[256];
+		int major;
+		int minor;
+		checkCudaErrors(cuDeviceGetName(name, sizeof(name), devices[dev]));
+		checkCudaErrors(cuDeviceGetAttribute(&major, CU_DEVICE_ATTRIBUTE_COMPUTE_CAPABILITY_MAJOR, devices[dev]));
+		checkCudaErrors(cuDeviceGetAttribute(&minor, CU_DEVICE_ATTRIBUTE_COMPUTE_CAPABILITY_MINOR, devices[dev]));
+		checksum c;
+		c(name, strlen(name));
+		c(major);
+		c(minor);
+		c(driver_version);
+		c(src.data(), src.size());
+		c(jit_vals);
+
+		// Load the cubin from the cache if any.
+		keys[dev] = c.value();
+		kc.load(keys[dev], cubins[dev]);
+	}
+
+	// Compile the kernel source in parallel for one device of each key missing from the cache, and save its cubin.
+	vector<int> builders;
+	for (int dev = 0; dev < num_devices; ++dev)
+	{
+		if (!cubins[dev].empty() || find_if(builders.cbegin(), builders.cend(), [&](const int b) { return keys[b] == keys[dev]; }) != builders.cend()) continue;
+		builders.push_back(dev);
+	}
+	if (!builders.empty())
+	{
+		cout << "Building kernel source for " << builders.size() << " devices in parallel" << endl;
+		task_group tg(ts);
+		for (const int dev : builders)
 		{
-			(void*)32,
-			(void*)CU_JIT_CACHE_OPTION_NONE // CU_JIT_CACHE_OPTION_CG, CU_JIT_CACHE_OPTION_CA
-		};
+			tg.run([&, dev]()
+			{
+				checkCudaErrors(cuCtxPushCurrent(contexts[dev]));
+				CUlinkState state;
+				void* cubin;
+				size_t cubin_size;
+				checkCudaErrors(cuLinkCreate(num_jit_options, jit_keys.data(), jit_vals.data(), &state));
+				checkCudaErrors(cuLinkAddData(state, CU_JIT_INPUT_FATBINARY, src.data(), src.size(), "kernel.fatbin", 0, NULL, NULL));
+				checkCudaErrors(cuLinkComplete(state, &cubin, &cubin_size));
+				cubins[dev].assign(static_cast<const char*>(cubin), static_cast<const char*>(cubin) + cubin_size);
+				checkCudaErrors(cuLinkDestroy(state));
+				checkCudaErrors(cuCtxPopCurrent(NULL));
+				if (!kernel_cache_path.empty() && !kc.save(keys[dev], cubins[dev]))
+				{
+					safe_print([&]()
+					{
+						cerr << "Failed to save cubin of device " << dev << " to " << kernel_cache_path << endl;
+					});
+				}
+			});
+		}
+		tg.wait();
+	}
 
-		// Load the module into the current context.
+	// Encode the receptor atoms and the atoms near each tile for the grid map kernel, which every device shares.
+	vector<float> atmh;
+	vector<int> tloh, tlah;
+	if (device_maps)
+	{
+		cout << "Creating grid maps on the devices from the atoms near " << rec.num_probes[2] * rec.num_tiles << " tiles" << endl;
+		rec.encode_tiles(atmh, tloh, tlah);
+	}
+
+	for (int dev = 0; dev < num_devices; ++dev)
+	{
+		// Push the context of the current device.
+		checkCudaErrors(cuCtxPushCurrent(contexts[dev]));
+//		checkCudaErrors(cuCtxSetCacheConfig(CU_FUNC_CACHE_PREFER_L1));
+//		checkCudaErrors(cuCtxSetSharedMemConfig(CU_SHARED_MEM_CONFIG_EIGHT_BYTE_BANK_SIZE));
+
+		// Load the module into the current context from the cubin of the current device, or of another device of the same key.
+		if (cubins[dev].empty()) cubins[dev] = cubins[*find_if(builders.cbegin(), builders.cend(), [&](const int b) { return keys[b] == keys[dev]; })];
 		CUmodule module;
-		checkCudaErrors(cuModuleLoadDataEx(&module, src.data(), num_jit_options, jit_keys.data(), jit_vals.data()));
+		checkCudaErrors(cuModuleLoadData(&module, cubins[dev].data()));
+		cubins[dev].clear();
 
 		// Get functions from module.
 		checkCudaErrors(cuModuleGetFunction(&functions[dev], module, "monte_carlo"));
+		checkCudaErrors(cuModuleGetFunction(&populates[dev], module, "populate"));
+		checkCudaErrors(cuModuleGetFunction(&ranks[dev], module, "rank"));
 
 		// Get symbols from module.
 		CUdeviceptr sfec;
 		CUdeviceptr sfdc;
 		CUdeviceptr sfsc;
+		CUdeviceptr sfic;
 		CUdeviceptr cr0c;
 		CUdeviceptr cr1c;
 		CUdeviceptr nprc;
 		CUdeviceptr gric;
 		CUdeviceptr mpsc;
+		CUdeviceptr mtsc;
+		CUdeviceptr bksc;
+		CUdeviceptr mpfc;
 		CUdeviceptr nbic;
 		CUdeviceptr sedc;
-		CUdeviceptr slnc;
-		CUdeviceptr ligc;
 		size_t sfes;
 		size_t sfds;
 		size_t sfss;
+		size_t sfis;
 		size_t cr0s;
 		size_t cr1s;
 		size_t nprs;
 		size_t gris;
 		size_t mpss;
+		size_t mtss;
+		size_t bkss;
+		size_t mpfs;
 		size_t nbis;
 		size_t seds;
-		size_t slns;
-		size_t ligs;
 		checkCudaErrors(cuModuleGetGlobal(&sfec, &sfes, module, "sfe")); //   8 const float*
 		checkCudaErrors(cuModuleGetGlobal(&sfdc, &sfds, module, "sfd")); //   8 const float*
 		checkCudaErrors(cuModuleGetGlobal(&sfsc, &sfss, module, "sfs")); //   4 int
+		checkCudaErrors(cuModuleGetGlobal(&sfic, &sfis, module, "sfi")); //   4 int
 		checkCudaErrors(cuModuleGetGlobal(&cr0c, &cr0s, module, "cr0")); //  12 float3
 		checkCudaErrors(cuModuleGetGlobal(&cr1c, &cr1s, module, "cr1")); //  12 float3
 		checkCudaErrors(cuModuleGetGlobal(&nprc, &nprs, module, "npr")); //  12 int3
 		checkCudaErrors(cuModuleGetGlobal(&gric, &gris, module, "gri")); //   4 float
 		checkCudaErrors(cuModuleGetGlobal(&mpsc, &mpss, module, "mps")); // 120 conat float* [15]
+		checkCudaErrors(cuModuleGetGlobal(&mtsc, &mtss, module, "mts")); // 120 cudaTextureObject_t [15]
+		checkCudaErrors(cuModuleGetGlobal(&bksc, &bkss, module, "bks")); //   4 int
+		checkCudaErrors(cuModuleGetGlobal(&mpfc, &mpfs, module, "mpf")); //   4 int
 		checkCudaErrors(cuModuleGetGlobal(&nbic, &nbis, module, "nbi")); //   4 int
 		checkCudaErrors(cuModuleGetGlobal(&sedc, &seds, module, "sed")); //   8 unsigned long
-		checkCudaErrors(cuModuleGetGlobal(&slnc, &slns, module, "s0e")); //   8 float*
-		checkCudaErrors(cuModuleGetGlobal(&ligc, &ligs, module, "lig")); //   8 const int*
 
-		// Initialize symbols for scoring function.
-		CUdeviceptr sfed;
-		CUdeviceptr sfdd;
+		// Initialize symbols for scoring function, whose type pairs are uploaded before the first launch that looks them up.
 		const int sfsh = sf.ns;
-		assert(sfes == sizeof(sfed));
-		assert(sfds == sizeof(sfdd));
+		const int sfih = sf.interpolated;
+		assert(sfes == sizeof(sfed[dev]));
+		assert(sfds == sizeof(sfdd[dev]));
 		assert(sfss == sizeof(sfsh));
-		const size_t sfe_bytes = sizeof(float) * sf.e.size();
-		const size_t sfd_bytes = sizeof(float) * sf.d.size();
-		checkCudaErrors(cuMemAlloc(&sfed, sfe_bytes));
-		checkCudaErrors(cuMemAlloc(&sfdd, sfd_bytes));
-		checkCudaErrors(cuMemcpyHtoD(sfed, sf.e.data(), sfe_bytes));
-		checkCudaErrors(cuMemcpyHtoD(sfdd, sf.d.data(), sfd_bytes));
-		checkCudaErrors(cuMemcpyHtoD(sfec, &sfed, sfes));
-		checkCudaErrors(cuMemcpyHtoD(sfdc, &sfdd, sfds));
+		assert(sfis == sizeof(sfih));
+		const size_t sfe_bytes = sizeof(float) * sf.ne;
+		const size_t sfd_bytes = sizeof(float) * sf.ne;
+		checkCudaErrors(cuMemAlloc(&sfed[dev], sfe_bytes));
+		checkCudaErrors(cuMemAlloc(&sfdd[dev], sfd_bytes));
+		checkCudaErrors(cuMemcpyHtoD(sfec, &sfed[dev], sfes));
+		checkCudaErrors(cuMemcpyHtoD(sfdc, &sfdd[dev], sfds));
 		checkCudaErrors(cuMemcpyHtoD(sfsc, &sfsh, sfss));
+		checkCudaErrors(cuMemcpyHtoD(sfic, &sfih, sfis));
+		sfu[dev].fill(false);
 
 		// Initialize symbols for receptor.
 		assert(cr0s == sizeof(rec.corner0));
@@ -340,6 +626,70 @@ int main(int argc, char* argv[])
 		checkCudaErrors(cuMemcpyHtoD(gric, &rec.granularity_inverse, gris));
 		mpsv[dev] = mpsc;
 
+		// Upload the grid maps of all atom types once as 3D arrays, and bind them to textures with trilinear filtering of unnormalized coordinates clamped at the edges.
+		assert(mtss == sizeof(CUtexObject) * sf.n);
+		if (textures)
+		{
+			cout << "Uploading grid maps of " << sf.n << " atom types as textures to device " << dev << endl;
+			array<CUtexObject, sf.n> mtsh;
+			for (size_t t = 0; t < sf.n; ++t)
+			{
+				CUDA_ARRAY3D_DESCRIPTOR arr_desc = {};
+				arr_desc.Width = rec.num_probes[0];
+				arr_desc.Height = rec.num_probes[1];
+				arr_desc.Depth = rec.num_probes[2];
+				arr_desc.Format = CU_AD_FORMAT_FLOAT;
+				arr_desc.NumChannels = 1;
+				CUarray arr;
+				checkCudaErrors(cuArray3DCreate(&arr, &arr_desc));
+				CUDA_MEMCPY3D cpy = {};
+				cpy.srcMemoryType = CU_MEMORYTYPE_HOST;
+				cpy.srcHost = rec.mps[t];
+				cpy.srcPitch = sizeof(float) * rec.num_probes[0];
+				cpy.srcHeight = rec.num_probes[1];
+				cpy.dstMemoryType = CU_MEMORYTYPE_ARRAY;
+				cpy.dstArray = arr;
+				cpy.WidthInBytes = sizeof(float) * rec.num_probes[0];
+				cpy.Height = rec.num_probes[1];
+				cpy.Depth = rec.num_probes[2];
+				checkCudaErrors(cuMemcpy3D(&cpy));
+				CUDA_RESOURCE_DESC res_desc = {};
+				res_desc.resType = CU_RESOURCE_TYPE_ARRAY;
+				res_desc.res.array.hArray = arr;
+				CUDA_TEXTURE_DESC tex_desc = {};
+				tex_desc.addressMode[0] = CU_TR_ADDRESS_MODE_CLAMP;
+				tex_desc.addressMode[1] = CU_TR_ADDRESS_MODE_CLAMP;
+				tex_desc.addressMode[2] = CU_TR_ADDRESS_MODE_CLAMP;
+				tex_desc.filterMode = CU_TR_FILTER_MODE_LINEAR;
+				checkCudaErrors(cuTexObjectCreate(&mtsh[t], &res_desc, &tex_desc, NULL));
+			}
+			checkCudaErrors(cuMemcpyHtoD(mtsc, mtsh.data(), mtss));
+		}
+		else
+		{
+			checkCudaErrors(cuMemsetD8(mtsc, 0, mtss));
+		}
+		checkCudaErrors(cuEventCreate(&mpse[dev], CU_EVENT_DISABLE_TIMING));
+
+		// Upload the receptor atoms and the atoms near each tile once for the grid map kernel.
+		if (device_maps)
+		{
+			checkCudaErrors(cuMemAlloc(&atmd[dev], sizeof(float) * atmh.size()));
+			checkCudaErrors(cuMemAlloc(&tlod[dev], sizeof(int) * tloh.size()));
+			checkCudaErrors(cuMemAlloc(&tlad[dev], sizeof(int) * max<size_t>(tlah.size(), 1)));
+			checkCudaErrors(cuMemcpyHtoD(atmd[dev], atmh.data(), sizeof(float) * atmh.size()));
+			checkCudaErrors(cuMemcpyHtoD(tlod[dev], tloh.data(), sizeof(int) * tloh.size()));
+			if (tlah.size()) checkCudaErrors(cuMemcpyHtoD(tlad[dev], tlah.data(), sizeof(int) * tlah.size()));
+		}
+
+		// Initialize the symbols of sparse and quantized grid maps.
+		const int bksh = brick_cap != 0;
+		const int mpfh = precision;
+		assert(bkss == sizeof(bksh));
+		assert(mpfs == sizeof(mpfh));
+		checkCudaErrors(cuMemcpyHtoD(bksc, &bksh, bkss));
+		checkCudaErrors(cuMemcpyHtoD(mpfc, &mpfh, mpfs));
+
 		// Initialize symbols for program control.
 		const int nbih = num_bfgs_iterations;
 		assert(nbis == sizeof(nbih));
@@ -347,191 +697,399 @@ int main(int argc, char* argv[])
 		checkCudaErrors(cuMemcpyHtoD(nbic, &nbih, nbis));
 		checkCudaErrors(cuMemcpyHtoD(sedc, &seed, seds));
 
-		// Allocate ligh, ligd, slnd and cnfh.
-		checkCudaErrors(cuMemHostAlloc((void**)&ligh[dev], sizeof(int) * lig_elems[dev], CU_MEMHOSTALLOC_DEVICEMAP));
-		checkCudaErrors(cuMemHostGetDevicePointer(&ligd[dev], ligh[dev], 0));
-		checkCudaErrors(cuMemAlloc(&slnd[dev], sizeof(float) * sln_elems[dev] * num_tasks));
-		checkCudaErrors(cuMemHostAlloc((void**)&cnfh[dev], sizeof(float) * cnf_elems[dev] * num_tasks, 0));
-
-		// Initialize symbols for sln and lig.
-		assert(slns == sizeof(slnd[dev]));
-		assert(ligs == sizeof(ligd[dev]));
-		checkCudaErrors(cuMemcpyHtoD(slnc, &slnd[dev], slns));
-		checkCudaErrors(cuMemcpyHtoD(ligc, &ligd[dev], ligs));
-		slnv[dev] = slnc;
-		ligv[dev] = ligc;
+		// Create the streams of the current device, each with its own pinned ligh and cnfh and device ligd and slnd, and cnfd if the conformations are ranked on the device, so that a ligand can be uploaded and another one downloaded while the kernel of a third one is running.
+		for (int slt = dev; slt < num_slots; slt += num_devices)
+		{
+			checkCudaErrors(cuStreamCreate(&streams[slt], CU_STREAM_NON_BLOCKING));
+			checkCudaErrors(cuMemHostAlloc((void**)&ligh[slt], sizeof(int) * lig_elems[slt], 0));
+			checkCudaErrors(cuMemAlloc(&ligd[slt], sizeof(int) * lig_elems[slt]));
+			checkCudaErrors(cuMemAlloc(&slnd[slt], sizeof(float) * sln_elems[slt]));
+			checkCudaErrors(cuMemHostAlloc((void**)&cnfh[slt], sizeof(float) * cnf_elems[slt], 0));
+			if (num_candidates < num_tasks) checkCudaErrors(cuMemAlloc(&cnfd[slt], sizeof(float) * cnf_elems[slt]));
+			if (prof)
+			{
+				for (auto& e : timers[slt])
+				{
+					checkCudaErrors(cuEventCreate(&e, CU_EVENT_DEFAULT));
+				}
+			}
+		}
 
 		// Pop the current context.
 		checkCudaErrors(cuCtxPopCurrent(NULL));
 	}
 	src.clear();
-	sf.clear();
+	atmh.clear();
+	tloh.clear();
+	tlah.clear();
+
+	// Copy the type pairs of the scoring function claimed since the last copy to device dev on a stream, and return true if any.
+	const auto upload_pairs = [&](const int dev, const CUstream stream)
+	{
+		bool uploaded = false;
+		for (size_t p = 0; p < sf.np; ++p)
+		{
+			if (sf.claimed[p] && !sfu[dev][p])
+			{
+				const size_t offset = sf.nr * p;
+				checkCudaErrors(cuMemcpyHtoDAsync(sfed[dev] + sizeof(float) * offset, sf.e + offset, sizeof(float) * sf.nr, stream));
+				checkCudaErrors(cuMemcpyHtoDAsync(sfdd[dev] + sizeof(float) * offset, sf.d + offset, sizeof(float) * sf.nr, stream));
+				sfu[dev][p] = true;
+				uploaded = true;
+			}
+		}
+		return uploaded;
+	};
+
+	// Allocate the dense float32 grid map of atom type t on device dev, populate it with the grid map kernel on a stream, and point the docking kernel to it. The type pairs of t with the receptor types must have been copied on the stream.
+	const auto populate_on_device = [&](const int dev, const CUstream stream, const size_t t)
+	{
+		int th = t;
+		float grh = rec.granularity;
+		int nrh = sf.nr;
+		int tileh = receptor::tile;
+		checkCudaErrors(cuMemAlloc(&mpsd[dev][t], rec.map_bytes));
+		void* params[] = { &mpsd[dev][t], &th, &grh, &nrh, &tileh, &atmd[dev], &tlod[dev], &tlad[dev] };
+		checkCudaErrors(cuLaunchKernel(populates[dev], (rec.num_probes[0] + 127) / 128, rec.num_probes[1], rec.num_probes[2], 128, 1, 1, 0, stream, params, NULL));
+		checkCudaErrors(cuMemcpyHtoDAsync(mpsv[dev] + sizeof(CUdeviceptr) * t, &mpsd[dev][t], sizeof(CUdeviceptr), stream));
+	};
 
-	// Initialize a vector of idle devices.
-	safe_vector<int> idle(num_devices);
+	// Initialize a vector of idle streams, of which stream slt belongs to device slt % num_devices, so that successive ligands go to different devices.
+	// Slots [num_slots, num_slots + num_cpu_slots) dock on the worker threads instead. Batches go to whichever slot frees first, so each backend receives batches in proportion to its throughput. CPU slots are placed at the front to be taken after the streams.
+	safe_vector<int> idle(num_slots + num_cpu_slots);
 	iota(idle.begin(), idle.end(), 0);
+	rotate(idle.begin(), idle.begin() + num_slots, idle.end());
+	const cpu_backend cpu(ts, num_threads, num_tasks, num_bfgs_iterations, seed, sf, rec, textures, prof.get());
+	vector<vector<float>> cpu_cnfh(num_cpu_slots);
 
-	cout << "Training a random forest of " << num_trees << " trees in parallel" << endl;
+	// Load the random forest from the model file if it is valid, or train and save it otherwise.
+	pt.next(phase_forest);
 	forest f(num_trees, seed);
-	cnt.init(num_trees);
-	for (size_t i = 0; i < num_trees; ++i)
+	if (!forest_path.empty() && f.load(forest_path))
 	{
-		io.post([&, i]()
+		cout << "Loading a random forest of " << num_trees << " trees from " << forest_path << endl;
+	}
+	else
+	{
+		cout << "Training a random forest of " << num_trees << " trees in parallel" << endl;
+		task_group tg(ts);
+		for (size_t i = 0; i < num_trees; ++i)
 		{
-			f[i].train(4, f.u01_s);
-			cnt.increment();
-		});
+			tg.run([&, i]()
+			{
+				f.train(i);
+			});
+		}
+		tg.wait();
+		f.clear();
+		if (!forest_path.empty())
+		{
+			cout << "Saving the random forest to " << forest_path << endl;
+			if (!f.save(forest_path))
+			{
+				cerr << "Failed to save random forest " << forest_path << endl;
+			}
+		}
 	}
-	cnt.wait();
-	f.clear();
+	pt.stop();
 
-	// Perform docking for each ligand in the input folder.
-	log_engine log;
+	// Perform docking for each batch of ligands in the input folder.
+	log_engine log(log_path, max_conformations, false, top_k);
 	cout.setf(ios::fixed, ios::floatfield);
-	cout << "Executing " << num_tasks << " optimization runs of " << num_bfgs_iterations << " BFGS iterations in parallel" << endl
-	     << "   Index        Ligand D  pKd 1     2     3     4     5     6     7     8     9" << endl << setprecision(2);
-	for (directory_iterator dir_iter(input_folder_path), const_dir_iter; dir_iter != const_dir_iter; ++dir_iter)
+	cout << "Executing " << num_tasks << " optimization runs of " << num_bfgs_iterations << " BFGS iterations in parallel for each of up to " << batch_size << " ligands per kernel launch" << endl;
+	if (num_candidates < num_tasks)
 	{
-		// Filter files with .pdbqt extension name.
-		const path& input_ligand_path = dir_iter->path();
-		if (input_ligand_path.extension() != ".pdbqt") continue;
-
-		// Parse the ligand. Don't declare it const as it will be moved to the callback data wrapper.
-		ligand lig(input_ligand_path);
+		cout << "Ranking and deduplicating the conformations on the devices, and copying back " << num_candidates << " candidates per ligand for clustering" << endl;
+	}
+	cout << "   Index        Ligand D  pKd 1     2     3     4     5     6     7     8     9" << endl << setprecision(2);
+	ligand_block blk;
+	size_t lid = 0; // Index of the next ligand in input order, which keys the random number streams of its tasks together with the seed.
+	for (ligand_reader reader(input_folder_path, input_offset); true;)
+	{
+		// Parse up to batch_size ligands into a batch. Don't declare it const as it will be moved to the callback data wrapper.
+		ligand_batch bat(num_tasks);
+		profile_timer bt(prof.get(), phase_ligands);
+		while (bat.size() < batch_size && reader.next(blk))
+		{
+			bat.push_back(ligand(blk.filename, blk.b, blk.e), lid++);
+		}
+		if (!bat.size()) break;
 
-		// Find atom types that are presented in the current ligand but not presented in the grid maps.
+		// Find atom types that are presented in the current batch but not presented in the grid maps.
 		vector<size_t> xs;
+		array<bool, scoring_function::n> batch_types, missing_types{};
 		for (size_t t = 0; t < sf.n; ++t)
 		{
-			if (lig.xs[t] && rec.maps[t].empty())
+			batch_types[t] = bat.uses(t);
+			if (bat.uses(t) && !rec.map_sizes[t])
 			{
-				rec.maps[t].resize(rec.num_probes_product);
 				xs.push_back(t);
+				missing_types[t] = true;
 			}
 		}
 
-		// Create grid maps on the fly if necessary.
-		if (xs.size())
+		// Precalculate the type pairs of the scoring function within the batch and between its missing grid maps and the receptor that no earlier batch has claimed. Batches already in flight look up other pairs only.
+		bt.next(phase_scoring_function);
+		precalculate_pairs(sf.claim(batch_types, batch_types));
+		precalculate_pairs(sf.claim(missing_types, rec.types));
+
+		// Create grid maps on the fly if necessary. Grid maps created on the devices are copied back from device 0 only if a CPU slot may dock the batch.
+		bt.next(phase_maps);
+		if (xs.size() && device_maps)
+		{
+			if (num_cpu_slots)
+			{
+				const auto start = std::chrono::steady_clock::now();
+				checkCudaErrors(cuCtxPushCurrent(contexts[0]));
+				bool uploaded = upload_pairs(0, NULL);
+				rec.allocate(xs);
+				for (const size_t t : xs)
+				{
+					if (!mpsd[0][t])
+					{
+						populate_on_device(0, NULL, t);
+						uploaded = true;
+					}
+					checkCudaErrors(cuMemcpyDtoHAsync(rec.maps[t].data(), mpsd[0][t], rec.map_bytes, NULL));
+				}
+				if (uploaded) checkCudaErrors(cuEventRecord(mpse[0], NULL));
+				checkCudaErrors(cuStreamSynchronize(NULL));
+				checkCudaErrors(cuCtxPopCurrent(NULL));
+				if (prof) prof->add_maps(xs, std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - start).count());
+			}
+		}
+		else if (xs.size())
 		{
 			// Precalculate p_offset.
+			const auto start = std::chrono::steady_clock::now();
+			rec.allocate(xs);
 			rec.precalculate(sf, xs);
 
-			// Create grid maps in parallel.
-			cnt.init(rec.num_probes[2]);
-			for (size_t z = 0; z < rec.num_probes[2]; ++z)
+			// Create grid maps in parallel, one layer of bricks at a time if the maps are sparse.
+			for (size_t l = 0; l < rec.num_layers(); ++l)
 			{
-				io.post([&,z]()
+				task_group tg(ts);
+				for (size_t z = rec.layer_begin(l); z < rec.layer_end(l); ++z)
 				{
-					rec.populate(xs, z, sf);
-					cnt.increment();
-				});
+					tg.run([&,z]()
+					{
+						rec.populate(xs, z, sf);
+					});
+				}
+				tg.wait();
+				rec.store(xs, l);
 			}
-			cnt.wait();
+			if (prof) prof->add_maps(xs, std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - start).count());
+			rec.quantize(xs);
 		}
+		bt.stop();
+
+		// Wait until a stream or a CPU slot is ready for execution. Its previous batch has been written and its buffers are free for reuse.
+		const int slt = idle.safe_pop_back();
 
-		// Wait until a device is ready for execution.
-		const int dev = idle.safe_pop_back();
+		// Dock the batch on the worker threads if a CPU slot is chosen, and write each ligand once its jobs have finished.
+		if (slt >= num_slots)
+		{
+			vector<float>& cnfv = cpu_cnfh[slt - num_slots];
+			if (bat.get_cnf_elems() > cnfv.size())
+			{
+				cnfv.resize(bat.get_cnf_elems());
+			}
+			float* const cnfh = cnfv.data();
+			const shared_ptr<ligand_batch> cbat = make_shared<ligand_batch>(move(bat));
+			ts.post([&, slt, cnfh, cbat]()
+			{
+				cpu.dock(*cbat, cnfh, [&](const size_t l)
+				{
+					// Write conformations.
+					auto& lig = cbat->ligands[l];
+					lig.write(cnfh + cbat->cnf_offsets[l], output_folder_path, max_conformations, num_tasks, rec, f, sf, ligand::parallel_for(), prof.get());
+
+					// Output and save ligand stem and predicted affinities.
+					safe_print([&]()
+					{
+						string stem = lig.filename.stem().string();
+						cout << setw(8) << log.size() + 1 << setw(14) << stem << setw(2) << 'C' << ' ';
+						for_each(lig.affinities.cbegin(), lig.affinities.cbegin() + min<size_t>(lig.affinities.size(), 9), [](const float a)
+						{
+							cout << setw(6) << a;
+						});
+						cout << endl;
+						log.push_back(move(stem), move(lig.affinities));
+					});
+				});
+
+				// Signal the main thread to post another batch once all the ligands of the current batch have been written.
+				idle.safe_push_back(slt);
+			});
+			continue;
+		}
+		const int dev = slt % num_devices;
+		const CUstream stream = streams[slt];
 
 		// Push the context of the chosen device.
 		checkCudaErrors(cuCtxPushCurrent(contexts[dev]));
 
-		// Copy grid maps from host memory to device memory if necessary.
+		// Copy the type pairs of the scoring function claimed since the last launch on the device, and grid maps from host memory to device memory on the stream if necessary, unless all of the maps have been uploaded as textures or they are created on the device. The pairs and the maps are never modified after precalculation and creation, so the copies need not complete before returning. The event chains the copies and the creations of all the streams of the device, so that a kernel waiting on it sees every pair and map uploaded so far.
+		checkCudaErrors(cuStreamWaitEvent(stream, mpse[dev], 0));
+		if (prof) checkCudaErrors(cuEventRecord(timers[slt][0], stream));
+		bool uploaded = upload_pairs(dev, stream);
 		for (size_t t = 0; t < sf.n; ++t)
 		{
-			if (lig.xs[t] && !mpsd[dev][t])
+			if (device_maps && bat.uses(t) && !mpsd[dev][t])
+			{
+				populate_on_device(dev, stream, t);
+				uploaded = true;
+			}
+			else if (!textures && bat.uses(t) && !mpsd[dev][t])
 			{
-				checkCudaErrors(cuMemAlloc(&mpsd[dev][t], rec.map_bytes));
-				checkCudaErrors(cuMemcpyHtoD(mpsd[dev][t], rec.maps[t].data(), rec.map_bytes));
-				checkCudaErrors(cuMemcpyHtoD(mpsv[dev] + sizeof(CUdeviceptr) * t, &mpsd[dev][t], sizeof(CUdeviceptr)));
+				// Upload the brick table of a sparse map, followed by the scale and offset of a quantized map, followed by the values or codes.
+				const size_t table_bytes = rec.bts[t] ? sizeof(int) * rec.num_bricks_product : 0;
+				const size_t header_bytes = rec.mqs[t] ? sizeof(float) * 2 : 0;
+				const size_t values_bytes = (rec.mqs[t] ? sizeof(uint16_t) : sizeof(float)) * rec.map_sizes[t];
+				checkCudaErrors(cuMemAlloc(&mpsd[dev][t], table_bytes + header_bytes + values_bytes));
+				if (table_bytes) checkCudaErrors(cuMemcpyHtoDAsync(mpsd[dev][t], rec.bts[t], table_bytes, stream));
+				if (header_bytes) checkCudaErrors(cuMemcpyHtoDAsync(mpsd[dev][t] + table_bytes, &rec.mqa[2 * t], header_bytes, stream));
+				checkCudaErrors(cuMemcpyHtoDAsync(mpsd[dev][t] + table_bytes + header_bytes, rec.mqs[t] ? static_cast<const void*>(rec.mqs[t]) : rec.mps[t], values_bytes, stream));
+				checkCudaErrors(cuMemcpyHtoDAsync(mpsv[dev] + sizeof(CUdeviceptr) * t, &mpsd[dev][t], sizeof(CUdeviceptr), stream));
+				uploaded = true;
 			}
 		}
+		if (uploaded)
+		{
+			checkCudaErrors(cuEventRecord(mpse[dev], stream));
+		}
 
-		// Reallocate ligh and ligd should the current ligand elements exceed the default size.
-		const size_t this_lig_elems = lig.get_lig_elems();
-		if (this_lig_elems > lig_elems[dev])
+		// Reallocate ligh and ligd should the current batch elements exceed the default size.
+		const size_t this_lig_elems = bat.get_lig_elems();
+		if (this_lig_elems > lig_elems[slt])
 		{
-			checkCudaErrors(cuMemFreeHost(ligh[dev]));
-			lig_elems[dev] = this_lig_elems;
-			checkCudaErrors(cuMemHostAlloc((void**)&ligh[dev], sizeof(int) * lig_elems[dev], CU_MEMHOSTALLOC_DEVICEMAP));
-			checkCudaErrors(cuMemHostGetDevicePointer(&ligd[dev], ligh[dev], 0));
-			checkCudaErrors(cuMemcpyHtoD(ligv[dev], &ligd[dev], sizeof(ligv[dev])));
+			checkCudaErrors(cuMemFreeHost(ligh[slt]));
+			checkCudaErrors(cuMemFree(ligd[slt]));
+			lig_elems[slt] = this_lig_elems;
+			checkCudaErrors(cuMemHostAlloc((void**)&ligh[slt], sizeof(int) * lig_elems[slt], 0));
+			checkCudaErrors(cuMemAlloc(&ligd[slt], sizeof(int) * lig_elems[slt]));
 		}
 
-		// Compute the number of shared memory bytes.
-		const size_t lig_bytes = sizeof(int) * lig_elems[dev];
+		// Compute the number of shared memory bytes, which hold the largest ligand of the batch.
+		const size_t lig_bytes = sizeof(int) * bat.get_max_lig_elems();
 
-		// Encode the current ligand.
-		lig.encode(ligh[dev]);
+		// Encode the current batch and upload it.
+		bat.encode(ligh[slt], sf.nr);
+		checkCudaErrors(cuMemcpyHtoDAsync(ligd[slt], ligh[slt], sizeof(int) * this_lig_elems, stream));
 
 		// Reallocate slnd should the current solution elements exceed the default size.
-		const size_t this_sln_elems = lig.get_sln_elems();
-		if (this_sln_elems > sln_elems[dev])
+		const size_t this_sln_elems = bat.get_sln_elems();
+		if (this_sln_elems > sln_elems[slt])
 		{
-			checkCudaErrors(cuMemFree(slnd[dev]));
-			sln_elems[dev] = this_sln_elems;
-			checkCudaErrors(cuMemAlloc(&slnd[dev], sizeof(float) * sln_elems[dev] * num_tasks));
-			checkCudaErrors(cuMemcpyHtoD(slnv[dev], &slnd[dev], sizeof(slnv[dev])));
+			checkCudaErrors(cuMemFree(slnd[slt]));
+			sln_elems[slt] = this_sln_elems;
+			checkCudaErrors(cuMemAlloc(&slnd[slt], sizeof(float) * sln_elems[slt]));
 		}
 
 		// Clear the solution buffer.
-		checkCudaErrors(cuMemsetD32Async(slnd[dev], 0, sln_elems[dev] * num_tasks, NULL));
+		checkCudaErrors(cuMemsetD32Async(slnd[slt], 0, this_sln_elems, stream));
 
-		// Launch kernel.
-		void* params[] = { &lig.nv, &lig.nf, &lig.na, &lig.np };
-		checkCudaErrors(cuLaunchKernel(functions[dev], (num_tasks - 1) / 32 + 1, 1, 1, 32, 1, 1, lig_bytes, NULL, params, NULL));
+		// Launch kernel, with (num_tasks - 1) / 32 + 1 blocks per ligand.
+		int nl = bat.size();
+		void* params[] = { &nl, &ligd[slt], &slnd[slt] };
+		if (prof) checkCudaErrors(cuEventRecord(timers[slt][1], stream));
+		checkCudaErrors(cuLaunchKernel(functions[dev], ((num_tasks - 1) / 32 + 1) * nl, 1, 1, 32, 1, 1, lig_bytes, stream, params, NULL));
 
-		// Reallocate cnfh should the current conformation elements exceed the default size.
-		const size_t this_cnf_elems = lig.get_cnf_elems();
-		if (this_cnf_elems > cnf_elems[dev])
+		// Reallocate cnfh, and cnfd if any, should the current conformation elements exceed the default size.
+		const size_t this_cnf_elems = bat.get_cnf_elems();
+		if (this_cnf_elems > cnf_elems[slt])
 		{
-			checkCudaErrors(cuMemFreeHost(cnfh[dev]));
-			cnf_elems[dev] = this_cnf_elems;
-			checkCudaErrors(cuMemHostAlloc((void**)&cnfh[dev], sizeof(float) * cnf_elems[dev] * num_tasks, 0));
+			checkCudaErrors(cuMemFreeHost(cnfh[slt]));
+			cnf_elems[slt] = this_cnf_elems;
+			checkCudaErrors(cuMemHostAlloc((void**)&cnfh[slt], sizeof(float) * cnf_elems[slt], 0));
+			if (cnfd[slt])
+			{
+				checkCudaErrors(cuMemFree(cnfd[slt]));
+				checkCudaErrors(cuMemAlloc(&cnfd[slt], sizeof(float) * cnf_elems[slt]));
+			}
 		}
 
-		// Copy conformations from device memory to host memory.
-		checkCudaErrors(cuMemcpyDtoHAsync(cnfh[dev], slnd[dev], sizeof(float) * cnf_elems[dev] * num_tasks, NULL));
+		// Rank and deduplicate the conformations of each ligand on the device with one block per ligand, and copy the candidates of all the ligands from device memory to host memory at once. Otherwise copy the conformations of all the tasks of each ligand.
+		if (num_candidates < num_tasks)
+		{
+			int nth = num_tasks;
+			int nch = num_candidates;
+			void* rank_params[] = { &nth, &nch, &ligd[slt], &slnd[slt], &cnfd[slt] };
+			checkCudaErrors(cuLaunchKernel(ranks[dev], nl, 1, 1, 128, 1, 1, lig_bytes + sizeof(int) * (num_tasks + 2 * num_candidates), stream, rank_params, NULL));
+			if (prof) checkCudaErrors(cuEventRecord(timers[slt][2], stream));
+			checkCudaErrors(cuMemcpyDtoHAsync(cnfh[slt], cnfd[slt], sizeof(float) * (this_cnf_elems / num_tasks * num_candidates), stream));
+		}
+		else
+		{
+			if (prof) checkCudaErrors(cuEventRecord(timers[slt][2], stream));
+			for (size_t l = 0; l < bat.size(); ++l)
+			{
+				checkCudaErrors(cuMemcpyDtoHAsync(cnfh[slt] + bat.cnf_offsets[l], slnd[slt] + sizeof(float) * bat.sln_offsets[l], sizeof(float) * bat.ligands[l].get_cnf_elems() * num_tasks, stream));
+			}
+		}
+		if (prof) checkCudaErrors(cuEventRecord(timers[slt][3], stream));
 
-		// Add a callback to the compute stream.
-		checkCudaErrors(cuStreamAddCallback(NULL, [](CUstream stream, CUresult error, void* data)
+		// Add a callback to the stream, which writes the ligands of the batch in parallel.
+		checkCudaErrors(cuStreamAddCallback(stream, [](CUstream stream, CUresult error, void* data)
 		{
 			checkCudaErrors(error);
 			const shared_ptr<callback_data<int>> cbd(reinterpret_cast<callback_data<int>*>(data));
-			cbd->io.post([=]()
+
+			// Add the kernel and transfer time of the batch to the profile in the pool, as a callback must not make CUDA calls itself.
+			if (cbd->prof)
 			{
-				const auto& output_folder_path = cbd->output_folder_path;
-				const auto  max_conformations = cbd->max_conformations;
-				const auto  num_tasks = cbd->num_tasks;
-				const auto& rec = cbd->rec;
-				const auto& f = cbd->f;
-				const auto& sf = cbd->sf;
-				const auto  dev = cbd->dev;
-				const auto cnfh = cbd->cnfh;
-				auto& lig = cbd->lig;
-				auto& safe_print = cbd->safe_print;
-				auto& log = cbd->log;
-				auto& idle = cbd->idle;
-
-				// Write conformations.
-				lig.write(cnfh, output_folder_path, max_conformations, num_tasks, rec, f, sf);
-
-				// Output and save ligand stem and predicted affinities.
-				safe_print([&]()
+				cbd->ts.post([=]()
 				{
-					string stem = lig.filename.stem().string();
-					cout << setw(8) << log.size() + 1 << setw(14) << stem << setw(2) << dev << ' ';
-					for_each(lig.affinities.cbegin(), lig.affinities.cbegin() + min<size_t>(lig.affinities.size(), 9), [](const float a)
+					float upload_ms, kernel_ms, download_ms;
+					checkCudaErrors(cuCtxPushCurrent(cbd->context));
+					checkCudaErrors(cuEventElapsedTime(&upload_ms, cbd->events[0], cbd->events[1]));
+					checkCudaErrors(cuEventElapsedTime(&kernel_ms, cbd->events[1], cbd->events[2]));
+					checkCudaErrors(cuEventElapsedTime(&download_ms, cbd->events[2], cbd->events[3]));
+					checkCudaErrors(cuCtxPopCurrent(NULL));
+					cbd->prof->add_device(cbd->dev, cbd->bat.size(), static_cast<uint64_t>(1e6 * kernel_ms), static_cast<uint64_t>(1e6 * (upload_ms + download_ms)));
+					if (!--cbd->remaining) cbd->idle.safe_push_back(cbd->slt);
+				});
+			}
+			for (size_t l = 0; l < cbd->bat.size(); ++l)
+			{
+				cbd->ts.post([=]()
+				{
+					const auto& output_folder_path = cbd->output_folder_path;
+					const auto  max_conformations = cbd->max_conformations;
+					const auto  num_candidates = cbd->num_candidates;
+					const auto& rec = cbd->rec;
+					const auto& f = cbd->f;
+					const auto& sf = cbd->sf;
+					const auto  dev = cbd->dev;
+					const auto  slt = cbd->slt;
+					const auto cnfh = cbd->cnfh + cbd->bat.cnf_offsets[l] / cbd->num_tasks * num_candidates;
+					auto& lig = cbd->bat.ligands[l];
+					auto& safe_print = cbd->safe_print;
+					auto& log = cbd->log;
+					auto& idle = cbd->idle;
+
+					// Write conformations.
+					lig.write(cnfh, output_folder_path, max_conformations, num_candidates, rec, f, sf, ligand::parallel_for(), cbd->prof);
+
+					// Output and save ligand stem and predicted affinities.
+					safe_print([&]()
 					{
-						cout << setw(6) << a;
+						string stem = lig.filename.stem().string();
+						cout << setw(8) << log.size() + 1 << setw(14) << stem << setw(2) << dev << ' ';
+						for_each(lig.affinities.cbegin(), lig.affinities.cbegin() + min<size_t>(lig.affinities.size(), 9), [](const float a)
+						{
+							cout << setw(6) << a;
+						});
+						cout << endl;
+						log.push_back(move(stem), move(lig.affinities));
 					});
-					cout << endl;
-					log.push_back(new log_record(move(stem), move(lig.affinities)));
-				});
 
-				// Signal the main thread to post another task.
-				idle.safe_push_back(dev);
-			});
-		}, new callback_data<int>(io, output_folder_path, max_conformations, num_tasks, rec, f, sf, dev, cnfh[dev], move(lig), safe_print, log, idle), 0));
+					// Signal the main thread to post another batch once all the ligands of the current batch have been written.
+					if (!--cbd->remaining) idle.safe_push_back(slt);
+				});
+			}
+		}, new callback_data<int>(ts, output_folder_path, max_conformations, num_tasks, num_candidates, rec, f, sf, dev, slt, cnfh[slt], move(bat), safe_print, log, idle, prof.get(), contexts[dev], timers[slt].data()), 0));
 
 		// Pop the context after use.
 		checkCudaErrors(cuCtxPopCurrent(NULL));
@@ -545,19 +1103,41 @@ int main(int argc, char* argv[])
 		checkCudaErrors(cuCtxPopCurrent(NULL));
 	}
 
-	// Wait until the io service pool has finished all its tasks.
-	io.wait();
-	assert(idle.size() == num_devices);
+	// Wait until the task scheduler has finished all its tasks.
+	ts.wait();
+	assert(idle.size() == num_slots + num_cpu_slots);
 
-	// Destroy contexts.
+	// Destroy contexts, which releases their streams, events and memory.
 	for (auto& context : contexts)
 	{
 		checkCudaErrors(cuCtxDestroy(context));
 	}
 
+	// Report the accuracy of quantized grid maps against float32.
+	if (rec.num_quantized_values)
+	{
+		cout << "Quantized " << rec.num_quantized_values << " grid map values to " << map_precision_name(precision) << " with a maximum error of " << setprecision(6) << rec.max_quantization_error << " and an RMS error of " << sqrt(rec.sum_squared_quantization_errors / rec.num_quantized_values) << " against float32" << endl;
+	}
+
 	// Sort and write ligand log records to the log file.
-	if (log.empty()) return 0;
-	cout << "Writing log records of " << log.size() << " ligands to " << log_path << endl;
-	log.sort();
-	log.write(log_path);
+	if (!log.empty())
+	{
+		if (top_k)
+		{
+			cout << "Writing the top " << min(top_k, log.size()) << " log records of " << log.size() << " ligands to " << log.summary_path << endl;
+		}
+		else
+		{
+			cout << "Writing log records of " << log.size() << " ligands to " << log_path << endl;
+		}
+		const profile_timer t(prof.get(), phase_output);
+		log.write();
+	}
+
+	// Write the profile.
+	if (prof)
+	{
+		cout << "Writing the profile to " << profile_path << " and the work of each ligand docked on the worker threads to " << prof->csv_path << endl;
+		prof->write();
+	}
 }
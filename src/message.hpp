@@ -0,0 +1,160 @@
+#pragma once
+#ifndef IDOCK_MESSAGE_HPP
+#define IDOCK_MESSAGE_HPP
+
+#include <array>
+#include <string>
+#include <vector>
+#include <cstring>
+#include <cstdint>
+#include <stdexcept>
+#include <boost/asio/ip/tcp.hpp>
+#include <boost/asio/read.hpp>
+#include <boost/asio/write.hpp>
+#include <boost/asio/connect.hpp>
+#include "pose_file.hpp"
+using namespace std;
+using boost::asio::ip::tcp;
+
+//! Represents the type of a message between a coordinator and its workers, or between a resident server and its clients.
+//! A worker receives setup once connected, then repeatedly sends request and receives either batch, which it answers with result, or done. A worker that fails to parse a ligand sends error, which aborts the run as a standalone run would abort.
+//! A client repeatedly sends dock, and receives a pose for each ligand as soon as it is docked followed by done, or error if the request fails.
+enum message_type : uint32_t
+{
+	message_setup, //!< Receptor, grid maps, random forest and docking parameters.
+	message_request, //!< Request for a batch of ligands.
+	message_batch, //!< Batch of ligands, each with its index in input order, output filename and PDBQT text.
+	message_result, //!< Output filenames and conformations of the ligands of a batch.
+	message_done, //!< All the ligands have been docked.
+	message_error, //!< Description of an error of a worker or of a request to a server.
+	message_dock, //!< Receptor, box and docking parameters, followed by a batch of ligands as in batch.
+	message_pose, //!< Index in input order, output filename and conformations of a docked ligand.
+};
+
+//! Appends a trivially copyable value to a message payload. Payloads are in host byte order, so the coordinator and the workers must share it.
+template <typename T>
+inline void put(string& buf, const T& v)
+{
+	buf.append(reinterpret_cast<const char*>(&v), sizeof(v));
+}
+
+//! Appends a string to a message payload, prefixed by its size.
+inline void put(string& buf, const string& s)
+{
+	put<uint64_t>(buf, s.size());
+	buf.append(s);
+}
+
+//! Appends a vector of trivially copyable values to a message payload, prefixed by its size.
+template <typename T>
+inline void put(string& buf, const vector<T>& v)
+{
+	put<uint64_t>(buf, v.size());
+	buf.append(reinterpret_cast<const char*>(v.data()), sizeof(T) * v.size());
+}
+
+//! Appends a pose record to a message payload losslessly, unlike its binary pose format, so that the coordinator writes exactly what a standalone run would.
+inline void put(string& buf, const pose_record& pose)
+{
+	put(buf, pose.name);
+	put(buf, pose.affinities);
+	put(buf, pose.pdbqt);
+	vector<uint64_t> ends(pose.ends.cbegin(), pose.ends.cend());
+	put(buf, ends);
+	put(buf, pose.coords);
+}
+
+//! Represents a reader of the values of a message payload in the order they were put.
+class message_reader
+{
+public:
+	//! Constructs a reader of a payload, which must outlive the reader.
+	explicit message_reader(const string& buf) : p(buf.data()), e(buf.data() + buf.size()) {}
+
+	//! Reads a trivially copyable value.
+	template <typename T>
+	void get(T& v)
+	{
+		read(&v, sizeof(v));
+	}
+
+	//! Reads a string.
+	void get(string& s)
+	{
+		uint64_t n;
+		get(n);
+		check(n);
+		s.assign(p, n);
+		p += n;
+	}
+
+	//! Reads a vector of trivially copyable values.
+	template <typename T>
+	void get(vector<T>& v)
+	{
+		uint64_t n;
+		get(n);
+		if (n > static_cast<uint64_t>(e - p) / sizeof(T)) throw runtime_error("Truncated message");
+		v.resize(n);
+		read(v.data(), sizeof(T) * n);
+	}
+
+	//! Reads a pose record.
+	void get(pose_record& pose)
+	{
+		get(pose.name);
+		get(pose.affinities);
+		get(pose.pdbqt);
+		vector<uint64_t> ends;
+		get(ends);
+		pose.ends.assign(ends.cbegin(), ends.cend());
+		get(pose.coords);
+	}
+private:
+	//! Throws if fewer than n bytes remain.
+	void check(const uint64_t n) const
+	{
+		if (n > static_cast<uint64_t>(e - p)) throw runtime_error("Truncated message");
+	}
+
+	//! Copies n bytes to d.
+	void read(void* const d, const size_t n)
+	{
+		check(n);
+		memcpy(d, p, n);
+		p += n;
+	}
+
+	const char* p; //!< Beginning of the unread bytes.
+	const char* e; //!< End of the payload.
+};
+
+//! Largest payload that receive_message accepts by default, i.e. 256 MiB, which bounds the memory that a malformed or hostile header on a listening port can make the coordinator or a resident server allocate. Only the setup of a worker, which holds the grid maps of the whole box, may exceed it.
+const uint64_t max_message_size = uint64_t(1) << 28;
+
+//! Sends a message of a type and a payload, framed by its type and size. Throws boost::system::system_error on failure.
+inline void send_message(tcp::socket& sock, const message_type type, const string& payload)
+{
+	string header;
+	put<uint32_t>(header, type);
+	put<uint64_t>(header, payload.size());
+	const array<boost::asio::const_buffer, 2> buffers = {{ boost::asio::buffer(header), boost::asio::buffer(payload) }};
+	boost::asio::write(sock, buffers);
+}
+
+//! Receives a message, storing its payload and returning its type. Throws boost::system::system_error on failure, including a closed connection, and runtime_error before allocating the payload if its size exceeds max_size.
+inline message_type receive_message(tcp::socket& sock, string& payload, const uint64_t max_size = max_message_size)
+{
+	array<char, sizeof(uint32_t) + sizeof(uint64_t)> header;
+	boost::asio::read(sock, boost::asio::buffer(header));
+	uint32_t type;
+	uint64_t size;
+	memcpy(&type, header.data(), sizeof(type));
+	memcpy(&size, header.data() + sizeof(type), sizeof(size));
+	if (size > max_size) throw runtime_error("Message of " + to_string(size) + " bytes exceeds the limit of " + to_string(max_size) + " bytes");
+	payload.resize(size);
+	boost::asio::read(sock, boost::asio::buffer(&payload[0], payload.size()));
+	return static_cast<message_type>(type);
+}
+
+#endif
@@ -0,0 +1,144 @@
+#include <boost/filesystem/operations.hpp>
+#include "output_writer.hpp"
+
+//! Number of buffered bytes per shard that triggers a write to its file.
+static const size_t flush_size = 1 << 24;
+
+output_writer::output_writer(const path& output_folder_path, const size_t num_shards, const bool binary, const vector<position>& positions) : binary(binary), shards(num_shards), next(0), stopping(false)
+{
+	for (size_t i = 0; i < num_shards; ++i)
+	{
+		shard& s = shards[i];
+		const path p = output_folder_path / ("shard_" + to_string(i + 1) + (binary ? ".poses" : ".pdbqt"));
+		s.buf.reserve(flush_size << 1);
+		if (i < positions.size() && positions[i].size)
+		{
+			if (!is_regular_file(p) || file_size(p) < positions[i].size) throw runtime_error("Output file " + p.string() + " is shorter than its checkpoint");
+			resize_file(p, positions[i].size);
+			s.ofs.open(p, ios::binary | ios::app);
+			if (!s.ofs) throw runtime_error("Failed to open output file " + p.string());
+			s.num_models = positions[i].num_models;
+			s.size = positions[i].size;
+		}
+		else
+		{
+			s.ofs.open(p, ios::binary);
+			if (!s.ofs) throw runtime_error("Failed to create output file " + p.string());
+			s.num_models = 0;
+			s.size = 0;
+			if (binary) s.buf.append(pose_file_magic, sizeof(pose_file_magic));
+		}
+	}
+	t = thread([this]()
+	{
+		pair<pose_record, written_handler> item;
+		while (true)
+		{
+			{
+				unique_lock<mutex> lock(m);
+				cv.wait(lock, [&]()
+				{
+					return !q.empty() || stopping;
+				});
+				if (q.empty()) break;
+				item = move(q.front());
+				q.pop_front();
+			}
+			if (err) continue;
+			try
+			{
+				append(next++ % shards.size(), item.first, move(item.second));
+			}
+			catch (...)
+			{
+				err = current_exception();
+			}
+		}
+		try
+		{
+			for (size_t i = 0; i < shards.size(); ++i)
+			{
+				flush(i);
+				shards[i].ofs.close();
+			}
+		}
+		catch (...)
+		{
+			if (!err) err = current_exception();
+		}
+	});
+}
+
+output_writer::~output_writer()
+{
+	if (!t.joinable()) return;
+	{
+		lock_guard<mutex> guard(m);
+		stopping = true;
+	}
+	cv.notify_one();
+	t.join();
+}
+
+void output_writer::push(pose_record&& pose, written_handler&& handle)
+{
+	{
+		lock_guard<mutex> guard(m);
+		q.emplace_back(move(pose), move(handle));
+	}
+	cv.notify_one();
+}
+
+void output_writer::close()
+{
+	{
+		lock_guard<mutex> guard(m);
+		stopping = true;
+	}
+	cv.notify_one();
+	t.join();
+	if (err) rethrow_exception(err);
+}
+
+void output_writer::append(const size_t i, const pose_record& pose, written_handler&& handle)
+{
+	shard& s = shards[i];
+	if (binary)
+	{
+		pose.encode(s.buf);
+	}
+	else
+	{
+		size_t b = 0;
+		for (size_t k = 0; k < pose.ends.size(); ++k)
+		{
+			s.buf.append("MODEL        ");
+			append_size(s.buf, ++s.num_models, 0);
+			s.buf.append("\nREMARK  Name = ");
+			s.buf.append(pose.name);
+			s.buf.append("\nREMARK       NORMALIZED FREE ENERGY PREDICTED BY IDOCK:");
+			append_float(s.buf, pose.affinities[k], 8);
+			s.buf.append(" KCAL/MOL\n");
+			s.buf.append(pose.pdbqt, b, pose.ends[k] - b);
+			s.buf.append("ENDMDL\n");
+			b = pose.ends[k];
+		}
+	}
+	if (handle) s.pending.emplace_back(move(handle), position{ s.size + s.buf.size(), s.num_models });
+	if (s.buf.size() >= flush_size) flush(i);
+}
+
+void output_writer::flush(const size_t i)
+{
+	shard& s = shards[i];
+	s.ofs.write(s.buf.data(), s.buf.size());
+	if (s.pending.size()) s.ofs.flush();
+	if (!s.ofs) throw runtime_error("Failed to write output file");
+	s.size += s.buf.size();
+	s.buf.clear();
+	for (const auto& p : s.pending)
+	{
+		p.first(i, p.second);
+	}
+	s.pending.clear();
+}
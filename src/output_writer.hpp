@@ -0,0 +1,68 @@
+#pragma once
+#ifndef IDOCK_OUTPUT_WRITER_HPP
+#define IDOCK_OUTPUT_WRITER_HPP
+
+#include <deque>
+#include <functional>
+#include <thread>
+#include <condition_variable>
+#include <boost/filesystem/fstream.hpp>
+#include "pose_file.hpp"
+using namespace boost::filesystem;
+
+//! Represents a writer of the conformations of all the ligands into a few shard files of the output folder, which a dedicated thread appends to through large buffers.
+//! A PDBQT shard wraps each conformation in MODEL and ENDMDL records numbered from 1 within the shard, preceded by the ligand name and its affinity in REMARK records. A binary shard holds pose records.
+class output_writer
+{
+public:
+	//! Represents the position of a shard file, i.e. its size and its number of models.
+	struct position
+	{
+		size_t size;
+		size_t num_models;
+	};
+
+	//! Represents a handler called by the writer thread once the conformations of a ligand have been written to a shard file, with the shard and its position right after them.
+	typedef function<void(const size_t shard, const position& pos)> written_handler;
+
+	//! Creates num_shards shard files in an output folder, named shard_1.pdbqt and so on, or shard_1.poses and so on if binary is true, and starts the writer thread.
+	//! Shards of nonzero positions, if any, are truncated to their positions and appended to instead, so that a resumed run drops the conformations written after its checkpoint.
+	explicit output_writer(const path& output_folder_path, const size_t num_shards, const bool binary, const vector<position>& positions = vector<position>());
+
+	//! Stops the writer thread if close has not been called.
+	~output_writer();
+
+	//! Queues the conformations of a ligand to be appended to the next shard in turn, and calls a handler, if any, once they have been written.
+	void push(pose_record&& pose, written_handler&& handle = written_handler());
+
+	//! Writes the queued conformations, flushes and closes the shard files, and propagates the first error of the writer thread, if any.
+	void close();
+private:
+	//! Represents a shard file and its buffer.
+	struct shard
+	{
+		boost::filesystem::ofstream ofs;
+		string buf;
+		size_t num_models;
+		size_t size; //!< Number of bytes written to the file.
+		vector<pair<written_handler, position>> pending; //!< Handlers of the conformations in the buffer, and the positions right after them.
+	};
+
+	//! Appends the conformations of a ligand to the buffer of shard i, and flushes the buffer once it is large.
+	void append(const size_t i, const pose_record& pose, written_handler&& handle);
+
+	//! Writes the buffer of shard i to its file, and calls the handlers of the conformations written.
+	void flush(const size_t i);
+
+	const bool binary; //!< Whether to write pose records in place of PDBQT text.
+	vector<shard> shards; //!< Shard files.
+	size_t next; //!< Shard to append the next ligand to.
+	deque<pair<pose_record, written_handler>> q; //!< Ligands yet to be appended, and their handlers.
+	mutex m; //!< Mutex guarding q and stopping.
+	condition_variable cv; //!< Condition variable to wake up the writer thread.
+	bool stopping; //!< Whether the writer thread is to exit once q is empty.
+	exception_ptr err; //!< First error of the writer thread.
+	thread t; //!< Writer thread.
+};
+
+#endif
@@ -0,0 +1,60 @@
+#pragma once
+#ifndef IDOCK_PHILOX_HPP
+#define IDOCK_PHILOX_HPP
+
+#include <array>
+#include <cstdint>
+using namespace std;
+
+//! Returns the Philox4x32-10 block of a counter c under a key k, as defined by Salmon et al., Parallel random numbers: as easy as 1, 2, 3, SC 2011.
+//! kernel.cu and kernel.cl implement the same function, so that all the backends draw the same numbers.
+inline array<uint32_t, 4> philox4x32(array<uint32_t, 4> c, array<uint32_t, 2> k)
+{
+	for (int r = 0; r < 10; ++r)
+	{
+		if (r)
+		{
+			k[0] += 0x9E3779B9;
+			k[1] += 0xBB67AE85;
+		}
+		const uint64_t p0 = static_cast<uint64_t>(0xD2511F53) * c[0];
+		const uint64_t p1 = static_cast<uint64_t>(0xCD9E8D57) * c[2];
+		c = {{ static_cast<uint32_t>(p1 >> 32) ^ c[1] ^ k[0], static_cast<uint32_t>(p1), static_cast<uint32_t>(p0 >> 32) ^ c[3] ^ k[1], static_cast<uint32_t>(p0) }};
+	}
+	return c;
+}
+
+//! Represents the stream of uniform random numbers of a Monte Carlo task, keyed by the seed of the run and counted by the ligand index, the task id and the draw number.
+//! Draw d of a stream is word d % 4 of the Philox block of counter (d / 4, task id, low and high words of the ligand index) under the key (low and high words of the seed), so any task of any ligand can be regenerated independently.
+class philox_stream
+{
+public:
+	//! Constructs an empty stream, to be started by reset.
+	philox_stream() : key{}, ctr{}, blk{}, d(0) {}
+
+	//! Restarts the stream of task t of ligand lid under seed.
+	void reset(const uint64_t seed, const uint64_t lid, const uint32_t t)
+	{
+		key = {{ static_cast<uint32_t>(seed), static_cast<uint32_t>(seed >> 32) }};
+		ctr = {{ 0, t, static_cast<uint32_t>(lid), static_cast<uint32_t>(lid >> 32) }};
+		d = 0;
+	}
+
+	//! Returns the next random number, uniformly distributed in [0, 1) with 24 bits of precision, which float arithmetic represents exactly on every backend.
+	float operator()()
+	{
+		if (!(d & 3))
+		{
+			ctr[0] = d >> 2;
+			blk = philox4x32(ctr, key);
+		}
+		return (blk[d++ & 3] >> 8) * (1.0f / 16777216);
+	}
+private:
+	array<uint32_t, 2> key; //!< Key of the stream.
+	array<uint32_t, 4> ctr; //!< Counter of the current block.
+	array<uint32_t, 4> blk; //!< Current block.
+	uint32_t d; //!< Number of numbers drawn.
+};
+
+#endif
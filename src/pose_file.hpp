@@ -0,0 +1,127 @@
+#pragma once
+#ifndef IDOCK_POSE_FILE_HPP
+#define IDOCK_POSE_FILE_HPP
+
+#include <array>
+#include <vector>
+#include <cstring>
+#include <cstdint>
+#include <istream>
+#include <stdexcept>
+#include "format.hpp"
+using namespace std;
+
+//! Magic bytes at the beginning of a binary pose file, the last of which is the format version.
+static const char pose_file_magic[8] = { 'I', 'D', 'O', 'C', 'K', 'P', 'S', '1' };
+
+//! Represents the predicted conformations of a ligand, either as PDBQT text or as a record of a binary pose file.
+//! A record stores the name, the affinities and the PDBQT text of the first conformation, followed by the coordinates of the ATOM lines of all the conformations in thousandths of an Angstrom, in host byte order.
+//! The other conformations are regenerated by substituting their coordinates into the text of the first one, because conformations of a ligand differ in coordinates only.
+class pose_record
+{
+public:
+	string name; //!< Name of the ligand, i.e. the stem of its output file.
+	vector<float> affinities; //!< Binding affinities of the conformations.
+	string pdbqt; //!< PDBQT text of the conformations, or of the first conformation only if the record is read from a binary pose file.
+	vector<size_t> ends; //!< End offset of the PDBQT text of each conformation, or of the first conformation only if the record is read from a binary pose file.
+	vector<array<float, 3>> coords; //!< Coordinates of the ATOM lines of the conformations in output order.
+
+	//! Clears the record for reuse.
+	void clear()
+	{
+		name.clear();
+		affinities.clear();
+		pdbqt.clear();
+		ends.clear();
+		coords.clear();
+	}
+
+	//! Returns the number of ATOM lines per conformation.
+	size_t num_atoms() const
+	{
+		return affinities.empty() ? 0 : coords.size() / affinities.size();
+	}
+
+	//! Appends the record in binary pose format to a buffer.
+	void encode(string& buf) const
+	{
+		const uint32_t header[4] = { static_cast<uint32_t>(name.size()), static_cast<uint32_t>(affinities.size()), static_cast<uint32_t>(num_atoms()), static_cast<uint32_t>(ends.empty() ? 0 : ends.front()) };
+		append(buf, header, sizeof(header));
+		append(buf, name.data(), name.size());
+		append(buf, affinities.data(), sizeof(float) * affinities.size());
+		append(buf, pdbqt.data(), header[3]);
+		const size_t o = buf.size();
+		buf.resize(o + sizeof(int32_t) * 3 * coords.size());
+		int32_t* p = reinterpret_cast<int32_t*>(&buf[o]);
+		for (const auto& c : coords)
+		{
+			for (const float v : c)
+			{
+				*p++ = static_cast<int32_t>(to_thousandths(v));
+			}
+		}
+	}
+
+	//! Reads the next record from a binary pose file positioned after its magic bytes, and returns false at the end of the file. Coordinates are rounded to thousandths.
+	bool decode(istream& is)
+	{
+		uint32_t header[4];
+		if (!is.read(reinterpret_cast<char*>(header), sizeof(header))) return false;
+		name.resize(header[0]);
+		affinities.resize(header[1]);
+		pdbqt.resize(header[3]);
+		ends.assign(1, header[3]);
+		vector<int32_t> t(3 * header[1] * header[2]);
+		is.read(&name[0], name.size());
+		is.read(reinterpret_cast<char*>(affinities.data()), sizeof(float) * affinities.size());
+		is.read(&pdbqt[0], pdbqt.size());
+		is.read(reinterpret_cast<char*>(t.data()), sizeof(int32_t) * t.size());
+		if (!is) throw runtime_error("Truncated pose record of " + name);
+		coords.resize(header[1] * header[2]);
+		for (size_t i = 0; i < coords.size(); ++i)
+		{
+			for (size_t d = 0; d < 3; ++d)
+			{
+				coords[i][d] = t[3 * i + d] * 0.001f;
+			}
+		}
+		return true;
+	}
+
+	//! Appends the PDBQT text of conformation k, regenerated from the text of the first conformation. A coordinate between -0.0005 and 0 is written as 0.000 rather than -0.000.
+	void conformation(const size_t k, string& s) const
+	{
+		const size_t na = num_atoms();
+		size_t i = na * k;
+		const char* const e = pdbqt.data() + ends.front();
+		for (const char* line = pdbqt.data(); line < e;)
+		{
+			const char* eol = static_cast<const char*>(memchr(line, '\n', e - line));
+			eol = eol ? eol + 1 : e;
+			if (eol - line > 54 && !memcmp(line, "ATOM  ", 6))
+			{
+				if (i == na * (k + 1)) throw runtime_error("Mismatched pose record of " + name);
+				s.append(line, 30);
+				for (const float v : coords[i++])
+				{
+					const long long t = to_thousandths(v);
+					append_thousandths(s, t, t < 0, 8);
+				}
+				s.append(line + 54, eol);
+			}
+			else
+			{
+				s.append(line, eol);
+			}
+			line = eol;
+		}
+	}
+private:
+	//! Appends n bytes to a buffer.
+	static void append(string& buf, const void* const p, const size_t n)
+	{
+		buf.append(static_cast<const char*>(p), n);
+	}
+};
+
+#endif
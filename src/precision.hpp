@@ -0,0 +1,63 @@
+#pragma once
+#ifndef IDOCK_PRECISION_HPP
+#define IDOCK_PRECISION_HPP
+
+#include <cstring>
+#include <cstdint>
+#include <string>
+#include <stdexcept>
+using namespace std;
+
+//! Represents the precision at which grid maps are stored for docking.
+enum map_precision
+{
+	map_float32, //!< 32-bit floats, as populated.
+	map_float16, //!< IEEE 754 half floats.
+	map_int16, //!< 16-bit signed integers with a scale and an offset per map.
+};
+
+//! Parses the name of a map precision, i.e. float32, float16 or int16.
+inline map_precision parse_map_precision(const string& s)
+{
+	if (s == "float32") return map_float32;
+	if (s == "float16") return map_float16;
+	if (s == "int16") return map_int16;
+	throw invalid_argument("Unknown map precision " + s + ", which must be float32, float16 or int16");
+}
+
+//! Returns the name of a map precision.
+inline const char* map_precision_name(const map_precision p)
+{
+	return p == map_float16 ? "float16" : p == map_int16 ? "int16" : "float32";
+}
+
+//! Largest finite half float.
+const float half_max = 65504.0f;
+
+//! Encodes a float into a half float by rounding to nearest even. Magnitudes below the smallest normal half are flushed to zero and those above half_max are clamped, so that every code decodes by half_to_float without handling subnormals, infinities or NaNs.
+inline uint16_t float_to_half(const float f)
+{
+	uint32_t b;
+	memcpy(&b, &f, sizeof(b));
+	const uint16_t s = static_cast<uint16_t>((b >> 16) & 0x8000);
+	const int e = static_cast<int>((b >> 23) & 0xff) - 127 + 15;
+	if (e <= 0) return s;
+	if (e >= 31) return s | 0x7bff;
+	const uint32_t m = b & 0x7fffff;
+	uint32_t h = (static_cast<uint32_t>(e) << 10) | (m >> 13);
+	const uint32_t r = m & 0x1fff;
+	if (r > 0x1000 || (r == 0x1000 && (h & 1))) ++h;
+	return s | static_cast<uint16_t>(h < 0x7c00 ? h : 0x7bff);
+}
+
+//! Decodes a half float encoded by float_to_half. kernel.cu and kernel.cl decode half floats by the same bit manipulation.
+inline float half_to_float(const uint16_t h)
+{
+	const uint32_t m = h & 0x7fff;
+	const uint32_t b = (static_cast<uint32_t>(h & 0x8000) << 16) | (m ? (m + 0x1c000) << 13 : 0);
+	float f;
+	memcpy(&f, &b, sizeof(f));
+	return f;
+}
+
+#endif
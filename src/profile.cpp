@@ -0,0 +1,95 @@
+#include <iomanip>
+#include "profile.hpp"
+
+//! Names of the phases in the profile file.
+static const char* const phase_names[num_phases] = { "scoring_function", "receptor", "maps", "forest", "ligands", "monte_carlo", "device_kernel", "device_transfer", "clustering", "rescoring", "output" };
+
+//! Names of the counters in the profile file and the CSV file of ligands.
+static const char* const counter_names[num_counters] = { "evaluations", "bfgs_iterations", "rejected_line_search_trials" };
+
+profile::profile(const path& p) : json_path(p), csv_path(p.parent_path() / (p.stem().string() + "_ligands.csv")), start(std::chrono::steady_clock::now()), totals{}, num_ligands(0), monte_carlo_ns(0)
+{
+	for (auto& n : phase_ns) n = 0;
+	for (auto& n : phase_counts) n = 0;
+	for (auto& n : map_ns) n = 0;
+	csv.open(csv_path);
+	if (!csv) throw runtime_error("Failed to create profile file " + csv_path.string());
+	csv << "Ligand,Tasks,Evaluations,BFGS iterations,Rejected line search trials,Monte Carlo seconds\n";
+	csv.setf(ios::fixed, ios::floatfield);
+	csv << setprecision(6);
+}
+
+void profile::set_num_devices(const size_t num_devices)
+{
+	devices = vector<device>(num_devices);
+}
+
+void profile::add(const profile_phase ph, const uint64_t ns)
+{
+	phase_ns[ph] += ns;
+	++phase_counts[ph];
+}
+
+void profile::add_maps(const vector<size_t>& xs, const uint64_t ns)
+{
+	for (const size_t t : xs)
+	{
+		map_ns[t] += ns / xs.size();
+	}
+}
+
+void profile::add_device(const size_t dev, const size_t num_ligands, const uint64_t kernel_ns, const uint64_t transfer_ns)
+{
+	device& d = devices[dev];
+	++d.num_batches;
+	d.num_ligands += num_ligands;
+	d.kernel_ns += kernel_ns;
+	d.transfer_ns += transfer_ns;
+	add(phase_device_kernel, kernel_ns);
+	add(phase_device_transfer, transfer_ns);
+}
+
+void profile::add_ligand(const string& stem, const size_t num_tasks, const profile_counters& counters, const uint64_t ns)
+{
+	lock_guard<mutex> guard(m);
+	++num_ligands;
+	monte_carlo_ns += ns;
+	csv << stem << ',' << num_tasks;
+	for (size_t i = 0; i < num_counters; ++i)
+	{
+		totals[i] += counters[i];
+		csv << ',' << counters[i];
+	}
+	csv << ',' << 1e-9 * ns << '\n';
+}
+
+void profile::write()
+{
+	const uint64_t wall_ns = std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - start).count();
+	lock_guard<mutex> guard(m);
+	csv.flush();
+	boost::filesystem::ofstream ofs(json_path);
+	ofs.setf(ios::fixed, ios::floatfield);
+	ofs << setprecision(6) << "{\n  \"wall_seconds\": " << 1e-9 * wall_ns << ",\n  \"phases\": {";
+	for (size_t i = 0; i < num_phases; ++i)
+	{
+		ofs << (i ? "," : "") << "\n    \"" << phase_names[i] << "\": { \"seconds\": " << 1e-9 * phase_ns[i] << ", \"count\": " << phase_counts[i] << " }";
+	}
+	ofs << "\n  },\n  \"map_seconds\": [";
+	for (size_t t = 0; t < scoring_function::n; ++t)
+	{
+		ofs << (t ? ", " : "") << 1e-9 * map_ns[t];
+	}
+	ofs << "],\n  \"ligands\": " << num_ligands << ",\n  \"monte_carlo_seconds\": " << 1e-9 * monte_carlo_ns;
+	for (size_t i = 0; i < num_counters; ++i)
+	{
+		ofs << ",\n  \"" << counter_names[i] << "\": " << totals[i];
+	}
+	ofs << ",\n  \"devices\": [";
+	for (size_t dev = 0; dev < devices.size(); ++dev)
+	{
+		const device& d = devices[dev];
+		ofs << (dev ? "," : "") << "\n    { \"batches\": " << d.num_batches << ", \"ligands\": " << d.num_ligands << ", \"kernel_seconds\": " << 1e-9 * d.kernel_ns << ", \"transfer_seconds\": " << 1e-9 * d.transfer_ns << " }";
+	}
+	ofs << (devices.empty() ? "" : "\n  ") << "]\n}\n";
+}
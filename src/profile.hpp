@@ -0,0 +1,141 @@
+#pragma once
+#ifndef IDOCK_PROFILE_HPP
+#define IDOCK_PROFILE_HPP
+
+#include <array>
+#include <mutex>
+#include <atomic>
+#include <chrono>
+#include <vector>
+#include <string>
+#include <cstdint>
+#include <boost/filesystem/fstream.hpp>
+#include "scoring_function.hpp"
+using namespace std;
+using namespace boost::filesystem;
+
+//! Represents the phases of a run timed by a profile.
+enum profile_phase
+{
+	phase_scoring_function, //!< Precalculating, mapping or saving the scoring function.
+	phase_receptor, //!< Parsing the receptor.
+	phase_maps, //!< Creating, mapping or saving grid maps.
+	phase_forest, //!< Training, loading or saving random forest.
+	phase_ligands, //!< Parsing and encoding ligands.
+	phase_monte_carlo, //!< Running the Monte Carlo kernel on CPU threads.
+	phase_device_kernel, //!< Running the Monte Carlo kernel on GPUs.
+	phase_device_transfer, //!< Transferring ligands and conformations between host and GPUs.
+	phase_clustering, //!< Clustering conformations in ligand::write.
+	phase_rescoring, //!< Featurizing the representatives and rescoring them with random forest in ligand::write.
+	phase_output, //!< Formatting and writing conformations and log records.
+	num_phases
+};
+
+//! Represents the counters by which the CPU Monte Carlo kernel measures its work. The CUDA and OpenCL kernels count nothing, so the ligands that idock_cu and idock_cl dock on devices are left out of the counters.
+enum profile_counter
+{
+	counter_evaluations, //!< Evaluations of a conformation, summed over lanes that hold a task.
+	counter_bfgs_iterations, //!< BFGS iterations that found an appropriate step.
+	counter_rejected_trials, //!< Line search trials whose step was rejected and shrunk.
+	num_counters
+};
+
+//! Represents the counters of the Monte Carlo kernel, which each job accumulates locally.
+typedef array<uint64_t, num_counters> profile_counters;
+
+//! Represents a profile of the time spent in the phases of a run, the time of creating grid maps of each atom type, the work of the Monte Carlo kernel per ligand, and the kernel and transfer time per GPU.
+//! Phase times are summed over threads, so phases that run in parallel may add up to more than the wall time. The counters of each ligand are streamed to a CSV file named after the profile file with a _ligands suffix, and the totals are written to the profile file in JSON at the end.
+class profile
+{
+public:
+	//! Creates the CSV file of ligands next to the profile file p, and starts the wall clock.
+	explicit profile(const path& p);
+
+	//! Sets the number of GPUs to profile, whose totals are reset. Not thread safe, so it must be called before any batch is launched.
+	void set_num_devices(const size_t num_devices);
+
+	//! Adds the nanoseconds of a phase. Thread safe.
+	void add(const profile_phase ph, const uint64_t ns);
+
+	//! Adds the nanoseconds of creating the grid maps of atom types xs together, shared evenly among them. Thread safe.
+	void add_maps(const vector<size_t>& xs, const uint64_t ns);
+
+	//! Adds the kernel and transfer nanoseconds of a batch of ligands on a GPU. Thread safe.
+	void add_device(const size_t dev, const size_t num_ligands, const uint64_t kernel_ns, const uint64_t transfer_ns);
+
+	//! Streams the counters and the Monte Carlo nanoseconds summed over the jobs of a ligand, and adds them to the totals. Thread safe.
+	void add_ligand(const string& stem, const size_t num_tasks, const profile_counters& counters, const uint64_t ns);
+
+	//! Writes the totals to the profile file in JSON, and flushes the CSV file of ligands.
+	void write();
+
+	const path json_path; //!< Profile file in JSON.
+	const path csv_path; //!< CSV file of the counters of each ligand.
+private:
+	//! Represents the totals of a GPU.
+	struct device
+	{
+		atomic<uint64_t> num_batches{0};
+		atomic<uint64_t> num_ligands{0};
+		atomic<uint64_t> kernel_ns{0};
+		atomic<uint64_t> transfer_ns{0};
+	};
+
+	const std::chrono::steady_clock::time_point start; //!< Time the profile was created.
+	array<atomic<uint64_t>, num_phases> phase_ns; //!< Nanoseconds of each phase.
+	array<atomic<uint64_t>, num_phases> phase_counts; //!< Number of times each phase was timed.
+	array<atomic<uint64_t>, scoring_function::n> map_ns; //!< Nanoseconds of creating the grid map of each atom type.
+	vector<device> devices; //!< Totals of each GPU.
+	profile_counters totals; //!< Counters summed over ligands, guarded by m.
+	uint64_t num_ligands; //!< Number of ligands streamed, guarded by m.
+	uint64_t monte_carlo_ns; //!< Monte Carlo nanoseconds summed over ligands, guarded by m.
+	boost::filesystem::ofstream csv; //!< CSV file of ligands, guarded by m.
+	mutex m; //!< Mutex guarding the ligand totals and the CSV file.
+};
+
+//! Represents a scoped timer that adds its lifetime to a phase of a profile, or does nothing if the profile is null.
+class profile_timer
+{
+public:
+	//! Starts timing a phase if prof is not null.
+	explicit profile_timer(profile* const prof, const profile_phase ph) : prof(prof), ph(ph)
+	{
+		if (prof) start = std::chrono::steady_clock::now();
+	}
+
+	//! Adds the time elapsed since the phase was started to it unless stopped.
+	~profile_timer()
+	{
+		stop();
+	}
+
+	//! Adds the time elapsed so far to the phase, and starts timing another phase.
+	void next(const profile_phase ph_)
+	{
+		if (!prof) return;
+		const auto now = std::chrono::steady_clock::now();
+		prof->add(ph, std::chrono::duration_cast<std::chrono::nanoseconds>(now - start).count());
+		ph = ph_;
+		start = now;
+	}
+
+	//! Adds the time elapsed so far to the phase, and stops timing.
+	void stop()
+	{
+		if (!prof) return;
+		prof->add(ph, elapsed());
+		prof = nullptr;
+	}
+
+	//! Returns the nanoseconds elapsed since the phase was started, or 0 if the profile is null.
+	uint64_t elapsed() const
+	{
+		return prof ? std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - start).count() : 0;
+	}
+private:
+	profile* prof; //!< Profile to add to, or null once stopped.
+	profile_phase ph; //!< Phase being timed.
+	std::chrono::steady_clock::time_point start; //!< Time the phase was started.
+};
+
+#endif
@@ -1,13 +1,58 @@
+#include <limits>
+#include <cstring>
 #include <numeric>
+#include <cassert>
 #include <algorithm>
+#include <boost/filesystem/operations.hpp>
+#include <boost/filesystem/fstream.hpp>
+#include "checksum.hpp"
 #include "random_forest.hpp"
 
+//! Represents the header of a random forest model file, which is followed by the numbers of trees and packed nodes, and then by the packed node arrays.
+class model_header
+{
+public:
+	char magic[8]; //!< File signature.
+	uint64_t checksum; //!< Checksum of the number of trees, the seed, mtry and the training samples.
+
+	//! Constructs a header with a given checksum.
+	explicit model_header(const uint64_t checksum) : magic{ 'i', 'd', 'o', 'c', 'k', 'r', 'f', 0 }, checksum(checksum)
+	{
+	}
+
+	//! Returns true if the current header is identical to the given one.
+	bool operator==(const model_header& h) const
+	{
+		return !memcmp(magic, h.magic, sizeof(magic)) && checksum == h.checksum;
+	}
+};
+
+//! Reads the elements of a vector from a binary stream.
+template <typename T>
+static void read(istream& is, vector<T>& v)
+{
+	is.read(reinterpret_cast<char*>(v.data()), sizeof(T) * v.size());
+}
+
+//! Writes the elements of a vector to a binary stream.
+template <typename T>
+static void write(ostream& os, const vector<T>& v)
+{
+	os.write(reinterpret_cast<const char*>(v.data()), sizeof(T) * v.size());
+}
+
 node::node() : children{}
 {
 }
 
-void tree::train(const size_t mtry, const function<double()> u01)
+void tree::train(const size_t mtry, mt19937_64& rng)
 {
+	uniform_real_distribution<double> uniform_01(0, 1); // double is required because float could possibly generate 1.
+	const auto u01 = [&]()
+	{
+		return uniform_01(rng);
+	};
+
 	// Create bootstrap samples with replacement.
 	reserve((ns << 1) - 1);
 	emplace_back();
@@ -104,22 +149,61 @@ void tree::clear()
 	}
 }
 
-forest::forest(const size_t nt, const size_t seed) : vector<tree>(nt), nt_inv(1.0f / nt), rng(seed), uniform_01(0, 1), u01_s([&]()
+uint64_t tree::checksum()
 {
-	lock_guard<mutex> guard(m);
-	return uniform_01(rng);
-})
+	::checksum c;
+	c(x);
+	c(y);
+	return c.value();
+}
+
+forest::forest(const size_t nt, const size_t seed) : vector<tree>(nt), nt_inv(1.0f / nt), seed(seed)
+{
+}
+
+void forest::train(const size_t i)
 {
+	seed_seq sseq{ static_cast<uint32_t>(seed), static_cast<uint32_t>(seed >> 32), static_cast<uint32_t>(i) };
+	mt19937_64 rng(sseq);
+	(*this)[i].train(mtry, rng);
 }
 
 float forest::operator()(const array<float, tree::nv>& x) const
 {
-	float y = 0;
-	for (const tree& t : *this)
+	return predict(x.data(), 1).front();
+}
+
+vector<float> forest::predict(const float* const X, const size_t n) const
+{
+	// Traverse each tree for a block of samples one level at a time without branching. Samples are independent, so their loads overlap rather than serialize, and a block of samples stays in cache across the trees.
+	const size_t block = 64;
+	vector<float> y(n, 0.0f);
+	array<uint32_t, block> k;
+	for (size_t b = 0; b < n; b += block)
+	{
+		const size_t e = min(b + block, n);
+		for (size_t t = 0; t < roots.size(); ++t)
+		{
+			fill(k.begin(), k.end(), roots[t]);
+			for (size_t d = 0; d < depths[t]; ++d)
+			{
+				for (size_t i = b; i < e; ++i)
+				{
+					const uint32_t j = k[i - b];
+					k[i - b] = lefts[j] + (X[tree::nv * i + vars[j]] > vals[j]);
+				}
+			}
+			for (size_t i = b; i < e; ++i)
+			{
+				y[i] += ys[k[i - b]];
+			}
+		}
+	}
+	for (float& v : y)
 	{
-		y += t(x);
+		v *= nt_inv;
 	}
-	return y *= nt_inv;
+	return y;
 }
 
 void forest::clear()
@@ -128,4 +212,108 @@ void forest::clear()
 	{
 		t.clear();
 	}
+
+	// Pack the nodes of all the trees, whose right children already follow their left children.
+	roots.clear();
+	depths.clear();
+	lefts.clear();
+	vals.clear();
+	vars.clear();
+	ys.clear();
+	vector<uint32_t> levels;
+	for (const tree& t : *this)
+	{
+		const uint32_t root = static_cast<uint32_t>(lefts.size());
+		roots.push_back(root);
+		levels.assign(t.size(), 0);
+		uint32_t depth = 0;
+		for (size_t k = 0; k < t.size(); ++k)
+		{
+			const node& n = t[k];
+			if (n.children[0])
+			{
+				assert(n.children[1] == n.children[0] + 1);
+				levels[n.children[0]] = levels[n.children[1]] = levels[k] + 1;
+				depth = max(depth, levels[k] + 1);
+				lefts.push_back(root + static_cast<uint32_t>(n.children[0]));
+				vals.push_back(n.val);
+				vars.push_back(static_cast<uint8_t>(n.var));
+			}
+			else
+			{
+				lefts.push_back(root + static_cast<uint32_t>(k));
+				vals.push_back(numeric_limits<float>::infinity());
+				vars.push_back(0);
+			}
+			ys.push_back(n.y);
+		}
+		depths.push_back(depth);
+	}
+}
+
+uint64_t forest::checksum() const
+{
+	const array<uint64_t, 4> params = { 2, size(), seed, mtry }; // The first parameter is the version of the model file layout and of the random number streams of the trees.
+	::checksum c;
+	c(params);
+	c(tree::checksum());
+	return c.value();
+}
+
+bool forest::load(const path& p)
+{
+	boost::filesystem::ifstream ifs(p, ios::binary);
+	model_header h(0);
+	array<uint32_t, 2> counts;
+	if (!ifs.read(reinterpret_cast<char*>(&h), sizeof(h)) || !(h == model_header(checksum())) || !ifs.read(reinterpret_cast<char*>(&counts), sizeof(counts)) || counts[0] != size()) return false;
+	roots.resize(counts[0]);
+	depths.resize(counts[0]);
+	lefts.resize(counts[1]);
+	vals.resize(counts[1]);
+	vars.resize(counts[1]);
+	ys.resize(counts[1]);
+	read(ifs, roots);
+	read(ifs, depths);
+	read(ifs, lefts);
+	read(ifs, vals);
+	read(ifs, vars);
+	read(ifs, ys);
+	if (!ifs)
+	{
+		roots.clear();
+		return false;
+	}
+	return true;
+}
+
+bool forest::save(const path& p) const
+{
+	const model_header h(checksum());
+	const array<uint32_t, 2> counts = { static_cast<uint32_t>(roots.size()), static_cast<uint32_t>(lefts.size()) };
+	const path tmp_path = p.parent_path() / unique_path(p.filename().string() + ".%%%%-%%%%-%%%%-%%%%");
+	boost::system::error_code ec;
+	{
+		boost::filesystem::ofstream ofs(tmp_path, ios::binary);
+		ofs.write(reinterpret_cast<const char*>(&h), sizeof(h));
+		ofs.write(reinterpret_cast<const char*>(&counts), sizeof(counts));
+		write(ofs, roots);
+		write(ofs, depths);
+		write(ofs, lefts);
+		write(ofs, vals);
+		write(ofs, vars);
+		write(ofs, ys);
+		if (!ofs)
+		{
+			ofs.close();
+			remove(tmp_path, ec);
+			return false;
+		}
+	}
+	rename(tmp_path, p, ec);
+	if (ec)
+	{
+		remove(tmp_path, ec);
+		return false;
+	}
+	return true;
 }
@@ -4,9 +4,11 @@
 
 #include <vector>
 #include <array>
+#include <cstdint>
 #include <random>
-#include <mutex>
+#include <boost/filesystem/path.hpp>
 using namespace std;
+using namespace boost::filesystem;
 
 //! Represents a node in a tree.
 class node
@@ -29,14 +31,17 @@ class tree : public vector<node>
 public:
 	static const size_t nv = 42; //!< Number of variables.
 
-	//! Trains an empty tree from bootstrap samples.
-	void train(const size_t mtry, const function<double()> u01);
+	//! Trains an empty tree from bootstrap samples drawn from a random number generator owned by the calling thread.
+	void train(const size_t mtry, mt19937_64& rng);
 
 	//! Predicts the y value of the given sample x.
 	float operator()(const array<float, nv>& x) const;
 
 	//! Clears node samples to save memory.
 	void clear();
+
+	//! Returns a checksum of the training samples.
+	static uint64_t checksum();
 private:
 	static const size_t ns = 3444; //!< Number of training samples.
 	static const array<array<float, nv>, ns> x; //!< Features of training samples.
@@ -47,22 +52,40 @@ private:
 class forest : public vector<tree>
 {
 public:
+	static const size_t mtry = 4; //!< Number of variables randomly selected as split candidates of a node.
+
 	//! Constructs a random forest of a number of empty trees.
 	forest(const size_t nt, const size_t seed);
 
-	//! Predicts the y value of the given sample x.
+	//! Predicts the y value of the given sample x from the packed nodes.
 	float operator()(const array<float, tree::nv>& x) const;
 
-	//! Clears node samples to save memory.
+	//! Predicts the y values of n samples in X, each of tree::nv consecutive features, from the packed nodes built by clear. The values are bitwise identical to those of operator().
+	vector<float> predict(const float* const X, const size_t n) const;
+
+	//! Clears node samples to save memory, and packs the nodes of all the trees for predict.
 	void clear();
 
-	//! Returns a random value from uniform distribution in [0, 1) in a thread safe manner.
-	const function<double()> u01_s;
+	//! Loads the packed nodes from a model file, leaving the trees empty, and returns false if the file is missing or was not trained with the current number of trees, seed, mtry and training samples.
+	bool load(const path& p);
+
+	//! Saves the packed nodes to a model file, and returns false on failure. The file is written to a temporary file first and then renamed so that concurrent processes never read a partial file.
+	bool save(const path& p) const;
+
+	//! Trains tree i from its own random number stream, which is derived from the seed and i, so that trees can be trained in parallel without contention and the forest does not depend on the number of threads.
+	void train(const size_t i);
 private:
 	float nt_inv; //!< Inverse of the number of trees.
-	mt19937_64 rng;
-	uniform_real_distribution<double> uniform_01; //!< double is required because float could possibly generate 1.
-	mutable mutex m;
+	size_t seed; //!< Seed of the random number generator for training.
+	vector<uint32_t> roots; //!< Index of the root node of each tree in the packed nodes.
+	vector<uint32_t> depths; //!< Depth of each tree, i.e. the number of splits along its longest path.
+	vector<uint32_t> lefts; //!< Left child of each packed node, which is followed by its right child, or the node itself for a leaf.
+	vector<float> vals; //!< Split value of each packed node, or infinity for a leaf, so that traversal stays at a leaf once it is reached.
+	vector<uint8_t> vars; //!< Split variable of each packed node.
+	vector<float> ys; //!< y value of each packed node.
+
+	//! Returns a checksum of the version, the number of trees, the seed, mtry and the training samples, which together determine the trained trees.
+	uint64_t checksum() const;
 };
 
 #endif
@@ -1,15 +1,28 @@
 #include <cmath>
+#include <cstring>
+#include <cassert>
+#include <limits>
+#include <numeric>
+#include <algorithm>
+#include <boost/filesystem/operations.hpp>
 #include <boost/filesystem/fstream.hpp>
+#include <boost/interprocess/file_mapping.hpp>
+#include "checksum.hpp"
 #include "array.hpp"
 #include "scoring_function.hpp"
 #include "receptor.hpp"
 
-receptor::receptor(const path& p, const array<float, 3>& center, const array<float, 3>& size, const float granularity) : center(center), size(size), corner0(center - 0.5f * size), corner1(corner0 + size), granularity(granularity), granularity_inverse(1.0f / granularity), num_probes({static_cast<int>(size[0] * granularity_inverse) + 2, static_cast<int>(size[1] * granularity_inverse) + 2, static_cast<int>(size[2] * granularity_inverse) + 2}), num_probes_product(num_probes[0] * num_probes[1] * num_probes[2]), map_bytes(sizeof(float) * num_probes_product), p_offset(scoring_function::n), maps(scoring_function::n)
+constexpr float receptor::cell_size;
+const int receptor::brick;
+const int receptor::brick_stride;
+const size_t receptor::brick_size;
+
+receptor::receptor(const path& p, const array<float, 3>& center, const array<float, 3>& size, const float granularity, const float brick_cap, const map_precision precision) : types{}, center(center), size(size), corner0(center - 0.5f * size), corner1(corner0 + size), granularity(granularity), granularity_inverse(1.0f / granularity), num_probes({static_cast<int>(size[0] * granularity_inverse) + 2, static_cast<int>(size[1] * granularity_inverse) + 2, static_cast<int>(size[2] * granularity_inverse) + 2}), num_probes_product(num_probes[0] * num_probes[1] * num_probes[2]), map_bytes(sizeof(float) * num_probes_product), num_tiles((num_probes[1] - 1) / tile + 1), p_offset(scoring_function::n), brick_cap(brick_cap), num_bricks({(num_probes[0] + brick - 2) / brick, (num_probes[1] + brick - 2) / brick, (num_probes[2] + brick - 2) / brick}), num_bricks_product(num_bricks[0] * num_bricks[1] * num_bricks[2]), maps(scoring_function::n), brick_tables(scoring_function::n), mps{}, bts{}, map_sizes{}, precision(precision), codes(scoring_function::n), mqs{}, mqa{}, max_quantization_error(0), sum_squared_quantization_errors(0), num_quantized_values(0), slabs(scoring_function::n)
 {
 	// Parse the receptor line by line.
 	atoms.reserve(2000); // A receptor typically consists of <= 2,000 atoms within bound.
 	string residue = "XXXX"; // Current residue sequence located at 1-based [23, 26], used to track residue change, initialized to a dummy value.
-	size_t residue_start; // The starting atom of the current residue.
+	size_t residue_start = 0; // The starting atom of the current residue.
 	string line;
 	for (boost::filesystem::ifstream ifs(p); getline(ifs, line);)
 	{
@@ -101,6 +114,193 @@ receptor::receptor(const path& p, const array<float, 3>& center, const array<flo
 			residue = "XXXX";
 		}
 	}
+
+	// Record the atom types present, which are final only once all the atoms are parsed.
+	for (const atom& a : atoms)
+	{
+		types[a.xs] = true;
+	}
+
+	// Index the atoms in cubic cells spanning their bounding box, sorting them by cell in ascending order of atom index.
+	cell_corner0 = atoms.empty() ? corner0 : atoms.front().coord;
+	array<float, 3> cell_corner1 = cell_corner0;
+	for (const atom& a : atoms)
+	{
+		for (size_t i = 0; i < 3; ++i)
+		{
+			cell_corner0[i] = min(cell_corner0[i], a.coord[i]);
+			cell_corner1[i] = max(cell_corner1[i], a.coord[i]);
+		}
+	}
+	for (size_t i = 0; i < 3; ++i)
+	{
+		num_cells[i] = static_cast<int>((cell_corner1[i] - cell_corner0[i]) * (1 / cell_size)) + 1;
+	}
+	vector<size_t> cells(atoms.size());
+	cell_offsets.assign(num_cells[0] * num_cells[1] * num_cells[2] + 1, 0);
+	for (size_t i = 0; i < atoms.size(); ++i)
+	{
+		array<int, 3> c;
+		for (size_t j = 0; j < 3; ++j)
+		{
+			c[j] = min(static_cast<int>((atoms[i].coord[j] - cell_corner0[j]) * (1 / cell_size)), num_cells[j] - 1);
+		}
+		cells[i] = (num_cells[1] * c[2] + c[1]) * num_cells[0] + c[0];
+		++cell_offsets[cells[i] + 1];
+	}
+	partial_sum(cell_offsets.begin(), cell_offsets.end(), cell_offsets.begin());
+	cell_atoms.resize(atoms.size());
+	vector<size_t> ends(cell_offsets.begin(), cell_offsets.end() - 1);
+	for (size_t i = 0; i < atoms.size(); ++i)
+	{
+		cell_atoms[ends[cells[i]]++] = i;
+	}
+}
+
+void receptor::neighbors(const array<float, 3>& lo, const array<float, 3>& hi, vector<size_t>& nbrs) const
+{
+	array<int, 3> c0, c1;
+	for (size_t i = 0; i < 3; ++i)
+	{
+		c0[i] = max(static_cast<int>(floor((lo[i] - cell_corner0[i]) * (1 / cell_size))), 0);
+		c1[i] = min(static_cast<int>(floor((hi[i] - cell_corner0[i]) * (1 / cell_size))), num_cells[i] - 1);
+		if (c0[i] > c1[i]) return;
+	}
+	for (int z = c0[2]; z <= c1[2]; ++z)
+	for (int y = c0[1]; y <= c1[1]; ++y)
+	{
+		const size_t c = (num_cells[1] * z + y) * num_cells[0];
+		nbrs.insert(nbrs.end(), cell_atoms.begin() + cell_offsets[c + c0[0]], cell_atoms.begin() + cell_offsets[c + c1[0] + 1]);
+	}
+}
+
+//! Represents the header of a grid map file, which is followed by the grid maps of all the atom types.
+//! A dense map is num_probes_product values. A sparse map is its number of values, its brick table and its values, so its size varies.
+class map_header
+{
+public:
+	char magic[8]; //!< File signature, which tells dense maps from sparse maps.
+	uint64_t checksum; //!< Checksum of the receptor atoms, box, granularity, brick cap and scoring function.
+
+	//! Constructs a header of dense or sparse maps with a given checksum.
+	explicit map_header(const uint64_t checksum, const bool sparse) : magic{ 'i', 'd', 'o', 'c', 'k', sparse ? 'b' : 'm', 'p', 0 }, checksum(checksum)
+	{
+	}
+
+	//! Returns true if the current header is identical to the given one.
+	bool operator==(const map_header& h) const
+	{
+		return !memcmp(magic, h.magic, sizeof(magic)) && checksum == h.checksum;
+	}
+};
+
+uint64_t receptor::checksum(const scoring_function& sf) const
+{
+	::checksum c;
+	c(sf.checksum());
+	c(corner0);
+	c(num_probes);
+	c(granularity);
+	if (brick_cap) c(brick_cap);
+	for (const atom& a : atoms)
+	{
+		c(a.coord);
+		c(static_cast<size_t>(a.xs)); // Checksummed as size_t, by which map files saved by earlier versions are keyed.
+	}
+	return c.value();
+}
+
+bool receptor::map(const path& p, const scoring_function& sf)
+{
+	using namespace boost::interprocess;
+	boost::system::error_code ec;
+	if (!is_regular_file(p, ec) || (brick_cap ? file_size(p, ec) < sizeof(map_header) : file_size(p, ec) != sizeof(map_header) + map_bytes * scoring_function::n)) return false;
+	try
+	{
+		region = mapped_region(file_mapping(p.string().c_str(), read_only), read_only);
+	}
+	catch (const interprocess_exception&)
+	{
+		return false;
+	}
+	if (region.get_size() < sizeof(map_header) || !(*static_cast<const map_header*>(region.get_address()) == map_header(checksum(sf), brick_cap != 0)))
+	{
+		region = mapped_region();
+		return false;
+	}
+	const char* b = static_cast<const char*>(region.get_address()) + sizeof(map_header);
+	if (!brick_cap)
+	{
+		const float* m = reinterpret_cast<const float*>(b);
+		for (size_t t = 0; t < scoring_function::n; ++t, m += num_probes_product)
+		{
+			mps[t] = m;
+			map_sizes[t] = num_probes_product;
+		}
+		return true;
+	}
+
+	// Walk the sparse maps, validating their sizes and brick offsets before exposing any of them.
+	const char* const e = static_cast<const char*>(region.get_address()) + region.get_size();
+	array<const float*, scoring_function::n> ms;
+	array<const int*, scoring_function::n> bs;
+	array<size_t, scoring_function::n> ns;
+	for (size_t t = 0; t < scoring_function::n; ++t)
+	{
+		uint64_t n;
+		if (static_cast<size_t>(e - b) < sizeof(n) + sizeof(int) * num_bricks_product) break;
+		memcpy(&n, b, sizeof(n));
+		bs[t] = reinterpret_cast<const int*>(b + sizeof(n));
+		b += sizeof(n) + sizeof(int) * num_bricks_product;
+		if (n < brick_size || n > static_cast<size_t>(e - b) / sizeof(float) || any_of(bs[t], bs[t] + num_bricks_product, [n](const int o) { return o < 0 || static_cast<uint64_t>(o) > n - brick_size; })) break;
+		ms[t] = reinterpret_cast<const float*>(b);
+		ns[t] = n;
+		b += sizeof(float) * n;
+		if (t + 1 == scoring_function::n && b == e)
+		{
+			mps = ms;
+			bts = bs;
+			map_sizes = ns;
+			return true;
+		}
+	}
+	region = mapped_region();
+	return false;
+}
+
+bool receptor::save(const path& p, const scoring_function& sf) const
+{
+	const map_header h(checksum(sf), brick_cap != 0);
+	const path tmp_path = p.parent_path() / unique_path(p.filename().string() + ".%%%%-%%%%-%%%%-%%%%");
+	boost::system::error_code ec;
+	{
+		boost::filesystem::ofstream ofs(tmp_path, ios::binary);
+		ofs.write(reinterpret_cast<const char*>(&h), sizeof(h));
+		for (size_t t = 0; t < scoring_function::n; ++t)
+		{
+			assert(mps[t]);
+			if (brick_cap)
+			{
+				const uint64_t n = map_sizes[t];
+				ofs.write(reinterpret_cast<const char*>(&n), sizeof(n));
+				ofs.write(reinterpret_cast<const char*>(bts[t]), sizeof(int) * num_bricks_product);
+			}
+			ofs.write(reinterpret_cast<const char*>(mps[t]), sizeof(float) * map_sizes[t]);
+		}
+		if (!ofs)
+		{
+			ofs.close();
+			remove(tmp_path, ec);
+			return false;
+		}
+	}
+	rename(tmp_path, p, ec);
+	if (ec)
+	{
+		remove(tmp_path, ec);
+		return false;
+	}
+	return true;
 }
 
 void receptor::precalculate(const scoring_function& sf, const vector<size_t>& xs)
@@ -118,49 +318,285 @@ void receptor::precalculate(const scoring_function& sf, const vector<size_t>& xs
 	}
 }
 
+void receptor::allocate(const vector<size_t>& xs)
+{
+	for (const size_t t : xs)
+	{
+		if (brick_cap)
+		{
+			slabs[t].resize(brick_stride * num_probes[0] * num_probes[1]);
+			maps[t].assign(brick_size, brick_cap);
+			brick_tables[t].assign(num_bricks_product, 0);
+			mps[t] = slabs[t].data();
+		}
+		else
+		{
+			maps[t].resize(num_probes_product);
+			mps[t] = maps[t].data();
+			map_sizes[t] = num_probes_product;
+		}
+	}
+}
+
+size_t receptor::num_layers() const
+{
+	return brick_cap ? num_bricks[2] : 1;
+}
+
+size_t receptor::layer_begin(const size_t l) const
+{
+	return l ? brick * l + 1 : 0;
+}
+
+size_t receptor::layer_end(const size_t l) const
+{
+	return brick_cap ? min<size_t>(brick * l + brick, num_probes[2] - 1) + 1 : num_probes[2];
+}
+
+void receptor::store(const vector<size_t>& xs, const size_t l)
+{
+	if (!brick_cap) return;
+	const size_t nx = num_probes[0];
+	const size_t ny = num_probes[1];
+	const size_t nxy = nx * ny;
+	const size_t z0 = brick * l;
+	for (const size_t t : xs)
+	{
+		vector<float>& s = slabs[t];
+		vector<float>& m = maps[t];
+		int* const bt = &brick_tables[t][num_bricks[0] * num_bricks[1] * l];
+		for (size_t by = 0; by < static_cast<size_t>(num_bricks[1]); ++by)
+		for (size_t bx = 0; bx < static_cast<size_t>(num_bricks[0]); ++bx)
+		{
+			// Copy the probes of the brick, clamping those beyond the box to the last ones, and keep the brick unless all of them are above the cap.
+			const size_t o = m.size();
+			m.resize(o + brick_size);
+			float* v = &m[o];
+			float e = brick_cap;
+			for (size_t k = 0; k < brick_stride; ++k)
+			{
+				const size_t z = min<size_t>(z0 + k, num_probes[2] - 1) - z0;
+				for (size_t j = 0; j < brick_stride; ++j)
+				{
+					const float* const r = &s[nxy * z + nx * min<size_t>(brick * by + j, ny - 1)];
+					for (size_t i = 0; i < brick_stride; ++i)
+					{
+						*v = r[min<size_t>(brick * bx + i, nx - 1)];
+						e = min(e, *v++);
+					}
+				}
+			}
+			if (e < brick_cap)
+			{
+				assert(o + brick_size <= static_cast<size_t>(numeric_limits<int>::max()));
+				bt[num_bricks[0] * by + bx] = static_cast<int>(o);
+			}
+			else
+			{
+				m.resize(o);
+			}
+		}
+
+		// Carry the last plane of the slab over as the first plane of the next layer, or complete the map after the last layer.
+		if (l + 1 < num_layers())
+		{
+			copy(s.cbegin() + nxy * brick, s.cbegin() + nxy * brick_stride, s.begin());
+		}
+		else
+		{
+			vector<float>().swap(s);
+			m.shrink_to_fit();
+			mps[t] = m.data();
+			bts[t] = brick_tables[t].data();
+			map_sizes[t] = m.size();
+		}
+	}
+}
+
+void receptor::quantize(const vector<size_t>& xs)
+{
+	if (precision == map_float32) return;
+	for (const size_t t : xs)
+	{
+		const float* const m = mps[t];
+		const size_t n = map_sizes[t];
+		assert(m && n);
+		vector<uint16_t>& q = codes[t];
+		q.resize(n);
+
+		// Map the range of an int16 map symmetrically onto [-32767, 32767].
+		float scale = 1, offset = 0;
+		if (precision == map_int16)
+		{
+			const auto r = minmax_element(m, m + n);
+			offset = 0.5f * (*r.first + *r.second);
+			scale = (*r.second - *r.first) * (1.0f / 65534);
+			if (!(scale > 0)) scale = 1;
+		}
+		mqa[2 * t] = scale;
+		mqa[2 * t + 1] = offset;
+
+		// Encode the values, and measure the errors of decoding them back.
+		for (size_t i = 0; i < n; ++i)
+		{
+			float v;
+			if (precision == map_float16)
+			{
+				q[i] = float_to_half(m[i]);
+				v = half_to_float(q[i]);
+			}
+			else
+			{
+				const int16_t c = static_cast<int16_t>(max(-32767.0f, min(32767.0f, nearbyint((m[i] - offset) / scale))));
+				q[i] = static_cast<uint16_t>(c);
+				v = offset + scale * c;
+			}
+			const float e = fabs(v - m[i]);
+			max_quantization_error = max(max_quantization_error, e);
+			sum_squared_quantization_errors += static_cast<double>(e) * e;
+		}
+		num_quantized_values += n;
+		mqs[t] = q.data();
+		mps[t] = nullptr;
+		vector<float>().swap(maps[t]);
+	}
+}
+
+void receptor::tile_neighbors(const size_t z, const size_t by, vector<size_t>& nbrs) const
+{
+	const size_t y0 = tile * by;
+	const size_t y1 = min<size_t>(y0 + tile, num_probes[1]);
+	const float z_coord = corner0[2] + granularity * z;
+	const float margin = static_cast<float>(scoring_function::cutoff) + granularity; // Cutoff widened by one probe to be conservative against rounding.
+	nbrs.clear();
+	neighbors({ corner0[0] - margin, corner0[1] + granularity * y0 - margin, z_coord - margin }, { corner0[0] + granularity * (num_probes[0] - 1) + margin, corner0[1] + granularity * (y1 - 1) + margin, z_coord + margin }, nbrs);
+	sort(nbrs.begin(), nbrs.end());
+}
+
+void receptor::encode_tiles(vector<float>& atm, vector<int>& tlo, vector<int>& tla) const
+{
+	atm.resize(4 * atoms.size());
+	for (size_t i = 0; i < atoms.size(); ++i)
+	{
+		const atom& a = atoms[i];
+		atm[4 * i + 0] = a.coord[0];
+		atm[4 * i + 1] = a.coord[1];
+		atm[4 * i + 2] = a.coord[2];
+		atm[4 * i + 3] = static_cast<float>(a.xs);
+	}
+	tlo.resize(num_probes[2] * num_tiles + 1);
+	tla.clear();
+	vector<size_t> nbrs;
+	for (size_t z = 0; z < static_cast<size_t>(num_probes[2]); ++z)
+	for (size_t by = 0; by < num_tiles; ++by)
+	{
+		tlo[num_tiles * z + by] = static_cast<int>(tla.size());
+		tile_neighbors(z, by, nbrs);
+		tla.insert(tla.end(), nbrs.cbegin(), nbrs.cend());
+	}
+	tlo.back() = static_cast<int>(tla.size());
+}
+
 void receptor::populate(const vector<size_t>& xs, const size_t z, const scoring_function& sf)
 {
 	const size_t n = xs.size();
+	const size_t nx = num_probes[0];
+	const size_t ny = num_probes[1];
+	const size_t rows = tile;
 	const float z_coord = corner0[2] + granularity * z;
-	const size_t z_offset = num_probes[0] * num_probes[1] * z;
-
-	for (const auto& a : atoms)
-	{
-		assert(!a.is_hydrogen());
-		const float dz = z_coord - a.coord[2];
-		const float dz_sqr = dz * dz;
-		const float dydx_sqr_ub = scoring_function::cutoff_sqr - dz_sqr;
-		if (dydx_sqr_ub <= 0) continue;
-		const float dydx_ub = sqrt(dydx_sqr_ub);
-		const float y_lb = a.coord[1] - dydx_ub;
-		const float y_ub = a.coord[1] + dydx_ub;
-		const size_t y_beg = y_lb > corner0[1] ? (y_lb < corner1[1] ? static_cast<size_t>((y_lb - corner0[1]) * granularity_inverse)     : num_probes[1]) : 0;
-		const size_t y_end = y_ub > corner0[1] ? (y_ub < corner1[1] ? static_cast<size_t>((y_ub - corner0[1]) * granularity_inverse) + 1 : num_probes[1]) : 0;
-		const vector<size_t>& p = p_offset[a.xs];
-		size_t zy_offset = z_offset + num_probes[0] * y_beg;
-		float dy = corner0[1] + granularity * y_beg - a.coord[1];
-		for (size_t y = y_beg; y < y_end; ++y, zy_offset += num_probes[0], dy += granularity)
-		{
-			const float dy_sqr = dy * dy;
-			const float dx_sqr_ub = dydx_sqr_ub - dy_sqr;
-			if (dx_sqr_ub <= 0) continue;
-			const float dx_ub = sqrt(dx_sqr_ub);
-			const float x_lb = a.coord[0] - dx_ub;
-			const float x_ub = a.coord[0] + dx_ub;
-			const size_t x_beg = x_lb > corner0[0] ? (x_lb < corner1[0] ? static_cast<size_t>((x_lb - corner0[0]) * granularity_inverse)     : num_probes[0]) : 0;
-			const size_t x_end = x_ub > corner0[0] ? (x_ub < corner1[0] ? static_cast<size_t>((x_ub - corner0[0]) * granularity_inverse) + 1 : num_probes[0]) : 0;
-			const float dzdy_sqr = dz_sqr + dy_sqr;
-			size_t zyx_offset = zy_offset + x_beg;
-			float dx = corner0[0] + granularity * x_beg - a.coord[0];
-			for (size_t x = x_beg; x < x_end; ++x, ++zyx_offset, dx += granularity)
+	const size_t z_offset = nx * ny * (brick_cap ? z - brick * (z ? (z - 1) / brick : 0) : z); // Sparse maps are populated into the slab of the layer of z.
+	vector<vector<float>>& dst = brick_cap ? slabs : maps;
+	vector<float> t(rows * nx * n); // Tile of grid map values, where the values of the n atom types of a probe are adjacent.
+	vector<size_t> r_offsets(nx); // Scoring function offsets of the probes along an X row, or nr for those beyond cutoff.
+	vector<float> r_fracs(sf.interpolated ? nx : 0); // Fractions of the probes along an X row between their samples and the next if the scoring function is interpolated.
+	vector<size_t> nbrs; // Ascending indexes to the atoms within cutoff of the tile.
+
+	for (size_t by = 0; by < num_tiles; ++by)
+	{
+		const size_t y0 = rows * by;
+		const size_t y1 = min(y0 + rows, ny);
+		t.assign(t.size(), 0.0f);
+
+		// Find the atoms near the tile, and visit them in ascending order to reproduce the rounding of visiting all the atoms.
+		tile_neighbors(z, by, nbrs);
+		for (const size_t ai : nbrs)
+		{
+			const atom& a = atoms[ai];
+			assert(!a.is_hydrogen());
+			const float dz = z_coord - a.coord[2];
+			const float dz_sqr = dz * dz;
+			const float dydx_sqr_ub = scoring_function::cutoff_sqr - dz_sqr;
+			if (dydx_sqr_ub <= 0) continue;
+			const float dydx_ub = sqrt(dydx_sqr_ub);
+			const float y_lb = a.coord[1] - dydx_ub;
+			const float y_ub = a.coord[1] + dydx_ub;
+			const size_t y_beg = y_lb > corner0[1] ? (y_lb < corner1[1] ? static_cast<size_t>((y_lb - corner0[1]) * granularity_inverse)     : ny) : 0;
+			const size_t y_end = y_ub > corner0[1] ? (y_ub < corner1[1] ? static_cast<size_t>((y_ub - corner0[1]) * granularity_inverse) + 1 : ny) : 0;
+			const size_t yt_beg = max(y_beg, y0);
+			const size_t yt_end = min(y_end, y1);
+			if (yt_beg >= yt_end) continue;
+			const vector<size_t>& p = p_offset[a.xs];
+
+			// dy is accumulated from y_beg rather than computed at yt_beg so as to reproduce the exact rounding of a full traversal.
+			float dy = corner0[1] + granularity * y_beg - a.coord[1];
+			for (size_t y = y_beg; y < yt_beg; ++y, dy += granularity);
+			for (size_t y = yt_beg; y < yt_end; ++y, dy += granularity)
+			{
+				const float dy_sqr = dy * dy;
+				const float dx_sqr_ub = dydx_sqr_ub - dy_sqr;
+				if (dx_sqr_ub <= 0) continue;
+				const float dx_ub = sqrt(dx_sqr_ub);
+				const float x_lb = a.coord[0] - dx_ub;
+				const float x_ub = a.coord[0] + dx_ub;
+				const size_t x_beg = x_lb > corner0[0] ? (x_lb < corner1[0] ? static_cast<size_t>((x_lb - corner0[0]) * granularity_inverse)     : nx) : 0;
+				const size_t x_end = x_ub > corner0[0] ? (x_ub < corner1[0] ? static_cast<size_t>((x_ub - corner0[0]) * granularity_inverse) + 1 : nx) : 0;
+				const float dzdy_sqr = dz_sqr + dy_sqr;
+
+				// Evaluate the scoring function offsets of the X row.
+				float dx = corner0[0] + granularity * x_beg - a.coord[0];
+				for (size_t x = x_beg; x < x_end; ++x, dx += granularity)
+				{
+					const float r2 = dzdy_sqr + dx * dx;
+					r_offsets[x] = r2 < scoring_function::cutoff_sqr ? static_cast<size_t>(sf.ns * r2) : sf.nr;
+					if (sf.interpolated) r_fracs[x] = sf.ns * r2 - r_offsets[x];
+				}
+
+				// Aggregate the scoring function values into the tile with atom types interleaved.
+				float* const tr = &t[nx * n * (y - y0)];
+				for (size_t x = x_beg; x < x_end; ++x)
+				{
+					const size_t r_offset = r_offsets[x];
+					if (r_offset == sf.nr) continue;
+					float* const tp = tr + n * x;
+					if (sf.interpolated)
+					{
+						const float f = r_fracs[x];
+						for (size_t i = 0; i < n; ++i)
+						{
+							const float* const e = sf.e + p[i] + r_offset;
+							tp[i] += e[0] + (e[1] - e[0]) * f;
+						}
+						continue;
+					}
+					for (size_t i = 0; i < n; ++i)
+					{
+						tp[i] += sf.e[p[i] + r_offset];
+					}
+				}
+			}
+		}
+
+		// Write the tile into the grid maps.
+		for (size_t y = y0; y < y1; ++y)
+		{
+			const float* const tr = &t[nx * n * (y - y0)];
+			const size_t zy_offset = z_offset + nx * y;
+			for (size_t i = 0; i < n; ++i)
 			{
-				const float dx_sqr = dx * dx;
-				const float r2 = dzdy_sqr + dx_sqr;
-				if (r2 >= scoring_function::cutoff_sqr) continue;
-				const size_t r_offset = static_cast<size_t>(sf.ns * r2);
-				for (size_t i = 0; i < n; ++i)
+				float* const m = &dst[xs[i]][zy_offset];
+				for (size_t x = 0; x < nx; ++x)
 				{
-					maps[xs[i]][zyx_offset] += sf.e[p[i] + r_offset];
+					m[x] = tr[n * x + i];
 				}
 			}
 		}
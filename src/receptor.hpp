@@ -3,8 +3,10 @@
 #define IDOCK_RECEPTOR_HPP
 
 #include <boost/filesystem/path.hpp>
+#include <boost/interprocess/mapped_region.hpp>
 #include "atom.hpp"
 #include "scoring_function.hpp"
+#include "precision.hpp"
 using namespace boost::filesystem;
 
 //! Represents a receptor.
@@ -12,6 +14,7 @@ class receptor
 {
 public:
 	vector<atom> atoms; //!< Heavy atoms.
+	array<bool, scoring_function::n> types; //!< Presence of XScore atom types among the heavy atoms, whose type pairs with the atom types of grid maps are looked up to create the maps.
 	const array<float, 3> center; //!< Box center.
 	const array<float, 3> size; //!< 3D sizes of box.
 	const array<float, 3> corner0; //!< Box boundary corner with smallest values of all the 3 dimensions.
@@ -21,17 +24,80 @@ public:
 	const array<int, 3> num_probes; //!< Number of probes.
 	const size_t num_probes_product; //!< Product of num_probes[0,1,2].
 	const size_t map_bytes; //!< Number of bytes in a map.
+	static const size_t tile = 8; //!< Number of Y rows in a tile of grid maps populated at a time.
+	const size_t num_tiles; //!< Number of tiles along Y.
+	static constexpr float cell_size = 4; //!< Edge length of the cubic cells of the atom index, which divides both the 8A cutoff of the scoring function and the 12A cutoff of RF-Score.
+	array<float, 3> cell_corner0; //!< Corner of the first cell of the atom index.
+	array<int, 3> num_cells; //!< Number of cells of the atom index along X, Y and Z.
+	vector<size_t> cell_offsets; //!< Offsets to cell_atoms of the first atom of each cell, followed by the number of atoms.
+	vector<size_t> cell_atoms; //!< Indexes to the atoms of each cell in ascending order.
 	vector<vector<size_t>> p_offset; //!< Auxiliary precalculated constants to accelerate grid map creation.
-	vector<vector<float>> maps; //!< Grid maps.
+	static const int brick = 8; //!< Number of cells along each edge of a brick of sparse grid maps.
+	static const int brick_stride = brick + 1; //!< Number of probes along each edge of a brick, which include the first probes of the next bricks so that the eight probes around any cell lie in a single brick.
+	static const size_t brick_size = brick_stride * brick_stride * brick_stride; //!< Number of values of a brick.
+	const float brick_cap; //!< Energy above which the bricks of sparse grid maps are not stored, or 0 for dense grid maps.
+	const array<int, 3> num_bricks; //!< Number of bricks along X, Y and Z, which cover all the cells between probes.
+	const size_t num_bricks_product; //!< Product of num_bricks[0,1,2].
+	vector<vector<float>> maps; //!< Grid maps populated in memory. A sparse map holds bricks, the first of which is filled with brick_cap and shared by all the bricks not stored.
+	vector<vector<int>> brick_tables; //!< Offsets to the values of each brick of the sparse grid maps populated in memory.
+	array<const float*, scoring_function::n> mps; //!< Pointers to grid maps, either populated in memory or memory-mapped from a map file. A null pointer indicates an absent map.
+	array<const int*, scoring_function::n> bts; //!< Pointers to the brick tables of sparse grid maps, or null pointers for dense grid maps.
+	array<size_t, scoring_function::n> map_sizes; //!< Number of values of each grid map present, or 0 for an absent map.
+	const map_precision precision; //!< Precision at which grid maps are stored for docking.
+	vector<vector<uint16_t>> codes; //!< 16-bit codes of the grid maps quantized from their float32 values unless precision is float32.
+	array<const uint16_t*, scoring_function::n> mqs; //!< Pointers to the codes of quantized grid maps, whose mps are then null, or null pointers for float32 maps.
+	array<float, 2 * scoring_function::n> mqa; //!< Scale and offset of each int16 grid map, whose values decode as offset + scale * code.
+	float max_quantization_error; //!< Largest absolute error of the values quantized so far against their float32 values.
+	double sum_squared_quantization_errors; //!< Sum of the squared errors of the values quantized so far.
+	size_t num_quantized_values; //!< Number of values quantized so far.
 
-	//! Constructs a receptor by parsing a receptor file in PDBQT format.
-	explicit receptor(const path& p, const array<float, 3>& center, const array<float, 3>& size, const float granularity);
+	//! Constructs a receptor by parsing a receptor file in PDBQT format. A nonzero brick_cap makes grid maps sparse, storing only the bricks of brick^3 cells whose probes are not all above the cap, and reading the others as the cap, so that large boxes mostly buried in the receptor fit in memory. A precision other than float32 quantizes grid maps to 16 bits once they are complete, halving the memory traffic of lookups.
+	explicit receptor(const path& p, const array<float, 3>& center, const array<float, 3>& size, const float granularity, const float brick_cap = 0, const map_precision precision = map_float32);
+
+	//! Memory-maps the grid maps of all the atom types from a map file read-only, and returns false if the file is missing or was not created from the current receptor atoms, box, granularity, brick cap and scoring function.
+	bool map(const path& p, const scoring_function& sf);
+
+	//! Saves the grid maps of all the atom types created with a scoring function to a map file, and returns false on failure.
+	bool save(const path& p, const scoring_function& sf) const;
+
+	//! Appends to nbrs the indexes to the atoms of the cells overlapping the axis-aligned box from lo to hi, which include all the atoms within the box. The indexes ascend within each cell but not across cells.
+	void neighbors(const array<float, 3>& lo, const array<float, 3>& hi, vector<size_t>& nbrs) const;
 
 	//! Precalculates auxiliary constants to accelerate grid map creation.
 	void precalculate(const scoring_function& sf, const vector<size_t>& xs);
 
-	//! Populates grid maps for certain atom types along X and Y dimensions for a given Z dimension value.
+	//! Allocates the grid maps of certain atom types to populate, or for sparse maps, a slab of brick_stride planes along Z of each of them together with the shared brick.
+	void allocate(const vector<size_t>& xs);
+
+	//! Returns the number of layers of planes along Z to populate one after another, which is 1 for dense maps and num_bricks[2] for sparse maps.
+	size_t num_layers() const;
+
+	//! Returns the first plane along Z to populate for layer l.
+	size_t layer_begin(const size_t l) const;
+
+	//! Returns one past the last plane along Z to populate for layer l.
+	size_t layer_end(const size_t l) const;
+
+	//! Stores the bricks of layer l of sparse grid maps from their slabs once all the planes of the layer are populated, and completes the maps after the last layer. Does nothing for dense maps.
+	void store(const vector<size_t>& xs, const size_t l);
+
+	//! Quantizes the complete grid maps of certain atom types to the precision of the receptor, releasing their float32 values, and accumulates the quantization errors. Does nothing at float32. Map files always hold float32 values, so maps are saved before they are quantized.
+	void quantize(const vector<size_t>& xs);
+
+	//! Sets nbrs to the ascending indexes to the atoms near tile by of Y rows of plane z along Z, which include all the atoms within cutoff of its probes. populate visits them in this order, and so do the grid map kernels of idock_cu and idock_cl.
+	void tile_neighbors(const size_t z, const size_t by, vector<size_t>& nbrs) const;
+
+	//! Encodes the atoms for the grid map kernels of idock_cu and idock_cl into atm, four floats each holding its coordinates and XScore type, and the atoms near every tile into tla, those of tile by of plane z starting at tla[tlo[num_tiles * z + by]] and ending at the start of the next tile.
+	void encode_tiles(vector<float>& atm, vector<int>& tlo, vector<int>& tla) const;
+
+	//! Populates grid maps for certain atom types along X and Y dimensions for a given Z dimension value. The maps are populated in tiles of Y rows with interleaved atom types, each tile visiting only the atoms that the cell index finds within cutoff of it. The values are bitwise identical to visiting all the atoms for each probe. The type pairs of the atom types with the receptor types must have been precalculated, and are interpolated between samples if the scoring function is.
 	void populate(const vector<size_t>& xs, const size_t z, const scoring_function& sf);
+private:
+	boost::interprocess::mapped_region region; //!< Mapped region of the map file.
+	vector<vector<float>> slabs; //!< Planes of the layer of sparse grid maps being populated.
+
+	//! Returns a checksum of the receptor atoms, box, granularity and scoring function, which together determine the grid maps.
+	uint64_t checksum(const scoring_function& sf) const;
 };
 
 #endif
@@ -1,7 +1,14 @@
 #include <cmath>
 #include <cassert>
+#include <cstdint>
+#include <cstring>
+#include <boost/filesystem/operations.hpp>
+#include <boost/filesystem/fstream.hpp>
+#include <boost/interprocess/file_mapping.hpp>
+#include "checksum.hpp"
 #include "scoring_function.hpp"
 
+const size_t scoring_function::default_ns;
 const float scoring_function::cutoff_sqr = cutoff * cutoff;
 const array<float, scoring_function::n> scoring_function::vdw =
 {
@@ -21,6 +28,33 @@ const array<float, scoring_function::n> scoring_function::vdw =
 	2.2f, //   I_H
 	1.2f, // Met_D
 };
+const array<float, 5> scoring_function::weights =
+{
+	-0.035579f, // gauss1
+	-0.005156f, // gauss2
+	 0.840245f, // repulsion
+	-0.035069f, // hydrophobic
+	-0.587439f, // hbonding
+};
+
+//! Represents the header of a scoring function cache file, which is followed by e and then d.
+class cache_header
+{
+public:
+	char magic[8]; //!< File signature.
+	uint64_t checksum; //!< Checksum of the scoring function parameters.
+
+	//! Constructs a header for a scoring function.
+	explicit cache_header(const scoring_function& sf) : magic{ 'i', 'd', 'o', 'c', 'k', 's', 'f', 0 }, checksum(sf.checksum())
+	{
+	}
+
+	//! Returns true if the current header is identical to the given one.
+	bool operator==(const cache_header& h) const
+	{
+		return !memcmp(magic, h.magic, sizeof(magic)) && checksum == h.checksum;
+	}
+};
 
 //! Returns true if the XScore atom type is hydrophobic.
 inline bool is_hydrophobic(const size_t t)
@@ -52,13 +86,82 @@ inline bool is_hbond(const size_t t0, const size_t t1)
 	return (is_hbdonor(t0) && is_hbacceptor(t1)) || (is_hbdonor(t1) && is_hbacceptor(t0));
 }
 
-scoring_function::scoring_function() : e(ne), d(ne), rs(nr)
+scoring_function::scoring_function(const path& cache_path, const size_t ns) : ns(ns), interpolated(ns != default_ns), nr(ns*cutoff*cutoff+1+interpolated), ne(nr*np), mapped(false), e(nullptr), d(nullptr)
 {
-	const float ns_inv = 1.0f / ns;
-	for (size_t i = 0; i < nr; ++i)
+	// Map the precalculated values from the cache file if it is present and valid.
+	if (!cache_path.empty() && map(cache_path))
+	{
+		mapped = true;
+		claimed.fill(true);
+		e = static_cast<const float*>(region.get_address()) + sizeof(cache_header) / sizeof(float);
+		d = e + ne;
+		return;
+	}
+
+	// Fall back to allocating memory for precalculation.
+	claimed.fill(false);
+	ev.reset(new float[ne]);
+	dv.reset(new float[ne]);
+	e = ev.get();
+	d = dv.get();
+}
+
+uint64_t scoring_function::checksum() const
+{
+	const array<uint32_t, 4> params = { 1, n, static_cast<uint32_t>(ns), cutoff }; // The first parameter is the version of the precalculated value layout.
+	::checksum c;
+	c(params);
+	c(vdw);
+	c(weights);
+	return c.value();
+}
+
+bool scoring_function::map(const path& cache_path)
+{
+	using namespace boost::interprocess;
+	boost::system::error_code ec;
+	if (!is_regular_file(cache_path, ec) || file_size(cache_path, ec) != sizeof(cache_header) + sizeof(float) * ne * 2) return false;
+	try
+	{
+		region = mapped_region(file_mapping(cache_path.string().c_str(), read_only), read_only);
+	}
+	catch (const interprocess_exception&)
+	{
+		return false;
+	}
+	if (region.get_size() < sizeof(cache_header) || !(*static_cast<const cache_header*>(region.get_address()) == cache_header(*this)))
+	{
+		region = mapped_region();
+		return false;
+	}
+	return true;
+}
+
+bool scoring_function::save(const path& cache_path) const
+{
+	assert(!mapped);
+	const cache_header h(*this);
+	const path tmp_path = cache_path.parent_path() / unique_path(cache_path.filename().string() + ".%%%%-%%%%-%%%%-%%%%");
+	boost::system::error_code ec;
 	{
-		rs[i] = sqrt(i * ns_inv);
+		boost::filesystem::ofstream ofs(tmp_path, ios::binary);
+		ofs.write(reinterpret_cast<const char*>(&h), sizeof(h));
+		ofs.write(reinterpret_cast<const char*>(ev.get()), sizeof(float) * ne);
+		ofs.write(reinterpret_cast<const char*>(dv.get()), sizeof(float) * ne);
+		if (!ofs)
+		{
+			ofs.close();
+			remove(tmp_path, ec);
+			return false;
+		}
 	}
+	rename(tmp_path, cache_path, ec);
+	if (ec)
+	{
+		remove(tmp_path, ec);
+		return false;
+	}
+	return true;
 }
 
 void scoring_function::score(float* const v, const size_t t0, const size_t t1, const float r2)
@@ -78,32 +181,50 @@ void scoring_function::precalculate(const size_t t0, const size_t t1)
 	const float s = vdw[t0] + vdw[t1];
 	const bool hydrophobic = is_hydrophobic(t0, t1);
 	const bool hbond = is_hbond(t0, t1);
+	const float ns_inv = 1.0f / ns;
 
 	// Evaluate the scoring function value at (t0, t1, r).
-	float* et = e.data() + offset;
+	float* et = ev.get() + offset;
 	for (size_t i = 0; i < nr; ++i)
 	{
 		// Calculate the surface distance d.
-		const float d = rs[i] - s;
+		const float d = sqrt(i * ns_inv) - s;
 
 		// The scoring function is a weighted sum of 5 terms. The first 3 terms depend on d only, while the latter 2 terms depend on t0, t1 and d.
 		et[i] =
-		    (-0.035579f) * exp(-4.0f * d * d)
-		  + (-0.005156f) * exp(-0.25f * (d - 3.0f) * (d - 3.0f))
-		  + (d < 0.0f ? 0.840245f * d * d : 0.0f)
-		  + (hydrophobic ? (-0.035069f) * (d >= 1.5f ? 0.0f : (d <= 0.5f ? 1.0f : 1.5f - d)) : 0.0f)
-		  + (hbond ? (-0.587439f) * (d >= 0.0f ? 0.0f : (d <= -0.7f ? 1.0f : d * -1.4285714285714286f)) : 0.0f);
+		    weights[0] * exp(-4.0f * d * d)
+		  + weights[1] * exp(-0.25f * (d - 3.0f) * (d - 3.0f))
+		  + (d < 0.0f ? weights[2] * d * d : 0.0f)
+		  + (hydrophobic ? weights[3] * (d >= 1.5f ? 0.0f : (d <= 0.5f ? 1.0f : 1.5f - d)) : 0.0f)
+		  + (hbond ? weights[4] * (d >= 0.0f ? 0.0f : (d <= -0.7f ? 1.0f : d * -1.4285714285714286f)) : 0.0f);
 	}
 
 	// Evaluate the scoring function derivative divided by distance at (t0, t1, r).
-	float* dt = d.data() + offset;
+	float* dt = dv.get() + offset;
 	for (size_t i = 0; i < nr - 1; ++i)
 	{
-		dt[i] = (et[i+1] - et[i]) / ((rs[i+1] - rs[i]) * rs[i]);
+		const float r0 = sqrt(i * ns_inv);
+		dt[i] = (et[i+1] - et[i]) / ((sqrt((i + 1) * ns_inv) - r0) * r0);
 	}
+	dt[nr - 1] = 0.0f;
 }
 
-void scoring_function::clear()
+vector<array<size_t, 2>> scoring_function::claim(const array<bool, n>& xs0, const array<bool, n>& xs1)
 {
-	rs.clear();
+	vector<array<size_t, 2>> pairs;
+	for (size_t t0 = 0; t0 < n; ++t0)
+	{
+		if (!xs0[t0]) continue;
+		for (size_t t1 = 0; t1 < n; ++t1)
+		{
+			if (!xs1[t1]) continue;
+			const size_t u0 = t0 < t1 ? t0 : t1;
+			const size_t u1 = t0 < t1 ? t1 : t0;
+			const size_t p = (u1*(u1+1)>>1) + u0;
+			if (claimed[p]) continue;
+			claimed[p] = true;
+			pairs.push_back({{ u0, u1 }});
+		}
+	}
+	return pairs;
 }
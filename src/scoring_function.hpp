@@ -3,8 +3,13 @@
 #define IDOCK_SCORING_FUNCTION_HPP
 
 #include <array>
+#include <memory>
+#include <cstdint>
 #include <vector>
+#include <boost/filesystem/path.hpp>
+#include <boost/interprocess/mapped_region.hpp>
 using namespace std;
+using namespace boost::filesystem;
 
 //! Represents the scoring function used in idock.
 class scoring_function
@@ -12,14 +17,19 @@ class scoring_function
 public:
 	static const size_t n = 15; //!< Number of XScore atom types.
 	static const size_t np = n*(n+1)>>1; //!< Number of XScore atom type pairs.
-	static const size_t ns = 1024; //!< Number of samples in a unit distance.
+	static const size_t default_ns = 1024; //!< Default number of samples in a unit squared distance.
 	static const size_t cutoff = 8; //!< Atom type pair distance cutoff.
-	static const size_t nr = ns*cutoff*cutoff+1; //!< Number of samples within the entire cutoff.
-	static const size_t ne = nr*np; //!< Number of values to precalculate.
 	static const float cutoff_sqr; //!< Cutoff square.
+	const size_t ns; //!< Number of samples in a unit squared distance.
+	const bool interpolated; //!< True if ns differs from default_ns, in which case lookups interpolate linearly between adjacent samples rather than taking the lower one.
+	const size_t nr; //!< Number of samples per type pair, which cover the entire cutoff, plus one more beyond it if interpolated so that the upper sample of every lookup within the cutoff belongs to the same type pair.
+	const size_t ne; //!< Number of values to precalculate.
 
-	//! Constructs an empty scoring function.
-	explicit scoring_function();
+	//! Constructs a scoring function of ns samples in a unit squared distance. If a valid cache file is supplied, the precalculated values are memory-mapped from it read-only, otherwise memory is allocated for precalculation, whose pages become resident only as type pairs are precalculated.
+	explicit scoring_function(const path& cache_path = path(), const size_t ns = default_ns);
+
+	//! Returns a checksum of the version, the numbers of atom types and samples, the cutoff, the van der Waals distances and the term weights, which together determine the precalculated values.
+	uint64_t checksum() const;
 
 	//! Aggregates the five term values evaluated at (t0, t1, r2).
 	static void score(float* const v, const size_t t0, const size_t t1, const float r2);
@@ -27,14 +37,25 @@ public:
 	//! Precalculates the scoring function values of sample points for the type combination of t0 and t1.
 	void precalculate(const size_t t0, const size_t t1);
 
-	//! Clears precalculated values.
-	void clear();
+	//! Saves precalculated values to a cache file, and returns false on failure. The file is written to a temporary file first and then renamed so that concurrent processes never map a partial file.
+	bool save(const path& cache_path) const;
+
+	//! Claims the type pairs of an atom type in xs0 and an atom type in xs1 that are not yet claimed, and returns them as (t0, t1) with t0 <= t1 for the caller to precalculate before any lookup of them. Not thread safe, but values of pairs claimed earlier may be looked up while those returned are precalculated.
+	vector<array<size_t, 2>> claim(const array<bool, n>& xs0, const array<bool, n>& xs1);
 
-	vector<float> e; //!< Scoring function values.
-	vector<float> d; //!< Scoring function derivatives divided by distance.
+	bool mapped; //!< True if the precalculated values are memory-mapped from a cache file.
+	array<bool, np> claimed; //!< True for the type pairs claimed for precalculation, or for all if mapped.
+	const float* e; //!< Scoring function values.
+	const float* d; //!< Scoring function derivatives divided by distance.
 private:
 	static const array<float, n> vdw; //!< Van der Waals distances for XScore atom types.
-	vector<float> rs; //!< Distance samples.
+	static const array<float, 5> weights; //!< Weights of the five terms.
+	unique_ptr<float[]> ev; //!< Memory of precalculated values if not mapped, left uninitialized so that type pairs never precalculated cost no resident pages.
+	unique_ptr<float[]> dv; //!< Memory of precalculated derivatives if not mapped.
+	boost::interprocess::mapped_region region; //!< Mapped region of the cache file.
+
+	//! Maps a cache file into region, and returns true if the file is valid.
+	bool map(const path& cache_path);
 };
 
 #endif
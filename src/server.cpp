@@ -0,0 +1,255 @@
+#include <chrono>
+#include <thread>
+#include <iostream>
+#include <algorithm>
+#include "checksum.hpp"
+#include "cpu_backend.hpp"
+#include "temp_file.hpp"
+#include "server.hpp"
+
+server::server(const unsigned short port, const size_t num_threads, const path& sf_cache_path, const size_t sf_samples, const size_t max_receptors) : port(port), num_threads(num_threads), max_receptors(max_receptors), ts(num_threads), sf(sf_cache_path, sf_samples)
+{
+	cout << "Creating a task scheduler of " << num_threads << " worker threads" << endl;
+	if (sf.mapped)
+	{
+		cout << "Mapping a precalculated scoring function from " << sf_cache_path << endl;
+	}
+	else if (!sf_cache_path.empty())
+	{
+		cout << "Precalculating a scoring function of " << scoring_function::n << " atom types in parallel" << endl;
+		array<bool, scoring_function::n> all_types;
+		all_types.fill(true);
+		precalculate_pairs(sf.claim(all_types, all_types));
+		cout << "Saving the precalculated scoring function to " << sf_cache_path << endl;
+		if (!sf.save(sf_cache_path))
+		{
+			cerr << "Failed to save scoring function cache " << sf_cache_path << endl;
+		}
+	}
+	else
+	{
+		cout << "Precalculating a scoring function of " << sf.ns << " samples per unit squared distance for the atom type pairs looked up" << endl;
+	}
+}
+
+void server::run()
+{
+	// Accept clients in the calling thread, and serve each in its own thread.
+	tcp::acceptor acceptor(io, tcp::endpoint(tcp::v4(), port));
+	cout << "Listening for clients on port " << port << " with up to " << max_receptors << " resident receptors" << endl;
+	while (true)
+	{
+		const auto sock = make_shared<tcp::socket>(io);
+		boost::system::error_code ec;
+		acceptor.accept(*sock, ec);
+		if (ec) continue;
+		thread([this, sock]()
+		{
+			serve(*sock);
+		}).detach();
+	}
+}
+
+void server::precalculate_pairs(const vector<array<size_t, 2>>& pairs)
+{
+	task_group tg(ts);
+	for (const auto& p : pairs)
+	{
+		tg.run([&, p]()
+		{
+			sf.precalculate(p[0], p[1]);
+		});
+	}
+	tg.wait();
+}
+
+void server::serve(tcp::socket& sock)
+{
+	boost::system::error_code ec;
+	const auto endpoint = sock.remote_endpoint(ec);
+	try
+	{
+		string payload;
+		while (true)
+		{
+			try
+			{
+				if (receive_message(sock, payload) != message_dock) throw runtime_error("Unexpected message");
+			}
+			catch (const boost::system::system_error& e)
+			{
+				if (e.code() == boost::asio::error::eof || e.code() == boost::asio::error::connection_reset) break;
+				throw;
+			}
+			const auto start = std::chrono::steady_clock::now();
+
+			// Decode the receptor, the box and the docking parameters.
+			message_reader r(payload);
+			string rec_bytes;
+			array<float, 3> center, size;
+			float granularity, brick_cap;
+			uint64_t seed, num_trees, num_tasks, num_bfgs_iterations, max_conformations, sf_samples, n;
+			uint8_t trilinear, precision;
+			r.get(rec_bytes);
+			r.get(center);
+			r.get(size);
+			r.get(granularity);
+			r.get(seed);
+			r.get(num_trees);
+			r.get(num_tasks);
+			r.get(num_bfgs_iterations);
+			r.get(max_conformations);
+			r.get(trilinear);
+			r.get(brick_cap);
+			r.get(precision);
+			r.get(sf_samples);
+			r.get(n);
+
+			// Parse the ligands, and find or create the receptor, its grid maps of the atom types of the ligands, and the random forest. A request that fails is reported to the client, which may send further requests.
+			ligand_batch bat(num_tasks);
+			shared_ptr<receptor> rec;
+			shared_ptr<const forest> f;
+			bool parsed = false, trained = false;
+			vector<size_t> xs;
+			try
+			{
+				if (sf_samples != sf.ns) throw runtime_error("Option sf_samples of the request differs from that of the server, " + to_string(sf.ns));
+				for (size_t i = 0; i < n; ++i)
+				{
+					uint64_t lid;
+					string filename, pdbqt;
+					r.get(lid);
+					r.get(filename);
+					r.get(pdbqt);
+					bat.push_back(ligand(filename, pdbqt.data(), pdbqt.data() + pdbqt.size()), lid);
+				}
+				lock_guard<mutex> guard(m);
+
+				// Find the receptor by the checksum of the parameters that determine its grid maps, or parse it.
+				checksum c;
+				c(rec_bytes.data(), rec_bytes.size());
+				c(center);
+				c(size);
+				c(granularity);
+				c(brick_cap);
+				c(precision);
+				const uint64_t key = c.value();
+				const auto ri = find_if(receptors.begin(), receptors.end(), [key](const resident_receptor& rr)
+				{
+					return rr.key == key;
+				});
+				if (ri == receptors.end())
+				{
+					const temp_file rec_file(rec_bytes);
+					receptors.push_front({ key, make_shared<receptor>(rec_file.p, center, size, granularity, brick_cap, static_cast<map_precision>(precision)) });
+					if (receptors.size() > max_receptors) receptors.pop_back();
+					parsed = true;
+				}
+				else
+				{
+					receptors.splice(receptors.begin(), receptors, ri);
+				}
+				rec = receptors.front().rec;
+
+				// Find the random forest by its seed and number of trees, or train it.
+				const array<uint64_t, 2> fkey = {{ seed, num_trees }};
+				const auto fi = find_if(forests.begin(), forests.end(), [&fkey](const resident_forest& rf)
+				{
+					return rf.key == fkey;
+				});
+				if (fi == forests.end())
+				{
+					const shared_ptr<forest> tf = make_shared<forest>(num_trees, seed);
+					task_group tg(ts);
+					for (size_t i = 0; i < num_trees; ++i)
+					{
+						tg.run([&, i]()
+						{
+							tf->train(i);
+						});
+					}
+					tg.wait();
+					tf->clear();
+					forests.push_front({ fkey, tf });
+					if (forests.size() > max_receptors) forests.pop_back();
+					trained = true;
+				}
+				else
+				{
+					forests.splice(forests.begin(), forests, fi);
+				}
+				f = forests.front().f;
+
+				// Precalculate the type pairs within the ligands and between their missing grid maps and the receptor that no earlier request has claimed, and create the missing grid maps. Requests already docking against the receptor use other maps and keep docking meanwhile.
+				array<bool, scoring_function::n> batch_types, missing_types;
+				for (size_t t = 0; t < sf.n; ++t)
+				{
+					batch_types[t] = bat.uses(t);
+					missing_types[t] = batch_types[t] && !rec->map_sizes[t];
+					if (missing_types[t]) xs.push_back(t);
+				}
+				precalculate_pairs(sf.claim(batch_types, batch_types));
+				precalculate_pairs(sf.claim(missing_types, rec->types));
+				if (xs.size())
+				{
+					rec->allocate(xs);
+					rec->precalculate(sf, xs);
+					for (size_t l = 0; l < rec->num_layers(); ++l)
+					{
+						task_group tg(ts);
+						for (size_t z = rec->layer_begin(l); z < rec->layer_end(l); ++z)
+						{
+							tg.run([&, z]()
+							{
+								rec->populate(xs, z, sf);
+							});
+						}
+						tg.wait();
+						rec->store(xs, l);
+					}
+					rec->quantize(xs);
+				}
+			}
+			catch (const exception& e)
+			{
+				send_message(sock, message_error, e.what());
+				continue;
+			}
+
+			// Dock the ligands, and stream each back as soon as its conformations are written. A failed connection stops the streaming, and ends the client once the ligands in flight are docked.
+			const cpu_backend cpu(ts, num_threads, num_tasks, num_bfgs_iterations, seed, sf, *rec, trilinear);
+			vector<float> cnfh(bat.get_cnf_elems());
+			mutex sm;
+			bool failed = false;
+			cpu.dock(bat, cnfh.data(), [&](const size_t l)
+			{
+				pose_record pose;
+				bat.ligands[l].write(cnfh.data() + bat.cnf_offsets[l], max_conformations, num_tasks, *rec, *f, sf, pose);
+				string result;
+				put<uint64_t>(result, bat.lids[l]);
+				put(result, bat.ligands[l].filename.string());
+				put(result, pose);
+				{
+					lock_guard<mutex> guard(sm);
+					try
+					{
+						if (!failed) send_message(sock, message_pose, result);
+					}
+					catch (const boost::system::system_error&)
+					{
+						failed = true;
+					}
+				}
+			});
+			if (failed) break;
+			send_message(sock, message_done, string());
+			lock_guard<mutex> guard(m);
+			cout << "Docked " << bat.size() << " ligands for client " << endpoint << " in " << std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count() << " seconds against a " << (parsed ? "newly parsed" : "resident") << " receptor with " << xs.size() << " grid maps created and a " << (trained ? "newly trained" : "resident") << " random forest" << endl;
+		}
+	}
+	catch (const exception& e)
+	{
+		lock_guard<mutex> guard(m);
+		cerr << "Client " << endpoint << ": " << e.what() << endl;
+	}
+}
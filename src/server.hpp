@@ -0,0 +1,58 @@
+#pragma once
+#ifndef IDOCK_SERVER_HPP
+#define IDOCK_SERVER_HPP
+
+#include <list>
+#include <array>
+#include <mutex>
+#include <memory>
+#include <boost/asio/io_service.hpp>
+#include "task_scheduler.hpp"
+#include "scoring_function.hpp"
+#include "receptor.hpp"
+#include "random_forest.hpp"
+#include "message.hpp"
+
+//! Represents a resident docking server, which keeps the scoring function, and the receptors with their grid maps and the random forests of recent requests, in memory across requests, so that a request docks its ligands without parsing its receptor, creating grid maps or training a forest again.
+//! Clients are served concurrently on the shared worker threads of a task scheduler. Each docked ligand is streamed back as soon as it is written, and its conformations are those of a standalone run, because its tasks are keyed by the index in input order that the client sends along.
+class server
+{
+public:
+	//! Constructs a server that listens on a TCP port, docks on num_threads threads, maps or creates a scoring function cache file if any, and keeps up to max_receptors receptors and as many random forests resident, evicting the least recently used.
+	explicit server(const unsigned short port, const size_t num_threads, const path& sf_cache_path, const size_t sf_samples, const size_t max_receptors);
+
+	//! Accepts clients until the process is terminated. Throws on errors of the listening socket.
+	void run();
+private:
+	//! Represents a resident receptor and its grid maps, keyed by a checksum of its PDBQT text, box, granularity, brick cap and precision.
+	struct resident_receptor
+	{
+		uint64_t key; //!< Checksum of the parameters the receptor was parsed with.
+		shared_ptr<receptor> rec; //!< Receptor and its grid maps created so far.
+	};
+
+	//! Represents a resident random forest, keyed by its seed and number of trees.
+	struct resident_forest
+	{
+		array<uint64_t, 2> key; //!< Seed and number of trees.
+		shared_ptr<const forest> f; //!< Trained random forest.
+	};
+
+	//! Docks the requests of a client connected by a socket until it disconnects or its connection fails.
+	void serve(tcp::socket& sock);
+
+	//! Precalculates type pairs of the scoring function on the docking threads. Requires the lock.
+	void precalculate_pairs(const vector<array<size_t, 2>>& pairs);
+
+	const unsigned short port; //!< TCP port to listen on.
+	const size_t num_threads; //!< Number of docking threads.
+	const size_t max_receptors; //!< Maximum number of resident receptors and of resident random forests.
+	task_scheduler ts; //!< Scheduler of docking threads shared by all the clients.
+	scoring_function sf; //!< Scoring function, whose type pairs are precalculated as requests first look them up.
+	list<resident_receptor> receptors; //!< Resident receptors, the most recently used first.
+	list<resident_forest> forests; //!< Resident random forests, the most recently used first.
+	mutex m; //!< Mutex guarding the above, together with the claims of the scoring function and the creation of grid maps.
+	boost::asio::io_service io; //!< I/O service of the sockets.
+};
+
+#endif
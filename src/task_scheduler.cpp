@@ -0,0 +1,223 @@
+#ifdef __linux__
+#include <pthread.h>
+#elif defined(_WIN32)
+#include <windows.h>
+#endif
+#include <algorithm>
+#include "task_scheduler.hpp"
+
+thread_local const task_scheduler* task_scheduler::owner = nullptr;
+thread_local size_t task_scheduler::index = 0;
+
+task_scheduler::task_scheduler(const size_t num_threads, const bool pin) : deques(num_threads), num_pending(0), num_running(0), num_sleeping(0), next(0), stopping(false)
+{
+	const size_t num_cores = max<size_t>(thread::hardware_concurrency(), 1);
+	threads.reserve(num_threads);
+	for (size_t i = 0; i < num_threads; ++i)
+	{
+		threads.emplace_back([this, i]()
+		{
+			owner = this;
+			index = i;
+			function<void(void)> f;
+			while (true)
+			{
+				if (acquire(i, f))
+				{
+					execute(f);
+					continue;
+				}
+
+				// Sleep until a task is posted, or exit if the scheduler is stopping and idle, i.e. all the deques are empty and no task is running that may fork more.
+				unique_lock<mutex> lock(m);
+				++num_sleeping;
+				cv.wait(lock, [&]()
+				{
+					return num_pending || (stopping && !num_running);
+				});
+				--num_sleeping;
+				if (!num_pending) return;
+			}
+		});
+		if (pin)
+		{
+#ifdef __linux__
+			cpu_set_t cpus;
+			CPU_ZERO(&cpus);
+			CPU_SET(i % num_cores, &cpus);
+			pthread_setaffinity_np(threads.back().native_handle(), sizeof(cpus), &cpus);
+#elif defined(_WIN32)
+			SetThreadAffinityMask(threads.back().native_handle(), static_cast<DWORD_PTR>(1) << (i % min<size_t>(num_cores, sizeof(DWORD_PTR) << 3)));
+#endif
+		}
+	}
+}
+
+task_scheduler::~task_scheduler()
+{
+	if (threads.empty()) return;
+	{
+		lock_guard<mutex> guard(m);
+		stopping = true;
+	}
+	cv.notify_all();
+	for (auto& t : threads)
+	{
+		t.join();
+	}
+}
+
+void task_scheduler::post(function<void(void)>&& f)
+{
+	// Increment num_pending before pushing the task, so that it never underflows when a thief pops the task at once.
+	++num_pending;
+	task_deque& d = deques[owner == this ? index : next++ % deques.size()];
+	{
+		lock_guard<mutex> guard(d.m);
+		d.q.push_back(move(f));
+	}
+
+	// Take the lock of idle workers only if some worker is asleep. A worker increments num_sleeping before checking num_pending, so either it sees the new task or this thread sees it asleep.
+	if (num_sleeping)
+	{
+		lock_guard<mutex> guard(m);
+		cv.notify_one();
+	}
+}
+
+bool task_scheduler::run_one()
+{
+	if (!is_worker()) return false;
+	function<void(void)> f;
+	if (!acquire(index, f)) return false;
+	execute(f);
+	return true;
+}
+
+bool task_scheduler::is_worker() const
+{
+	return owner == this;
+}
+
+void task_scheduler::wait()
+{
+	{
+		lock_guard<mutex> guard(m);
+		stopping = true;
+	}
+	cv.notify_all();
+	for (auto& t : threads)
+	{
+		t.join();
+	}
+	threads.clear();
+	if (err) rethrow_exception(err);
+}
+
+bool task_scheduler::acquire(const size_t i, function<void(void)>& f)
+{
+	if (!num_pending) return false;
+	const size_t n = deques.size();
+	for (size_t k = 0; k < n; ++k)
+	{
+		const size_t j = (i + k) % n;
+		task_deque& d = deques[j];
+		lock_guard<mutex> guard(d.m);
+		if (d.q.empty()) continue;
+		if (j == i)
+		{
+			f = move(d.q.back());
+			d.q.pop_back();
+		}
+		else
+		{
+			f = move(d.q.front());
+			d.q.pop_front();
+		}
+		// Increment num_running before decrementing num_pending, so that the scheduler never appears idle while the task is in hand.
+		++num_running;
+		--num_pending;
+		return true;
+	}
+	return false;
+}
+
+void task_scheduler::execute(function<void(void)>& f)
+{
+	try
+	{
+		f();
+	}
+	catch (...)
+	{
+		lock_guard<mutex> guard(m);
+		if (!err) err = current_exception();
+	}
+	f = nullptr;
+
+	// Wake the sleeping workers once no task is running, so that they exit if the scheduler is stopping. A worker increments num_sleeping before checking num_running, so either it sees no task running or this thread sees it asleep.
+	if (!--num_running && num_sleeping)
+	{
+		lock_guard<mutex> guard(m);
+		cv.notify_all();
+	}
+}
+
+task_group::task_group(task_scheduler& s) : s(s), n(0)
+{
+}
+
+void task_group::run(function<void(void)>&& f)
+{
+	{
+		lock_guard<mutex> guard(m);
+		++n;
+	}
+	s.post(bind([this](function<void(void)>& f)
+	{
+		exception_ptr e;
+		try
+		{
+			f();
+		}
+		catch (...)
+		{
+			e = current_exception();
+		}
+
+		// Decrement n and notify under the lock, so that the group is not destroyed by a returning wait before this task releases it. Every completion is notified, so that a worker waiting for the group retries to execute pending tasks.
+		lock_guard<mutex> guard(m);
+		if (e && !err) err = e;
+		--n;
+		cv.notify_all();
+	}, move(f)));
+}
+
+void task_group::wait()
+{
+	unique_lock<mutex> lock(m);
+	if (s.is_worker())
+	{
+		// Execute pending tasks rather than block the worker, which may be the only one to execute the tasks of this group.
+		while (n)
+		{
+			lock.unlock();
+			const bool ran = s.run_one();
+			lock.lock();
+			if (!ran && n) cv.wait(lock);
+		}
+	}
+	else
+	{
+		cv.wait(lock, [&]()
+		{
+			return !n;
+		});
+	}
+	if (err)
+	{
+		const exception_ptr e = err;
+		err = nullptr;
+		rethrow_exception(e);
+	}
+}
@@ -0,0 +1,82 @@
+#pragma once
+#ifndef IDOCK_TASK_SCHEDULER_HPP
+#define IDOCK_TASK_SCHEDULER_HPP
+
+#include <deque>
+#include <vector>
+#include <thread>
+#include <atomic>
+#include <functional>
+#include <condition_variable>
+using namespace std;
+
+//! Represents a pool of worker threads, each of which owns a deque of tasks. A worker pops its own tasks from the back, and steals tasks from the front of the others' deques when its own is empty.
+class task_scheduler
+{
+public:
+	//! Creates a number of worker threads, optionally pinning worker i to logical core i modulo the number of cores, so that consecutive workers share a NUMA node.
+	explicit task_scheduler(const size_t num_threads, const bool pin = false);
+
+	//! Stops the worker threads if wait has not been called.
+	~task_scheduler();
+
+	//! Posts a task to the deque of the calling worker, or to the deques of all the workers in turn if called from another thread.
+	void post(function<void(void)>&& f);
+
+	//! Executes one pending task in the calling thread, and returns false if there is none.
+	bool run_one();
+
+	//! Returns true if the calling thread is a worker of this scheduler.
+	bool is_worker() const;
+
+	//! Waits for all the posted tasks and worker threads to complete, and propagates the first exception thrown by a task posted outside any task group, if any.
+	void wait();
+private:
+	//! Represents the deque of tasks of a worker.
+	struct task_deque
+	{
+		mutex m;
+		deque<function<void(void)>> q;
+	};
+
+	//! Pops a task from the back of deque i, or steals one from the front of another deque, and returns false if all the deques are empty.
+	bool acquire(const size_t i, function<void(void)>& f);
+
+	//! Executes a task, recording the exception it throws, if any.
+	void execute(function<void(void)>& f);
+
+	vector<task_deque> deques; //!< Task deques, one per worker.
+	vector<thread> threads; //!< Worker threads.
+	atomic<size_t> num_pending; //!< Number of tasks in all the deques.
+	atomic<size_t> num_running; //!< Number of tasks acquired and not yet completed.
+	atomic<size_t> num_sleeping; //!< Number of idle workers asleep or about to sleep.
+	atomic<size_t> next; //!< Deque to post the next task from outside the workers to.
+	mutex m; //!< Mutex guarding the sleep of idle workers.
+	condition_variable cv; //!< Condition variable to wake up idle workers.
+	bool stopping; //!< Whether the workers are to exit once the scheduler is idle, i.e. all the deques are empty and no task is running.
+	exception_ptr err; //!< First exception thrown by a task.
+	static thread_local const task_scheduler* owner; //!< Scheduler of the calling worker thread.
+	static thread_local size_t index; //!< Index of the calling worker thread.
+};
+
+//! Represents a group of tasks forked to a scheduler and joined by wait, replacing the init/increment/wait pattern of safe_counter.
+class task_group
+{
+public:
+	//! Constructs an empty group of tasks to run on a scheduler.
+	explicit task_group(task_scheduler& s);
+
+	//! Forks a task to the scheduler.
+	void run(function<void(void)>&& f);
+
+	//! Waits until all the forked tasks have completed, and rethrows the first exception thrown by them, if any. A worker thread executes pending tasks meanwhile rather than blocking.
+	void wait();
+private:
+	task_scheduler& s; //!< Scheduler to run the tasks.
+	size_t n; //!< Number of forked tasks yet to complete.
+	mutex m; //!< Mutex guarding n and err.
+	condition_variable cv; //!< Condition variable notified whenever a task completes.
+	exception_ptr err; //!< First exception thrown by a task.
+};
+
+#endif
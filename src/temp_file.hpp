@@ -0,0 +1,34 @@
+#pragma once
+#ifndef IDOCK_TEMP_FILE_HPP
+#define IDOCK_TEMP_FILE_HPP
+
+#include <string>
+#include <stdexcept>
+#include <boost/filesystem/operations.hpp>
+#include <boost/filesystem/fstream.hpp>
+using namespace std;
+using namespace boost::filesystem;
+
+//! Represents a temporary file holding bytes received over a connection, which is removed on destruction.
+class temp_file
+{
+public:
+	const path p; //!< Path of the file.
+
+	//! Writes bytes to a new temporary file.
+	explicit temp_file(const string& bytes) : p(temp_directory_path() / unique_path("idock-%%%%-%%%%-%%%%-%%%%"))
+	{
+		boost::filesystem::ofstream ofs(p, ios::binary);
+		ofs.write(bytes.data(), bytes.size());
+		if (!ofs) throw runtime_error("Failed to write temporary file " + p.string());
+	}
+
+	//! Removes the file.
+	~temp_file()
+	{
+		boost::system::error_code ec;
+		remove(p, ec);
+	}
+};
+
+#endif
@@ -0,0 +1,186 @@
+#include <iostream>
+#include <cmath>
+#include <numeric>
+#include <limits>
+#include <boost/asio/io_service.hpp>
+#include "random_forest.hpp"
+#include "cpu_backend.hpp"
+#include "message.hpp"
+#include "temp_file.hpp"
+#include "worker.hpp"
+
+worker::worker(const string& address, const size_t num_threads, const path& sf_cache_path) : host(address.substr(0, address.rfind(':'))), port(address.substr(address.rfind(':') + 1)), num_threads(num_threads), sf_cache_path(sf_cache_path)
+{
+}
+
+void worker::run()
+{
+	cout << "Connecting to coordinator " << host << ':' << port << endl;
+	boost::asio::io_service io;
+	tcp::socket sock(io);
+	boost::asio::connect(sock, tcp::resolver(io).resolve(tcp::resolver::query(host, port)));
+	string payload;
+	if (receive_message(sock, payload, numeric_limits<uint64_t>::max()) != message_setup) throw runtime_error("Unexpected message"); // The setup holds all the grid maps, and comes from the coordinator this worker connects to.
+
+	// Decode the setup, and store the receptor, its grid maps and the random forest in temporary files to parse and map them.
+	array<float, 3> center, size;
+	float granularity, brick_cap;
+	uint64_t seed, num_trees, num_tasks, num_bfgs_iterations, max_conformations, sf_samples;
+	uint8_t trilinear, precision;
+	string rec_bytes, maps_bytes, forest_bytes;
+	{
+		message_reader r(payload);
+		r.get(rec_bytes);
+		r.get(center);
+		r.get(size);
+		r.get(granularity);
+		r.get(seed);
+		r.get(num_trees);
+		r.get(num_tasks);
+		r.get(num_bfgs_iterations);
+		r.get(max_conformations);
+		r.get(trilinear);
+		r.get(brick_cap);
+		r.get(precision);
+		r.get(sf_samples);
+		r.get(maps_bytes);
+		r.get(forest_bytes);
+	}
+	payload.clear();
+	const temp_file rec_file(rec_bytes);
+	const temp_file maps_file(maps_bytes);
+	const temp_file forest_file(forest_bytes);
+	rec_bytes.clear();
+	maps_bytes.clear();
+	forest_bytes.clear();
+
+	cout << "Creating a task scheduler of " << num_threads << " worker threads" << endl;
+	task_scheduler ts(num_threads);
+
+	// Precalculate the type pairs of the scoring function claimed in parallel.
+	scoring_function sf(sf_cache_path, sf_samples);
+	const auto precalculate_pairs = [&](const vector<array<size_t, 2>>& pairs)
+	{
+		task_group tg(ts);
+		for (const auto& p : pairs)
+		{
+			tg.run([&, p]()
+			{
+				sf.precalculate(p[0], p[1]);
+			});
+		}
+		tg.wait();
+	};
+	if (sf.mapped)
+	{
+		cout << "Mapping a precalculated scoring function from " << sf_cache_path << endl;
+	}
+	else if (!sf_cache_path.empty())
+	{
+		cout << "Precalculating a scoring function of " << scoring_function::n << " atom types in parallel" << endl;
+		array<bool, scoring_function::n> all_types;
+		all_types.fill(true);
+		precalculate_pairs(sf.claim(all_types, all_types));
+		cout << "Saving the precalculated scoring function to " << sf_cache_path << endl;
+		if (!sf.save(sf_cache_path))
+		{
+			cerr << "Failed to save scoring function cache " << sf_cache_path << endl;
+		}
+	}
+	else
+	{
+		// The grid maps are received complete, so only the type pairs within the ligands are looked up.
+		cout << "Precalculating a scoring function of " << sf.ns << " samples per unit squared distance for the atom type pairs looked up" << endl;
+	}
+
+	cout << "Mapping the receptor and its grid maps received from the coordinator" << endl;
+	receptor rec(rec_file.p, center, size, granularity, brick_cap, static_cast<map_precision>(precision));
+	if (!rec.map(maps_file.p, sf)) throw runtime_error("Grid maps received from the coordinator do not match the receptor");
+	vector<size_t> xs(sf.n);
+	iota(xs.begin(), xs.end(), 0);
+	rec.quantize(xs);
+	forest f(num_trees, seed);
+	if (!f.load(forest_file.p)) throw runtime_error("Random forest received from the coordinator does not match the seed and the number of trees");
+	const cpu_backend cpu(ts, num_threads, num_tasks, num_bfgs_iterations, seed, sf, rec, trilinear);
+
+	// Pull batches until the coordinator is done. The coordinator closes the connections of workers still docking copies of batches once it is done, which ends them as done too.
+	size_t num_ligands = 0;
+	string result; // Payload of the result of the last batch, sent along with the next request.
+	while (true)
+	{
+		message_type type;
+		try
+		{
+			if (!result.empty()) send_message(sock, message_result, result);
+			send_message(sock, message_request, string());
+			type = receive_message(sock, payload);
+		}
+		catch (const boost::system::system_error& e)
+		{
+			if (e.code() != boost::asio::error::eof && e.code() != boost::asio::error::broken_pipe && e.code() != boost::asio::error::connection_reset) throw;
+			type = message_done;
+		}
+		if (type == message_done)
+		{
+			cout << "Docked " << num_ligands << " ligands" << endl;
+			if (rec.num_quantized_values)
+			{
+				cout << "Quantized " << rec.num_quantized_values << " grid map values to " << map_precision_name(rec.precision) << " with a maximum error of " << rec.max_quantization_error << " and an RMS error of " << sqrt(rec.sum_squared_quantization_errors / rec.num_quantized_values) << " against float32" << endl;
+			}
+			break;
+		}
+		if (type != message_batch) throw runtime_error("Unexpected message");
+
+		// Parse the ligands of the batch, reporting a ligand that fails to parse to the coordinator, which aborts the run.
+		message_reader r(payload);
+		uint64_t id, n;
+		r.get(id);
+		r.get(n);
+		ligand_batch bat(num_tasks);
+		try
+		{
+			for (size_t i = 0; i < n; ++i)
+			{
+				uint64_t lid;
+				string filename, pdbqt;
+				r.get(lid);
+				r.get(filename);
+				r.get(pdbqt);
+				bat.push_back(ligand(filename, pdbqt.data(), pdbqt.data() + pdbqt.size()), lid);
+			}
+		}
+		catch (const exception& e)
+		{
+			send_message(sock, message_error, e.what());
+			throw;
+		}
+
+		// Precalculate the type pairs within the ligands of the batch that no earlier batch has claimed.
+		array<bool, scoring_function::n> batch_types;
+		for (size_t t = 0; t < sf.n; ++t)
+		{
+			batch_types[t] = bat.uses(t);
+		}
+		precalculate_pairs(sf.claim(batch_types, batch_types));
+
+		// Dock the batch, and write the conformations of each ligand into its pose record.
+		vector<float> cnfh(bat.get_cnf_elems());
+		vector<pose_record> poses(bat.size());
+		cpu.dock(bat, cnfh.data(), [&](const size_t l)
+		{
+			bat.ligands[l].write(cnfh.data() + bat.cnf_offsets[l], max_conformations, num_tasks, rec, f, sf, poses[l]);
+		});
+
+		// Return the conformations along with the next request.
+		result.clear();
+		put(result, id);
+		put(result, n);
+		for (size_t l = 0; l < bat.size(); ++l)
+		{
+			put(result, bat.ligands[l].filename.string());
+			put(result, poses[l]);
+		}
+		num_ligands += n;
+	}
+	ts.wait();
+}
@@ -0,0 +1,27 @@
+#pragma once
+#ifndef IDOCK_WORKER_HPP
+#define IDOCK_WORKER_HPP
+
+#include <string>
+#include <boost/filesystem/path.hpp>
+using namespace std;
+using namespace boost::filesystem;
+
+//! Represents a worker of a distributed run, which receives the receptor, its grid maps of all atom types, the random forest and the docking parameters from a coordinator, then repeatedly pulls a batch of ligands, docks it on its own threads and returns the conformations.
+//! Ligands are keyed by their index in the input of the coordinator, so every ligand is docked exactly as a standalone run would dock it, whichever worker docks it.
+class worker
+{
+public:
+	//! Constructs a worker of a coordinator at an address of the form host:port, which docks on num_threads threads and maps or creates a scoring function cache file if any.
+	explicit worker(const string& address, const size_t num_threads, const path& sf_cache_path);
+
+	//! Connects to the coordinator and docks batches until it is done. Throws on errors of the connection and of the setup.
+	void run();
+private:
+	const string host; //!< Host of the coordinator.
+	const string port; //!< Port of the coordinator.
+	const size_t num_threads; //!< Number of docking threads.
+	const path sf_cache_path; //!< Scoring function cache file to map or create.
+};
+
+#endif
@@ -6,6 +6,7 @@
 #include <boost/filesystem/path.hpp>
 #include <boost/filesystem/operations.hpp>
 #include <boost/filesystem/fstream.hpp>
+#include "text_reader.hpp"
 
 using std::string;
 using std::vector;
@@ -13,58 +14,42 @@ using boost::lexical_cast;
 using boost::filesystem::path;
 using boost::filesystem::directory_iterator;
 using boost::filesystem::is_directory;
-using boost::filesystem::ifstream;
-using boost::filesystem::ofstream;
 
+//! Represents a line of a log.csv, and the offset of the comma ending its ligand.
 class record
 {
 public:
-	string line;
-	string slice;
+	line_view line;
 	size_t comma;
-	double energy;
-
-	explicit record(string&& line_, const string& slice) : line(static_cast<string&&>(line_)), slice(slice), comma(line.find_first_of(',', 12)), energy(lexical_cast<double>(line.substr(comma + 3, line.find_first_of(',', comma + 8) - comma - 3))) {}
-
-	record(const record&) = default;
-	record(record&&) = default;
-	record& operator=(const record&) = default;
-	record& operator=(record&&) = default;
 };
 
-inline bool operator<(const record& a, const record& b)
-{
-	return a.energy < b.energy;
-}
-
-inline bool starts_with(const string& str, const string& start)
+//! Parses the records of a log.csv into a sorted run, keeping only the best k if k is nonzero.
+vector<ranked<record>> parse_log(const mapped_text& log, const size_t k)
 {
-	const size_t start_size = start.size();
-	if (str.size() < start_size) return false;
-	for (size_t i = 0; i < start_size; ++i)
+	top_k<record> run(k);
+	size_t ordinal = 0;
+	for_each_line(log.begin(), log.end(), [&](const line_view& line)
 	{
-		if (str[i] != start[i]) return false;
-	}
-	return true;
+		if (ordinal++ && line.size()) // Filter out header line.
+		{
+			const size_t comma = line.find(',', 12);
+			if (comma == string::npos) throw runtime_error("Invalid record " + line.str());
+			run.push({ parse_decimal(line.substr(comma + 3, line.find(',', comma + 8))), ordinal, { line, comma } });
+		}
+		return true;
+	});
+	return run.sorted();
 }
 
-class property
-{
-public:
-	string line;
-	string id;
-
-	explicit property(string&& line_) : line(static_cast<string&&>(line_)), id(line.substr(4, 8)) {}
-};
-
-inline size_t binary(const vector<property>& properties, const string& id)
+//! Returns the index of the last property whose id is not greater than a given id, or 0 if there is none.
+inline size_t binary(const vector<line_view>& ids, const line_view& id)
 {
 	size_t s = 0;
-	size_t e = properties.size();
+	size_t e = ids.size();
 	while (s + 1 < e)
 	{
 		const size_t mid = (s + e) / 2;
-		if (id < properties[mid].id)
+		if (id < ids[mid])
 		{
 			e = mid;
 		}
@@ -78,9 +63,9 @@ inline size_t binary(const vector<property>& properties, const string& id)
 
 int main(int argc, char* argv[])
 {
-	if (argc != 5)
+	if (argc != 5 && argc != 6)
 	{
-		std::cout << "combinelog slices_folder prefix 16_prop_350.xls out.csv\n";
+		std::cout << "combinelog slices_folder prefix 16_prop_350.xls out.csv [num_records]\n";
 		return 1;
 	}
 
@@ -88,72 +73,84 @@ int main(int argc, char* argv[])
 	const string prefix = argv[2];
 	const path prop = argv[3];
 	const path output_csv = argv[4];
+	const size_t k = argc == 6 ? lexical_cast<size_t>(argv[5]) : 0;
 
-	string line;
-	line.reserve(600);
-
-	std::cout << "Reading log.csv's." << std::endl;
-	vector<record> records;
-	records.reserve(80000);
+	// Find the slice folders, in order of their names so that ties are merged deterministically.
+	vector<path> slice_paths;
 	const directory_iterator end_dir_iter;
 	for (directory_iterator dir_iter(slices); dir_iter != end_dir_iter; ++dir_iter)
 	{
 		if (!is_directory(dir_iter->status())) continue; // Find example directories.
 		const path slice_path = dir_iter->path();
-		const string fullslice = slice_path.filename().string();
-		if (!starts_with(fullslice, prefix)) continue;
-		std::cout << fullslice << '\n';
-		const string slice = fullslice.substr(6);
-		ifstream log(slice_path / "log.csv");
-		getline(log, line); // Filter out header line.
-		while (getline(log, line))
-		{
-			records.push_back(record(static_cast<string&&>(line), slice));
-		}
+		if (slice_path.filename().string().compare(0, prefix.size(), prefix)) continue;
+		slice_paths.push_back(slice_path);
 	}
-
-	const size_t num_records = records.size();
-	std::cout << "Sorting " << num_records << " records." << std::endl;
-	std::sort(records.begin(), records.end());
-
+	sort(slice_paths.begin(), slice_paths.end());
+
+	// Map and parse the log.csv's in parallel, each into a run sorted by free energy.
+	std::cout << "Reading " << slice_paths.size() << " log.csv's." << std::endl;
+	vector<unique_ptr<mapped_text>> logs(slice_paths.size());
+	vector<vector<ranked<record>>> runs(slice_paths.size());
+	vector<string> slice_names(slice_paths.size());
+	parallel_for(slice_paths.size(), [&](const size_t i)
+	{
+		slice_names[i] = slice_paths[i].filename().string().substr(6);
+		logs[i].reset(new mapped_text(slice_paths[i] / "log.csv"));
+		runs[i] = parse_log(*logs[i], k);
+	});
+	size_t num_records = 0;
+	for (const auto& run : runs) num_records += run.size();
+	std::cout << "Merging " << num_records << " records." << std::endl;
+
+	// Map the property xls file, and index its lines in parallel chunks. The lines are sorted by id.
 	std::cout << "Reading property xls file " << prop << '.' << std::endl;
-	vector<property> properties;
-	properties.reserve(7220928); // Number of molecules in 16_prop_350.xls
-	ifstream xls(prop);
-	getline(xls, line); // Filter out header line.
-	while (getline(xls, line))
+	const mapped_text xls(prop);
+	const vector<const char*> bounds = split_lines(xls.begin(), xls.end(), num_workers() * 4);
+	vector<vector<line_view>> chunks(bounds.size() - 1);
+	parallel_for(chunks.size(), [&](const size_t i)
 	{
-		properties.push_back(property(static_cast<string&&>(line)));
+		for_each_line(bounds[i], bounds[i + 1], [&](const line_view& line)
+		{
+			if (line.size()) chunks[i].push_back(line);
+			return true;
+		});
+	});
+	vector<line_view> properties, ids;
+	for (const auto& c : chunks)
+	{
+		properties.insert(properties.end(), c.begin() + (&c == &chunks.front() && c.size()), c.end()); // Filter out header line.
 	}
-	xls.close();
+	ids.reserve(properties.size());
+	for (const auto& p : properties) ids.push_back(p.substr(4, 12));
 	std::cout << properties.size() << " records in prop xls file." << std::endl;
 
+	// Merge the sorted runs, streaming each record with its properties to the combined csv.
 	std::cout << "Writing combined csv to " << output_csv << std::endl;
-	ofstream csv(output_csv);
+	boost::filesystem::ofstream csv(output_csv);
 	csv << "Slice,Ligand,Conf,FE1,HB1,FE2,HB2,FE3,HB3,FE4,HB4,FE5,HB5,FE6,HB6,FE7,HB7,FE8,HB8,FE9,HB9,HA,MWT,LogP,Desolv_apolar,Desolv_polar,HBD,HBA,tPSA,Charge,NRB,SMILES\n";
-	size_t s, e, num_not_found = 0;
-	for (size_t i = 0; i < num_records; ++i)
+	size_t num_not_found = 0;
+	merge_runs(runs, k, [&](const ranked<record>& rr, const size_t run)
 	{
-		const record& r = records[i];
-		const string id = r.line.substr(4, 8);
-		csv << r.slice << ',' << id << ',' << r.line.substr(r.comma + 1);
-		const property& p = properties[binary(properties, id)];
-		if (id != p.id)
+		const record& r = rr.value;
+		const line_view id = r.line.substr(4, 12);
+		csv << slice_names[run] << ',' << id << ',' << r.line.substr(r.comma + 1, r.line.size());
+		const size_t i = binary(ids, id);
+		if (ids.empty() || !(id == ids[i]))
 		{
-			//std::cerr << id << ' '  << p.id;
 			++num_not_found;
 			csv << ",,,,,,,,,,,,,,,,,,,\n";
-			continue;
+			return;
 		}
-		s = 13;
+		const line_view& p = properties[i];
+		size_t s = 13, e;
 		for (size_t j = 0; j < 10; ++j) // 9 properties, i.e. HA,MWT,LogP,Desolv_apolar,Desolv_polar,HBD,HBA,tPSA,Charge,NRB
 		{
-			e = p.line.find_first_of('\t', s + 1);
-			csv << ',' << p.line.substr(s, e - s);
+			e = min(p.find('\t', s + 1), p.size());
+			csv << ',' << p.substr(s, e);
 			s = e + 1;
 		}
-		csv << ',' << p.line.substr(s) << '\n'; // SMILES
-	}
+		csv << ',' << p.substr(s, p.size()) << '\n'; // SMILES
+	});
 	csv.close();
 	std::cout << num_not_found << " records in log.csv's but not in prop xls file." << std::endl;
 
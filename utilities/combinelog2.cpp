@@ -6,6 +6,7 @@
 #include <boost/filesystem/path.hpp>
 #include <boost/filesystem/operations.hpp>
 #include <boost/filesystem/fstream.hpp>
+#include "text_reader.hpp"
 
 using std::cout;
 using std::string;
@@ -13,91 +14,90 @@ using std::vector;
 using boost::lexical_cast;
 using boost::filesystem::path;
 using boost::filesystem::directory_iterator;
-using boost::filesystem::is_directory;
-using boost::filesystem::ifstream;
-using boost::filesystem::ofstream;
+using boost::filesystem::is_regular_file;
 
-class record
+//! Parses the records of a log.csv into a sorted run, keeping only the best k if k is nonzero, and returns whether the log has HB columns.
+bool parse_log(const mapped_text& log, const size_t k, vector<ranked<line_view>>& records)
 {
-public:
-	string line;
-	double energy;
-	bool hb;
-
-	explicit record(string&& line_, const bool hb) : line(static_cast<string&&>(line_)), hb(hb)
+	top_k<line_view> run(k);
+	size_t ordinal = 0;
+	bool hb = false;
+	for_each_line(log.begin(), log.end(), [&](const line_view& line)
 	{
-		const auto comma = line.find(',', 12);
-		energy = lexical_cast<double>(line.substr(comma + 1, line.find(',', comma + 7) - comma - 1));
-	}
-
-	record(const record&) = default;
-	record(record&&) = default;
-	record& operator=(const record&) = default;
-	record& operator=(record&&) = default;
-};
-
-inline bool operator<(const record& a, const record& b)
-{
-	return a.energy < b.energy;
+		if (!ordinal++)
+		{
+			hb = line.size() == 156; // Header line.
+		}
+		else if (line.size())
+		{
+			const size_t comma = line.find(',', 12);
+			if (comma == string::npos) throw runtime_error("Invalid record " + line.str());
+			run.push({ parse_decimal(line.substr(comma + 1, line.find(',', comma + 7))), ordinal, line });
+		}
+		return true;
+	});
+	records = run.sorted();
+	return hb;
 }
 
 int main(int argc, char* argv[])
 {
-	if (argc != 3)
+	if (argc != 3 && argc != 4)
 	{
-		std::cout << "combinelog logs_folder out.csv\n";
+		std::cout << "combinelog2 logs_folder out.csv [num_records]\n";
 		return 1;
 	}
+	const size_t k = argc == 4 ? lexical_cast<size_t>(argv[3]) : 0;
 
-	string line;
-	line.reserve(600);
-
-	std::cout << "Reading log.csv's." << std::endl;
-	vector<record> records;
-	records.reserve(7220836);
+	// Find the log.csv's, in order of their names so that ties are merged deterministically.
+	vector<path> log_paths;
 	const directory_iterator end_dir_iter;
 	for (directory_iterator dir_iter(argv[1]); dir_iter != end_dir_iter; ++dir_iter)
 	{
-		const path log_path = dir_iter->path();
-		std::cout << log_path << '\n';
-		ifstream log(log_path);
-		getline(log, line); // Header line.
-		const auto hb = line.size() == 156;
-		while (getline(log, line))
-		{
-			records.push_back(record(static_cast<string&&>(line), hb));
-		}
+		if (is_regular_file(dir_iter->status())) log_paths.push_back(dir_iter->path());
 	}
+	sort(log_paths.begin(), log_paths.end());
 
-	const size_t num_records = records.size();
-	std::cout << "Sorting " << num_records << " records." << std::endl;
-	std::sort(records.begin(), records.end());
+	// Map and parse the log.csv's in parallel, each into a run sorted by free energy.
+	std::cout << "Reading " << log_paths.size() << " log.csv's." << std::endl;
+	vector<unique_ptr<mapped_text>> logs(log_paths.size());
+	vector<vector<ranked<line_view>>> runs(log_paths.size());
+	vector<char> hbs(log_paths.size());
+	parallel_for(log_paths.size(), [&](const size_t i)
+	{
+		logs[i].reset(new mapped_text(log_paths[i]));
+		hbs[i] = parse_log(*logs[i], k, runs[i]);
+	});
+	size_t num_records = 0;
+	for (const auto& run : runs) num_records += run.size();
+	std::cout << "Merging " << num_records << " records." << std::endl;
 
+	// Merge the sorted runs, streaming each record to the combined csv with empty HB columns if its log has none.
 	std::cout << "Writing combined csv\n";
-	ofstream csv(argv[2]);
+	boost::filesystem::ofstream csv(argv[2]);
 	csv << "Slice,Ligand,Conf,FE1,HB1,FE2,HB2,FE3,HB3,FE4,HB4,FE5,HB5,FE6,HB6,FE7,HB7,FE8,HB8,FE9,HB9,MWT,LogP,Desolv_apolar,Desolv_polar,HBD,HBA,tPSA,Charge,NRB,SMILES\n";
-	for (size_t i = 0; i < num_records; ++i)
+	merge_runs(runs, k, [&](const ranked<line_view>& r, const size_t run)
 	{
-		const record& r = records[i];
-		if (r.hb)
+		const line_view& line = r.value;
+		if (hbs[run])
 		{
-			csv << r.line;
+			csv << line;
 		}
 		else
 		{
-			size_t s = r.line[12] == ',' ? 13 : 14;
-			csv << r.line.substr(0, s);
+			size_t s = line.b[12] == ',' ? 13 : 14;
+			csv << line.substr(0, s);
 			size_t e;
 			for (size_t j = 0; j < 9; ++j) // 9 properties, i.e. MWT,LogP,Desolv_apolar,Desolv_polar,HBD,HBA,tPSA,Charge,NRB
 			{
-				e = r.line.find(',', s);
-				csv << r.line.substr(s, e - s) << ",,";
+				e = min(line.find(',', s), line.size());
+				csv << line.substr(s, e) << ",,";
 				s = e + 1;
 			}
-			csv << r.line.substr(s);
+			csv << line.substr(s, line.size());
 		}
 		csv << '\n';
-	}
+	});
 	csv.close();
 
 	return 0;
@@ -1,14 +1,14 @@
 #include <iostream>
 #include <string>
+#include <set>
 #include <boost/lexical_cast.hpp>
 #include <boost/filesystem/path.hpp>
-#include <boost/filesystem/fstream.hpp>
 #include <boost/filesystem/operations.hpp>
+#include "text_reader.hpp"
 
 using std::string;
 using boost::lexical_cast;
 using boost::filesystem::path;
-using boost::filesystem::ifstream;
 
 int main(int argc, char* argv[])
 {
@@ -20,22 +20,42 @@ int main(int argc, char* argv[])
 
 	const path examples = argv[1];
 	const size_t num_elitists = lexical_cast<size_t>(argv[2]);
+	if (!num_elitists) return 0;
 
 	const string output = "output";
 	const string pdbqtext = ".pdbqt";
-	string line;
-	line.reserve(600);
 
-	ifstream log(examples / "log.csv");
-	getline(log, line); // Filter out header line.
-	for (size_t i = 0; i < num_elitists; ++i)
+	// Stream the combined log.csv, keeping the records of the lowest FE1 in a bounded heap, so that it need not be sorted or held in memory.
+	const mapped_text log(examples / "log.csv");
+	top_k<line_view> elitists(num_elitists);
+	size_t ordinal = 0;
+	for_each_line(log.begin(), log.end(), [&](const line_view& line)
 	{
-		getline(log, line);
-		const size_t comma = line.find_first_of(',', 1);
-		const path ligand = "ZINC" + line.substr(comma + 1, 8) + pdbqtext;
-		if (exists(ligand)) continue; // If this ligand has been extracted, no action is needed.
-		const string slice = "16_p0." + line.substr(0, comma);
-		copy(examples / slice / output / ligand, ligand); // Copy the elite ligand to the current working directory.
+		if (ordinal++ && line.size()) // Filter out header line.
+		{
+			size_t comma = line.find(',', 1);
+			for (size_t j = 0; j < 2 && comma != string::npos; ++j) comma = line.find(',', comma + 1); // Skip Slice, Ligand and Conf to FE1.
+			if (comma == string::npos) throw runtime_error("Invalid record " + line.str());
+			elitists.push({ parse_decimal(line.substr(comma + 1, line.find(',', comma + 1))), ordinal, line });
+		}
+		return true;
+	});
+
+	// Copy the elite ligands to the current working directory in parallel, once each.
+	vector<line_view> lines;
+	std::set<path> ligands;
+	for (const auto& r : elitists.sorted())
+	{
+		const size_t comma = r.value.find(',', 1);
+		if (ligands.insert("ZINC" + r.value.substr(comma + 1, comma + 9).str() + pdbqtext).second) lines.push_back(r.value);
 	}
+	parallel_for(lines.size(), [&](const size_t i)
+	{
+		const size_t comma = lines[i].find(',', 1);
+		const path ligand = "ZINC" + lines[i].substr(comma + 1, comma + 9).str() + pdbqtext;
+		if (exists(ligand)) return; // If this ligand has been extracted, no action is needed.
+		const string slice = "16_p0." + lines[i].substr(0, comma).str();
+		copy_file(examples / slice / output / ligand, ligand); // Copy the elite ligand to the current working directory.
+	});
 	return 0;
 }
@@ -3,12 +3,11 @@
 #include <boost/lexical_cast.hpp>
 #include <boost/filesystem/path.hpp>
 #include <boost/filesystem/fstream.hpp>
+#include "../src/pose_file.hpp"
 
 using std::string;
 using boost::lexical_cast;
 using boost::filesystem::path;
-using boost::filesystem::ifstream;
-using boost::filesystem::ofstream;
 
 inline bool starts_with(const string& str, const string& start)
 {
@@ -25,19 +24,53 @@ int main(int argc, char* argv[])
 {
 	if (argc != 3)
 	{
-		std::cout << "extractmodel models.pdbqt model\n";
+		std::cout << "extractmodel models.pdbqt model\n"
+		          << "extractmodel models.poses model, where model 0 regenerates all the models\n";
 		return 1;
 	}
 
 	const path models = argv[1];
 	const size_t model = lexical_cast<size_t>(argv[2]);
+
+	// Regenerate PDBQT from a binary pose file, numbering models across its records as idock does in a PDBQT shard file.
+	if (models.extension() == ".poses")
+	{
+		boost::filesystem::ifstream in(models, std::ios::binary);
+		char magic[sizeof(pose_file_magic)];
+		if (!in.read(magic, sizeof(magic)) || memcmp(magic, pose_file_magic, sizeof(magic)))
+		{
+			std::cerr << models << " is not a binary pose file\n";
+			return 1;
+		}
+		boost::filesystem::ofstream out(models.stem().string() + ".pdbqt", std::ios::binary);
+		pose_record pose;
+		string buf;
+		for (size_t serial = 0; pose.decode(in);)
+		{
+			for (size_t k = 0; k < pose.affinities.size(); ++k)
+			{
+				if (model && ++serial != model) continue;
+				buf.clear();
+				if (!model) buf.append("MODEL        " + lexical_cast<string>(++serial) + '\n');
+				buf.append("REMARK  Name = " + pose.name + "\nREMARK       NORMALIZED FREE ENERGY PREDICTED BY IDOCK:");
+				append_float(buf, pose.affinities[k], 8);
+				buf.append(" KCAL/MOL\n");
+				pose.conformation(k, buf);
+				if (!model) buf.append("ENDMDL\n");
+				out.write(buf.data(), buf.size());
+				if (model) return 0;
+			}
+		}
+		return 0;
+	}
+
 	const string model_start = "MODEL        " + lexical_cast<string>(model);
 	const string model_end = "ENDMDL";
 
 	string line;
-	ofstream out(models.filename());
-	ifstream in(models);
-	while (getline(in, line) && !starts_with(line, model_start));
+	boost::filesystem::ofstream out(models.filename());
+	boost::filesystem::ifstream in(models);
+	while (getline(in, line) && !(starts_with(line, model_start) && line.find_first_not_of(" \r", model_start.size()) == string::npos));
 	while (getline(in, line) && !starts_with(line, model_end))
 	{
 		out << line << '\n';
@@ -3,11 +3,11 @@
 #include <vector>
 #include <fstream>
 #include <string>
-#include <boost/lexical_cast.hpp>
-#include <boost/ptr_container/ptr_vector.hpp>
 #include <boost/filesystem.hpp>
 #include <boost/filesystem/fstream.hpp>
 #include <boost/filesystem/operations.hpp>
+#include "../src/pose_file.hpp"
+#include "text_reader.hpp"
 
 using namespace std;
 using namespace boost;
@@ -15,37 +15,18 @@ using namespace boost::filesystem;
 
 typedef double fl;
 
-/// Returns true if a string starts with another string.
-inline bool starts_with(const string& str, const string& start)
-{
-	const size_t start_size = start.size();
-	if (str.size() < start_size) return false;
-	for (size_t i = 0; i < start_size; ++i)
-	{
-		if (str[i] != start[i]) return false;
-	}
-	return true;
-}
-
-template<typename T>
-T right_cast(const string& str, const size_t i, const size_t j)
-{
-	const size_t start = str.find_first_not_of(' ', i - 1);
-	return lexical_cast<T>(str.substr(start, j - start));
-}
-
 class summary
 {
 public:
-	const path filename;
-	const vector<fl> energies;
+	path filename;
+	vector<fl> energies;
 	explicit summary(const path& filename, const vector<fl>& energies) : filename(filename), energies(energies) {}
 };
 
-/// For sorting ptr_vector<summary>.
+/// For sorting summaries, those without energies last.
 inline bool operator<(const summary& a, const summary& b)
 {
-	return a.energies.front() < b.energies.front();
+	return !a.energies.empty() && (b.energies.empty() || a.energies.front() < b.energies.front());
 }
 
 int main(int argc, char* argv[])
@@ -56,34 +37,71 @@ int main(int argc, char* argv[])
 		return 1;
 	}
 
-	ptr_vector<summary> summaries;
-	summaries.reserve(10000);
-	vector<fl> energies;
-	energies.reserve(9);
-	string line;
+	// Collect the files, skipping non-regular files such as folders.
+	vector<path> paths;
 	using boost::filesystem::directory_iterator;
 	const directory_iterator end_dir_iter; // A default constructed directory_iterator acts as the end iterator.
 	for (directory_iterator dir_iter(argv[1]); dir_iter != end_dir_iter; ++dir_iter)
 	{
-		// Skip non-regular files such as folders.
-		if (!boost::filesystem::is_regular_file(dir_iter->status())) continue;
-		const path p = dir_iter->path();
-		boost::filesystem::fstream in(p);
-		while (getline(in, line))
+		if (boost::filesystem::is_regular_file(dir_iter->status())) paths.push_back(dir_iter->path());
+	}
+
+	// Summarize the files in parallel.
+	vector<vector<summary>> file_summaries(paths.size());
+	parallel_for(paths.size(), [&](const size_t i)
+	{
+		const path p = canonical(paths[i]);
+		vector<summary>& summaries = file_summaries[i];
+
+		// A binary pose file holds the affinities of many ligands.
+		if (p.extension() == ".poses")
 		{
-			if (starts_with(line, "REMARK VINA RESULT:"))
+			boost::filesystem::ifstream in(p, std::ios::binary);
+			char magic[sizeof(pose_file_magic)];
+			if (!in.read(magic, sizeof(magic)) || memcmp(magic, pose_file_magic, sizeof(magic))) return;
+			pose_record pose;
+			while (pose.decode(in))
 			{
-				energies.push_back(right_cast<fl>(line, 20, 29));
+				summaries.emplace_back(p.string() + ':' + pose.name, vector<fl>(pose.affinities.cbegin(), pose.affinities.cend()));
 			}
-			else if (starts_with(line, "REMARK       NORMALIZED FREE ENERGY PREDICTED BY IDOCK:"))
+			return;
+		}
+
+		// A PDBQT shard file holds the models of many ligands, each preceded by a REMARK Name record.
+		const mapped_text in(p);
+		vector<fl> energies;
+		energies.reserve(9);
+		string name;
+		for_each_line(in.begin(), in.end(), [&](const line_view& line)
+		{
+			if (line.starts_with("REMARK  Name = "))
 			{
-				energies.push_back(right_cast<fl>(line, 56, 63));
+				const string next = line.substr(15, line.size()).trim().str();
+				if (next != name && !energies.empty())
+				{
+					summaries.emplace_back(p.string() + ':' + name, energies);
+					energies.clear();
+				}
+				name = next;
 			}
-		}
-		summaries.push_back(new summary(canonical(p), energies));
-		energies.clear();
+			else if (line.starts_with("REMARK VINA RESULT:"))
+			{
+				energies.push_back(parse_decimal(line.substr(19, 29)));
+			}
+			else if (line.starts_with("REMARK       NORMALIZED FREE ENERGY PREDICTED BY IDOCK:"))
+			{
+				energies.push_back(parse_decimal(line.substr(55, 63)));
+			}
+			return true;
+		});
+		summaries.emplace_back(name.empty() ? p : path(p.string() + ':' + name), energies);
+	});
+	vector<summary> summaries;
+	for (auto& fs : file_summaries)
+	{
+		move(fs.begin(), fs.end(), back_inserter(summaries));
 	}
-	summaries.sort();
+	stable_sort(summaries.begin(), summaries.end());
 	cout << "ligand,no. of conformations";
 	for (size_t i = 1; i <= 9; ++i)
 	{
@@ -5,8 +5,11 @@
 #include <algorithm>
 #include <vector>
 #include <fstream>
+#include <sstream>
 #include <limits>
 #include <cassert>
+#include <boost/filesystem/path.hpp>
+#include "text_reader.hpp"
 using namespace std;
 
 class atom
@@ -24,7 +27,7 @@ public:
 	size_t xs;
 
 	// Constructs an atom from an ATOM/HETATM line in PDBQT format.
-	explicit atom(const string& line);
+	explicit atom(const line_view& line);
 
 	/// Returns true if the AutoDock4 atom type is not supported.
 	bool ad_unsupported() const;
@@ -189,13 +192,13 @@ const array<size_t, atom::n> atom::ad_to_xs =
 	14, // 30 = Cs -> Met_D = 14, Metal, hydrogen bond donor.
 };
 
-atom::atom(const string& line) :
-	ad(find(ad_strings.cbegin(), ad_strings.cend(), line.substr(77, isspace(line[78]) ? 1 : 2)) - ad_strings.cbegin()),
-	xs(ad_to_xs[ad])
+atom::atom(const line_view& line) :
+	ad(find_if(ad_strings.cbegin(), ad_strings.cend(), [&line](const string& s) { return line.substr(77, 79).trim() == s.c_str(); }) - ad_strings.cbegin()),
+	xs(ad < n ? ad_to_xs[ad] : n)
 {
-	coord[0] = stof(line.substr(30, 8));
-	coord[1] = stof(line.substr(38, 8));
-	coord[2] = stof(line.substr(46, 8));
+	coord[0] = static_cast<float>(parse_decimal(line.substr(30, 38)));
+	coord[1] = static_cast<float>(parse_decimal(line.substr(38, 46)));
+	coord[2] = static_cast<float>(parse_decimal(line.substr(46, 54)));
 }
 
 /// Returns true if the AutoDock4 atom type is not supported.
@@ -252,8 +255,8 @@ inline bool is_hbacceptor(const size_t t)
 class ligand : public vector<atom>
 {
 public:
-	/// Load current ligand from an ifstream
-	explicit ligand(istream& ifs);
+	/// Load current ligand from the PDBQT text [b, e).
+	explicit ligand(const char* b, const char* e);
 
 	/// Ligand properties.
 	size_t num_hydrogens;
@@ -278,7 +281,7 @@ public:
 	explicit frame(const size_t parent, const size_t rotorYidx) : parent(parent), rotorYidx(rotorYidx) {}
 };
 
-ligand::ligand(istream& ifs) : num_hydrogens(0), num_hydrogen_bond_donors(0), num_hydrogen_bond_acceptors(0), num_active_torsions(0), num_inactive_torsions(0), molecular_weight(0), mn(3, numeric_limits<float>::max()), mx(3, numeric_limits<float>::lowest()), sz(3)
+ligand::ligand(const char* b, const char* e) : num_hydrogens(0), num_hydrogen_bond_donors(0), num_hydrogen_bond_acceptors(0), num_active_torsions(0), num_inactive_torsions(0), molecular_weight(0), mn(3, numeric_limits<float>::max()), mx(3, numeric_limits<float>::lowest()), sz(3)
 {
 	// Initialize necessary variables for constructing a ligand.
 	vector<frame> frames; ///< ROOT and BRANCH frames.
@@ -291,16 +294,16 @@ ligand::ligand(istream& ifs) : num_hydrogens(0), num_hydrogen_bond_donors(0), nu
 	frame* f = &frames.front(); // Pointer to the current frame.
 
 	// Parse the ligand line by line.
-	for (string line; getline(ifs, line);)
+	for_each_line(b, e, [&](const line_view& line)
 	{
-		const string record = line.substr(0, 6);
+		const line_view record = line.substr(0, 6);
 		if (record == "ATOM  " || record == "HETATM")
 		{
 			// Parse the line.
 			atom a(line);
 
 			// Skip unsupported atom types.
-			if (a.ad_unsupported()) continue;
+			if (a.ad_unsupported()) return true;
 
 			// Count statistics.
 			if (a.is_nonpolar_hydrogen())
@@ -356,8 +359,9 @@ ligand::ligand(istream& ifs) : num_hydrogens(0), num_hydrogen_bond_donors(0), nu
 			// Update the pointer to the current frame.
 			f = &frames[current];
 		}
-		else if (record == "TORSDO") break;
-	}
+		else if (record == "TORSDO") return false;
+		return true;
+	});
 	assert(1 + num_active_torsions + num_inactive_torsions == frames.size());
 	assert(num_hydrogen_bond_acceptors <= size());
 	assert(num_hydrogen_bond_donors + num_hydrogen_bond_acceptors <= num_hydrogens + size());
@@ -367,16 +371,65 @@ ligand::ligand(istream& ifs) : num_hydrogens(0), num_hydrogen_bond_donors(0), nu
 	}
 }
 
+//! Writes the statistics of a ligand.
+void write(ostream& os, const ligand& lig)
+{
+	os << lig.num_hydrogens + lig.size() << ',' << lig.size() << ',' << lig.num_hydrogen_bond_donors << ',' << lig.num_hydrogen_bond_acceptors << ',' << lig.num_active_torsions << ',' << lig.num_inactive_torsions << ',' << setprecision(3) << lig.molecular_weight << ',' << lig.sz[0] << ',' << lig.sz[1] << ',' << lig.sz[2];
+}
+
 int main(int argc, char* argv[])
 {
-	ligand lig(cin);
-	if (lig.empty())
+	const string header = "H,HA,HBD,HBA,NAT,NIT,MWT,size_x,size_y,size_z";
+
+	// With no arguments, read a ligand from the standard input, and write its statistics, or the header if it is empty.
+	if (argc == 1)
+	{
+		const string s((istreambuf_iterator<char>(cin)), istreambuf_iterator<char>());
+		const ligand lig(s.data(), s.data() + s.size());
+		if (lig.empty())
+		{
+			cout << header << endl;
+		}
+		else
+		{
+			cout.setf(ios::fixed, ios::floatfield);
+			write(cout, lig);
+			cout << endl;
+		}
+		return 0;
+	}
+
+	// Otherwise map and parse the ligand files in parallel, and write the header and their statistics in input order, leaving those of an empty ligand empty.
+	vector<string> rows(argc - 1);
+	try
+	{
+		parallel_for(rows.size(), [&](const size_t i)
+		{
+			const mapped_text text(argv[1 + i]);
+			const ligand lig(text.begin(), text.end());
+			ostringstream os;
+			os.setf(ios::fixed, ios::floatfield);
+			os << boost::filesystem::path(argv[1 + i]).stem().string() << ',';
+			if (lig.empty())
+			{
+				os << ",,,,,,,,,";
+			}
+			else
+			{
+				write(os, lig);
+			}
+			os << '\n';
+			rows[i] = os.str();
+		});
+	}
+	catch (const exception& e)
 	{
-		cout << "H,HA,HBD,HBA,NAT,NIT,MWT,size_x,size_y,size_z" << endl;
+		cerr << e.what() << endl;
+		return 1;
 	}
-	else
+	cout << "Ligand," << header << '\n';
+	for (const string& r : rows)
 	{
-		cout.setf(ios::fixed, ios::floatfield);
-		cout << lig.num_hydrogens + lig.size() << ',' << lig.size() << ',' << lig.num_hydrogen_bond_donors << ',' << lig.num_hydrogen_bond_acceptors << ',' << lig.num_active_torsions << ',' << lig.num_inactive_torsions << ',' << setprecision(3) << lig.molecular_weight << ',' << lig.sz[0] << ',' << lig.sz[1] << ',' << lig.sz[2] << endl;
+		cout << r;
 	}
 }
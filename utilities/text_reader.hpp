@@ -0,0 +1,341 @@
+#pragma once
+#ifndef IDOCK_TEXT_READER_HPP
+#define IDOCK_TEXT_READER_HPP
+
+#include <cmath>
+#include <queue>
+#include <mutex>
+#include <atomic>
+#include <thread>
+#include <string>
+#include <ostream>
+#include <vector>
+#include <memory>
+#include <cstring>
+#include <stdexcept>
+#include <exception>
+#include <algorithm>
+#include <functional>
+#include <boost/filesystem/operations.hpp>
+#include <boost/interprocess/file_mapping.hpp>
+#include <boost/interprocess/mapped_region.hpp>
+using namespace std;
+using boost::filesystem::path;
+
+//! Represents a line of text without its line terminator, pointing into a mapped file.
+class line_view
+{
+public:
+	const char* b; //!< Beginning of the line.
+	const char* e; //!< End of the line, excluding any trailing \r.
+
+	//! Returns the number of characters of the line.
+	size_t size() const
+	{
+		return e - b;
+	}
+
+	//! Returns true if the line starts with a string.
+	bool starts_with(const char* s) const
+	{
+		const size_t n = strlen(s);
+		return size() >= n && !memcmp(b, s, n);
+	}
+
+	//! Returns the characters in columns [i, j) clamped to the line, i.e. substr(i, j - i) of a string.
+	line_view substr(const size_t i, const size_t j) const
+	{
+		const size_t n = size();
+		return { b + min(i, n), b + min(j, n) };
+	}
+
+	//! Returns the line with leading and trailing spaces removed.
+	line_view trim() const
+	{
+		line_view v = *this;
+		while (v.b < v.e && *v.b == ' ') ++v.b;
+		while (v.b < v.e && v.e[-1] == ' ') --v.e;
+		return v;
+	}
+
+	//! Returns the offset of the first occurrence of a character at or after offset i, or npos if there is none.
+	size_t find(const char c, const size_t i = 0) const
+	{
+		if (i >= size()) return string::npos;
+		const void* p = memchr(b + i, c, size() - i);
+		return p ? static_cast<const char*>(p) - b : string::npos;
+	}
+
+	//! Returns true if the line equals a string.
+	bool operator==(const char* s) const
+	{
+		const size_t n = strlen(s);
+		return size() == n && !memcmp(b, s, n);
+	}
+
+	//! Returns a copy of the line.
+	string str() const
+	{
+		return string(b, e);
+	}
+};
+
+//! Compares two lines lexicographically.
+inline bool operator<(const line_view& a, const line_view& b)
+{
+	const int c = memcmp(a.b, b.b, min(a.size(), b.size()));
+	return c < 0 || (!c && a.size() < b.size());
+}
+
+//! Returns true if two lines are equal.
+inline bool operator==(const line_view& a, const line_view& b)
+{
+	return a.size() == b.size() && !memcmp(a.b, b.b, a.size());
+}
+
+//! Writes a line to a stream without copying it.
+inline ostream& operator<<(ostream& os, const line_view& l)
+{
+	return os.write(l.b, l.size());
+}
+
+//! Represents a read-only memory mapping of a text file. An empty file maps to an empty range.
+class mapped_text
+{
+public:
+	//! Maps a file. Throws if it cannot be opened.
+	explicit mapped_text(const path& p)
+	{
+		using namespace boost::interprocess;
+		boost::system::error_code ec;
+		const uintmax_t size = boost::filesystem::file_size(p, ec);
+		if (ec) throw runtime_error("Failed to open " + p.string());
+		if (!size) return;
+		region.reset(new mapped_region(file_mapping(p.string().c_str(), read_only), read_only));
+		region->advise(mapped_region::advice_sequential);
+	}
+
+	//! Returns the beginning of the text.
+	const char* begin() const
+	{
+		return region ? static_cast<const char*>(region->get_address()) : nullptr;
+	}
+
+	//! Returns the end of the text.
+	const char* end() const
+	{
+		return region ? begin() + region->get_size() : nullptr;
+	}
+private:
+	unique_ptr<boost::interprocess::mapped_region> region; //!< Mapped region of the file, or null if the file is empty.
+};
+
+//! Calls f on each line of the text [b, e), and stops early if f returns false.
+template <typename F>
+inline void for_each_line(const char* b, const char* const e, F f)
+{
+	while (b < e)
+	{
+		const char* n = static_cast<const char*>(memchr(b, '\n', e - b));
+		if (!n) n = e;
+		const line_view l = { b, n > b && n[-1] == '\r' ? n - 1 : n };
+		if (!f(l)) return;
+		b = n + 1;
+	}
+}
+
+//! Splits the text [b, e) into up to n chunks of about equal size at line boundaries, and returns the boundaries of the chunks, the first being b and the last being e.
+inline vector<const char*> split_lines(const char* const b, const char* const e, const size_t n)
+{
+	vector<const char*> bounds(1, b);
+	for (size_t i = 1; i < n; ++i)
+	{
+		const char* p = max(bounds.back(), b + (e - b) * i / n);
+		if (p == e) break;
+		if (p > b && p[-1] != '\n')
+		{
+			p = static_cast<const char*>(memchr(p, '\n', e - p));
+			if (!p) break;
+			++p;
+		}
+		if (p > bounds.back()) bounds.push_back(p);
+	}
+	bounds.push_back(e);
+	return bounds;
+}
+
+//! Parses a decimal number in fixed or scientific notation from the characters [b, e), surrounded by optional spaces, without copying or consulting the locale. Throws if they are not a number.
+inline double parse_decimal(const char* b, const char* e)
+{
+	while (b < e && *b == ' ') ++b;
+	while (b < e && e[-1] == ' ') --e;
+	const char* const s = b;
+	const bool negative = b < e && *b == '-';
+	if (b < e && (*b == '-' || *b == '+')) ++b;
+	double v = 0;
+	size_t num_digits = 0;
+	for (; b < e && *b >= '0' && *b <= '9'; ++b, ++num_digits)
+	{
+		v = v * 10 + (*b - '0');
+	}
+	if (b < e && *b == '.')
+	{
+		double scale = 1;
+		for (++b; b < e && *b >= '0' && *b <= '9'; ++b, ++num_digits)
+		{
+			v = v * 10 + (*b - '0');
+			scale *= 10;
+		}
+		v /= scale;
+	}
+	if (num_digits && b < e && (*b == 'e' || *b == 'E'))
+	{
+		++b;
+		const bool negative_exponent = b < e && *b == '-';
+		if (b < e && (*b == '-' || *b == '+')) ++b;
+		int x = 0;
+		if (b == e) num_digits = 0;
+		for (; b < e && *b >= '0' && *b <= '9'; ++b)
+		{
+			x = x * 10 + (*b - '0');
+		}
+		v *= pow(10.0, negative_exponent ? -x : x);
+	}
+	if (!num_digits || b != e) throw runtime_error("Invalid number \"" + string(s, e) + '"');
+	return negative ? -v : v;
+}
+
+//! Parses a decimal number from a field of a line.
+inline double parse_decimal(const line_view& l)
+{
+	return parse_decimal(l.b, l.e);
+}
+
+//! Returns the number of worker threads to use, i.e. the number of hardware threads, or 1 if unknown.
+inline size_t num_workers()
+{
+	return max<size_t>(thread::hardware_concurrency(), 1);
+}
+
+//! Calls f(i) for every i in [0, n) on up to num_workers() threads, handing out the indices one at a time so that uneven work balances. Rethrows the first exception thrown by f once all the threads have joined.
+template <typename F>
+inline void parallel_for(const size_t n, F f)
+{
+	atomic<size_t> next(0);
+	exception_ptr error;
+	mutex m;
+	const auto work = [&]()
+	{
+		for (size_t i; (i = next++) < n;)
+		{
+			try
+			{
+				f(i);
+			}
+			catch (...)
+			{
+				lock_guard<mutex> guard(m);
+				if (!error) error = current_exception();
+				next = n;
+			}
+		}
+	};
+	vector<thread> threads;
+	for (size_t t = 1; t < min(n, num_workers()); ++t)
+	{
+		threads.emplace_back(work);
+	}
+	work();
+	for (auto& t : threads) t.join();
+	if (error) rethrow_exception(error);
+}
+
+//! Represents a record ranked by an energy, which breaks ties by its ordinal so that rankings are deterministic however the records are produced.
+//! Lower energies rank first.
+template <typename T>
+class ranked
+{
+public:
+	double energy; //!< Energy the record is ranked by.
+	size_t ordinal; //!< Ordinal of the record in its input to break ties with.
+	T value; //!< Record.
+};
+
+//! Compares two ranked records.
+template <typename T>
+inline bool operator<(const ranked<T>& a, const ranked<T>& b)
+{
+	return a.energy < b.energy || (a.energy == b.energy && a.ordinal < b.ordinal);
+}
+
+//! Represents the top k records of a stream, kept as a max-heap so that memory stays bounded however many records are pushed. A k of 0 keeps all the records.
+template <typename T>
+class top_k
+{
+public:
+	//! Constructs an empty set of the top k records.
+	explicit top_k(const size_t k) : k(k) {}
+
+	//! Pushes a record, which is kept in place of the worst kept record if it is better.
+	void push(ranked<T>&& r)
+	{
+		if (!k)
+		{
+			records.push_back(move(r));
+		}
+		else if (records.size() < k)
+		{
+			records.push_back(move(r));
+			push_heap(records.begin(), records.end());
+		}
+		else if (r < records.front())
+		{
+			pop_heap(records.begin(), records.end());
+			records.back() = move(r);
+			push_heap(records.begin(), records.end());
+		}
+	}
+
+	//! Returns the kept records sorted, leaving none kept.
+	vector<ranked<T>> sorted()
+	{
+		if (k)
+		{
+			sort_heap(records.begin(), records.end());
+		}
+		else
+		{
+			sort(records.begin(), records.end());
+		}
+		return move(records);
+	}
+private:
+	size_t k; //!< Number of records to keep, or 0 to keep all.
+	vector<ranked<T>> records; //!< Kept records, as a max-heap if k is nonzero.
+};
+
+//! Merges sorted runs of ranked records, calling f on each in rank order until limit records, or all of them if limit is 0, have been merged. Only the head of each run is held in the heap, so the merge streams.
+template <typename T, typename F>
+inline void merge_runs(const vector<vector<ranked<T>>>& runs, const size_t limit, F f)
+{
+	typedef pair<const ranked<T>*, size_t> head; // Head record and its run.
+	const auto worse = [&runs](const head& a, const head& b)
+	{
+		return *b.first < *a.first || (!(*a.first < *b.first) && b.second < a.second);
+	};
+	priority_queue<head, vector<head>, decltype(worse)> heads(worse);
+	vector<size_t> positions(runs.size());
+	for (size_t i = 0; i < runs.size(); ++i)
+	{
+		if (runs[i].size()) heads.emplace(runs[i].data(), i);
+	}
+	for (size_t n = 0; heads.size() && (!limit || n < limit); ++n)
+	{
+		const head h = heads.top();
+		heads.pop();
+		f(*h.first, h.second);
+		if (++positions[h.second] < runs[h.second].size()) heads.emplace(runs[h.second].data() + positions[h.second], h.second);
+	}
+}
+
+#endif